@@ -2,10 +2,16 @@
 
 #include <inttypes.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <vector>
 #include <stdexcept>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AUDIO_CODECS_X86
+#endif
+
 using namespace std;
 
 
@@ -122,16 +128,34 @@ static const int16_t mace_table_4[][2] = {
   {0x38F0, 0x7FFF}, {0x3B7A, 0x7FFF}, {0x3E22, 0x7FFF}, {0x40E7, 0x7FFF},
 };
 
-static const struct {
-  const int16_t* table1;
-  const int16_t* table2;
-  int stride;
-} tables[] = {
-  {mace_table_1, &mace_table_2[0][0], 4},
-  {mace_table_3, &mace_table_4[0][0], 2},
-  {mace_table_1, &mace_table_2[0][0], 4},
+// the decoders look up each 3- or 2-bit code with the channel's table row
+// already applied, so these are the tables in the same layout as the original
+// decoder's, but with the sign handling precomputed. there are two kinds of
+// codes: 3-bit codes (the first and last of each group of 3) and 2-bit codes
+// (the middle one).
+struct mace_tables {
+  int16_t samples3[0x80][8];
+  int16_t samples2[0x80][4];
+
+  mace_tables() {
+    for (size_t row = 0; row < 0x80; row++) {
+      for (size_t value = 0; value < 8; value++) {
+        this->samples3[row][value] = (value < 4)
+            ? mace_table_2[row][value] : (-1 - mace_table_2[row][7 - value]);
+      }
+      for (size_t value = 0; value < 4; value++) {
+        this->samples2[row][value] = (value < 2)
+            ? mace_table_4[row][value] : (-1 - mace_table_4[row][3 - value]);
+      }
+    }
+  }
 };
 
+static const mace_tables& get_mace_tables() {
+  static const mace_tables tables;
+  return tables;
+}
+
 struct ChannelData {
   int16_t index;
   int16_t factor;
@@ -150,249 +174,413 @@ static int16_t clip_int16(int32_t x) {
   return x;
 }
 
-static int16_t read_table(ChannelData& channel, uint8_t value, size_t table_index) {
+// returns the table entry for the code and updates the channel's table row.
+// code_index is the position of the code in its group of 3 (0-2).
+static inline int16_t read_table(const mace_tables& tables,
+    ChannelData& channel, uint8_t value, size_t code_index) {
+  size_t row = (channel.index & 0x7F0) >> 4;
   int16_t current;
-
-  size_t entry_index = ((channel.index & 0x7F0) >> 4) * tables[table_index].stride;
-  if (value < tables[table_index].stride) {
-    entry_index += value;
-    current = tables[table_index].table2[entry_index];
+  int16_t delta;
+  if (code_index == 1) {
+    current = tables.samples2[row][value];
+    delta = mace_table_3[value];
   } else {
-    entry_index += 2 * tables[table_index].stride - value - 1;
-    current = -1 - tables[table_index].table2[entry_index];
+    current = tables.samples3[row][value];
+    delta = mace_table_1[value];
   }
 
-  if ((channel.index += tables[table_index].table1[value] - (channel.index >> 5)) < 0) {
+  channel.index += delta - (channel.index >> 5);
+  if (channel.index < 0) {
     channel.index = 0;
   }
-
   return current;
 }
 
-vector<int16_t> decode_mace(const uint8_t* data, size_t size, bool stereo,
-    bool is_mace3) {
+static inline void decode_mace3_code(const mace_tables& tables,
+    ChannelData& channel, uint8_t value, size_t code_index, int16_t* dest) {
+  int16_t sample = clip_int16(read_table(tables, channel, value, code_index) + channel.level);
+  *dest = sample;
+  channel.level = sample - (sample >> 3);
+}
 
-  size_t num_channels = stereo ? 2 : 1;
-  ChannelData channel_data[num_channels];
-  vector<int16_t> result_data(size * (is_mace3 ? 3 : 6));
+static inline void decode_mace6_code(const mace_tables& tables,
+    ChannelData& channel, uint8_t value, size_t code_index, int16_t* dest,
+    size_t dest_step) {
+  int16_t current = read_table(tables, channel, value, code_index);
 
-  size_t bytes_per_frame = (is_mace3 ? 2 : 1) * num_channels;
-  size_t output_offset = 0;
-  for (size_t input_offset = 0; input_offset < size;) {
-    if (input_offset + bytes_per_frame > size) {
-      throw runtime_error("odd number of bytes remaining");
+  if ((channel.previous ^ current) >= 0) {
+    if (channel.factor + 506 > 32767) {
+      channel.factor = 32767;
+    } else {
+      channel.factor += 506;
     }
+  } else {
+    if (channel.factor - 314 < -32768) {
+      channel.factor = -32767;
+    } else {
+      channel.factor -= 314;
+    }
+  }
 
-    for (size_t which_channel = 0; which_channel < num_channels; which_channel++) {
-      ChannelData& channel = channel_data[which_channel];
+  current = clip_int16(current + channel.level);
 
-      if (is_mace3) {
-        for (size_t k = 0; k < 2; k++) {
-          uint8_t value = data[input_offset++];
-          uint8_t values[3] = {static_cast<uint8_t>(value & 7),
-                               static_cast<uint8_t>((value >> 3) & 3),
-                               static_cast<uint8_t>(value >> 5)};
+  channel.level = (current * channel.factor) >> 15;
+  current >>= 1;
 
-          for (size_t l = 0; l < 3; l++) {
-            int16_t current = read_table(channel_data[which_channel], values[l], l);
+  dest[0] = channel.previous + channel.prev2 - ((channel.prev2 - current) >> 2);
+  dest[dest_step] = channel.previous + current + ((channel.prev2 - current) >> 2);
 
-            int16_t sample = clip_int16(current + channel.level);
-            result_data[output_offset++] = sample;
-            channel.level = sample - (sample >> 3);
-          }
-        }
+  channel.prev2 = channel.previous;
+  channel.previous = current;
+}
 
-      } else {
-        uint8_t value = data[input_offset++];
-
-        uint8_t values[3] = {static_cast<uint8_t>(value >> 5),
-                             static_cast<uint8_t>((value >> 3) & 3),
-                             static_cast<uint8_t>(value & 7)};
-        for (size_t l = 0; l < 3; l++) {
-
-          int16_t current = read_table(channel, values[l], l);
-
-          if ((channel.previous ^ current) >= 0) {
-            if (channel.factor + 506 > 32767) {
-              channel.factor = 32767;
-            } else {
-              channel.factor += 506;
-            }
-          } else {
-            if (channel.factor - 314 < -32768) {
-              channel.factor = -32767;
-            } else {
-              channel.factor -= 314;
-            }
-          }
-
-          current = clip_int16(current + channel.level);
-
-          channel.level = (current * channel.factor) >> 15;
-          current >>= 1;
-
-          result_data[output_offset++] = channel.previous + channel.prev2 -
-                                        ((channel.prev2 - current) >> 2);
-          result_data[output_offset++] = channel.previous + current +
-                                        ((channel.prev2 - current) >> 2);
-
-          channel.prev2 = channel.previous;
-          channel.previous = current;
-        }
+// the channels don't depend on each other, so each step is done for all of
+// them at once; in stereo sounds this interleaves the two channels'
+// dependency chains, so one channel's table lookups can happen while the
+// other's are still in flight
+template <size_t NumChannels>
+static void decode_mace3_channels(int16_t* dest, const uint8_t* data,
+    size_t size) {
+  const auto& tables = get_mace_tables();
+  ChannelData channels[NumChannels];
+  memset(channels, 0, sizeof(channels));
+
+  for (size_t offset = 0; offset < size; offset += 2 * NumChannels) {
+    for (size_t k = 0; k < 2; k++) {
+      uint8_t values[NumChannels];
+      for (size_t c = 0; c < NumChannels; c++) {
+        values[c] = data[offset + 2 * c + k];
+      }
+      for (size_t c = 0; c < NumChannels; c++) {
+        decode_mace3_code(tables, channels[c], values[c] & 7, 0,
+            &dest[(k * 3 + 0) * NumChannels + c]);
+      }
+      for (size_t c = 0; c < NumChannels; c++) {
+        decode_mace3_code(tables, channels[c], (values[c] >> 3) & 3, 1,
+            &dest[(k * 3 + 1) * NumChannels + c]);
+      }
+      for (size_t c = 0; c < NumChannels; c++) {
+        decode_mace3_code(tables, channels[c], values[c] >> 5, 2,
+            &dest[(k * 3 + 2) * NumChannels + c]);
       }
     }
+    dest += 6 * NumChannels;
+  }
+}
+
+template <size_t NumChannels>
+static void decode_mace6_channels(int16_t* dest, const uint8_t* data,
+    size_t size) {
+  const auto& tables = get_mace_tables();
+  ChannelData channels[NumChannels];
+  memset(channels, 0, sizeof(channels));
+
+  for (size_t offset = 0; offset < size; offset += NumChannels) {
+    for (size_t c = 0; c < NumChannels; c++) {
+      decode_mace6_code(tables, channels[c], data[offset + c] >> 5, 0,
+          &dest[c], NumChannels);
+    }
+    for (size_t c = 0; c < NumChannels; c++) {
+      decode_mace6_code(tables, channels[c], (data[offset + c] >> 3) & 3, 1,
+          &dest[2 * NumChannels + c], NumChannels);
+    }
+    for (size_t c = 0; c < NumChannels; c++) {
+      decode_mace6_code(tables, channels[c], data[offset + c] & 7, 2,
+          &dest[4 * NumChannels + c], NumChannels);
+    }
+    dest += 6 * NumChannels;
+  }
+}
+
+size_t mace_decoded_sample_count(size_t size, bool is_mace3) {
+  return size * (is_mace3 ? 3 : 6);
+}
+
+size_t decode_mace(int16_t* dest, const uint8_t* data, size_t size,
+    bool stereo, bool is_mace3) {
+  size_t num_channels = stereo ? 2 : 1;
+  size_t bytes_per_frame = (is_mace3 ? 2 : 1) * num_channels;
+  if (size % bytes_per_frame) {
+    throw runtime_error("odd number of bytes remaining");
+  }
+
+  if (is_mace3) {
+    if (stereo) {
+      decode_mace3_channels<2>(dest, data, size);
+    } else {
+      decode_mace3_channels<1>(dest, data, size);
+    }
+  } else {
+    if (stereo) {
+      decode_mace6_channels<2>(dest, data, size);
+    } else {
+      decode_mace6_channels<1>(dest, data, size);
+    }
   }
+  return mace_decoded_sample_count(size, is_mace3);
+}
 
+vector<int16_t> decode_mace(const uint8_t* data, size_t size, bool stereo,
+    bool is_mace3) {
+  vector<int16_t> result_data(mace_decoded_sample_count(size, is_mace3));
+  decode_mace(result_data.data(), data, size, stereo, is_mace3);
   return result_data;
 }
 
 
 
+// each packet has a header containing the decoder state at its start, so all
+// packets can be decoded independently. the tables here combine the step table
+// with the index table, so decoding a nybble is just two lookups.
+struct ima4_tables {
+  int32_t diffs[89][16];
+  uint8_t next_step_index[89][16];
+
+  ima4_tables() {
+    static const int8_t index_table[16] = {
+        -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+    static const int16_t step_table[89] = {
+            7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+           19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+           50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+          130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+          337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+          876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+         2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+         5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+        15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+    for (size_t step_index = 0; step_index < 89; step_index++) {
+      int32_t step = step_table[step_index];
+      for (size_t nybble = 0; nybble < 16; nybble++) {
+        int32_t diff = step >> 3;
+        if (nybble & 4) {
+          diff += step;
+        }
+        if (nybble & 2) {
+          diff += step >> 1;
+        }
+        if (nybble & 1) {
+          diff += step >> 2;
+        }
+        this->diffs[step_index][nybble] = (nybble & 8) ? -diff : diff;
+
+        int32_t next = step_index + index_table[nybble];
+        this->next_step_index[step_index][nybble] = (next < 0) ? 0 : ((next > 88) ? 88 : next);
+      }
+    }
+  }
+};
+
+static const ima4_tables& get_ima4_tables() {
+  static const ima4_tables tables;
+  return tables;
+}
+
 struct ima4_packet {
-  uint16_t header;
+  uint8_t header[2];
   uint8_t data[32];
 
-  uint16_t predictor() const {
-    return this->header & 0xFF80;
+  int32_t predictor() const {
+    return static_cast<int16_t>((this->header[0] << 8) | (this->header[1] & 0x80));
   }
 
   uint8_t step_index() const {
-    return this->header & 0x007F;
+    uint8_t ret = this->header[1] & 0x7F;
+    return (ret > 88) ? 88 : ret;
   }
 };
 
-vector<int16_t> decode_ima4(const uint8_t* data, size_t size, bool stereo) {
-  static const int16_t index_table[16] = {
-      -1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
-  static const int16_t step_table[89] = {
-          7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
-         19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
-         50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
-        130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
-        337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
-        876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
-       2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
-       5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
-      15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+// decodes NumLanes consecutive packets at once, starting at dest (which is
+// where the first packet's first sample goes). in stereo sounds, the packets
+// alternate between the left and right channels, so each pair of packets makes
+// 128 interleaved samples.
+template <size_t NumLanes, bool Stereo>
+static void decode_ima4_packets(const ima4_tables& tables, int16_t* dest,
+    const ima4_packet* packets) {
+  int32_t predictors[NumLanes];
+  uint8_t step_indexes[NumLanes];
+  int16_t* lane_dests[NumLanes];
+  for (size_t z = 0; z < NumLanes; z++) {
+    predictors[z] = packets[z].predictor();
+    step_indexes[z] = packets[z].step_index();
+    lane_dests[z] = dest + (Stereo ? ((z >> 1) * 128 + (z & 1)) : (z * 64));
+  }
 
+  size_t dest_step = Stereo ? 2 : 1;
+  for (size_t x = 0; x < 32; x++) {
+    for (size_t y = 0; y < 2; y++) {
+      for (size_t z = 0; z < NumLanes; z++) {
+        uint8_t nybble = (packets[z].data[x] >> (y * 4)) & 0x0F;
+        int32_t predictor = predictors[z] + tables.diffs[step_indexes[z]][nybble];
+        predictor = (predictor > 0x7FFF) ? 0x7FFF : ((predictor < -0x8000) ? -0x8000 : predictor);
+        predictors[z] = predictor;
+        step_indexes[z] = tables.next_step_index[step_indexes[z]][nybble];
+        lane_dests[z][(x * 2 + y) * dest_step] = predictor;
+      }
+    }
+  }
+}
+
+size_t ima4_decoded_sample_count(size_t size) {
+  return (size / 34) * 64;
+}
+
+size_t decode_ima4(int16_t* dest, const uint8_t* data, size_t size,
+    bool stereo) {
   if (size % (stereo ? 68 : 34)) {
     throw runtime_error("ima4 data size must be a multiple of 34 bytes");
   }
-  vector<int16_t> result_data((size * 64) / 34);
-
-  struct ChannelState {
-    int32_t predictor;
-    int32_t step_index;
-    int32_t step;
-  } channel_state[2];
-
-  {
-    const ima4_packet* base_packet = reinterpret_cast<const ima4_packet*>(data);
-    channel_state[0].predictor = base_packet->predictor();
-    channel_state[0].step_index = base_packet->step_index();
-    channel_state[0].step = step_table[channel_state[0].step_index];
-  }
-  if (stereo) {
-    const ima4_packet* base_packet = reinterpret_cast<const ima4_packet*>(data + 34);
-    channel_state[1].predictor = base_packet->predictor();
-    channel_state[1].step_index = base_packet->step_index();
-    channel_state[1].step = step_table[channel_state[1].step_index];
-  }
 
-  for (size_t packet_offset = 0; packet_offset < size; packet_offset += 34) {
-    const ima4_packet* packet = reinterpret_cast<const ima4_packet*>(
-        data + packet_offset);
-    size_t packet_index = packet_offset / 34;
-    auto& channel = channel_state[stereo ? (packet_index & 1) : 0];
+  const auto& tables = get_ima4_tables();
+  const ima4_packet* packets = reinterpret_cast<const ima4_packet*>(data);
+  size_t num_packets = size / 34;
 
-    // interleave stereo samples appropriately
-    size_t output_offset;
-    size_t output_step = stereo ? 2 : 1;
+  // packets are decoded 4 at a time, so the CPU can work on 4 independent
+  // dependency chains at once
+  size_t packet_index = 0;
+  for (; packet_index + 4 <= num_packets; packet_index += 4) {
     if (stereo) {
-      output_offset = (packet_index & ~1) * 64 + (packet_index & 1);
+      decode_ima4_packets<4, true>(tables, dest + packet_index * 64,
+          &packets[packet_index]);
     } else {
-      output_offset = packet_index * 64;
+      decode_ima4_packets<4, false>(tables, dest + packet_index * 64,
+          &packets[packet_index]);
     }
+  }
+  for (; packet_index < num_packets; packet_index += (stereo ? 2 : 1)) {
+    if (stereo) {
+      decode_ima4_packets<2, true>(tables, dest + packet_index * 64,
+          &packets[packet_index]);
+    } else {
+      decode_ima4_packets<1, false>(tables, dest + packet_index * 64,
+          &packets[packet_index]);
+    }
+  }
 
-    for (size_t x = 0; x < 32; x++) {
-      uint8_t value = packet->data[x];
-      for (size_t y = 0; y < 2; y++) {
-        uint8_t nybble = value & 0x0F;
-        value >>= 4;
+  return ima4_decoded_sample_count(size);
+}
 
-        int32_t diff = 0;
-        if (nybble & 4) {
-          diff += channel.step;
-        }
-        if (nybble & 2) {
-          diff += channel.step >> 1;
-        }
-        if (nybble & 1) {
-          diff += channel.step >> 2;
-        }
-        diff += channel.step >> 3;
-        if (nybble & 8) {
-          diff = -diff;
-        }
+vector<int16_t> decode_ima4(const uint8_t* data, size_t size, bool stereo) {
+  vector<int16_t> result_data(ima4_decoded_sample_count(size));
+  decode_ima4(result_data.data(), data, size, stereo);
+  return result_data;
+}
 
-        channel.predictor += diff;
+// a-law and mu-law samples are decoded with 256-entry tables (of int32s, so
+// the AVX2 version can gather from them directly). the tables are built with
+// the arithmetic definitions below.
 
-        if (channel.predictor > 0x7FFF) {
-          channel.predictor = 0x7FFF;
-        } else if (channel.predictor < -0x8000) {
-          channel.predictor = -0x8000;
-        }
+static int16_t decode_alaw_sample(uint8_t value) {
+  int8_t sample = static_cast<int8_t>(value) ^ 0x55;
+  int8_t sign = (sample & 0x80) ? -1 : 1;
 
-        result_data[output_offset] = channel.predictor;
-        output_offset += output_step;
+  if (sign == -1) {
+     sample &= 0x7F;
+  }
 
-        channel.step_index += index_table[nybble];
-        if (channel.step_index < 0) {
-          channel.step_index = 0;
-        } else if (channel.step_index > 88) {
-          channel.step_index = 88;
-        }
-        channel.step = step_table[channel.step_index];
-      }
-    }
+  uint8_t shift = ((sample & 0xF0) >> 4) + 4;
+  if (shift == 4) {
+    return sign * ((sample << 1) | 1);
+  } else {
+    return sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5)));
   }
+}
 
-  return result_data;
+static int16_t decode_ulaw_sample(uint8_t value) {
+  static const uint16_t ULAW_BIAS = 33;
+
+  int8_t sample = ~static_cast<int8_t>(value);
+
+  int8_t sign = (sample & 0x80) ? -1 : 1;
+  if (sign == -1) {
+    sample &= 0x7F;
+  }
+  uint8_t shift = ((sample & 0xF0) >> 4) + 5;
+  return sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS;
 }
 
-vector<int16_t> decode_alaw(const uint8_t* data, size_t size) {
-  vector<int16_t> ret(size);
-  for (size_t x = 0; x < size; x++) {
-    int8_t sample = static_cast<int8_t>(data[x]) ^ 0x55;
-    int8_t sign = (sample & 0x80) ? -1 : 1;
+struct law_tables {
+  int32_t alaw[0x100];
+  int32_t ulaw[0x100];
 
-    if (sign == -1) {
-       sample &= 0x7F;
+  law_tables() {
+    for (size_t x = 0; x < 0x100; x++) {
+      this->alaw[x] = decode_alaw_sample(x);
+      this->ulaw[x] = decode_ulaw_sample(x);
     }
+  }
+};
 
-    uint8_t shift = ((sample & 0xF0) >> 4) + 4;
-    if (shift == 4) {
-      ret[x] = sign * ((sample << 1) | 1);
-    } else {
-      ret[x] = sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5)));
-    }
+static const law_tables& get_law_tables() {
+  static const law_tables tables;
+  return tables;
+}
+
+static void decode_law_scalar(int16_t* dest, const uint8_t* data, size_t size,
+    const int32_t* table, size_t start_offset) {
+  for (size_t x = start_offset; x < size; x++) {
+    dest[x] = table[data[x]];
+  }
+}
+
+#ifdef AUDIO_CODECS_X86
+
+// this looks up 16 samples at a time with two gathers, then packs the results
+// down to 16 bits. packs works within 128-bit lanes, so the permute puts the
+// two halves back in order.
+__attribute__((target("avx2")))
+static void decode_law_avx2(int16_t* dest, const uint8_t* data, size_t size,
+    const int32_t* table) {
+  size_t x;
+  for (x = 0; x + 16 <= size; x += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + x));
+    __m256i low = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table),
+        _mm256_cvtepu8_epi32(bytes), 4);
+    __m256i high = _mm256_i32gather_epi32(reinterpret_cast<const int*>(table),
+        _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8)), 4);
+    __m256i samples = _mm256_permute4x64_epi64(_mm256_packs_epi32(low, high), 0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dest + x), samples);
   }
+  decode_law_scalar(dest, data, size, table, x);
+}
+
+static bool cpu_has_avx2() {
+  static const bool ret = __builtin_cpu_supports("avx2");
   return ret;
 }
 
-vector<int16_t> decode_ulaw(const uint8_t* data, size_t size) {
-  static const uint16_t ULAW_BIAS = 33;
+#endif
+
+static void decode_law(int16_t* dest, const uint8_t* data, size_t size,
+    const int32_t* table) {
+#ifdef AUDIO_CODECS_X86
+  if (cpu_has_avx2()) {
+    decode_law_avx2(dest, data, size, table);
+    return;
+  }
+#endif
+  decode_law_scalar(dest, data, size, table, 0);
+}
+
+size_t decode_alaw(int16_t* dest, const uint8_t* data, size_t size) {
+  decode_law(dest, data, size, get_law_tables().alaw);
+  return size;
+}
 
+vector<int16_t> decode_alaw(const uint8_t* data, size_t size) {
   vector<int16_t> ret(size);
-  for (size_t x = 0; x < size; x++) {
-    int8_t sample = ~static_cast<int8_t>(data[x]);
+  decode_alaw(ret.data(), data, size);
+  return ret;
+}
 
-    int8_t sign = (sample & 0x80) ? -1 : 1;
-    if (sign == -1) {
-      sample &= 0x7F;
-    }
-    uint8_t shift = ((sample & 0xF0) >> 4) + 5;
-    ret[x] = sign * ((1 << shift) | ((sample & 0x0F) << (shift - 4)) | (1 << (shift - 5))) - ULAW_BIAS;
-  }
+size_t decode_ulaw(int16_t* dest, const uint8_t* data, size_t size) {
+  decode_law(dest, data, size, get_law_tables().ulaw);
+  return size;
+}
+
+vector<int16_t> decode_ulaw(const uint8_t* data, size_t size) {
+  vector<int16_t> ret(size);
+  decode_ulaw(ret.data(), data, size);
   return ret;
 }
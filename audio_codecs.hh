@@ -1,9 +1,23 @@
 #include <stdint.h>
+#include <stddef.h>
 
 #include <vector>
 
+// the versions that take a dest buffer write the decoded samples there instead
+// of allocating a vector. dest must have room for the number of samples
+// returned by the corresponding *_decoded_sample_count function; they return
+// the number of samples written. stereo samples are interleaved.
+size_t mace_decoded_sample_count(size_t size, bool is_mace3);
+size_t decode_mace(int16_t* dest, const uint8_t* data, size_t size,
+    bool stereo, bool is_mace3);
 std::vector<int16_t> decode_mace(const uint8_t* data, size_t size, bool stereo,
     bool is_mace3);
+size_t ima4_decoded_sample_count(size_t size);
+size_t decode_ima4(int16_t* dest, const uint8_t* data, size_t size,
+    bool stereo);
 std::vector<int16_t> decode_ima4(const uint8_t* data, size_t size, bool stereo);
+// a-law and mu-law produce one sample per byte
+size_t decode_alaw(int16_t* dest, const uint8_t* data, size_t size);
 std::vector<int16_t> decode_alaw(const uint8_t* data, size_t size);
+size_t decode_ulaw(int16_t* dest, const uint8_t* data, size_t size);
 std::vector<int16_t> decode_ulaw(const uint8_t* data, size_t size);
@@ -0,0 +1,185 @@
+#include "decompression_cache.hh"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <memory>
+#include <phosg/Filesystem.hh>
+#include <phosg/Hash.hh>
+#include <phosg/Strings.hh>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+
+// cache file names are 32 hex digits; anything else in the directory (e.g. a
+// temporary file from an interrupted write) is ignored
+static const size_t cache_name_length = 32;
+
+static bool is_cache_name(const char* name) {
+  size_t x;
+  for (x = 0; name[x]; x++) {
+    if (!isxdigit(name[x])) {
+      return false;
+    }
+  }
+  return (x == cache_name_length);
+}
+
+
+
+DecompressionCache::DecompressionCache(const string& directory,
+    size_t max_size) : directory(directory), max_size(max_size),
+    total_size(0) {
+  mkdir(this->directory.c_str(), 0777);
+
+  unique_ptr<DIR, int(*)(DIR*)> dir(opendir(this->directory.c_str()), closedir);
+  if (!dir.get()) {
+    throw cannot_open_file(this->directory);
+  }
+
+  // index the existing files, oldest first. the modification time is updated
+  // when a file is used, so this is the least-recently-used order from any
+  // previous runs
+  vector<pair<time_t, entry>> existing_entries;
+  struct dirent* dirent;
+  while ((dirent = readdir(dir.get()))) {
+    if (!is_cache_name(dirent->d_name)) {
+      continue;
+    }
+    struct stat st;
+    if (::stat(this->filename_for_name(dirent->d_name).c_str(), &st)) {
+      continue;
+    }
+    existing_entries.emplace_back(st.st_mtime,
+        entry({dirent->d_name, static_cast<size_t>(st.st_size)}));
+  }
+  sort(existing_entries.begin(), existing_entries.end(), [](
+      const pair<time_t, entry>& a, const pair<time_t, entry>& b) {
+    return a.first < b.first;
+  });
+
+  lock_guard<mutex> g(this->lock);
+  for (const auto& it : existing_entries) {
+    this->name_to_entry.emplace(it.second.name,
+        this->lru.emplace(this->lru.end(), it.second));
+    this->total_size += it.second.size;
+  }
+  this->evict_locked();
+}
+
+bool DecompressionCache::get(const string& compressed_data,
+    const string& dcmp_key, string& decompressed_data) {
+  string name = this->name_for_key(compressed_data, dcmp_key);
+  string filename = this->filename_for_name(name);
+  try {
+    decompressed_data = load_file(filename);
+  } catch (const cannot_open_file&) {
+    return false;
+  }
+
+  // mark it as recently used, both here and on disk for future runs
+  utimes(filename.c_str(), NULL);
+  lock_guard<mutex> g(this->lock);
+  auto it = this->name_to_entry.find(name);
+  if (it != this->name_to_entry.end()) {
+    this->lru.splice(this->lru.end(), this->lru, it->second);
+  } else {
+    // another process must have written it
+    this->name_to_entry.emplace(name, this->lru.emplace(this->lru.end(),
+        entry({name, decompressed_data.size()})));
+    this->total_size += decompressed_data.size();
+    this->evict_locked();
+  }
+  return true;
+}
+
+void DecompressionCache::put(const string& compressed_data,
+    const string& dcmp_key, const string& decompressed_data) {
+  string name = this->name_for_key(compressed_data, dcmp_key);
+  string filename = this->filename_for_name(name);
+
+  // write to a temporary file and rename it, so other threads or processes
+  // never see a partially-written file
+  string temp_filename = filename + ".XXXXXX";
+  int fd = mkstemp(&temp_filename[0]);
+  if (fd < 0) {
+    throw runtime_error("can\'t create temporary file in cache directory");
+  }
+  // mkstemp creates files that only the current user can read
+  fchmod(fd, 0644);
+  {
+    scoped_fd temp_fd(fd);
+    try {
+      writex(temp_fd, decompressed_data);
+    } catch (const exception&) {
+      unlink(temp_filename.c_str());
+      throw;
+    }
+  }
+  if (rename(temp_filename.c_str(), filename.c_str())) {
+    unlink(temp_filename.c_str());
+    throw runtime_error("can\'t rename temporary file in cache directory");
+  }
+
+  lock_guard<mutex> g(this->lock);
+  auto it = this->name_to_entry.find(name);
+  if (it != this->name_to_entry.end()) {
+    this->total_size -= it->second->size;
+    it->second->size = decompressed_data.size();
+    this->lru.splice(this->lru.end(), this->lru, it->second);
+  } else {
+    this->name_to_entry.emplace(name, this->lru.emplace(this->lru.end(),
+        entry({name, decompressed_data.size()})));
+  }
+  this->total_size += decompressed_data.size();
+  this->evict_locked();
+}
+
+size_t DecompressionCache::size() const {
+  lock_guard<mutex> g(this->lock);
+  return this->total_size;
+}
+
+string DecompressionCache::name_for_key(const string& compressed_data,
+    const string& dcmp_key) {
+  // two 64-bit hashes of the inputs (in different orders and with different
+  // initial values), so an accidental collision is very unlikely. the sizes are
+  // included so the boundary between the inputs is unambiguous
+  uint64_t sizes[2] = {compressed_data.size(), dcmp_key.size()};
+  uint64_t h1 = fnv1a64(sizes, sizeof(sizes));
+  h1 = fnv1a64(dcmp_key.data(), dcmp_key.size(), h1);
+  h1 = fnv1a64(compressed_data.data(), compressed_data.size(), h1);
+  uint64_t h2 = fnv1a64(sizes, sizeof(sizes), 0x6C62272E07BB0142);
+  h2 = fnv1a64(compressed_data.data(), compressed_data.size(), h2);
+  h2 = fnv1a64(dcmp_key.data(), dcmp_key.size(), h2);
+  return string_printf("%016" PRIX64 "%016" PRIX64, h1, h2);
+}
+
+string DecompressionCache::filename_for_name(const string& name) const {
+  return this->directory + "/" + name;
+}
+
+void DecompressionCache::evict_locked() {
+  if (this->max_size == 0) {
+    return;
+  }
+  while ((this->total_size > this->max_size) && !this->lru.empty()) {
+    const auto& e = this->lru.front();
+    unlink(this->filename_for_name(e.name).c_str());
+    this->total_size -= e.size;
+    this->name_to_entry.erase(e.name);
+    this->lru.pop_front();
+  }
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+
+// a directory of decompressed resources, named by a hash of the compressed data
+// and the decompressor code that produced them. this lets repeated runs over the
+// same files skip decompression. it can be shared by multiple threads (and
+// processes, though they won't know about each other's entries for eviction
+// purposes). if the total size of the cached files exceeds max_size, the least
+// recently used ones are deleted.
+class DecompressionCache {
+public:
+  // max_size of 0 means there's no limit
+  DecompressionCache(const std::string& directory, size_t max_size = 0);
+  ~DecompressionCache() = default;
+
+  // returns true and sets decompressed_data if the result is in the cache
+  bool get(const std::string& compressed_data, const std::string& dcmp_key,
+      std::string& decompressed_data);
+  void put(const std::string& compressed_data, const std::string& dcmp_key,
+      const std::string& decompressed_data);
+
+  size_t size() const;
+
+private:
+  struct entry {
+    std::string name;
+    size_t size;
+  };
+
+  std::string directory;
+  size_t max_size;
+
+  // entries in least- to most-recently-used order
+  mutable std::mutex lock;
+  std::list<entry> lru;
+  std::unordered_map<std::string, std::list<entry>::iterator> name_to_entry;
+  size_t total_size;
+
+  static std::string name_for_key(const std::string& compressed_data,
+      const std::string& dcmp_key);
+  std::string filename_for_name(const std::string& name) const;
+  void evict_locked();
+};
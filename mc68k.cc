@@ -3,6 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 
+#include <algorithm>
 #include <phosg/Encoding.hh>
 #include <unordered_map>
 
@@ -128,13 +129,35 @@ static Size size_for_dsize(uint8_t ds) {
 
 
 MC68KEmulator::MC68KEmulator() : pc(0), sr(0), execute(false),
-    debug(DebuggingMode::Disabled), trap_call_region(NULL) {
+    debug(DebuggingMode::Disabled), trap_call_region(NULL),
+    last_code_cache_index(0), immediate_operand(0),
+    last_page_region_index(0) {
   for (size_t x = 0; x < 8; x++) {
     this->d[x] = 0;
     this->a[x] = 0;
   }
 }
 
+void MC68KEmulator::reset() {
+  for (size_t x = 0; x < 8; x++) {
+    this->d[x] = 0;
+    this->a[x] = 0;
+  }
+  this->pc = 0;
+  this->sr = 0;
+  this->execute = false;
+
+  // the trap call region is kept (it's in memory_regions), but its routines
+  // are regenerated as needed
+  if (this->trap_call_region) {
+    this->trap_call_region->clear();
+  }
+  this->trap_to_call_addr.clear();
+
+  this->invalidate_instruction_cache();
+  this->invalidate_address_translation();
+}
+
 
 
 void MC68KEmulator::print_state(FILE* stream, bool print_memory) {
@@ -260,6 +283,10 @@ void MC68KEmulator::write(uint32_t addr, uint32_t value, Size size) {
 }
 
 void MC68KEmulator::write(void* addr, uint32_t value, Size size) {
+  if (!this->code_caches.empty() && !this->address_is_register(addr)) {
+    this->invalidate_decoded_instructions(addr, bytes_for_size(size));
+  }
+
   if (size == Size::BYTE) {
     *reinterpret_cast<uint8_t*>(addr) = value;
     return;
@@ -286,21 +313,84 @@ void MC68KEmulator::write(void* addr, uint32_t value, Size size) {
   }
 }
 
+static const size_t PAGE_BITS = 16;
+
+[[noreturn]] __attribute__((noinline, cold))
+static void throw_address_error(uint32_t addr, bool before_any_range) {
+  if (before_any_range) {
+    throw out_of_range(string_printf("memory access before any range (%08" PRIX32 ")", addr));
+  }
+  throw out_of_range(string_printf("memory access out of range (%08" PRIX32 ")", addr));
+}
+
 void* MC68KEmulator::translate_address(uint32_t addr) {
+  // most accesses hit the same region as the previous one
+  if (this->last_page_region_index < this->page_regions.size()) {
+    const auto& r = this->page_regions[this->last_page_region_index];
+    uint32_t offset = addr - r.first;
+    if ((addr >= r.first) && (offset < r.second->size())) {
+      return const_cast<char*>(r.second->data() + offset);
+    }
+  }
+
+  // if not, try the region that was last seen in this page
+  if (!this->page_table.empty()) {
+    uint16_t index = this->page_table[addr >> PAGE_BITS];
+    if (index) {
+      const auto& r = this->page_regions[index - 1];
+      uint32_t offset = addr - r.first;
+      if ((addr >= r.first) && (offset < r.second->size())) {
+        this->last_page_region_index = index - 1;
+        return const_cast<char*>(r.second->data() + offset);
+      }
+    }
+  }
+
+  return this->translate_address_slow(addr);
+}
+
+void* MC68KEmulator::translate_address_slow(uint32_t addr) {
   auto region_it = memory_regions.upper_bound(addr);
   if (region_it == memory_regions.begin()) {
-    throw out_of_range(string_printf("memory access before any range (%08" PRIX32 ")", addr));
+    throw_address_error(addr, true);
   }
 
   region_it--;
   uint32_t offset = addr - region_it->first;
   if (offset >= region_it->second.size()) {
-    throw out_of_range(string_printf("memory access out of range (%08" PRIX32 ")", addr));
+    throw_address_error(addr, false);
   }
 
+  // remember this region for the page the address is in
+  size_t index;
+  for (index = 0; index < this->page_regions.size(); index++) {
+    if (this->page_regions[index].second == &region_it->second) {
+      break;
+    }
+  }
+  if (index == this->page_regions.size()) {
+    // page table entries are 16 bits; if there are somehow more regions than
+    // that, just don't cache this one
+    if (index >= 0xFFFF) {
+      return const_cast<char*>(region_it->second.data() + offset);
+    }
+    this->page_regions.emplace_back(region_it->first, &region_it->second);
+  }
+  if (this->page_table.empty()) {
+    this->page_table.resize(1 << (32 - PAGE_BITS), 0);
+  }
+  this->page_table[addr >> PAGE_BITS] = index + 1;
+  this->last_page_region_index = index;
+
   return const_cast<char*>(region_it->second.data() + offset);
 }
 
+void MC68KEmulator::invalidate_address_translation() {
+  this->page_regions.clear();
+  this->page_table.clear();
+  this->last_page_region_index = 0;
+}
+
 uint16_t MC68KEmulator::fetch_instruction_word(bool advance) {
   return this->fetch_instruction_data(Size::WORD, advance);
 }
@@ -445,6 +535,58 @@ void* MC68KEmulator::resolve_address(uint8_t M, uint8_t Xn, Size size) {
   }
 }
 
+// these are the same as above, but for operands from decode_instruction, so
+// the extension words have already been fetched (and pc-relative addresses
+// computed). decode_instruction only produces the modes handled here.
+uint32_t MC68KEmulator::resolve_address_control(const decoded_operand& op) {
+  switch (op.M) {
+    case 2:
+      return this->a[op.Xn];
+    case 5:
+      return this->a[op.Xn] + op.value;
+    case 6:
+      return this->a[op.Xn] + this->resolve_address_extension(op.ext);
+    default: // 7
+      if (op.Xn == 2) {
+        return op.value;
+      }
+      return op.value + this->resolve_address_extension(op.ext);
+  }
+}
+
+void* MC68KEmulator::resolve_address(const decoded_operand& op, Size size) {
+  switch (op.M) {
+    case 0:
+      return &this->d[op.Xn];
+    case 1:
+      return &this->a[op.Xn];
+    case 2:
+      return this->translate_address(this->a[op.Xn]);
+    case 3: {
+      void* ret = this->translate_address(this->a[op.Xn]);
+      this->a[op.Xn] += bytes_for_size(size);
+      return ret;
+    }
+    case 4:
+      this->a[op.Xn] -= bytes_for_size(size);
+      return this->translate_address(this->a[op.Xn]);
+    case 5:
+      return this->translate_address(this->a[op.Xn] + op.value);
+    case 6:
+      return this->translate_address(
+          this->a[op.Xn] + this->resolve_address_extension(op.ext));
+    default: // 7
+      if (op.Xn == 2) {
+        return this->translate_address(op.value);
+      } else if (op.Xn == 3) {
+        return this->translate_address(
+            op.value + this->resolve_address_extension(op.ext));
+      }
+      this->immediate_operand = op.value;
+      return &this->immediate_operand;
+  }
+}
+
 
 
 bool MC68KEmulator::check_condition(uint8_t condition) {
@@ -583,6 +725,34 @@ void MC68KEmulator::opcode_0123(uint16_t opcode) {
     return;
   }
 
+  // the immediate value comes before the target address's extension words (if
+  // any), so it has to be fetched first. bit operations always have a word
+  // immediate (the bit number), regardless of the size field
+  Size fetch_size = ((a == 4) || (size == Size::BYTE)) ? Size::WORD : size;
+  uint32_t value = this->fetch_instruction_data(fetch_size);
+
+  if (a == 4) { // btst/bchg/bclr/bset ADDR, IMM
+    // these are long operations on data registers and byte operations on memory
+    void* target = this->resolve_address(M, Xn, Size::BYTE);
+    bool target_is_reg = this->address_is_register(target);
+    Size bit_size = target_is_reg ? Size::LONG : Size::BYTE;
+    uint32_t test_value = 1 << (value & (target_is_reg ? 0x1F : 0x07));
+
+    uint32_t mem_value = this->read(target, bit_size);
+    this->set_ccr_flags(-1, -1, (mem_value & test_value) ? 0 : 1, -1, -1);
+    if (s == 0) { // btst
+      return;
+    } else if (s == 1) { // bchg
+      mem_value ^= test_value;
+    } else if (s == 2) { // bclr
+      mem_value &= ~test_value;
+    } else { // bset
+      mem_value |= test_value;
+    }
+    this->write(target, mem_value, bit_size);
+    return;
+  }
+
   // ccr/sr are allowed for ori, andi, and xori opcodes
   void* target;
   if (((a == 0) || (a == 1) || (a == 5)) && (M == 7) && (Xn == 4)) {
@@ -594,8 +764,6 @@ void MC68KEmulator::opcode_0123(uint16_t opcode) {
     target = this->resolve_address(M, Xn, size);
   }
 
-  Size fetch_size = (size == Size::BYTE) ? Size::WORD : size;
-  uint32_t value = this->fetch_instruction_data(fetch_size);
   uint32_t mem_value = this->read(target, size);
   switch (a) {
     case 0: // ori ADDR, IMM
@@ -634,20 +802,6 @@ void MC68KEmulator::opcode_0123(uint16_t opcode) {
       this->set_ccr_flags_integer_subtract(mem_value, value, size);
       break;
 
-    case 4:
-      // TODO: these are all byte operations and they ignore the size field
-      switch (s) {
-        case 0:
-          throw runtime_error("btst ADDR, IMM");
-        case 1:
-          throw runtime_error("bchg ADDR, IMM");
-        case 2:
-          throw runtime_error("bclr ADDR, IMM");
-        case 3:
-          throw runtime_error("bset ADDR, IMM");
-      }
-      throw runtime_error("opcode not implemented");
-
     default:
       throw runtime_error("invalid immediate operation");
   }
@@ -1170,6 +1324,26 @@ void MC68KEmulator::opcode_A(uint16_t opcode) {
   }
 
   switch (trap_number) {
+    case 0x002E: { // _BlockMove
+      // A0 = source, A1 = dest, D0 = size; the ranges may overlap
+      uint32_t size = this->d[0];
+      if (size) {
+        const char* src = reinterpret_cast<const char*>(
+            this->translate_address(this->a[0]));
+        char* dest = reinterpret_cast<char*>(this->translate_address(this->a[1]));
+        if ((this->translate_address(this->a[0] + size - 1) != src + size - 1) ||
+            (this->translate_address(this->a[1] + size - 1) != dest + size - 1)) {
+          throw out_of_range("_BlockMove range spans multiple memory regions");
+        }
+        memmove(dest, src, size);
+        if (!this->code_caches.empty()) {
+          this->invalidate_decoded_instructions(dest, size);
+        }
+      }
+      this->d[0] = 0; // noErr
+      break;
+    }
+
     case 0x0046: { // _GetTrapAddress
       uint16_t trap_number = this->d[0] & 0xFFFF;
       if ((trap_number > 0x4F) && (trap_number != 0x54) && (trap_number != 0x57)) {
@@ -1361,6 +1535,11 @@ void MC68KEmulator::opcode_E(uint16_t opcode) {
     }
   }
 
+  this->shift_register(k, size, Xn, shift_amount);
+}
+
+void MC68KEmulator::shift_register(uint8_t k, Size size, uint8_t Xn,
+    uint8_t shift_amount) {
   switch (k) {
     case 0x00: // asr DREG, COUNT/REG
     case 0x01: // asl DREG, COUNT/REG
@@ -1550,50 +1729,842 @@ void MC68KEmulator::opcode_E(uint16_t opcode) {
 
 
 
-void MC68KEmulator::execute_next_opcode() {
-  uint16_t opcode = this->fetch_instruction_word();
-  switch ((opcode >> 12) & 0x000F) {
-    case 0x00:
-    case 0x01:
-    case 0x02:
-    case 0x03:
-      this->opcode_0123(opcode);
-      break;
-    case 0x04:
-      this->opcode_4(opcode);
-      break;
-    case 0x05:
-      this->opcode_5(opcode);
-      break;
-    case 0x06:
-      this->opcode_6(opcode);
-      break;
-    case 0x07:
-      this->opcode_7(opcode);
-      break;
-    case 0x08:
-      this->opcode_8(opcode);
-      break;
-    case 0x09:
-    case 0x0D:
-      this->opcode_9D(opcode);
+// handlers for instructions from decode_instruction. these do the same thing
+// as the corresponding cases in the opcode_* functions above, but get their
+// operands from the decoded instruction instead of fetching and decoding them.
+// when one of these is called, pc already points to the next instruction.
+
+void MC68KEmulator::exec_opcode(const decoded_instruction& insn) {
+  (this->*handler_for_opcode(insn.opcode))(insn.opcode);
+}
+
+void MC68KEmulator::exec_move(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  void* s = this->resolve_address(insn.source, size);
+  void* d = this->resolve_address(insn.dest, size);
+  uint32_t value = this->read(s, size);
+  this->write(d, value, size);
+  this->set_ccr_flags(-1, is_negative(value, size), (value == 0), 0, 0);
+}
+
+void MC68KEmulator::exec_movea(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  void* source = this->resolve_address(insn.source, size);
+  this->a[insn.dest.Xn] = sign_extend(this->read(source, size), size);
+}
+
+void MC68KEmulator::exec_moveq(const decoded_instruction& insn) {
+  uint32_t y = insn.source.value;
+  this->d[insn.dest.Xn] = y;
+  this->set_ccr_flags(-1, (y & 0x80000000), (y == 0), 0, 0);
+}
+
+void MC68KEmulator::exec_immediate(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  uint32_t value = insn.source.value;
+  void* target = this->resolve_address(insn.dest, size);
+
+  uint32_t mem_value = this->read(target, size);
+  switch (op_get_a(insn.opcode)) {
+    case 0: // ori ADDR, IMM
+      mem_value |= value;
+      this->write(target, mem_value, size);
+      this->set_ccr_flags(-1, is_negative(mem_value, size), !mem_value, 0, 0);
       break;
-    case 0x0A:
-      this->opcode_A(opcode);
+
+    case 1: // andi ADDR, IMM
+      mem_value &= value;
+      this->write(target, mem_value, size);
+      this->set_ccr_flags(-1, is_negative(mem_value, size), !mem_value, 0, 0);
       break;
-    case 0x0B:
-      this->opcode_B(opcode);
+
+    case 2: // subi ADDR, IMM
+      this->set_ccr_flags_integer_subtract(mem_value, value, size);
+      this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+      mem_value -= value;
+      this->write(target, mem_value, size);
       break;
-    case 0x0C:
-      this->opcode_C(opcode);
+
+    case 3: // addi ADDR, IMM
+      this->set_ccr_flags_integer_add(mem_value, value, size);
+      this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+      mem_value += value;
+      this->write(target, mem_value, size);
       break;
-    case 0x0E:
-      this->opcode_E(opcode);
+
+    case 5: // xori ADDR, IMM
+      mem_value ^= value;
+      this->write(target, mem_value, size);
+      this->set_ccr_flags(-1, is_negative(mem_value, size), !mem_value, 0, 0);
       break;
-    case 0x0F:
-      this->opcode_unimplemented(opcode);
+
+    case 6: // cmpi ADDR, IMM
+      this->set_ccr_flags_integer_subtract(mem_value, value, size);
       break;
+
+    default:
+      throw runtime_error("invalid immediate operation");
+  }
+}
+
+void MC68KEmulator::exec_addq_subq(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  void* addr = this->resolve_address(insn.dest, size);
+  uint8_t value = insn.source.value;
+
+  // note: ccr flags are skipped when operating on an A register (M == 1)
+  uint32_t mem_value = this->read(addr, size);
+  if (op_get_g(insn.opcode)) {
+    this->write(addr, mem_value - value, size);
+    if (insn.dest.M != 1) {
+      this->set_ccr_flags_integer_subtract(mem_value, value, size);
+    }
+  } else {
+    this->write(addr, mem_value + value, size);
+    if (insn.dest.M != 1) {
+      this->set_ccr_flags_integer_add(mem_value, value, size);
+    }
+  }
+  this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+}
+
+void MC68KEmulator::exec_add_sub(const decoded_instruction& insn) {
+  bool is_add = (insn.opcode & 0xF000) == 0xD000;
+  Size size = static_cast<Size>(insn.size);
+  uint8_t dest = op_get_a(insn.opcode);
+
+  // add.S/sub.S DREG, ADDR
+  // add.S/sub.S ADDR, DREG
+  if (op_get_b(insn.opcode) & 4) {
+    void* addr = this->resolve_address(insn.dest, size);
+    uint32_t mem_value = this->read(addr, size);
+    uint32_t reg_value = this->read(&this->d[dest], size);
+    if (is_add) {
+      this->set_ccr_flags_integer_add(mem_value, reg_value, size);
+      mem_value += reg_value;
+    } else {
+      this->set_ccr_flags_integer_subtract(mem_value, reg_value, size);
+      mem_value -= reg_value;
+    }
+    this->write(addr, mem_value, size);
+  } else {
+    void* addr = this->resolve_address(insn.source, size);
+    uint32_t mem_value = this->read(addr, size);
+    uint32_t reg_value = this->read(&this->d[dest], size);
+    if (is_add) {
+      this->set_ccr_flags_integer_add(reg_value, mem_value, size);
+      reg_value += mem_value;
+    } else {
+      this->set_ccr_flags_integer_subtract(reg_value, mem_value, size);
+      reg_value -= mem_value;
+    }
+    this->write(&this->d[dest], reg_value, size);
+  }
+  this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+}
+
+void MC68KEmulator::exec_adda_suba(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  void* addr = this->resolve_address(insn.source, size);
+  uint32_t mem_value = sign_extend(this->read(addr, size), size);
+
+  uint8_t dest = insn.dest.Xn;
+  if ((insn.opcode & 0xF000) == 0xD000) {
+    this->set_ccr_flags_integer_add(this->a[dest], mem_value, Size::LONG);
+    this->a[dest] += mem_value;
+  } else {
+    this->set_ccr_flags_integer_subtract(this->a[dest], mem_value, Size::LONG);
+    this->a[dest] -= mem_value;
+  }
+  this->set_ccr_flags(this->ccr & 0x01, -1, -1, -1, -1);
+}
+
+void MC68KEmulator::exec_and_or(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  uint8_t a = op_get_a(insn.opcode);
+  bool to_addr = op_get_b(insn.opcode) & 4;
+  void* addr = this->resolve_address(to_addr ? insn.dest : insn.source, size);
+
+  // or uses the entire register (not just the low bytes); this affects the z
+  // flag for byte and word operations
+  uint32_t value;
+  if ((insn.opcode & 0xF000) == 0x8000) {
+    value = this->read(addr, size) | this->d[a];
+  } else {
+    value = this->read(addr, size) & this->read(&this->d[a], size);
+  }
+  this->write(to_addr ? addr : &this->d[a], value, size);
+  this->set_ccr_flags(-1, is_negative(value, size), (value == 0), 0, 0);
+}
+
+void MC68KEmulator::exec_cmp(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  int32_t left_value;
+  if (insn.dest.M == 1) { // cmpa.S AREG, ADDR
+    left_value = this->a[insn.dest.Xn];
+  } else { // cmp.S DREG, ADDR
+    left_value = this->d[insn.dest.Xn];
+    if (size == Size::BYTE) {
+      left_value &= 0x000000FF;
+    } else if (size == Size::WORD) {
+      left_value &= 0x0000FFFF;
+    }
+  }
+
+  void* addr = this->resolve_address(insn.source, size);
+  int32_t right_value = this->read(addr, size);
+  this->set_ccr_flags_integer_subtract(left_value, right_value, size);
+}
+
+void MC68KEmulator::exec_tst(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  uint32_t value = this->read(this->resolve_address(insn.source, size), size);
+  this->set_ccr_flags(-1, is_negative(value, size), (value == 0), 0, 0);
+}
+
+void MC68KEmulator::exec_clr(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  this->write(this->resolve_address(insn.dest, size), 0, size);
+  this->set_ccr_flags(-1, 0, 1, 0, 0);
+}
+
+void MC68KEmulator::exec_lea(const decoded_instruction& insn) {
+  this->a[insn.dest.Xn] = this->resolve_address_control(insn.source);
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_pea(const decoded_instruction& insn) {
+  uint32_t addr = this->resolve_address_control(insn.source);
+  this->a[7] -= 4;
+  this->write(this->a[7], addr, Size::LONG);
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_movem(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+  uint8_t bytes_per_value = bytes_for_size(size);
+
+  if (!(insn.opcode & 0x0400)) { // movem.S ADDR REGMASK
+    uint16_t reg_mask = insn.source.value;
+    uint8_t Xn = insn.dest.Xn;
+
+    // predecrement mode is special-cased for this opcode. in this mode we write
+    // the registers in reverse order
+    if (insn.dest.M == 4) {
+      // bit 15 is D0, bit 0 is A7
+      for (size_t x = 0; x < 8; x++) {
+        if (reg_mask & (1 << x)) {
+          this->a[Xn] -= bytes_per_value;
+          this->write(this->a[Xn], this->a[7 - x], size);
+        }
+      }
+      for (size_t x = 0; x < 8; x++) {
+        if (reg_mask & (1 << (x + 8))) {
+          this->a[Xn] -= bytes_per_value;
+          this->write(this->a[Xn], this->d[7 - x], size);
+        }
+      }
+
+    } else {
+      // bit 15 is A7, bit 0 is D0
+      uint32_t addr = this->resolve_address_control(insn.dest);
+      for (size_t x = 0; x < 8; x++) {
+        if (reg_mask & (1 << x)) {
+          this->write(addr, this->d[x], size);
+          addr += bytes_per_value;
+        }
+      }
+      for (size_t x = 0; x < 8; x++) {
+        if (reg_mask & (1 << (x + 8))) {
+          this->write(addr, this->a[x], size);
+          addr += bytes_per_value;
+        }
+      }
+    }
+
+  } else { // movem.S REGMASK ADDR
+    uint16_t reg_mask = insn.dest.value;
+
+    // postincrement mode is special-cased for this opcode
+    uint32_t addr;
+    if (insn.source.M == 3) {
+      addr = this->a[insn.source.Xn];
+    } else {
+      addr = this->resolve_address_control(insn.source);
+    }
+
+    // bit 15 is A7, bit 0 is D0
+    for (size_t x = 0; x < 8; x++) {
+      if (reg_mask & (1 << x)) {
+        this->d[x] = this->read(addr, size);
+        addr += bytes_per_value;
+      }
+    }
+    for (size_t x = 0; x < 8; x++) {
+      if (reg_mask & (1 << (x + 8))) {
+        this->a[x] = this->read(addr, size);
+        addr += bytes_per_value;
+      }
+    }
+
+    if (insn.source.M == 3) {
+      this->a[insn.source.Xn] = addr;
+    }
   }
+
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_link(const decoded_instruction& insn) {
+  uint8_t d = insn.dest.Xn;
+  this->a[7] -= 4;
+  this->write(this->a[7], this->a[d], Size::LONG);
+  this->a[d] = this->a[7];
+  this->a[7] += insn.source.value;
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_unlink(const decoded_instruction& insn) {
+  uint8_t d = insn.dest.Xn;
+  this->a[7] = this->a[d];
+  this->a[d] = this->read(this->a[7], Size::LONG);
+  this->a[7] += 4;
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_shift(const decoded_instruction& insn) {
+  Size size = static_cast<Size>(insn.size);
+
+  uint8_t shift_amount;
+  if (insn.source.M == 0) {
+    if (size == Size::BYTE) {
+      shift_amount = this->d[insn.source.Xn] & 0x00000007;
+    } else if (size == Size::WORD) {
+      shift_amount = this->d[insn.source.Xn] & 0x0000000F;
+    } else {
+      shift_amount = this->d[insn.source.Xn] & 0x0000001F;
+    }
+  } else {
+    shift_amount = insn.source.value;
+  }
+
+  uint8_t k = ((op_get_c(insn.opcode) & 3) << 1) | op_get_g(insn.opcode);
+  this->shift_register(k, size, insn.dest.Xn, shift_amount);
+}
+
+void MC68KEmulator::exec_bcc(const decoded_instruction& insn) {
+  uint8_t k = op_get_k(insn.opcode);
+  if (k == 1) { // bsr; pc is already the return address
+    this->a[7] -= 4;
+    this->write(this->a[7], this->pc, Size::LONG);
+    this->pc = insn.dest.value;
+  } else if (this->check_condition(k)) {
+    this->pc = insn.dest.value;
+  }
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_dbcc(const decoded_instruction& insn) {
+  if (!this->check_condition(op_get_k(insn.opcode))) {
+    uint32_t& reg = this->d[insn.source.Xn];
+    uint16_t target = (reg & 0xFFFF) - 1;
+    reg = (reg & 0xFFFF0000) | target;
+    if (target != 0xFFFF) {
+      this->pc = insn.dest.value;
+    }
+  }
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_jmp_jsr(const decoded_instruction& insn) {
+  uint32_t addr = this->resolve_address_control(insn.source);
+  if (!(insn.opcode & 0x0040)) { // jsr ADDR
+    this->a[7] -= 4;
+    this->write(this->a[7], this->pc, Size::LONG);
+  }
+  this->pc = addr;
+  // note: ccr not affected
+}
+
+void MC68KEmulator::exec_rts(const decoded_instruction& insn) {
+  this->pc = this->read(this->a[7], Size::LONG);
+  this->a[7] += 4;
+}
+
+
+
+MC68KEmulator::opcode_handler MC68KEmulator::handler_for_opcode(uint16_t opcode) {
+  static const opcode_handler handlers[0x10] = {
+    &MC68KEmulator::opcode_0123,
+    &MC68KEmulator::opcode_0123,
+    &MC68KEmulator::opcode_0123,
+    &MC68KEmulator::opcode_0123,
+    &MC68KEmulator::opcode_4,
+    &MC68KEmulator::opcode_5,
+    &MC68KEmulator::opcode_6,
+    &MC68KEmulator::opcode_7,
+    &MC68KEmulator::opcode_8,
+    &MC68KEmulator::opcode_9D,
+    &MC68KEmulator::opcode_A,
+    &MC68KEmulator::opcode_B,
+    &MC68KEmulator::opcode_C,
+    &MC68KEmulator::opcode_9D,
+    &MC68KEmulator::opcode_E,
+    &MC68KEmulator::opcode_unimplemented,
+  };
+  return handlers[(opcode >> 12) & 0x000F];
+}
+
+// longest instruction that decode_instruction produces (e.g. addi.l IMM with a
+// displacement)
+static const size_t MAX_DECODED_INSTRUCTION_LENGTH = 8;
+
+// reads an instruction's words for decode_instruction. if the instruction runs
+// past the end of its memory region, valid is cleared (and the instruction is
+// run through exec_opcode instead, which fails when it gets there)
+struct instruction_word_reader {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+  uint32_t addr;
+  bool valid;
+
+  instruction_word_reader(const void* data, size_t size, uint32_t addr) :
+      data(reinterpret_cast<const uint8_t*>(data)), size(size), offset(0),
+      addr(addr), valid(true) { }
+
+  // address of the next word to be read
+  uint32_t pc() const {
+    return this->addr + this->offset;
+  }
+
+  uint16_t get_u16() {
+    if (this->offset + 2 > this->size) {
+      this->valid = false;
+      return 0;
+    }
+    uint16_t ret = (this->data[this->offset] << 8) | this->data[this->offset + 1];
+    this->offset += 2;
+    return ret;
+  }
+
+  uint32_t get_u32() {
+    uint32_t high = this->get_u16();
+    return (high << 16) | this->get_u16();
+  }
+};
+
+// decodes an effective address and fetches its extension words. returns false
+// if the address mode isn't one that the exec_* handlers support; these are
+// left to the opcode_* functions, which throw for most of them.
+static bool decode_operand(instruction_word_reader& r,
+    MC68KEmulator::decoded_operand& op, uint8_t M, uint8_t Xn, Size size,
+    bool is_written) {
+  op.M = M;
+  op.Xn = Xn;
+  switch (M) {
+    case 0:
+    case 1:
+    case 2:
+    case 3:
+    case 4:
+      return true;
+    case 5:
+      op.value = static_cast<int16_t>(r.get_u16());
+      return true;
+    case 6:
+      op.ext = r.get_u16();
+      return true;
+    case 7:
+      if (Xn == 2) {
+        op.value = r.pc();
+        op.value += static_cast<int16_t>(r.get_u16());
+        return true;
+      } else if (Xn == 3) {
+        op.value = r.pc();
+        op.ext = r.get_u16();
+        return true;
+      } else if ((Xn == 4) && !is_written) {
+        // like resolve_address, this reads byte immediates from the first byte
+        // of the extension word
+        if (size == Size::LONG) {
+          op.value = r.get_u32();
+        } else {
+          op.value = r.get_u16();
+          if (size == Size::BYTE) {
+            op.value >>= 8;
+          }
+        }
+        return true;
+      }
+      return false;
+    default:
+      return false;
+  }
+}
+
+static bool decode_control_operand(instruction_word_reader& r,
+    MC68KEmulator::decoded_operand& op, uint8_t M, uint8_t Xn) {
+  if ((M == 2) || (M == 5) || (M == 6) || ((M == 7) && ((Xn == 2) || (Xn == 3)))) {
+    return decode_operand(r, op, M, Xn, Size::LONG, false);
+  }
+  return false;
+}
+
+// returns the handler for an instruction, or NULL if it should go through
+// exec_opcode. this only accepts forms of instructions that the corresponding
+// opcode_* functions implement; anything that would throw is left to them.
+static MC68KEmulator::instruction_handler decode_instruction_handler(
+    MC68KEmulator::decoded_instruction& insn, instruction_word_reader& r) {
+  uint16_t opcode = insn.opcode;
+  uint8_t i = op_get_i(opcode);
+  uint8_t a = op_get_a(opcode);
+  uint8_t b = op_get_b(opcode);
+  uint8_t c = op_get_c(opcode);
+  uint8_t d = op_get_d(opcode);
+
+  switch (i) {
+    case 0x0: {
+      // ori/andi/subi/addi/xori/cmpi ADDR, IMM; the immediate value comes
+      // before the target address's extension words
+      uint8_t s = op_get_s(opcode);
+      if (op_get_g(opcode) || (a == 4) || (a == 7) || (s == 3) ||
+          (((a == 0) || (a == 1) || (a == 5)) && (c == 7) && (d == 4))) {
+        return NULL;
+      }
+      Size size = static_cast<Size>(s);
+      insn.size = s;
+      insn.source.M = 7;
+      insn.source.Xn = 4;
+      insn.source.value = (size == Size::LONG) ? r.get_u32() : r.get_u16();
+      return decode_operand(r, insn.dest, c, d, size, true) ?
+          &MC68KEmulator::exec_immediate : NULL;
+    }
+
+    case 0x1:
+    case 0x2:
+    case 0x3: {
+      Size size = size_for_dsize(i);
+      insn.size = static_cast<uint8_t>(size);
+      if (b == 1) { // movea.S AREG, ADDR
+        if (size == Size::BYTE) {
+          return NULL;
+        }
+        insn.dest.M = 1;
+        insn.dest.Xn = a;
+        return decode_operand(r, insn.source, c, d, size, false) ?
+            &MC68KEmulator::exec_movea : NULL;
+      }
+      // move.S ADDR1, ADDR2 (the source's extension words come first)
+      if (!decode_operand(r, insn.source, c, d, size, false) ||
+          !decode_operand(r, insn.dest, b, a, size, true)) {
+        return NULL;
+      }
+      return &MC68KEmulator::exec_move;
+    }
+
+    case 0x4:
+      if (opcode == 0x4E75) {
+        return &MC68KEmulator::exec_rts;
+      }
+      if ((opcode & 0xFFF0) == 0x4E50) { // link/unlink
+        insn.dest.M = 1;
+        insn.dest.Xn = d;
+        if (c == 2) {
+          insn.source.value = static_cast<int16_t>(r.get_u16());
+          return &MC68KEmulator::exec_link;
+        }
+        return &MC68KEmulator::exec_unlink;
+      }
+      if (op_get_g(opcode)) {
+        if (b == 7) { // lea.l AREG, ADDR
+          insn.dest.M = 1;
+          insn.dest.Xn = a;
+          return decode_control_operand(r, insn.source, c, d) ?
+              &MC68KEmulator::exec_lea : NULL;
+        }
+        return NULL;
+      }
+      if ((a == 1) && (b != 3)) { // clr.S ADDR
+        insn.size = b;
+        return decode_operand(r, insn.dest, c, d, static_cast<Size>(b), true) ?
+            &MC68KEmulator::exec_clr : NULL;
+      }
+      if ((a == 5) && (b != 3)) { // tst.S ADDR
+        insn.size = b;
+        return decode_operand(r, insn.source, c, d, static_cast<Size>(b), false) ?
+            &MC68KEmulator::exec_tst : NULL;
+      }
+      if ((a == 4) && (b == 1) && (c != 0)) { // pea.l ADDR
+        return decode_control_operand(r, insn.source, c, d) ?
+            &MC68KEmulator::exec_pea : NULL;
+      }
+      if ((a == 4) && (b & 2) && (c != 0)) { // movem.S ADDR REGMASK
+        insn.size = static_cast<uint8_t>(size_for_tsize(op_get_t(opcode)));
+        insn.source.value = r.get_u16();
+        if (c == 4) {
+          insn.dest.M = 4;
+          insn.dest.Xn = d;
+          return &MC68KEmulator::exec_movem;
+        }
+        return decode_control_operand(r, insn.dest, c, d) ?
+            &MC68KEmulator::exec_movem : NULL;
+      }
+      if ((a == 6) && (b & 2)) { // movem.S REGMASK ADDR
+        insn.size = static_cast<uint8_t>(size_for_tsize(op_get_t(opcode)));
+        insn.dest.value = r.get_u16();
+        if (c == 3) {
+          insn.source.M = 3;
+          insn.source.Xn = d;
+          return &MC68KEmulator::exec_movem;
+        }
+        return decode_control_operand(r, insn.source, c, d) ?
+            &MC68KEmulator::exec_movem : NULL;
+      }
+      if ((a == 7) && ((b == 2) || (b == 3))) { // jsr/jmp ADDR
+        return decode_control_operand(r, insn.source, c, d) ?
+            &MC68KEmulator::exec_jmp_jsr : NULL;
+      }
+      return NULL;
+
+    case 0x5:
+      if (op_get_s(opcode) == 3) {
+        if (c != 1) { // sCC ADDR
+          return NULL;
+        }
+        // dbCC DISPLACEMENT
+        insn.source.M = 0;
+        insn.source.Xn = d;
+        insn.dest.value = r.pc();
+        insn.dest.value += static_cast<int16_t>(r.get_u16());
+        return &MC68KEmulator::exec_dbcc;
+      }
+      // subq/addq ADDR, IMM
+      insn.size = op_get_s(opcode);
+      insn.source.M = 7;
+      insn.source.Xn = 4;
+      insn.source.value = a ? a : 8;
+      return decode_operand(r, insn.dest, c, d, static_cast<Size>(insn.size), true) ?
+          &MC68KEmulator::exec_addq_subq : NULL;
+
+    case 0x6: {
+      // bra/bsr/bCC DISPLACEMENT. the displacement is relative to the word
+      // after the opcode, even if there's an extended displacement
+      int32_t displacement = static_cast<int8_t>(op_get_y(opcode));
+      insn.dest.value = r.pc();
+      if (displacement == 0) {
+        displacement = static_cast<int16_t>(r.get_u16());
+      } else if (displacement == -1) {
+        displacement = r.get_u32();
+      }
+      insn.dest.value += displacement;
+      return &MC68KEmulator::exec_bcc;
+    }
+
+    case 0x7: // moveq DREG, IMM
+      insn.dest.M = 0;
+      insn.dest.Xn = a;
+      insn.source.value = static_cast<int8_t>(op_get_y(opcode));
+      return &MC68KEmulator::exec_moveq;
+
+    case 0x8: // or.S DREG, ADDR / or.S ADDR, DREG
+    case 0xC: // and.S DREG, ADDR / and.S ADDR, DREG
+      if (((b & 3) == 3) || ((b & 4) && !(c & 6))) {
+        return NULL;
+      }
+      insn.size = b & 3;
+      if (b & 4) {
+        insn.source.M = 0;
+        insn.source.Xn = a;
+        return decode_operand(r, insn.dest, c, d, static_cast<Size>(insn.size), true) ?
+            &MC68KEmulator::exec_and_or : NULL;
+      }
+      insn.dest.M = 0;
+      insn.dest.Xn = a;
+      return decode_operand(r, insn.source, c, d, static_cast<Size>(insn.size), false) ?
+          &MC68KEmulator::exec_and_or : NULL;
+
+    case 0x9: // sub
+    case 0xD: // add
+      if (((c & 6) == 0) && (b & 4) && (b != 7)) {
+        return NULL;
+      }
+      if ((b & 3) == 3) { // adda.S/suba.S AREG, ADDR
+        Size size = (b & 4) ? Size::LONG : Size::WORD;
+        insn.size = static_cast<uint8_t>(size);
+        insn.dest.M = 1;
+        insn.dest.Xn = a;
+        return decode_operand(r, insn.source, c, d, size, false) ?
+            &MC68KEmulator::exec_adda_suba : NULL;
+      }
+      insn.size = b & 3;
+      if (b & 4) { // add.S/sub.S DREG, ADDR
+        insn.source.M = 0;
+        insn.source.Xn = a;
+        return decode_operand(r, insn.dest, c, d, static_cast<Size>(insn.size), true) ?
+            &MC68KEmulator::exec_add_sub : NULL;
+      }
+      // add.S/sub.S ADDR, DREG
+      insn.dest.M = 0;
+      insn.dest.Xn = a;
+      return decode_operand(r, insn.source, c, d, static_cast<Size>(insn.size), false) ?
+          &MC68KEmulator::exec_add_sub : NULL;
+
+    case 0xB: // cmp.S DREG, ADDR / cmpa.S AREG, ADDR
+      if (b < 3) {
+        insn.size = b;
+        insn.dest.M = 0;
+      } else if ((b & 3) == 3) {
+        insn.size = static_cast<uint8_t>((b & 4) ? Size::LONG : Size::WORD);
+        insn.dest.M = 1;
+      } else {
+        return NULL;
+      }
+      insn.dest.Xn = a;
+      return decode_operand(r, insn.source, c, d, static_cast<Size>(insn.size), false) ?
+          &MC68KEmulator::exec_cmp : NULL;
+
+    case 0xE: { // asr/asl/lsr/lsl/roxr/roxl/ror/rol DREG, COUNT/REG
+      uint8_t s = op_get_s(opcode);
+      if (s == 3) {
+        return NULL;
+      }
+      insn.size = s;
+      insn.dest.M = 0;
+      insn.dest.Xn = d;
+      if (c & 4) {
+        insn.source.M = 0;
+        insn.source.Xn = a;
+      } else {
+        if ((a == 0) && (static_cast<Size>(s) == Size::BYTE)) {
+          return NULL;
+        }
+        insn.source.M = 7;
+        insn.source.Xn = 4;
+        insn.source.value = a ? a : 8;
+      }
+      return &MC68KEmulator::exec_shift;
+    }
+
+    default:
+      return NULL;
+  }
+}
+
+void MC68KEmulator::decode_instruction(decoded_instruction& insn,
+    const void* data, size_t size, uint32_t addr) {
+  instruction_word_reader r(data, size, addr);
+  insn = decoded_instruction();
+  insn.opcode = r.get_u16();
+  insn.handler = decode_instruction_handler(insn, r);
+  if (insn.handler && r.valid) {
+    insn.length = r.offset;
+  } else {
+    insn.handler = &MC68KEmulator::exec_opcode;
+    insn.length = 2;
+  }
+}
+
+MC68KEmulator::decoded_instruction* MC68KEmulator::find_decoded_instruction(
+    uint32_t addr) {
+  if (addr & 1) {
+    return NULL;
+  }
+
+  // usually we're still in the same region as the last instruction
+  code_region_cache* cache = NULL;
+  if (this->last_code_cache_index < this->code_caches.size()) {
+    code_region_cache& last = this->code_caches[this->last_code_cache_index];
+    if ((addr >= last.start_addr) && (addr - last.start_addr < last.region->size())) {
+      cache = &last;
+    }
+  }
+  for (size_t x = 0; !cache && (x < this->code_caches.size()); x++) {
+    code_region_cache& c = this->code_caches[x];
+    if ((addr >= c.start_addr) && (addr - c.start_addr < c.region->size())) {
+      cache = &c;
+      this->last_code_cache_index = x;
+    }
+  }
+
+  // if we haven't executed anything in this region yet, start caching it
+  if (!cache) {
+    auto region_it = this->memory_regions.upper_bound(addr);
+    if (region_it == this->memory_regions.begin()) {
+      return NULL;
+    }
+    region_it--;
+    if (addr - region_it->first >= region_it->second.size()) {
+      return NULL;
+    }
+    this->code_caches.emplace_back();
+    cache = &this->code_caches.back();
+    cache->start_addr = region_it->first;
+    cache->region = &region_it->second;
+    this->last_code_cache_index = this->code_caches.size() - 1;
+  }
+
+  // the region may have grown since we last looked at it (e.g. the trap call
+  // region does this)
+  size_t offset = addr - cache->start_addr;
+  if (offset + 2 > cache->region->size()) {
+    return NULL;
+  }
+  size_t index = offset / 2;
+  if (index >= cache->instructions.size()) {
+    cache->instructions.resize(cache->region->size() / 2);
+  }
+  decoded_instruction& insn = cache->instructions[index];
+  if (!insn.handler) {
+    decode_instruction(insn, cache->region->data() + offset,
+        cache->region->size() - offset, addr);
+  }
+  return &insn;
+}
+
+void MC68KEmulator::invalidate_decoded_instructions(const void* addr,
+    size_t size) {
+  const char* ptr = reinterpret_cast<const char*>(addr);
+  for (auto& cache : this->code_caches) {
+    const char* region_data = cache.region->data();
+    if ((ptr < region_data) || (ptr >= region_data + cache.region->size())) {
+      continue;
+    }
+    // extension words are cached with the instruction they belong to, so an
+    // instruction that starts a few bytes before the write can be affected too
+    size_t offset = ptr - region_data;
+    size_t start_index = (offset - min<size_t>(offset, MAX_DECODED_INSTRUCTION_LENGTH)) / 2;
+    size_t end_index = (offset + size - 1) / 2;
+    for (size_t x = start_index; (x <= end_index) && (x < cache.instructions.size()); x++) {
+      decoded_instruction& insn = cache.instructions[x];
+      if (x * 2 + insn.length > offset) {
+        insn.handler = NULL;
+      }
+    }
+  }
+}
+
+void MC68KEmulator::invalidate_instruction_cache() {
+  this->code_caches.clear();
+  this->last_code_cache_index = 0;
+}
+
+void MC68KEmulator::execute_next_opcode() {
+  decoded_instruction* insn = this->find_decoded_instruction(this->pc);
+
+  // if the pc isn't somewhere we can cache (e.g. it's odd or out of range), do
+  // it the slow way; fetch_instruction_word will throw if the pc is invalid
+  if (!insn) {
+    uint16_t opcode = this->fetch_instruction_word();
+    (this->*handler_for_opcode(opcode))(opcode);
+    return;
+  }
+
+  // the handler may write to the instruction it's executing (or cause the cache
+  // to be reallocated), so copy the entry before calling it
+  decoded_instruction decoded = *insn;
+  this->pc += decoded.length;
+  (this->*decoded.handler)(decoded);
 }
 
 void MC68KEmulator::execute_forever() {
@@ -8,6 +8,7 @@
 #include <unordered_set>
 #include <phosg/Strings.hh>
 #include <string>
+#include <vector>
 
 
 enum class Size {
@@ -44,6 +45,72 @@ enum class DebuggingMode {
 };
 
 
+// an opcode found by MC68KEmulator::disassemble's linear sweep. offsets are
+// relative to the beginning of the data; complete is false if the opcode
+// couldn't be disassembled (it's written as .incomplete in the listing)
+struct mc68k_opcode_span {
+  uint32_t offset;
+  uint32_t end_offset;
+  bool complete;
+};
+
+// control flow graph for a block of 68K code, built from the same linear sweep
+// as MC68KEmulator::disassemble (so the opcode boundaries match the listing).
+// all offsets are relative to the beginning of the analyzed data, and all the
+// lists are flat arrays that refer to each other by index.
+struct mc68k_control_flow_graph {
+  enum block_flag {
+    // how the block's last opcode ends it. blocks with none of these flags fall
+    // through to the next block (or end at the end of the data)
+    ENDS_WITH_BRANCH = 0x01, // bra or jmp to a known target
+    ENDS_WITH_CONDITIONAL_BRANCH = 0x02, // bcc or dbcc; also falls through
+    ENDS_WITH_RETURN = 0x04, // rts, rtd, rte or rtr
+    ENDS_WITH_INDIRECT_JUMP = 0x08, // jmp to a computed or external address
+    ENDS_WITH_STOP = 0x10, // stop, illegal or _ExitToShell
+    ENDS_WITH_INVALID_OPCODE = 0x20, // couldn't be disassembled
+  };
+  enum class edge_type {
+    FALLTHROUGH = 0,
+    BRANCH,
+  };
+  enum class call_type {
+    LOCAL = 0, // bsr or jsr to an offset in the data; target is the offset
+    A5_RELATIVE, // jsr or jmp to d16(A5); target is the displacement
+    INDIRECT, // jsr to any other address; target is unused
+  };
+
+  struct basic_block {
+    uint32_t start_offset;
+    uint32_t end_offset; // offset of the first byte after the last opcode
+    uint32_t function_index; // NO_FUNCTION if unreachable from any entry point
+    uint32_t flags;
+  };
+  struct edge {
+    uint32_t from_block;
+    uint32_t to_block;
+    edge_type type;
+  };
+  struct call {
+    uint32_t opcode_offset;
+    uint32_t from_block;
+    call_type type;
+    bool is_tail_call; // jmp instead of jsr
+    int32_t target;
+  };
+  struct function {
+    uint32_t entry_offset;
+    uint32_t entry_block;
+  };
+
+  static const uint32_t NO_FUNCTION = 0xFFFFFFFF;
+
+  std::vector<basic_block> blocks; // in order of start_offset
+  std::vector<edge> edges; // in order of from_block
+  std::vector<call> calls; // in order of opcode_offset
+  std::vector<function> functions; // in order of entry_offset
+};
+
+
 struct MC68KEmulator {
   std::map<uint32_t, std::string> memory_regions;
 
@@ -61,17 +128,85 @@ struct MC68KEmulator {
   std::string* trap_call_region;
   std::unordered_map<uint16_t, uint32_t> trap_to_call_addr;
 
+  // decoded instruction cache. each region that code has been executed from
+  // gets a vector with one entry per word; an entry holds the handler for the
+  // instruction that starts there, along with its operands (addressing modes,
+  // registers, size and extension words), so execute_next_opcode doesn't have
+  // to translate, fetch and decode it again. the most common instructions have
+  // handlers that use these directly; the rest go through exec_opcode, which
+  // calls the opcode_* functions below as if the instruction weren't cached.
+  // writes through write() into these regions clear the affected entries; if
+  // you modify memory_regions directly after execution has started, call
+  // invalidate_instruction_cache().
+  struct decoded_operand {
+    uint8_t M;
+    uint8_t Xn;
+    uint16_t ext; // brief extension word, if M is 6 or M is 7 and Xn is 3
+    // displacement (M = 5), target address (M = 7, Xn = 2), address of the
+    // extension word (M = 7, Xn = 3) or immediate value (M = 7, Xn = 4)
+    uint32_t value;
+  };
+  struct decoded_instruction;
+  typedef void (MC68KEmulator::*opcode_handler)(uint16_t);
+  typedef void (MC68KEmulator::*instruction_handler)(
+      const decoded_instruction&);
+  struct decoded_instruction {
+    instruction_handler handler; // NULL if not decoded yet
+    uint16_t opcode;
+    uint8_t size; // a Size, for instructions that have one
+    uint8_t length; // in bytes, including extension words
+    decoded_operand source;
+    decoded_operand dest; // for branches, value is the target address
+  };
+  struct code_region_cache {
+    uint32_t start_addr;
+    const std::string* region;
+    std::vector<decoded_instruction> instructions;
+  };
+  std::vector<code_region_cache> code_caches;
+  size_t last_code_cache_index;
+  // immediate operands are read from here, so they can be used like the
+  // results of resolve_address
+  uint32_t immediate_operand;
+
+  // address translation. memory_regions is still the source of truth; the page
+  // table maps each 64KB page to the region that was last found to contain an
+  // address in it (as an index into page_regions, plus one; 0 means not looked
+  // up yet), and last_page_region_index is the region of the last successful
+  // translation. both are filled in lazily, so regions can be added (or
+  // resized) at any time; if you remove a region after execution has started,
+  // call invalidate_address_translation().
+  std::vector<std::pair<uint32_t, const std::string*>> page_regions;
+  std::vector<uint16_t> page_table;
+  size_t last_page_region_index;
+
   MC68KEmulator();
 
+  // clears the registers, trap call routines and caches so the emulator can be
+  // used to run something else. memory_regions is left alone, so the caller
+  // can reuse the regions' allocations by resizing or reassigning them.
+  void reset();
+
   void print_state(FILE* stream, bool print_memory = false);
 
   static std::string disassemble_one(const void* vdata, size_t size,
       uint32_t start_address);
   static std::string disassemble_one(StringReader& r, uint32_t start_address,
       std::unordered_set<uint32_t>& branch_target_addresses);
+  // if opcodes is given, the span of each disassembled opcode is appended to
+  // it, so the caller can analyze the control flow without disassembling the
+  // data again
   static std::string disassemble(const void* vdata, size_t size,
       uint32_t start_address,
-      const std::unordered_multimap<uint32_t, std::string>* labels = NULL);
+      const std::unordered_multimap<uint32_t, std::string>* labels = NULL,
+      std::vector<mc68k_opcode_span>* opcodes = NULL);
+  // entry_offsets are the offsets of functions that are called from outside the
+  // data; the targets of local calls are added to these automatically. opcodes
+  // should be the spans that disassemble returned for the same data; if it's
+  // NULL, the data is disassembled here to find them.
+  static mc68k_control_flow_graph analyze_control_flow(const void* vdata,
+      size_t size, const std::vector<uint32_t>& entry_offsets,
+      const std::vector<mc68k_opcode_span>* opcodes = NULL);
 
   uint32_t get_reg_value(bool is_a_reg, uint8_t reg_num);
   void set_ccr_flags(int64_t x, int64_t n, int64_t z, int64_t v, int64_t c);
@@ -85,6 +220,8 @@ struct MC68KEmulator {
   void write(void* addr, uint32_t value, Size size);
 
   void* translate_address(uint32_t addr);
+  void* translate_address_slow(uint32_t addr);
+  void invalidate_address_translation();
   uint16_t fetch_instruction_word(bool advance = true);
   int16_t fetch_instruction_word_signed(bool advance = true);
   uint32_t fetch_instruction_data(Size size, bool advance = true);
@@ -93,6 +230,8 @@ struct MC68KEmulator {
   uint32_t resolve_address_extension(uint16_t ext);
   uint32_t resolve_address_control(uint8_t M, uint8_t Xn);
   void* resolve_address(uint8_t M, uint8_t Xn, Size size);
+  uint32_t resolve_address_control(const decoded_operand& op);
+  void* resolve_address(const decoded_operand& op, Size size);
 
   bool check_condition(uint8_t condition_code);
 
@@ -109,6 +248,38 @@ struct MC68KEmulator {
   void opcode_C(uint16_t opcode);
   void opcode_E(uint16_t opcode);
 
+  void shift_register(uint8_t k, Size size, uint8_t Xn, uint8_t shift_amount);
+
+  void exec_opcode(const decoded_instruction& insn);
+  void exec_move(const decoded_instruction& insn);
+  void exec_movea(const decoded_instruction& insn);
+  void exec_moveq(const decoded_instruction& insn);
+  void exec_immediate(const decoded_instruction& insn);
+  void exec_addq_subq(const decoded_instruction& insn);
+  void exec_add_sub(const decoded_instruction& insn);
+  void exec_adda_suba(const decoded_instruction& insn);
+  void exec_and_or(const decoded_instruction& insn);
+  void exec_cmp(const decoded_instruction& insn);
+  void exec_tst(const decoded_instruction& insn);
+  void exec_clr(const decoded_instruction& insn);
+  void exec_lea(const decoded_instruction& insn);
+  void exec_pea(const decoded_instruction& insn);
+  void exec_movem(const decoded_instruction& insn);
+  void exec_link(const decoded_instruction& insn);
+  void exec_unlink(const decoded_instruction& insn);
+  void exec_shift(const decoded_instruction& insn);
+  void exec_bcc(const decoded_instruction& insn);
+  void exec_dbcc(const decoded_instruction& insn);
+  void exec_jmp_jsr(const decoded_instruction& insn);
+  void exec_rts(const decoded_instruction& insn);
+
+  static opcode_handler handler_for_opcode(uint16_t opcode);
+  static void decode_instruction(decoded_instruction& insn, const void* data,
+      size_t size, uint32_t addr);
+  decoded_instruction* find_decoded_instruction(uint32_t addr);
+  void invalidate_decoded_instructions(const void* addr, size_t size);
+  void invalidate_instruction_cache();
+
   void execute_next_opcode();
   void execute_forever();
 };
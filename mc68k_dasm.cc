@@ -3,7 +3,7 @@
 #include <stdio.h>
 #include <stdint.h>
 
-#include <deque>
+#include <algorithm>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -54,6 +54,48 @@ static const unordered_map<uint8_t, const char*> string_for_condition({
 
 
 
+// the disassembler produces a lot of text, so the common cases are formatted
+// with these instead of string_printf, which is much slower
+
+// appends value in uppercase hex, zero-padded to at least min_digits digits
+static void append_hex(string& out, uint64_t value, size_t min_digits = 1) {
+  char buf[16];
+  size_t len = 0;
+  do {
+    buf[15 - len++] = "0123456789ABCDEF"[value & 0x0F];
+    value >>= 4;
+  } while (value || (len < min_digits));
+  out.append(&buf[16 - len], len);
+}
+
+// writes value in uppercase hex to dest, using exactly num_digits digits
+static inline void write_hex(char* dest, uint64_t value, size_t num_digits) {
+  for (size_t x = num_digits; x > 0; x--) {
+    dest[x - 1] = "0123456789ABCDEF"[value & 0x0F];
+    value >>= 4;
+  }
+}
+
+// appends a register name, like D0 or A7
+static inline void append_reg(string& out, char type, uint8_t num) {
+  out += type;
+  out += static_cast<char>('0' + num);
+}
+
+// appends an opcode name (with a size suffix, if size isn't 0), padded to the
+// width of the opcode column so the operands can be appended after it
+static void append_op_name(string& out, const char* name, char size = 0) {
+  size_t start_offset = out.size();
+  out += name;
+  if (size) {
+    out += '.';
+    out += size;
+  }
+  out.resize(start_offset + 11, ' ');
+}
+
+
+
 inline int op_get_i(uint16_t op) {
   return ((op >> 12) & 0x000F);
 }
@@ -122,13 +164,14 @@ inline bool maybe_char(uint8_t ch) {
 }
 
 string format_immediate(int64_t value) {
-  string hex_repr = string_printf("0x%" PRIX64, value);
+  string ret = "0x";
+  append_hex(ret, value);
 
   string char_repr;
   for (ssize_t shift = 56; shift >= 0; shift-= 8) {
     uint8_t byte = (value >> shift) & 0xFF;
     if (!maybe_char(byte)) {
-      return hex_repr;
+      return ret;
     }
     if (char_repr.empty() && (byte == 0)) {
       continue; // ignore leading \0 bytes
@@ -148,14 +191,19 @@ string format_immediate(int64_t value) {
     }
   }
 
-  return string_printf("%s /* \'%s\' */", hex_repr.c_str(), char_repr.c_str());
+  ret += " /* \'";
+  ret += char_repr;
+  ret += "\' */";
+  return ret;
 }
 
 
 
-string disassemble_opcode_F(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_F(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint16_t opcode = r.get_u16r();
-  return string_printf(".extension 0x%03hX // unimplemented", opcode & 0x0FFF);
+  out += ".extension 0x";
+  append_hex(out, opcode & 0x0FFF, 3);
+  out += " // unimplemented";
 }
 
 string disassemble_reg_mask(uint16_t mask, bool reverse) {
@@ -167,24 +215,28 @@ string disassemble_reg_mask(uint16_t mask, bool reverse) {
   if (reverse) {
     for (ssize_t x = 15; x >= 8; x--) {
       if (mask & (1 << x)) {
-        ret += string_printf("A%zd,", x - 8);
+        append_reg(ret, 'A', x - 8);
+        ret += ',';
       }
     }
     for (ssize_t x = 7; x >= 0; x--) {
       if (mask & (1 << x)) {
-        ret += string_printf("D%zd,", x);
+        append_reg(ret, 'D', x);
+        ret += ',';
       }
     }
 
   } else {
     for (ssize_t x = 15; x >= 8; x--) {
       if (mask & (1 << x)) {
-        ret += string_printf("D%zd,", 15 - x);
+        append_reg(ret, 'D', 15 - x);
+        ret += ',';
       }
     }
     for (ssize_t x = 7; x >= 0; x--) {
       if (mask & (1 << x)) {
-        ret += string_printf("A%zd,", 7 - x);
+        append_reg(ret, 'A', 7 - x);
+        ret += ',';
       }
     }
   }
@@ -203,22 +255,31 @@ string disassemble_address_extension(StringReader& r, uint16_t ext, int8_t An) {
 
   if (!(ext & 0x0100)) {
     // brief extension word
-    ret += (An == -1) ? "[PC" : string_printf("[A%hhd", An);
+    if (An == -1) {
+      ret += "[PC";
+    } else {
+      ret += '[';
+      append_reg(ret, 'A', An);
+    }
 
+    ret += " + ";
+    append_reg(ret, index_is_a_reg ? 'A' : 'D', index_reg_num);
+    if (index_is_word) {
+      ret += ".w";
+    }
     if (scale != 1) {
-      ret += string_printf(" + %c%hhu%s * %hhu", index_is_a_reg ? 'A' : 'D',
-          index_reg_num, index_is_word ? ".w" : "", scale);
-    } else {
-      ret += string_printf(" + %c%hhu%s", index_is_a_reg ? 'A' : 'D',
-          index_reg_num, index_is_word ? ".w" : "");
+      ret += " * ";
+      ret += static_cast<char>('0' + scale);
     }
 
     // TODO: is this signed? here we're assuming it is
     int8_t offset = static_cast<int8_t>(ext & 0xFF);
     if (offset > 0) {
-      return ret + string_printf(" + 0x%hhX]", offset);
+      ret += " + 0x";
+      append_hex(ret, offset);
     } else if (offset < 0) {
-      return ret + string_printf(" - 0x%hhX]", -offset);
+      ret += " - 0x";
+      append_hex(ret, -offset);
     }
     return ret + ']';
   }
@@ -384,24 +445,42 @@ string estimate_pstring(const StringReader& r, uint32_t addr) {
 
 string disassemble_address(StringReader& r, uint32_t opcode_start_address,
     uint8_t M, uint8_t Xn, uint8_t size, unordered_set<uint32_t>* branch_target_addresses) {
+  string ret;
   switch (M) {
     case 0:
-      return string_printf("D%hhu", Xn);
+      append_reg(ret, 'D', Xn);
+      return ret;
     case 1:
-      return string_printf("A%hhu", Xn);
+      append_reg(ret, 'A', Xn);
+      return ret;
     case 2:
-      return string_printf("[A%hhu]", Xn);
+      ret += '[';
+      append_reg(ret, 'A', Xn);
+      ret += ']';
+      return ret;
     case 3:
-      return string_printf("[A%hhu]+", Xn);
+      ret += '[';
+      append_reg(ret, 'A', Xn);
+      ret += "]+";
+      return ret;
     case 4:
-      return string_printf("-[A%hhu]", Xn);
+      ret += "-[";
+      append_reg(ret, 'A', Xn);
+      ret += ']';
+      return ret;
     case 5: {
       int16_t displacement = r.get_u16r();
+      ret += '[';
+      append_reg(ret, 'A', Xn);
       if (displacement < 0) {
-        return string_printf("[A%hhu - 0x%" PRIX16 "]", Xn, -displacement);
+        ret += " - 0x";
+        append_hex(ret, -static_cast<int32_t>(displacement));
       } else {
-        return string_printf("[A%hhu + 0x%" PRIX16 "]", Xn, displacement);
+        ret += " + 0x";
+        append_hex(ret, displacement);
       }
+      ret += ']';
+      return ret;
     }
     case 6: {
       uint16_t ext = r.get_u16r();
@@ -414,11 +493,17 @@ string disassemble_address(StringReader& r, uint32_t opcode_start_address,
           if (address & 0x00008000) {
             address |= 0xFFFF0000;
           }
-          return string_printf("[0x%08" PRIX32 "]", address);
+          ret += "[0x";
+          append_hex(ret, address, 8);
+          ret += ']';
+          return ret;
         }
         case 1: {
           uint32_t address = r.get_u32r();
-          return string_printf("[0x%08" PRIX32 "]", address);
+          ret += "[0x";
+          append_hex(ret, address, 8);
+          ret += ']';
+          return ret;
         }
         case 2: {
           int16_t displacement = r.get_s16r();
@@ -427,16 +512,28 @@ string disassemble_address(StringReader& r, uint32_t opcode_start_address,
             branch_target_addresses->emplace(target_address);
           }
           if (displacement == 0) {
-            return string_printf("[PC] /* label%08" PRIX32 " */", target_address);
+            ret += "[PC] /* label";
+            append_hex(ret, target_address, 8);
+            ret += " */";
           } else {
-            string offset_str = (displacement > 0) ? string_printf(" + 0x%" PRIX16, displacement) : string_printf(" - 0x%" PRIX16, -displacement);
+            ret += "[PC";
+            if (displacement > 0) {
+              ret += " + 0x";
+              append_hex(ret, displacement);
+            } else {
+              ret += " - 0x";
+              append_hex(ret, -static_cast<int32_t>(displacement));
+            }
+            ret += " /* label";
+            append_hex(ret, target_address, 8);
             string estimated_pstring = estimate_pstring(r, target_address);
             if (estimated_pstring.size()) {
-              return string_printf("[PC%s /* label%08" PRIX32 ", pstring %s */]", offset_str.c_str(), target_address, estimated_pstring.c_str());
-            } else {
-              return string_printf("[PC%s /* label%08" PRIX32 " */]", offset_str.c_str(), target_address);
+              ret += ", pstring ";
+              ret += estimated_pstring;
             }
+            ret += " */]";
           }
+          return ret;
         }
         case 3: {
           uint16_t ext = r.get_u16r();
@@ -453,7 +550,7 @@ string disassemble_address(StringReader& r, uint32_t opcode_start_address,
   }
 }
 
-string disassemble_opcode_0123(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_0123(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   // 1, 2, 3 are actually also handled by 0 (this is the only case where the i
   // field is split)
   uint32_t opcode_start_address = start_address + r.where();
@@ -465,7 +562,8 @@ string disassemble_opcode_0123(StringReader& r, uint32_t start_address, unordere
       // movea isn't valid with the byte operand size. we'll disassemble it
       // anyway, but complain at the end of the line
       if (i == SIZE_BYTE) {
-        return "movea.b    <<invalid>>";
+        out += "movea.b    <<invalid>>";
+        return;
       }
 
       uint8_t source_M = op_get_c(op);
@@ -474,10 +572,15 @@ string disassemble_opcode_0123(StringReader& r, uint32_t start_address, unordere
 
       uint8_t An = op_get_a(op);
       if (i == SIZE_BYTE) {
-        return string_printf(".invalid   A%d, %s // movea not valid with byte operand size",
+        out += string_printf(".invalid   A%d, %s // movea not valid with byte operand size",
             An, source_addr.c_str());
+        return;
       } else {
-        return string_printf("movea.%c    A%d, %s", char_for_dsize.at(i), An, source_addr.c_str());
+        append_op_name(out, "movea", char_for_dsize.at(i));
+        append_reg(out, 'A', An);
+        out += ", ";
+        out += source_addr;
+        return;
       }
 
     } else {
@@ -492,8 +595,11 @@ string disassemble_opcode_0123(StringReader& r, uint32_t start_address, unordere
       uint8_t dest_Xn = op_get_a(op);
       string dest_addr = disassemble_address(r, opcode_start_address, dest_M, dest_Xn, size, NULL);
 
-      return string_printf("move.%c     %s, %s", char_for_dsize.at(i),
-          dest_addr.c_str(), source_addr.c_str());
+      append_op_name(out, "move", char_for_dsize.at(i));
+      out += dest_addr;
+      out += ", ";
+      out += source_addr;
+      return;
     }
   }
 
@@ -528,8 +634,11 @@ string disassemble_opcode_0123(StringReader& r, uint32_t start_address, unordere
         break;
     }
 
-    string addr = disassemble_address(r, opcode_start_address, M, Xn, s, NULL);
-    return string_printf("%s       %s, D%d", operation.c_str(), addr.c_str(), op_get_a(op));
+    append_op_name(out, operation.c_str());
+    out += disassemble_address(r, opcode_start_address, M, Xn, s, NULL);
+    out += ", ";
+    append_reg(out, 'D', op_get_a(op));
+    return;
 
   } else {
     switch (a) {
@@ -585,47 +694,66 @@ string disassemble_opcode_0123(StringReader& r, uint32_t start_address, unordere
 
   if (special_regs_allowed && (M == 7) && (Xn == 4)) {
     if (s == 0) {
-      return string_printf("%s ccr, %d%s", operation.c_str(),
+      out += string_printf("%s ccr, %d%s", operation.c_str(),
           r.get_u16r() & 0x00FF, invalid_str);
+      return;
     } else if (s == 1) {
-      return string_printf("%s sr, %d%s", operation.c_str(), r.get_u16r(),
+      out += string_printf("%s sr, %d%s", operation.c_str(), r.get_u16r(),
           invalid_str);
+      return;
     }
   }
 
-  string addr = disassemble_address(r, opcode_start_address, M, Xn, s, NULL);
-  string imm = format_immediate(read_immediate(r, s));
-  return string_printf("%s %s, %s%s", operation.c_str(), addr.c_str(),
-      imm.c_str(), invalid_str);
+  out += operation;
+  out += ' ';
+  out += disassemble_address(r, opcode_start_address, M, Xn, s, NULL);
+  out += ", ";
+  out += format_immediate(read_immediate(r, s));
+  out += invalid_str;
 }
 
-string disassemble_opcode_4(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_4(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint32_t opcode_start_address = start_address + r.where();
   uint16_t op = r.get_u16r();
   uint8_t g = op_get_g(op);
 
   if (g == 0) {
     if (op == 0x4AFC) {
-      return ".invalid";
+      out += ".invalid";
+      return;
     }
     if ((op & 0xFFF0) == 0x4E70) {
       switch (op & 0x000F) {
         case 0:
-          return "reset";
+          out += "reset";
+          return;
         case 1:
-          return "nop";
-        case 2:
-          return string_printf("stop       0x%04X", r.get_u16r());
+          out += "nop";
+          return;
+        case 2: {
+          append_op_name(out, "stop");
+          out += "0x";
+          append_hex(out, r.get_u16r(), 4);
+          return;
+        }
         case 3:
-          return "rte";
-        case 4:
-          return string_printf("rtd        0x%04X", r.get_u16r());
+          out += "rte";
+          return;
+        case 4: {
+          append_op_name(out, "rtd");
+          out += "0x";
+          append_hex(out, r.get_u16r(), 4);
+          return;
+        }
         case 5:
-          return "rts";
+          out += "rts";
+          return;
         case 6:
-          return "trapv";
+          out += "trapv";
+          return;
         case 7:
-          return "rtr";
+          out += "rtr";
+          return;
       }
     }
 
@@ -636,25 +764,43 @@ string disassemble_opcode_4(StringReader& r, uint32_t start_address, unordered_s
       uint8_t s = op_get_s(op);
       if (s == 3) {
         if (a == 0) {
-          return string_printf("move.w     %s, SR", addr.c_str());
+          append_op_name(out, "move", 'w');
+          out += addr;
+          out += ", SR";
+          return;
         } else if (a == 2) {
-          return string_printf("move.b     %s, CCR", addr.c_str());
+          append_op_name(out, "move", 'b');
+          out += addr;
+          out += ", CCR";
+          return;
         } else if (a == 3) {
-          return string_printf("move.w     SR, %s", addr.c_str());
+          append_op_name(out, "move", 'w');
+          out += "SR, ";
+          out += addr;
+          return;
         }
-        return string_printf(".invalid   %s // invalid opcode 4 with subtype 1",
+        out += string_printf(".invalid   %s // invalid opcode 4 with subtype 1",
             addr.c_str());
+        return;
 
       } else { // s is a valid SIZE_x
         switch (a) {
           case 0:
-            return string_printf("negx.%c     %s", char_for_size.at(s), addr.c_str());
+            append_op_name(out, "negx", char_for_size.at(s));
+            out += addr;
+            return;
           case 1:
-            return string_printf("clr.%c      %s", char_for_size.at(s), addr.c_str());
+            append_op_name(out, "clr", char_for_size.at(s));
+            out += addr;
+            return;
           case 2:
-            return string_printf("neg.%c      %s", char_for_size.at(s), addr.c_str());
+            append_op_name(out, "neg", char_for_size.at(s));
+            out += addr;
+            return;
           case 3:
-            return string_printf("not.%c      %s", char_for_size.at(s), addr.c_str());
+            append_op_name(out, "not", char_for_size.at(s));
+            out += addr;
+            return;
         }
       }
 
@@ -665,92 +811,132 @@ string disassemble_opcode_4(StringReader& r, uint32_t start_address, unordered_s
         uint8_t M = op_get_c(op);
         if (b & 2) {
           if (M == 0) {
-            return string_printf("ext.%c      D%d", char_for_tsize.at(op_get_t(op)), op_get_d(op));
+            append_op_name(out, "ext", char_for_tsize.at(op_get_t(op)));
+            append_reg(out, 'D', op_get_d(op));
+            return;
           } else {
             uint8_t t = op_get_t(op);
             string addr = disassemble_address(r, opcode_start_address, M, op_get_d(op), size_for_tsize.at(t), NULL);
             string reg_mask = disassemble_reg_mask(r.get_u16r(), false);
-            return string_printf("movem.%c    %s, %s", char_for_tsize.at(t), addr.c_str(), reg_mask.c_str());
+            append_op_name(out, "movem", char_for_tsize.at(t));
+            out += addr;
+            out += ", ";
+            out += reg_mask;
+            return;
           }
         }
         if (b == 0) {
           string addr = disassemble_address(r, opcode_start_address, M, op_get_d(op), SIZE_BYTE, NULL);
-          return string_printf("nbcd.b     %s", addr.c_str());
+          append_op_name(out, "nbcd", 'b');
+          out += addr;
+          return;
         }
         // b == 1
         if (M == 0) {
-          return string_printf("swap.w     D%d", op_get_d(op));
+          append_op_name(out, "swap", 'w');
+          append_reg(out, 'D', op_get_d(op));
+          return;
         }
         string addr = disassemble_address(r, opcode_start_address, M, op_get_d(op), SIZE_LONG, NULL);
-        return string_printf("pea.l      %s", addr.c_str());
+        append_op_name(out, "pea", 'l');
+        out += addr;
+        return;
 
       } else if (a == 5) {
         if (b == 3) {
           string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_LONG, NULL);
-          return string_printf("tas.b      %s", addr.c_str());
+          append_op_name(out, "tas", 'b');
+          out += addr;
+          return;
         }
 
         string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), b, NULL);
-        return string_printf("tst.%c      %s", char_for_size.at(b), addr.c_str());
+        append_op_name(out, "tst", char_for_size.at(b));
+        out += addr;
+        return;
 
       } else if (a == 6) {
         uint8_t t = op_get_t(op);
         string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), size_for_tsize.at(t), NULL);
         string reg_mask = disassemble_reg_mask(r.get_u16r(), true);
-        return string_printf("movem.%c    %s, %s", char_for_tsize.at(t), reg_mask.c_str(), addr.c_str());
+        append_op_name(out, "movem", char_for_tsize.at(t));
+        out += reg_mask;
+        out += ", ";
+        out += addr;
+        return;
 
       } else if (a == 7) {
         if (b == 1) {
           uint8_t c = op_get_c(op);
           if (c == 2) {
             int16_t delta = r.get_s16r();
+            append_op_name(out, "link");
+            append_reg(out, 'A', op_get_d(op));
             if (delta == 0) {
-              return string_printf("link       A%d, 0", op_get_d(op));
+              out += ", 0";
             } else {
-              return string_printf("link       A%d, -0x%04X", op_get_d(op), -delta);
+              out += ", -0x";
+              append_hex(out, static_cast<uint32_t>(-delta), 4);
             }
+            return;
           } else if (c == 3) {
-            return string_printf("unlink     A%d", op_get_d(op));
+            append_op_name(out, "unlink");
+            append_reg(out, 'A', op_get_d(op));
+            return;
           } else if ((c & 6) == 0) {
-            return string_printf("trap       %d", op_get_v(op));
+            out += string_printf("trap       %d", op_get_v(op));
+            return;
           } else if ((c & 6) == 4) {
-            return string_printf("move.usp   A%d, %s", op_get_d(op), (c & 1) ? "store" : "load");
+            out += string_printf("move.usp   A%d, %s", op_get_d(op), (c & 1) ? "store" : "load");
+            return;
           }
 
         } else if (b == 2) {
           string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), b, &branch_target_addresses);
-          return string_printf("jsr        %s", addr.c_str());
+          append_op_name(out, "jsr");
+          out += addr;
+          return;
 
         } else if (b == 3) {
           string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_LONG, &branch_target_addresses);
-          return string_printf("jmp        %s", addr.c_str());
+          append_op_name(out, "jmp");
+          out += addr;
+          return;
         }
       }
 
-      return ".invalid   // invalid opcode 4";
+      out += ".invalid   // invalid opcode 4";
+      return;
     }
 
   } else { // g == 1
     uint8_t b = op_get_b(op);
     if (b == 7) {
-      string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_LONG, NULL);
-      return string_printf("lea.l      A%d, %s", op_get_a(op), addr.c_str());
+      append_op_name(out, "lea", 'l');
+      append_reg(out, 'A', op_get_a(op));
+      out += ", ";
+      out += disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_LONG, NULL);
+      return;
 
     } else if (b == 5) {
-      string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_WORD, NULL);
-      return string_printf("chk.w      D%d, %s", op_get_a(op), addr.c_str());
+      append_op_name(out, "chk", 'w');
+      append_reg(out, 'D', op_get_a(op));
+      out += ", ";
+      out += disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_WORD, NULL);
+      return;
 
     } else {
       string addr = disassemble_address(r, opcode_start_address, op_get_c(op), op_get_d(op), SIZE_LONG, NULL);
-      return string_printf(".invalid   %d, %s // invalid opcode 4 with b == %d",
+      out += string_printf(".invalid   %d, %s // invalid opcode 4 with b == %d",
           op_get_a(op), addr.c_str(), b);
+      return;
     }
   }
 
-  return ".invalid   // invalid opcode 4";
+  out += ".invalid   // invalid opcode 4";
 }
 
-string disassemble_opcode_5(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_5(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint32_t opcode_start_address = start_address + r.where();
   uint16_t op = r.get_u16r();
   uint32_t pc_base = start_address + r.where();
@@ -767,29 +953,39 @@ string disassemble_opcode_5(StringReader& r, uint32_t start_address, unordered_s
       int16_t displacement = r.get_s16r();
       uint32_t target_address = pc_base + displacement;
       branch_target_addresses.emplace(target_address);
+      const char name[5] = {'d', 'b', cond[0], cond[1], 0};
+      append_op_name(out, name);
+      append_reg(out, 'D', Xn);
       if (displacement < 0) {
-        return string_printf("db%s       D%d, -0x%" PRIX16 " /* label%08" PRIX32 " */",
-            cond, Xn, -displacement + 2, target_address);
+        out += ", -0x";
+        append_hex(out, -displacement + 2);
       } else {
-        return string_printf("db%s       D%d, +0x%" PRIX16 " /* label%08" PRIX32 " */",
-            cond, Xn, displacement + 2, target_address);
+        out += ", +0x";
+        append_hex(out, displacement + 2);
       }
+      out += " /* label";
+      append_hex(out, target_address, 8);
+      out += " */";
+      return;
     }
-    string addr = disassemble_address(r, opcode_start_address, M, Xn, SIZE_BYTE, &branch_target_addresses);
-    return string_printf("s%s        %s", cond, addr.c_str(), &branch_target_addresses);
+    const char name[4] = {'s', cond[0], cond[1], 0};
+    append_op_name(out, name);
+    out += disassemble_address(r, opcode_start_address, M, Xn, SIZE_BYTE, &branch_target_addresses);
+    return;
   }
 
   uint8_t size = op_get_s(op);
-  string addr = disassemble_address(r, opcode_start_address, M, Xn, size, NULL);
+  append_op_name(out, op_get_g(op) ? "subq" : "addq", char_for_size.at(size));
+  out += disassemble_address(r, opcode_start_address, M, Xn, size, NULL);
   uint8_t value = op_get_a(op);
   if (value == 0) {
     value = 8;
   }
-  return string_printf("%s.%c     %s, %d", op_get_g(op) ? "subq" : "addq",
-      char_for_size.at(size), addr.c_str(), value);
+  out += ", ";
+  out += static_cast<char>('0' + value);
 }
 
-string disassemble_opcode_6(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_6(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   // TODO in what situation is the optional word displacement used?
   uint16_t op = r.get_u16r();
   uint32_t pc_base = start_address + r.where();
@@ -801,36 +997,43 @@ string disassemble_opcode_6(StringReader& r, uint32_t start_address, unordered_s
     displacement = r.get_s32r();
   }
 
+  uint8_t k = op_get_k(op);
+  if (k == 0) {
+    append_op_name(out, "bra");
+  } else if (k == 1) {
+    append_op_name(out, "bsr");
+  } else {
+    const char* cond = string_for_condition.at(k);
+    const char name[4] = {'b', cond[0], cond[1], 0};
+    append_op_name(out, name);
+  }
+
   // according to the programmer's manual, the displacement is relative to
   // (pc + 2) regardless of whether there's an extended displacement
-  string displacement_str;
   uint32_t target_address = pc_base + displacement;
   branch_target_addresses.emplace(target_address);
   if (displacement < 0) {
-    displacement_str = string_printf("-0x%" PRIX64 " /* label%08" PRIX32 " */",
-        -displacement - 2, target_address);
+    out += "-0x";
+    append_hex(out, -displacement - 2);
   } else {
-    displacement_str = string_printf("+0x%" PRIX64 " /* label%08" PRIX32 " */",
-        displacement + 2, target_address);
-  }
-
-  uint8_t k = op_get_k(op);
-  if (k == 0) {
-    return "bra        " + displacement_str;
+    out += "+0x";
+    append_hex(out, displacement + 2);
   }
-  if (k == 1) {
-    return "bsr        " + displacement_str;
-  }
-  return string_printf("b%s        %s", string_for_condition.at(k), displacement_str.c_str());
+  out += " /* label";
+  append_hex(out, target_address, 8);
+  out += " */";
 }
 
-string disassemble_opcode_7(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_7(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint16_t op = r.get_u16r();
   int32_t value = static_cast<int32_t>(static_cast<int8_t>(op_get_y(op)));
-  return string_printf("moveq.l    D%d, 0x%02X", op_get_a(op), value);
+  append_op_name(out, "moveq", 'l');
+  append_reg(out, 'D', op_get_a(op));
+  out += ", 0x";
+  append_hex(out, static_cast<uint32_t>(value), 2);
 }
 
-string disassemble_opcode_8(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_8(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint16_t op = r.get_u16r();
   uint8_t a = op_get_a(op);
   uint8_t opmode = op_get_b(op);
@@ -838,43 +1041,52 @@ string disassemble_opcode_8(StringReader& r, uint32_t start_address, unordered_s
   uint8_t Xn = op_get_d(op);
 
   if ((opmode & 3) == 3) {
-    char s = (opmode & 4) ? 's' : 'u';
-    string ea_dasm = disassemble_address(r, start_address, M, Xn, SIZE_WORD, NULL);
-    return string_printf("div%c.w     D%hhu, %s", s, a, ea_dasm.c_str());
+    append_op_name(out, (opmode & 4) ? "divs" : "divu", 'w');
+    append_reg(out, 'D', a);
+    out += ", ";
+    out += disassemble_address(r, start_address, M, Xn, SIZE_WORD, NULL);
+    return;
   }
 
   if ((opmode & 4) && !(M & 6)) {
     if (opmode == 4) {
       if (M) {
-        return string_printf("sbcd       -[A%hhu], -[A%hhu]", a, Xn);
+        out += string_printf("sbcd       -[A%hhu], -[A%hhu]", a, Xn);
+        return;
       } else {
-        return string_printf("sbcd       D%hhu, D%hhu", a, Xn);
+        out += string_printf("sbcd       D%hhu, D%hhu", a, Xn);
+        return;
       }
     }
     if ((opmode == 5) || (opmode == 6)) {
       uint16_t value = r.get_u16r();
       const char* opcode_name = (opmode == 6) ? "unpk" : "pack";
       if (M) {
-        return string_printf("%s       -[A%hhu], -[A%hhu], 0x%04hX",
+        out += string_printf("%s       -[A%hhu], -[A%hhu], 0x%04hX",
             opcode_name, a, Xn, value);
+        return;
       } else {
-        return string_printf("%s       D%hhu, D%hhu, 0x%04hX", opcode_name, a,
+        out += string_printf("%s       D%hhu, D%hhu, 0x%04hX", opcode_name, a,
             Xn, value);
+        return;
       }
     }
   }
 
+  append_op_name(out, "or", char_for_size.at(opmode & 3));
   string ea_dasm = disassemble_address(r, start_address, M, Xn, opmode & 3, NULL);
   if (opmode & 4) {
-    return string_printf("or.%c       %s, D%hhu", char_for_size.at(opmode & 3),
-        ea_dasm.c_str(), a);
+    out += ea_dasm;
+    out += ", ";
+    append_reg(out, 'D', a);
   } else {
-    return string_printf("or.%c       D%hhu, %s", char_for_size.at(opmode & 3),
-        a, ea_dasm.c_str());
+    append_reg(out, 'D', a);
+    out += ", ";
+    out += ea_dasm;
   }
 }
 
-string disassemble_opcode_B(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_B(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint32_t opcode_start_address = start_address + r.where();
   uint16_t op = r.get_u16r();
   uint8_t dest = op_get_a(op);
@@ -883,32 +1095,36 @@ string disassemble_opcode_B(StringReader& r, uint32_t start_address, unordered_s
   uint8_t Xn = op_get_d(op);
 
   if ((opmode & 4) && (opmode != 7) && (M == 1)) {
-    return string_printf("cmpm.%c     [A%hhu]+, [A%hhu]+",
+    out += string_printf("cmpm.%c     [A%hhu]+, [A%hhu]+",
         char_for_size.at(opmode & 3), dest, Xn);
+    return;
   }
 
   if (opmode < 3) {
-    string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, opmode, NULL);
-    return string_printf("cmp.%c      D%hhu, %s", char_for_size.at(opmode),
-        dest, ea_dasm.c_str());
+    append_op_name(out, "cmp", char_for_size.at(opmode));
+    append_reg(out, 'D', dest);
+    out += ", ";
+    out += disassemble_address(r, opcode_start_address, M, Xn, opmode, NULL);
+    return;
   }
 
   if ((opmode & 3) == 3) {
-    if (opmode & 4) {
-      string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, SIZE_LONG, NULL);
-      return string_printf("cmpa.l     A%hhu, %s", dest, ea_dasm.c_str());
-    } else {
-      string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, SIZE_WORD, NULL);
-      return string_printf("cmpa.w     A%hhu, %s", dest, ea_dasm.c_str());
-    }
+    bool is_long = opmode & 4;
+    append_op_name(out, "cmpa", is_long ? 'l' : 'w');
+    append_reg(out, 'A', dest);
+    out += ", ";
+    out += disassemble_address(r, opcode_start_address, M, Xn,
+        is_long ? SIZE_LONG : SIZE_WORD, NULL);
+    return;
   }
 
-  string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, opmode & 3, NULL);
-  return string_printf("xor.%c      %s, D%hhu", char_for_size.at(opmode & 3),
-      ea_dasm.c_str(), dest);
+  append_op_name(out, "xor", char_for_size.at(opmode & 3));
+  out += disassemble_address(r, opcode_start_address, M, Xn, opmode & 3, NULL);
+  out += ", ";
+  append_reg(out, 'D', dest);
 }
 
-string disassemble_opcode_9D(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_9D(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint32_t opcode_start_address = start_address + r.where();
   uint16_t op = r.get_u16r();
   const char* op_name = ((op & 0xF000) == 0x9000) ? "sub" : "add";
@@ -921,32 +1137,38 @@ string disassemble_opcode_9D(StringReader& r, uint32_t start_address, unordered_
   if (((M & 6) == 0) && (opmode & 4) && (opmode != 7)) {
     char ch = char_for_size.at(opmode & 3);
     if (M) {
-      return string_printf("%sx.%c     -[A%hhu], -[A%hhu]", op_name, ch, dest, Xn);
+      out += string_printf("%sx.%c     -[A%hhu], -[A%hhu]", op_name, ch, dest, Xn);
+      return;
     } else {
-      return string_printf("%sx.%c     D%hhu, D%hhu", op_name, ch, dest, Xn);
+      out += string_printf("%sx.%c     D%hhu, D%hhu", op_name, ch, dest, Xn);
+      return;
     }
   }
 
   if ((opmode & 3) == 3) {
-    if (opmode & 4) {
-      string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, SIZE_LONG, NULL);
-      return string_printf("%s.l      A%hhu, %s", op_name, dest, ea_dasm.c_str());
-    } else {
-      string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, SIZE_WORD, NULL);
-      return string_printf("%s.w      A%hhu, %s", op_name, dest, ea_dasm.c_str());
-    }
+    bool is_long = opmode & 4;
+    append_op_name(out, op_name, is_long ? 'l' : 'w');
+    append_reg(out, 'A', dest);
+    out += ", ";
+    out += disassemble_address(r, opcode_start_address, M, Xn,
+        is_long ? SIZE_LONG : SIZE_WORD, NULL);
+    return;
   }
 
+  append_op_name(out, op_name, char_for_size.at(opmode & 3));
   string ea_dasm = disassemble_address(r, opcode_start_address, M, Xn, opmode & 3, NULL);
-  char ch = char_for_size.at(opmode & 3);
   if (opmode & 4) {
-    return string_printf("%s.%c      %s, D%hhu", op_name, ch, ea_dasm.c_str(), dest);
+    out += ea_dasm;
+    out += ", ";
+    append_reg(out, 'D', dest);
   } else {
-    return string_printf("%s.%c      D%hhu, %s", op_name, ch, dest, ea_dasm.c_str());
+    append_reg(out, 'D', dest);
+    out += ", ";
+    out += ea_dasm;
   }
 }
 
-string disassemble_opcode_A(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_A(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   static const unordered_map<uint16_t, const char*> trap_names({
     // os traps
     {0x00, "_Open"},
@@ -1647,25 +1869,26 @@ string disassemble_opcode_A(StringReader& r, uint32_t start_address, unordered_s
     flags = (op >> 9) & 3;
   }
 
-  string ret = "trap       ";
-  try {
-    ret += trap_names.at(trap_number);
-  } catch (const out_of_range&) {
-    ret += string_printf("0x%03hX", trap_number);
+  append_op_name(out, "trap");
+  auto trap_name_it = trap_names.find(trap_number);
+  if (trap_name_it != trap_names.end()) {
+    out += trap_name_it->second;
+  } else {
+    out += "0x";
+    append_hex(out, trap_number, 3);
   }
 
   if (flags) {
-    ret += string_printf(", flags=%hhu", flags);
+    out += ", flags=";
+    out += static_cast<char>('0' + flags);
   }
 
   if (auto_pop) {
-    ret += ", auto_pop";
+    out += ", auto_pop";
   }
-
-  return ret;
 }
 
-string disassemble_opcode_C(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_C(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint16_t op = r.get_u16r();
   uint8_t a = op_get_a(op);
   uint8_t b = op_get_b(op);
@@ -1673,48 +1896,70 @@ string disassemble_opcode_C(StringReader& r, uint32_t start_address, unordered_s
   uint8_t d = op_get_d(op);
 
   if (b < 3) { // and.S DREG, ADDR
-    string ea_dasm = disassemble_address(r, start_address, c, d, b, NULL);
-    return string_printf("and.%c      D%hhu, %s", char_for_size.at(b), a,
-        ea_dasm.c_str());
+    append_op_name(out, "and", char_for_size.at(b));
+    append_reg(out, 'D', a);
+    out += ", ";
+    out += disassemble_address(r, start_address, c, d, b, NULL);
+    return;
 
   } else if (b == 3) { // mulu.w DREG, ADDR (word * word = long form)
-    string ea_dasm = disassemble_address(r, start_address, c, d, b, NULL);
-    return string_printf("mulu.w     D%hhu, %s", a, ea_dasm.c_str());
+    append_op_name(out, "mulu", 'w');
+    append_reg(out, 'D', a);
+    out += ", ";
+    out += disassemble_address(r, start_address, c, d, b, NULL);
+    return;
 
   } else if (b == 4) {
     if (c == 0) { // abcd DREG, DREG
-      return string_printf("abcd       D%hhu, D%hhu", a, d);
+      out += string_printf("abcd       D%hhu, D%hhu", a, d);
+      return;
     } else if (c == 1) { // abcd -[AREG], -[AREG]
-      return string_printf("abcd       -[A%hhu], -[A%hhu]", a, d);
+      out += string_printf("abcd       -[A%hhu], -[A%hhu]", a, d);
+      return;
     } else { // and.S ADDR, DREG
       string ea_dasm = disassemble_address(r, start_address, c, d, b, NULL);
-      return string_printf("and.%c      %s, D%hhu", char_for_size.at(b),
-          ea_dasm.c_str(), a);
+      append_op_name(out, "and", char_for_size.at(b));
+      out += ea_dasm;
+      out += ", ";
+      append_reg(out, 'D', a);
+      return;
     }
 
   } else if (b == 5) {
     if (c == 0) { // exg DREG, DREG
-      return string_printf("exg        D%hhu, D%hhu", a, d);
+      out += string_printf("exg        D%hhu, D%hhu", a, d);
+      return;
     } else if (c == 1) { // exg AREG, AREG
-      return string_printf("exg        A%hhu, A%hhu", a, d);
+      out += string_printf("exg        A%hhu, A%hhu", a, d);
+      return;
     } else { // and.S ADDR, DREG
       string ea_dasm = disassemble_address(r, start_address, c, d, b, NULL);
-      return string_printf("and.%c      %s, D%hhu", char_for_size.at(b),
-          ea_dasm.c_str(), a);
+      append_op_name(out, "and", char_for_size.at(b));
+      out += ea_dasm;
+      out += ", ";
+      append_reg(out, 'D', a);
+      return;
     }
 
   } else if (b == 6) {
     if (c == 1) { // exg AREG, DREG
-      return string_printf("exg        A%hhu, D%hhu", a, d);
+      out += string_printf("exg        A%hhu, D%hhu", a, d);
+      return;
     } else { // and.S ADDR, DREG
       string ea_dasm = disassemble_address(r, start_address, c, d, b, NULL);
-      return string_printf("and.%c      %s, D%hhu", char_for_size.at(b),
-          ea_dasm.c_str(), a);
+      append_op_name(out, "and", char_for_size.at(b));
+      out += ea_dasm;
+      out += ", ";
+      append_reg(out, 'D', a);
+      return;
     }
 
   } else if (b == 7) { // muls DREG, ADDR (word * word = long form)
-    string ea_dasm = disassemble_address(r, start_address, c, d, b, NULL);
-    return string_printf("muls.w     D%hhu, %s", a, ea_dasm.c_str());
+    append_op_name(out, "muls", 'w');
+    append_reg(out, 'D', a);
+    out += ", ";
+    out += disassemble_address(r, start_address, c, d, b, NULL);
+    return;
   }
 
   // this should be impossible; we covered all possible values for b and all
@@ -1722,7 +1967,7 @@ string disassemble_opcode_C(StringReader& r, uint32_t start_address, unordered_s
   throw logic_error("no cases matched for 1100bbb opcode");
 }
 
-string disassemble_opcode_E(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+void disassemble_opcode_E(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
   uint16_t op = r.get_u16r();
 
   static const vector<const char*> op_names({
@@ -1753,15 +1998,18 @@ string disassemble_opcode_E(StringReader& r, uint32_t start_address, unordered_s
 
       if (k & 1) {
         uint8_t Dn = (ext >> 12) & 7;
-        return string_printf("%s     %s {%s:%s}, D%hhu", op_name,
+        out += string_printf("%s     %s {%s:%s}, D%hhu", op_name,
             ea_dasm.c_str(), offset_str.c_str(), width_str.c_str(), Dn);
+        return;
       } else {
-        return string_printf("%s     %s {%s:%s}", op_name, ea_dasm.c_str(),
+        out += string_printf("%s     %s {%s:%s}", op_name, ea_dasm.c_str(),
             offset_str.c_str(), width_str.c_str());
+        return;
       }
     }
     string ea_dasm = disassemble_address(r, start_address, M, Xn, SIZE_WORD, NULL);
-    return string_printf("%s.w   %s", op_name, ea_dasm.c_str());
+    out += string_printf("%s.w   %s", op_name, ea_dasm.c_str());
+    return;
   }
 
   uint8_t c = op_get_c(op);
@@ -1770,28 +2018,28 @@ string disassemble_opcode_E(StringReader& r, uint32_t start_address, unordered_s
   uint8_t k = ((c & 3) << 1) | op_get_g(op);
   const char* op_name = op_names[k];
 
-  string dest_reg_str;
+  append_op_name(out, op_name);
+  append_reg(out, 'D', Xn);
   if (size == SIZE_BYTE) {
-    dest_reg_str = string_printf("D%hhu.b", Xn);
+    out += ".b";
   } else if (size == SIZE_WORD) {
-    dest_reg_str = string_printf("D%hhu.w", Xn);
-  } else if (size == SIZE_LONG) {
-    dest_reg_str = string_printf("D%hhu", Xn);
-  } else {
-    dest_reg_str = string_printf("D%hhu.?", Xn);
+    out += ".w";
+  } else if (size != SIZE_LONG) {
+    out += ".?";
   }
 
+  out += ", ";
   if (shift_is_reg) {
-    return string_printf("%s     %s, D%hhu", op_name, dest_reg_str.c_str(), a);
+    append_reg(out, 'D', a);
   } else {
     if (!a) {
       a = 8;
     }
-    return string_printf("%s     %s, %hhu", op_name, dest_reg_str.c_str(), a);
+    out += static_cast<char>('0' + a);
   }
 }
 
-string (*dasm_functions[16])(StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) = {
+void (*dasm_functions[16])(string& out, StringReader& r, uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) = {
   disassemble_opcode_0123,
   disassemble_opcode_0123,
   disassemble_opcode_0123,
@@ -1812,46 +2060,56 @@ string (*dasm_functions[16])(StringReader& r, uint32_t start_address, unordered_
 
 ////////////////////////////////////////////////////////////////////////////////
 
-string MC68KEmulator::disassemble_one(StringReader& r, uint32_t start_address,
-    unordered_set<uint32_t>& branch_target_addresses) {
+// disassembles one opcode, appending its raw data and disassembly to out.
+// returns false if the opcode couldn't be disassembled (it's written as
+// .incomplete in that case)
+static bool append_disassembly(string& out, StringReader& r,
+    uint32_t start_address, unordered_set<uint32_t>& branch_target_addresses) {
+  // the opcode functions write the disassembly directly to out, but the raw
+  // data goes before it and we don't know how long the opcode is until it's
+  // been disassembled. the raw data is short, so it's inserted afterward.
   size_t opcode_offset = r.where();
-  string opcode_disassembly;
+  size_t line_start_offset = out.size();
+  bool complete = true;
   try {
     uint8_t op_high = r.get_u8(false);
-    opcode_disassembly = (dasm_functions[(op_high >> 4) & 0x000F])(r,
-        start_address, branch_target_addresses);
+    (dasm_functions[(op_high >> 4) & 0x000F])(out, r, start_address,
+        branch_target_addresses);
   } catch (const out_of_range&) {
     if (r.where() == opcode_offset) {
       // there must be at least 1 byte available since r.eof() was false
       r.get_u8();
     }
-    opcode_disassembly = ".incomplete";
+    out.resize(line_start_offset);
+    out += ".incomplete";
+    complete = false;
   }
 
-  string line;
-  {
-    string hex_data;
-    size_t end_offset = r.where();
-    if (end_offset <= opcode_offset) {
-      throw logic_error(string_printf("disassembly did not advance; used %zX/%zX bytes", r.where(), r.size()));
-    }
+  size_t end_offset = r.where();
+  if (end_offset <= opcode_offset) {
+    throw logic_error(string_printf("disassembly did not advance; used %zX/%zX bytes", r.where(), r.size()));
+  }
 
-    for (r.go(opcode_offset); r.where() < (end_offset & (~1));) {
-      hex_data += string_printf(" %04X", r.get_u16r());
-    }
-    if (end_offset & 1) {
-      // this should only happen for .incomplete at the end of the stream
-      hex_data += string_printf(" %02X  ", r.get_u8());
-    }
-    while (hex_data.size() < 25) {
-      hex_data += "     ";
-    }
-    line += hex_data;
+  // each word takes 5 characters, and the column is at least 5 words wide
+  size_t data_bytes = end_offset - opcode_offset;
+  size_t column_width = max<size_t>(((data_bytes + 1) / 2) * 5, 25) + 1;
+  out.insert(line_start_offset, column_width, ' ');
+  char* column = &out[line_start_offset];
+  for (r.go(opcode_offset); r.where() < (end_offset & (~1)); column += 5) {
+    write_hex(column + 1, r.get_u16r(), 4);
   }
+  if (end_offset & 1) {
+    // this should only happen for .incomplete at the end of the stream
+    write_hex(column + 1, r.get_u8(), 2);
+  }
+  return complete;
+}
 
-  line += ' ';
-  line += opcode_disassembly;
-  return line;
+string MC68KEmulator::disassemble_one(StringReader& r, uint32_t start_address,
+    unordered_set<uint32_t>& branch_target_addresses) {
+  string ret;
+  append_disassembly(ret, r, start_address, branch_target_addresses);
+  return ret;
 }
 
 string MC68KEmulator::disassemble_one(const void* vdata, size_t size,
@@ -1863,37 +2121,332 @@ string MC68KEmulator::disassemble_one(const void* vdata, size_t size,
 
 
 string MC68KEmulator::disassemble(const void* vdata, size_t size,
-    uint32_t start_address, const unordered_multimap<uint32_t, string>* labels) {
+    uint32_t start_address, const unordered_multimap<uint32_t, string>* labels,
+    vector<mc68k_opcode_span>* opcodes) {
   unordered_set<uint32_t> branch_target_addresses;
-  deque<pair<uint32_t, string>> ret_lines; // (addr, line) pairs
-  size_t ret_bytes = 0;
+
+  // the lines are all written to one buffer, and we remember where each one
+  // starts. labels can't be written until all the branch targets are known, so
+  // they're inserted between the lines in a second pass.
+  string text;
+  vector<pair<uint32_t, size_t>> line_offsets; // (offset in data, offset in text)
+  text.reserve(size * 24);
+  line_offsets.reserve(size / 2);
 
   StringReader r(vdata, size);
   while (!r.eof()) {
-    uint32_t opcode_offset = r.where();
-    string line = string_printf("%08" PRIX64 " ", start_address + opcode_offset);
-    line += MC68KEmulator::disassemble_one(r, start_address, branch_target_addresses);
-    line += '\n';
+    uint32_t offset = r.where();
+    line_offsets.emplace_back(offset, text.size());
+    append_hex(text, static_cast<uint32_t>(start_address + offset), 8);
+    text += ' ';
+    bool complete = append_disassembly(text, r, start_address,
+        branch_target_addresses);
+    text += '\n';
+    if (opcodes) {
+      opcodes->emplace_back(mc68k_opcode_span({offset,
+          static_cast<uint32_t>(r.where()), complete}));
+    }
+  }
 
-    ret_bytes += line.size();
-    ret_lines.emplace_back(make_pair(opcode_offset + start_address, move(line)));
+  // find the offsets that need labels. most lines don't have any, so it's
+  // faster to look up the lines for these than to look up each line in the
+  // label sets. (these are offsets from start_address rather than addresses so
+  // they sort in the same order as the lines, even if the addresses wrap.)
+  vector<uint32_t> label_offsets;
+  for (uint32_t addr : branch_target_addresses) {
+    label_offsets.emplace_back(addr - start_address);
+  }
+  if (labels) {
+    for (const auto& it : *labels) {
+      label_offsets.emplace_back(it.first - start_address);
+    }
+  }
+  if (label_offsets.empty()) {
+    return text;
   }
+  sort(label_offsets.begin(), label_offsets.end());
+  label_offsets.erase(unique(label_offsets.begin(), label_offsets.end()),
+      label_offsets.end());
 
   string ret;
-  ret.reserve(ret_bytes);
-  for (const auto& it : ret_lines) {
-    uint32_t opcode_address = it.first;
-    string line = it.second;
+  ret.reserve(text.size() + label_offsets.size() * 20);
+  size_t text_offset = 0;
+  auto line_it = line_offsets.begin();
+  for (uint32_t label_offset : label_offsets) {
+    // offsets that aren't at the beginning of an opcode don't get labels
+    while ((line_it != line_offsets.end()) && (line_it->first < label_offset)) {
+      line_it++;
+    }
+    if (line_it == line_offsets.end()) {
+      break;
+    }
+    if (line_it->first != label_offset) {
+      continue;
+    }
+
+    uint32_t label_address = start_address + label_offset;
+    ret.append(text, text_offset, line_it->second - text_offset);
+    text_offset = line_it->second;
     if (labels) {
-      auto label_its = labels->equal_range(opcode_address);
+      auto label_its = labels->equal_range(label_address);
       for (; label_its.first != label_its.second; label_its.first++) {
-        ret += string_printf("%s:\n", label_its.first->second.c_str());
+        ret += label_its.first->second;
+        ret += ":\n";
+      }
+    }
+    if (branch_target_addresses.count(label_address)) {
+      ret += "label";
+      append_hex(ret, label_address, 8);
+      ret += ":\n";
+    }
+  }
+  ret.append(text, text_offset, string::npos);
+  return ret;
+}
+
+
+
+mc68k_control_flow_graph MC68KEmulator::analyze_control_flow(const void* vdata,
+    size_t size, const vector<uint32_t>& entry_offsets,
+    const vector<mc68k_opcode_span>* opcodes) {
+  typedef mc68k_control_flow_graph CFG;
+  CFG ret;
+  if (size == 0) {
+    return ret;
+  }
+
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
+  auto get_s16 = [&](size_t offset) -> int16_t {
+    return static_cast<int16_t>((data[offset] << 8) | data[offset + 1]);
+  };
+  auto get_s32 = [&](size_t offset) -> int32_t {
+    return static_cast<int32_t>((static_cast<uint32_t>(data[offset]) << 24) |
+        (data[offset + 1] << 16) | (data[offset + 2] << 8) | data[offset + 3]);
+  };
+
+  // the opcodes that end basic blocks. their targets aren't validated until
+  // all the opcode boundaries are known
+  struct block_end {
+    uint32_t offset;
+    uint32_t end_offset;
+    uint32_t flags;
+    int64_t target; // -1 if there's no branch target
+  };
+
+  // the opcode boundaries come from disassembling everything, so they're the
+  // same as in the listing. if the caller didn't already do that, do it here
+  vector<mc68k_opcode_span> swept_opcodes;
+  if (!opcodes) {
+    swept_opcodes.reserve(size / 2);
+    StringReader r(data, size);
+    string text;
+    unordered_set<uint32_t> branch_target_addresses;
+    while (!r.eof()) {
+      uint32_t offset = r.where();
+      text.clear();
+      branch_target_addresses.clear();
+      bool complete = append_disassembly(text, r, 0, branch_target_addresses);
+      swept_opcodes.emplace_back(mc68k_opcode_span({offset,
+          static_cast<uint32_t>(r.where()), complete}));
+    }
+    opcodes = &swept_opcodes;
+  }
+
+  // note the opcodes that affect control flow. each opcode's length has already
+  // been checked by the disassembler, so reading its extension words here can't
+  // go past the end of the data
+  vector<uint32_t> opcode_offsets;
+  vector<block_end> block_ends;
+  vector<CFG::call> calls;
+  opcode_offsets.reserve(opcodes->size());
+
+  for (const auto& span : *opcodes) {
+    uint32_t offset = span.offset;
+    uint32_t end_offset = span.end_offset;
+    opcode_offsets.emplace_back(offset);
+
+    if (!span.complete) {
+      block_ends.emplace_back(block_end({offset, end_offset,
+          CFG::ENDS_WITH_INVALID_OPCODE, -1}));
+      continue;
+    }
+
+    uint16_t op = (data[offset] << 8) | data[offset + 1];
+    if ((op & 0xF000) == 0x6000) { // bra, bsr, bcc
+      int64_t displacement = static_cast<int8_t>(op & 0x00FF);
+      if (displacement == 0) {
+        displacement = get_s16(offset + 2);
+      } else if (displacement == -1) {
+        displacement = get_s32(offset + 2);
+      }
+      int64_t target = offset + 2 + displacement;
+      uint8_t k = (op >> 8) & 0x0F;
+      if (k == 1) {
+        calls.emplace_back(CFG::call({offset, 0, CFG::call_type::LOCAL, false,
+            static_cast<int32_t>(target)}));
+      } else {
+        block_ends.emplace_back(block_end({offset, end_offset,
+            (k == 0) ? CFG::ENDS_WITH_BRANCH : CFG::ENDS_WITH_CONDITIONAL_BRANCH,
+            target}));
+      }
+
+    } else if ((op & 0xF0F8) == 0x50C8) { // dbcc
+      block_ends.emplace_back(block_end({offset, end_offset,
+          CFG::ENDS_WITH_CONDITIONAL_BRANCH, offset + 2 + get_s16(offset + 2)}));
+
+    } else if ((op & 0xFF80) == 0x4E80) { // jsr, jmp
+      bool is_jmp = op & 0x0040;
+      uint8_t M = (op >> 3) & 7;
+      uint8_t Xn = op & 7;
+      if ((M == 7) && (Xn == 2)) {
+        int64_t target = offset + 2 + get_s16(offset + 2);
+        if (is_jmp) {
+          block_ends.emplace_back(block_end({offset, end_offset,
+              CFG::ENDS_WITH_BRANCH, target}));
+        } else {
+          calls.emplace_back(CFG::call({offset, 0, CFG::call_type::LOCAL,
+              false, static_cast<int32_t>(target)}));
+        }
+      } else {
+        if ((M == 5) && (Xn == 5)) {
+          calls.emplace_back(CFG::call({offset, 0, CFG::call_type::A5_RELATIVE,
+              is_jmp, get_s16(offset + 2)}));
+        } else if (!is_jmp) {
+          calls.emplace_back(CFG::call({offset, 0, CFG::call_type::INDIRECT,
+              false, 0}));
+        }
+        if (is_jmp) {
+          block_ends.emplace_back(block_end({offset, end_offset,
+              CFG::ENDS_WITH_INDIRECT_JUMP, -1}));
+        }
+      }
+
+    } else if ((op == 0x4E73) || (op == 0x4E74) || (op == 0x4E75) || (op == 0x4E77)) {
+      block_ends.emplace_back(block_end({offset, end_offset,
+          CFG::ENDS_WITH_RETURN, -1}));
+
+    } else if ((op == 0x4E72) || (op == 0x4AFC) || (op == 0xA9F4)) {
+      block_ends.emplace_back(block_end({offset, end_offset,
+          CFG::ENDS_WITH_STOP, -1}));
+    }
+  }
+
+  // branches and calls can only go to the beginning of an opcode (as with
+  // labels in the listing); anything else is treated as an unknown target
+  auto is_opcode_start = [&](int64_t offset) -> bool {
+    return (offset >= 0) && (offset < static_cast<int64_t>(size)) &&
+        binary_search(opcode_offsets.begin(), opcode_offsets.end(),
+          static_cast<uint32_t>(offset));
+  };
+
+  vector<uint32_t> function_offsets;
+  for (uint32_t offset : entry_offsets) {
+    if (is_opcode_start(offset)) {
+      function_offsets.emplace_back(offset);
+    }
+  }
+  for (auto& c : calls) {
+    if (c.type != CFG::call_type::LOCAL) {
+      continue;
+    }
+    if (is_opcode_start(c.target)) {
+      function_offsets.emplace_back(c.target);
+    } else {
+      c.type = CFG::call_type::INDIRECT;
+      c.target = 0;
+    }
+  }
+  sort(function_offsets.begin(), function_offsets.end());
+  function_offsets.erase(unique(function_offsets.begin(), function_offsets.end()),
+      function_offsets.end());
+
+  vector<uint32_t> block_starts(1, 0);
+  for (auto& e : block_ends) {
+    if ((e.target >= 0) && !is_opcode_start(e.target)) {
+      e.target = -1;
+      if (e.flags == CFG::ENDS_WITH_BRANCH) {
+        e.flags = CFG::ENDS_WITH_INDIRECT_JUMP;
       }
     }
-    if (branch_target_addresses.count(opcode_address)) {
-      ret += string_printf("label%08" PRIX32 ":\n", opcode_address);
+    if (e.end_offset < size) {
+      block_starts.emplace_back(e.end_offset);
+    }
+    if (e.target >= 0) {
+      block_starts.emplace_back(e.target);
+    }
+  }
+  block_starts.insert(block_starts.end(), function_offsets.begin(),
+      function_offsets.end());
+  sort(block_starts.begin(), block_starts.end());
+  block_starts.erase(unique(block_starts.begin(), block_starts.end()),
+      block_starts.end());
+
+  auto block_for_offset = [&](uint32_t offset) -> uint32_t {
+    return upper_bound(block_starts.begin(), block_starts.end(), offset) -
+        block_starts.begin() - 1;
+  };
+
+  size_t num_blocks = block_starts.size();
+  ret.blocks.reserve(num_blocks);
+  for (size_t x = 0; x < num_blocks; x++) {
+    uint32_t end_offset = (x + 1 < num_blocks) ? block_starts[x + 1] : size;
+    ret.blocks.emplace_back(CFG::basic_block({block_starts[x], end_offset,
+        CFG::NO_FUNCTION, 0}));
+  }
+
+  // each block_end is the last opcode in its block, since the next opcode
+  // always starts a new block
+  vector<int64_t> block_targets(num_blocks, -1);
+  for (const auto& e : block_ends) {
+    uint32_t block_index = block_for_offset(e.offset);
+    ret.blocks[block_index].flags = e.flags;
+    block_targets[block_index] = e.target;
+  }
+
+  static const uint32_t no_fallthrough_flags = CFG::ENDS_WITH_BRANCH |
+      CFG::ENDS_WITH_RETURN | CFG::ENDS_WITH_INDIRECT_JUMP |
+      CFG::ENDS_WITH_STOP | CFG::ENDS_WITH_INVALID_OPCODE;
+  vector<uint32_t> block_edges_begin(num_blocks + 1);
+  for (uint32_t x = 0; x < num_blocks; x++) {
+    block_edges_begin[x] = ret.edges.size();
+    if (block_targets[x] >= 0) {
+      ret.edges.emplace_back(CFG::edge({x, block_for_offset(block_targets[x]),
+          CFG::edge_type::BRANCH}));
+    }
+    if (!(ret.blocks[x].flags & no_fallthrough_flags) && (x + 1 < num_blocks)) {
+      ret.edges.emplace_back(CFG::edge({x, x + 1, CFG::edge_type::FALLTHROUGH}));
     }
-    ret += line;
   }
+  block_edges_begin[num_blocks] = ret.edges.size();
+
+  for (auto& c : calls) {
+    c.from_block = block_for_offset(c.opcode_offset);
+  }
+  ret.calls = move(calls);
+
+  // each block belongs to the first function (in order of entry offset) that
+  // reaches it without going through another function's entry block
+  for (uint32_t offset : function_offsets) {
+    uint32_t block_index = block_for_offset(offset);
+    ret.blocks[block_index].function_index = ret.functions.size();
+    ret.functions.emplace_back(CFG::function({offset, block_index}));
+  }
+  vector<uint32_t> pending_blocks;
+  for (uint32_t x = 0; x < ret.functions.size(); x++) {
+    pending_blocks.emplace_back(ret.functions[x].entry_block);
+    while (!pending_blocks.empty()) {
+      uint32_t block_index = pending_blocks.back();
+      pending_blocks.pop_back();
+      for (size_t z = block_edges_begin[block_index];
+           z < block_edges_begin[block_index + 1]; z++) {
+        auto& to_block = ret.blocks[ret.edges[z].to_block];
+        if (to_block.function_index == CFG::NO_FUNCTION) {
+          to_block.function_index = x;
+          pending_blocks.emplace_back(ret.edges[z].to_block);
+        }
+      }
+    }
+  }
+
   return ret;
 }
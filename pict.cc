@@ -1,6 +1,7 @@
 #include "pict.hh"
 
 #include <inttypes.h>
+#include <math.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -27,6 +28,11 @@ using namespace std;
 
 pict_render_result::pict_render_result() : image(0, 0) { }
 
+pict_unimplemented_opcode_error::pict_unimplemented_opcode_error(
+    uint16_t opcode, size_t offset) : runtime_error(string_printf(
+      "unimplemented opcode %04hX at offset %zX", opcode, offset)),
+    opcode(opcode) { }
+
 
 
 struct pict_fixed {
@@ -217,24 +223,284 @@ union pict_subheader {
 
 
 
+// clipping state, shared by all drawing commands that it applies to
+struct pict_clip {
+  rect clip_rect;
+  Image mask;
+
+  pict_clip(const rect& clip_rect, Image&& mask) : clip_rect(clip_rect),
+      mask(move(mask)) { }
+};
+
+// returns true if (x, y) is inside the oval inscribed in r
+static bool oval_contains(const rect& r, ssize_t x, ssize_t y) {
+  double x_center = static_cast<double>(r.x2 + r.x1) / 2.0;
+  double y_center = static_cast<double>(r.y2 + r.y1) / 2.0;
+  double x_dist = (static_cast<double>(x) - x_center) / (r.x2 - r.x1);
+  double y_dist = (static_cast<double>(y) - y_center) / (r.y2 - r.y1);
+  return (x_dist * x_dist + y_dist * y_dist <= 0.25);
+}
+
+enum class pict_shape_type {
+  Rect = 0,
+  RoundRect,
+  Oval,
+  Arc,
+  Polygon, // also used for lines, which are polygons that aren't closed
+  Region,
+};
+
+// the geometry of a shape drawn by one of the frame/paint/erase/invert/fill
+// opcodes, in picture coordinates
+struct pict_shape {
+  pict_shape_type type;
+  rect bounds;
+  pict_point pen_size; // only used when framing the shape
+  pict_point oval_size; // RoundRect only
+  int16_t start_angle; // Arc only; degrees clockwise from 12 o'clock
+  int16_t arc_angle;
+  vector<pict_point> points; // Polygon only
+  shared_ptr<const Image> region_mask; // Region only; black is inside. NULL for rect regions
+
+  pict_shape(pict_shape_type type, const rect& bounds, const pict_point& pen_size) :
+      type(type),
+      bounds(bounds),
+      pen_size(pen_size),
+      oval_size(0, 0),
+      start_angle(0),
+      arc_angle(0) { }
+
+  bool contains(ssize_t x, ssize_t y) const {
+    if (!this->bounds.contains(x, y)) {
+      return false;
+    }
+
+    switch (this->type) {
+      case pict_shape_type::Rect:
+        return true;
+
+      case pict_shape_type::RoundRect: {
+        // the corners are quarters of an oval_size oval; outside the corners
+        // this is just a rect
+        ssize_t corner_w = min<ssize_t>(this->oval_size.x, this->bounds.width());
+        ssize_t corner_h = min<ssize_t>(this->oval_size.y, this->bounds.height());
+        if ((corner_w <= 0) || (corner_h <= 0)) {
+          return true;
+        }
+        ssize_t left = this->bounds.x1 + corner_w / 2;
+        ssize_t right = this->bounds.x2 - corner_w / 2;
+        ssize_t top = this->bounds.y1 + corner_h / 2;
+        ssize_t bottom = this->bounds.y2 - corner_h / 2;
+        if (((x >= left) && (x < right)) || ((y >= top) && (y < bottom))) {
+          return true;
+        }
+        ssize_t corner_x1 = (x < left) ? this->bounds.x1 : (this->bounds.x2 - corner_w);
+        ssize_t corner_y1 = (y < top) ? this->bounds.y1 : (this->bounds.y2 - corner_h);
+        return oval_contains(rect(corner_y1, corner_x1, corner_y1 + corner_h,
+            corner_x1 + corner_w), x, y);
+      }
+
+      case pict_shape_type::Oval:
+        return oval_contains(this->bounds, x, y);
+
+      case pict_shape_type::Arc:
+        return oval_contains(this->bounds, x, y) && this->arc_contains_angle(x, y);
+
+      case pict_shape_type::Polygon: {
+        // even-odd rule, sampling at the center of the pixel
+        double px = x + 0.5, py = y + 0.5;
+        bool inside = false;
+        for (size_t z = 0, w = this->points.size() - 1; z < this->points.size(); w = z++) {
+          const auto& a = this->points[z];
+          const auto& b = this->points[w];
+          if (((a.y > py) != (b.y > py)) &&
+              (px < (b.x - a.x) * (py - a.y) / static_cast<double>(b.y - a.y) + a.x)) {
+            inside = !inside;
+          }
+        }
+        return inside;
+      }
+
+      case pict_shape_type::Region: {
+        if (!this->region_mask.get()) {
+          return true;
+        }
+        uint64_t r;
+        this->region_mask->read_pixel(x - this->bounds.x1, y - this->bounds.y1,
+            &r, NULL, NULL);
+        return !r;
+      }
+    }
+    return false;
+  }
+
+  // returns true if (x, y) is in the outline drawn when framing the shape,
+  // which is the part of it that's within the pen size of its edge
+  bool frame_contains(ssize_t x, ssize_t y) const {
+    if (!this->contains(x, y)) {
+      return false;
+    }
+    // arcs are framed along the curved edge only, not along the radii
+    if (this->type == pict_shape_type::Arc) {
+      return !oval_contains(this->bounds, x - this->pen_size.x, y) ||
+             !oval_contains(this->bounds, x + this->pen_size.x, y) ||
+             !oval_contains(this->bounds, x, y - this->pen_size.y) ||
+             !oval_contains(this->bounds, x, y + this->pen_size.y);
+    }
+    return !this->contains(x - this->pen_size.x, y) ||
+           !this->contains(x + this->pen_size.x, y) ||
+           !this->contains(x, y - this->pen_size.y) ||
+           !this->contains(x, y + this->pen_size.y);
+  }
+
+private:
+  bool arc_contains_angle(ssize_t x, ssize_t y) const {
+    if ((this->arc_angle >= 360) || (this->arc_angle <= -360)) {
+      return true;
+    }
+    // angles are relative to the shape of the bounding rect, not true angles,
+    // so 45 degrees is always toward its corner
+    double dx = (x + 0.5 - static_cast<double>(this->bounds.x1 + this->bounds.x2) / 2.0) / this->bounds.width();
+    double dy = (y + 0.5 - static_cast<double>(this->bounds.y1 + this->bounds.y2) / 2.0) / this->bounds.height();
+    double angle = atan2(dx, -dy) * 180.0 / M_PI;
+    double start = this->start_angle;
+    double extent = this->arc_angle;
+    if (extent < 0) {
+      start += extent;
+      extent = -extent;
+    }
+    double offset = fmod(angle - start, 360.0);
+    if (offset < 0) {
+      offset += 360.0;
+    }
+    return offset < extent;
+  }
+};
+
+// the image being drawn. area is the part of the picture frame that the image
+// covers (in picture coordinates); drawing outside of it is ignored. this is
+// the entire frame unless the picture is being rendered in bands or with a
+// clip rect.
+struct pict_canvas {
+  rect bounds;
+  rect area;
+  Image image;
+
+  // these are used to handle compressed images. currently we don't decompress
+  // them; we only extract them from the PICT and save them as-is. this means we
+  // can't do drawing operations on the canvas before or after loading a
+  // compressed image!
+  bool modified;
+  string embedded_image_format;
+  shared_ptr<const string> embedded_image_data;
+
+  pict_canvas(const rect& bounds, const rect& area) :
+      bounds(bounds),
+      area(area),
+      image(this->area.width(), this->area.height(), true),
+      modified(false) { }
+
+  // returns true if the pixel is drawn to (that is, it's in the drawn area and
+  // not clipped out)
+  bool prepare_pixel(const pict_clip& clip, ssize_t x, ssize_t y) {
+    if (!clip.clip_rect.contains(x, y) || !this->bounds.contains(x, y)) {
+      return false;
+    }
+    if (clip.mask.get_width()) {
+      uint64_t r, g, b;
+      clip.mask.read_pixel(x - clip.clip_rect.x1, y - clip.clip_rect.y1,
+          &r, &g, &b);
+      if (!r && !g && !b) {
+        return false;
+      }
+    }
+    if (!this->embedded_image_format.empty()) {
+      throw runtime_error("PICT requires drawing opcodes after QuickTime data");
+    }
+    // this is set even if the pixel isn't in the drawn area, so every band
+    // sees the same QuickTime data ordering errors
+    this->modified = true;
+    return this->area.contains(x, y);
+  }
+
+  void write_pixel(const pict_clip& clip, ssize_t x, ssize_t y, uint64_t r,
+      uint64_t g, uint64_t b, uint64_t a = 0xFF) {
+    if (this->prepare_pixel(clip, x, y)) {
+      this->image.write_pixel(x - this->area.x1, y - this->area.y1, r, g, b, a);
+    }
+  }
+
+  void invert_pixel(const pict_clip& clip, ssize_t x, ssize_t y) {
+    if (!this->prepare_pixel(clip, x, y)) {
+      return;
+    }
+    // pixels that haven't been drawn yet are transparent, but they're white
+    // as far as QuickDraw is concerned
+    uint64_t r, g, b, a;
+    this->image.read_pixel(x - this->area.x1, y - this->area.y1, &r, &g, &b, &a);
+    if (!a) {
+      r = g = b = 0xFF;
+    }
+    this->image.write_pixel(x - this->area.x1, y - this->area.y1, r ^ 0xFF,
+        g ^ 0xFF, b ^ 0xFF, 0xFF);
+  }
+};
+
+// a drawing operation, with all of its arguments (including the parts of the
+// render state it depends on) already parsed, byteswapped, and decoded
+struct pict_display_command {
+  void (*execute)(pict_canvas& canvas, const pict_display_command& cmd);
+  rect r; // shape or destination rect
+  pict_pattern pattern;
+  ssize_t source_x; // source (or mask) offset for copy commands
+  ssize_t source_y;
+  shared_ptr<const pict_clip> clip;
+  shared_ptr<const Image> image; // pixel pattern or source image
+  shared_ptr<const Image> mask;
+  shared_ptr<const pict_shape> shape;
+  string embedded_image_format;
+  shared_ptr<const string> embedded_image_data;
+
+  pict_display_command(void (*execute)(pict_canvas&, const pict_display_command&)) :
+      execute(execute), r(0, 0, 0, 0), pattern(0), source_x(0), source_y(0) { }
+};
+
+struct pict_display_list {
+  pict_header header;
+  vector<pict_display_command> commands;
+  size_t size; // approximate memory usage, including decoded images
+
+  pict_display_list(const pict_header& header) : header(header),
+      size(sizeof(pict_display_list)) { }
+};
+
+// returns the picture frame with its corners in the right order
+static rect normalized_frame(const rect& bounds) {
+  return rect(bounds.y1, bounds.x1, bounds.y1 + abs(bounds.y2 - bounds.y1),
+      bounds.x1 + abs(bounds.x2 - bounds.x1));
+}
+
+
+
 struct pict_render_state {
   pict_header header;
 
   uint8_t version; // must be 1 or 2
 
-  rect clip_rect;
-  Image clip_region_mask;
+  shared_ptr<const pict_clip> clip;
 
   pict_point pen_location;
   pict_point pen_size;
   uint16_t pen_mode;
 
+  // the pixel patterns are NULL if the corresponding monochrome pattern should
+  // be used instead
   pict_pattern pen_pattern;
   pict_pattern fill_pattern;
   pict_pattern background_pattern;
-  Image pen_pixel_pattern;
-  Image fill_pixel_pattern;
-  Image background_pixel_pattern;
+  shared_ptr<const Image> pen_pixel_pattern;
+  shared_ptr<const Image> fill_pixel_pattern;
+  shared_ptr<const Image> background_pixel_pattern;
 
   color foreground_color;
   color background_color;
@@ -244,6 +510,8 @@ struct pict_render_state {
   color default_highlight_color;
 
   rect last_rect;
+  shared_ptr<const pict_shape> last_polygon;
+  shared_ptr<const pict_shape> last_region;
   pict_point oval_size;
   pict_point origin;
 
@@ -257,30 +525,25 @@ struct pict_render_state {
   pict_point text_ratio_numerator;
   pict_point text_ratio_denominator;
 
-  Image canvas;
-
-  // these are used to handle compressed images. currently we don't decompress
-  // them; we only extract them from the PICT and save them as-is. this means we
-  // can't do drawing operations on the canvas before or after loading a
-  // compressed image!
-  bool canvas_modified;
-  string embedded_image_format;
-  string embedded_image_data;
+  // exactly one of these is set. when rendering directly, drawing commands are
+  // executed on the canvas as soon as they're parsed; when compiling a display
+  // list, they're saved in it instead.
+  pict_canvas* canvas;
+  pict_display_list* display_list;
 
-  pict_render_state(const pict_header& header) :
+  pict_render_state(const pict_header& header, pict_canvas* canvas,
+      pict_display_list* display_list) :
       header(header),
       version(1),
-      clip_rect(this->header.bounds),
-      clip_region_mask(0, 0),
+      clip(new pict_clip(this->header.bounds, Image(0, 0))),
       pen_location(0, 0),
       pen_size(1, 1),
       pen_mode(0),
-      pen_pattern(0x0000000000000000),
-      fill_pattern(0x0000000000000000),
-      background_pattern(0xFFFFFFFFFFFFFFFF),
-      pen_pixel_pattern(0, 0),
-      fill_pixel_pattern(0, 0),
-      background_pixel_pattern(0, 0),
+      // QuickDraw's defaults are a black pen and fill pattern and a white
+      // background pattern
+      pen_pattern(0xFFFFFFFFFFFFFFFF),
+      fill_pattern(0xFFFFFFFFFFFFFFFF),
+      background_pattern(0x0000000000000000),
       foreground_color(0xFFFF, 0xFFFF, 0xFFFF),
       background_color(0x0000, 0x0000, 0x0000),
       op_color(0xFFFF, 0x0000, 0xFFFF),
@@ -298,28 +561,56 @@ struct pict_render_state {
       text_nonspace_extra_width(0),
       text_ratio_numerator(0, 0),
       text_ratio_denominator(0, 0),
-      canvas(abs(this->header.bounds.x2 - this->header.bounds.x1),
-             abs(this->header.bounds.y2 - this->header.bounds.y1), true),
-      canvas_modified(false) { }
+      canvas(canvas),
+      display_list(display_list) { }
+
+  void emit(pict_display_command&& cmd) {
+    if (this->canvas) {
+      cmd.execute(*this->canvas, cmd);
+    } else {
+      this->display_list->size += sizeof(pict_display_command);
+      this->display_list->commands.emplace_back(move(cmd));
+    }
+  }
 
-  void write_canvas_pixel(ssize_t x, ssize_t y, uint64_t r, uint64_t g, uint64_t b, uint64_t a = 0xFF) {
-    if (!this->clip_rect.contains(x, y) || !this->header.bounds.contains(x, y)) {
-      return;
+  // counts memory used by images that are referenced by the display list
+  void account_for(const Image& img) {
+    if (this->display_list) {
+      this->display_list->size += img.get_data_size();
     }
-    if (this->clip_region_mask.get_width()) {
-      uint64_t r, g, b;
-      this->clip_region_mask.read_pixel(x - this->clip_rect.x1,
-          y - this->clip_rect.y1, &r, &g, &b);
-      if (!r && !g && !b) {
-        return;
-      }
+  }
+
+  bool is_banded() const {
+    if (!this->canvas) {
+      return false;
     }
-    if (!this->embedded_image_format.empty()) {
-      throw runtime_error("PICT requires drawing opcodes after QuickTime data");
+    rect frame = normalized_frame(this->header.bounds);
+    return (this->canvas->area.y1 != frame.y1) || (this->canvas->area.y2 != frame.y2);
+  }
+
+  // given a copy from source rows [source_y1, source_y1 + dest_rect.height())
+  // of a bitmap with height source_h to dest_rect, returns the range of source
+  // rows that have to be decoded to draw the part of it within the band, and
+  // the number of rows at the top of dest_rect that aren't in the band. when
+  // not rendering in bands, this is always the entire source bitmap, so
+  // unbanded rendering decodes exactly what it always has.
+  void get_visible_source_rows(const rect& dest_rect, ssize_t source_y1,
+      size_t source_h, size_t* first_row, size_t* num_rows,
+      size_t* dest_skip_rows) const {
+    if (!this->is_banded()) {
+      *first_row = 0;
+      *num_rows = source_h;
+      *dest_skip_rows = 0;
+      return;
     }
-    this->canvas.write_pixel(x - this->header.bounds.x1,
-        y - this->header.bounds.y1, r, g, b, a);
-    this->canvas_modified = true;
+    ssize_t band_y1 = this->canvas->area.y1;
+    ssize_t band_y2 = this->canvas->area.y2;
+    ssize_t skip = max<ssize_t>(band_y1 - dest_rect.y1, 0);
+    ssize_t start = max<ssize_t>(source_y1 + skip, 0);
+    ssize_t end = min<ssize_t>(source_y1 + min<ssize_t>(dest_rect.y2, band_y2) - dest_rect.y1, source_h);
+    *first_row = min<size_t>(start, source_h);
+    *num_rows = (end > start) ? (end - start) : 0;
+    *dest_skip_rows = skip;
   }
 };
 
@@ -329,6 +620,10 @@ static void skip_2(StringReader& r, pict_render_state& st, uint16_t opcode) {
   r.go(r.where() + 2);
 }
 
+static void skip_4(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  r.go(r.where() + 4);
+}
+
 static void skip_8(StringReader& r, pict_render_state& st, uint16_t opcode) {
   r.go(r.where() + 8);
 }
@@ -354,8 +649,7 @@ static void skip_long_comment(StringReader& r, pict_render_state& st, uint16_t o
 }
 
 static void unimplemented_opcode(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  throw runtime_error(string_printf("unimplemented opcode %04hX at offset %zX",
-      opcode, r.where() - st.version));
+  throw pict_unimplemented_opcode_error(opcode, r.where() - st.version);
 }
 
 
@@ -364,8 +658,9 @@ static void unimplemented_opcode(StringReader& r, pict_render_state& st, uint16_
 
 static void set_clipping_region(StringReader& r, pict_render_state& st, uint16_t opcode) {
   pict_region rgn(r);
-  st.clip_rect = rgn._rect;
-  st.clip_region_mask = rgn.render();
+  Image mask = rgn.render();
+  st.account_for(mask);
+  st.clip.reset(new pict_clip(rgn._rect, move(mask)));
 }
 
 static void set_font_number(StringReader& r, pict_render_state& st, uint16_t opcode) {
@@ -410,17 +705,17 @@ static void set_pen_mode(StringReader& r, pict_render_state& st, uint16_t opcode
 
 static void set_background_pattern(StringReader& r, pict_render_state& st, uint16_t opcode) {
   st.background_pattern = r.get<pict_pattern>();
-  st.background_pixel_pattern = Image(0, 0);
+  st.background_pixel_pattern.reset();
 }
 
 static void set_pen_pattern(StringReader& r, pict_render_state& st, uint16_t opcode) {
   st.pen_pattern = r.get<pict_pattern>();
-  st.pen_pixel_pattern = Image(0, 0);
+  st.pen_pixel_pattern.reset();
 }
 
 static void set_fill_pattern(StringReader& r, pict_render_state& st, uint16_t opcode) {
   st.fill_pattern = r.get<pict_pattern>();
-  st.fill_pixel_pattern = Image(0, 0);
+  st.fill_pixel_pattern.reset();
 }
 
 static pair<pict_pattern, Image> read_pixel_pattern(StringReader& r) {
@@ -451,20 +746,23 @@ static pair<pict_pattern, Image> read_pixel_pattern(StringReader& r) {
 
 static void set_background_pixel_pattern(StringReader& r, pict_render_state& st, uint16_t opcode) {
   auto p = read_pixel_pattern(r);
+  st.account_for(p.second);
   st.background_pattern = p.first;
-  st.background_pixel_pattern = p.second;
+  st.background_pixel_pattern.reset(new Image(move(p.second)));
 }
 
 static void set_pen_pixel_pattern(StringReader& r, pict_render_state& st, uint16_t opcode) {
   auto p = read_pixel_pattern(r);
+  st.account_for(p.second);
   st.pen_pattern = p.first;
-  st.pen_pixel_pattern = p.second;
+  st.pen_pixel_pattern.reset(new Image(move(p.second)));
 }
 
 static void set_fill_pixel_pattern(StringReader& r, pict_render_state& st, uint16_t opcode) {
   auto p = read_pixel_pattern(r);
+  st.account_for(p.second);
   st.fill_pattern = p.first;
-  st.fill_pixel_pattern = p.second;
+  st.fill_pixel_pattern.reset(new Image(move(p.second)));
 }
 
 static void set_oval_size(StringReader& r, pict_render_state& st, uint16_t opcode) {
@@ -542,70 +840,247 @@ static void set_default_highlight_color(StringReader& r, pict_render_state& st,
 
 
 
-// simple shape opcodes
+// shape opcodes
 
-static void fill_current_rect_with_pattern(pict_render_state& st,
-    const pict_pattern& pat, const Image& pixel_pat) {
-  if (pixel_pat.get_width() && pixel_pat.get_height()) {
-    for (ssize_t y = st.last_rect.y1; y < st.last_rect.y2; y++) {
-      for (ssize_t x = st.last_rect.x1; x < st.last_rect.x2; x++) {
-        uint64_t r, g, b;
-        pixel_pat.read_pixel(x % pixel_pat.get_width(), y % pixel_pat.get_height(), &r, &g, &b);
-        st.write_canvas_pixel(x, y, r, g, b);
+static void write_pattern_pixel(pict_canvas& canvas,
+    const pict_display_command& cmd, ssize_t x, ssize_t y) {
+  const Image* pixel_pat = cmd.image.get();
+  if (pixel_pat && pixel_pat->get_width() && pixel_pat->get_height()) {
+    ssize_t w = pixel_pat->get_width(), h = pixel_pat->get_height();
+    uint64_t r, g, b;
+    pixel_pat->read_pixel(((x % w) + w) % w, ((y % h) + h) % h, &r, &g, &b);
+    canvas.write_pixel(*cmd.clip, x, y, r, g, b);
+  } else {
+    uint8_t value = cmd.pattern.pixel_at(x - canvas.bounds.x1, y - canvas.bounds.y1) ? 0x00 : 0xFF;
+    canvas.write_pixel(*cmd.clip, x, y, value, value, value);
+  }
+}
+
+static void execute_fill_shape(pict_canvas& canvas,
+    const pict_display_command& cmd) {
+  const pict_shape& shape = *cmd.shape;
+  for (ssize_t y = shape.bounds.y1; y < shape.bounds.y2; y++) {
+    for (ssize_t x = shape.bounds.x1; x < shape.bounds.x2; x++) {
+      if (shape.contains(x, y)) {
+        write_pattern_pixel(canvas, cmd, x, y);
       }
     }
-  } else {
-    for (ssize_t y = st.last_rect.y1; y < st.last_rect.y2; y++) {
-      for (ssize_t x = st.last_rect.x1; x < st.last_rect.x2; x++) {
-        uint8_t value = pat.pixel_at(x - st.header.bounds.x1, y - st.header.bounds.y1) ? 0x00 : 0xFF;
-        st.write_canvas_pixel(x, y, value, value, value);
+  }
+}
+
+static void execute_invert_shape(pict_canvas& canvas,
+    const pict_display_command& cmd) {
+  const pict_shape& shape = *cmd.shape;
+  for (ssize_t y = shape.bounds.y1; y < shape.bounds.y2; y++) {
+    for (ssize_t x = shape.bounds.x1; x < shape.bounds.x2; x++) {
+      if (shape.contains(x, y)) {
+        canvas.invert_pixel(*cmd.clip, x, y);
       }
     }
   }
 }
 
-static void erase_last_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  fill_current_rect_with_pattern(st, st.background_pattern, st.background_pixel_pattern);
+// draws a line with the pen, which hangs below and to the right of each point
+// on the line
+static void stroke_line(pict_canvas& canvas, const pict_display_command& cmd,
+    const pict_point& from, const pict_point& to) {
+  const pict_point& pen_size = cmd.shape->pen_size;
+  ssize_t x = from.x, y = from.y;
+  ssize_t dx = abs(to.x - from.x), dy = -abs(to.y - from.y);
+  ssize_t step_x = (from.x < to.x) ? 1 : -1;
+  ssize_t step_y = (from.y < to.y) ? 1 : -1;
+  ssize_t error = dx + dy;
+  for (;;) {
+    for (ssize_t yy = y; yy < y + pen_size.y; yy++) {
+      for (ssize_t xx = x; xx < x + pen_size.x; xx++) {
+        write_pattern_pixel(canvas, cmd, xx, yy);
+      }
+    }
+    if ((x == to.x) && (y == to.y)) {
+      break;
+    }
+    ssize_t error2 = 2 * error;
+    if (error2 >= dy) {
+      error += dy;
+      x += step_x;
+    }
+    if (error2 <= dx) {
+      error += dx;
+      y += step_y;
+    }
+  }
 }
 
-static void erase_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  st.last_rect = r.get<rect>();
-  st.last_rect.byteswap();
-  fill_current_rect_with_pattern(st, st.background_pattern, st.background_pixel_pattern);
+static void execute_frame_shape(pict_canvas& canvas,
+    const pict_display_command& cmd) {
+  const pict_shape& shape = *cmd.shape;
+  if (shape.type == pict_shape_type::Polygon) {
+    for (size_t z = 1; z < shape.points.size(); z++) {
+      stroke_line(canvas, cmd, shape.points[z - 1], shape.points[z]);
+    }
+    return;
+  }
+
+  for (ssize_t y = shape.bounds.y1; y < shape.bounds.y2; y++) {
+    for (ssize_t x = shape.bounds.x1; x < shape.bounds.x2; x++) {
+      if (shape.frame_contains(x, y)) {
+        write_pattern_pixel(canvas, cmd, x, y);
+      }
+    }
+  }
 }
 
-static void fill_last_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  fill_current_rect_with_pattern(st, st.fill_pattern, st.fill_pixel_pattern);
+// the low 3 bits of each shape opcode say what to do with the shape: 0 =
+// frame, 1 = paint, 2 = erase, 3 = invert, 4 = fill
+static void draw_shape(pict_render_state& st, shared_ptr<const pict_shape> shape,
+    uint16_t opcode) {
+  pict_display_command cmd(execute_fill_shape);
+  switch (opcode & 7) {
+    case 0:
+      cmd.execute = execute_frame_shape;
+      cmd.pattern = st.pen_pattern;
+      cmd.image = st.pen_pixel_pattern;
+      break;
+    case 1:
+      cmd.pattern = st.pen_pattern;
+      cmd.image = st.pen_pixel_pattern;
+      break;
+    case 2:
+      cmd.pattern = st.background_pattern;
+      cmd.image = st.background_pixel_pattern;
+      break;
+    case 3:
+      cmd.execute = execute_invert_shape;
+      break;
+    case 4:
+      cmd.pattern = st.fill_pattern;
+      cmd.image = st.fill_pixel_pattern;
+      break;
+    default:
+      throw logic_error("invalid shape opcode");
+  }
+  cmd.clip = st.clip;
+  cmd.shape = move(shape);
+  st.emit(move(cmd));
 }
 
-static void fill_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  st.last_rect = r.get<rect>();
-  st.last_rect.byteswap();
-  fill_current_rect_with_pattern(st, st.fill_pattern, st.fill_pixel_pattern);
+// the "same" variants of the rect-based opcodes (with bit 3 set) reuse the
+// last rect instead of reading one
+static void read_last_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  if (!(opcode & 8)) {
+    st.last_rect = r.get<rect>();
+    st.last_rect.byteswap();
+  }
 }
 
-static void fill_last_oval(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  double x_center = static_cast<double>(st.last_rect.x2 + st.last_rect.x1) / 2.0;
-  double y_center = static_cast<double>(st.last_rect.y2 + st.last_rect.y1) / 2.0;
-  double width = st.last_rect.x2 - st.last_rect.x1;
-  double height = st.last_rect.y2 - st.last_rect.y1;
-  for (ssize_t y = st.last_rect.y1; y < st.last_rect.y2; y++) {
-    for (ssize_t x = st.last_rect.x1; x < st.last_rect.x2; x++) {
-      double x_dist = (static_cast<double>(x) - x_center) / width;
-      double y_dist = (static_cast<double>(y) - y_center) / height;
-      if (x_dist * x_dist + y_dist * y_dist > 0.25) {
-        continue;
-      }
-      uint8_t value = st.fill_pattern.pixel_at(x - st.header.bounds.x1, y - st.header.bounds.y1) ? 0x00 : 0xFF;
-      st.write_canvas_pixel(x, y, value, value, value);
+static void draw_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  read_last_rect(r, st, opcode);
+  draw_shape(st, make_shared<pict_shape>(pict_shape_type::Rect, st.last_rect,
+      st.pen_size), opcode);
+}
+
+static void draw_round_rect(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  read_last_rect(r, st, opcode);
+  auto shape = make_shared<pict_shape>(pict_shape_type::RoundRect,
+      st.last_rect, st.pen_size);
+  shape->oval_size = st.oval_size;
+  draw_shape(st, move(shape), opcode);
+}
+
+static void draw_oval(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  read_last_rect(r, st, opcode);
+  draw_shape(st, make_shared<pict_shape>(pict_shape_type::Oval, st.last_rect,
+      st.pen_size), opcode);
+}
+
+static void draw_arc(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  read_last_rect(r, st, opcode);
+  auto shape = make_shared<pict_shape>(pict_shape_type::Arc, st.last_rect,
+      st.pen_size);
+  shape->start_angle = r.get_u16r();
+  shape->arc_angle = r.get_u16r();
+  draw_shape(st, move(shape), opcode);
+}
+
+static void draw_polygon(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  if (!(opcode & 8)) {
+    uint16_t size = r.get_u16r();
+    if ((size < 0x0A) || ((size - 0x0A) & 3)) {
+      throw runtime_error("polygon size is incorrect");
+    }
+    rect bounds = r.get<rect>();
+    bounds.byteswap();
+    auto shape = make_shared<pict_shape>(pict_shape_type::Polygon, bounds,
+        st.pen_size);
+    for (size_t z = 0; z < (size - 0x0A) / 4; z++) {
+      shape->points.emplace_back(r.get<pict_point>());
+      shape->points.back().byteswap();
     }
+    st.last_polygon = move(shape);
+  } else if (!st.last_polygon.get()) {
+    throw runtime_error("same polygon opcode used before any polygon");
   }
+
+  auto shape = make_shared<pict_shape>(*st.last_polygon);
+  shape->pen_size = st.pen_size;
+  draw_shape(st, move(shape), opcode);
 }
 
-static void fill_oval(StringReader& r, pict_render_state& st, uint16_t opcode) {
-  st.last_rect = r.get<rect>();
-  st.last_rect.byteswap();
-  fill_last_oval(r, st, opcode);
+static void draw_region(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  if (!(opcode & 8)) {
+    pict_region rgn(r);
+    auto shape = make_shared<pict_shape>(pict_shape_type::Region, rgn._rect,
+        st.pen_size);
+    Image mask = rgn.render();
+    if (mask.get_width()) {
+      st.account_for(mask);
+      shape->region_mask.reset(new Image(move(mask)));
+    }
+    st.last_region = move(shape);
+  } else if (!st.last_region.get()) {
+    throw runtime_error("same region opcode used before any region");
+  }
+
+  auto shape = make_shared<pict_shape>(*st.last_region);
+  shape->pen_size = st.pen_size;
+  draw_shape(st, move(shape), opcode);
+}
+
+static void draw_line_to(pict_render_state& st, const pict_point& to) {
+  rect bounds(min(st.pen_location.y, to.y), min(st.pen_location.x, to.x),
+      max(st.pen_location.y, to.y) + 1, max(st.pen_location.x, to.x) + 1);
+  auto shape = make_shared<pict_shape>(pict_shape_type::Polygon, bounds,
+      st.pen_size);
+  shape->points.emplace_back(st.pen_location);
+  shape->points.emplace_back(to);
+  draw_shape(st, move(shape), 0);
+  st.pen_location = to;
+}
+
+static void draw_line(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  st.pen_location = r.get<pict_point>();
+  st.pen_location.byteswap();
+  pict_point to = r.get<pict_point>();
+  to.byteswap();
+  draw_line_to(st, to);
+}
+
+static void draw_line_from(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  pict_point to = r.get<pict_point>();
+  to.byteswap();
+  draw_line_to(st, to);
+}
+
+static void draw_short_line_from(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  int8_t dh = r.get_s8();
+  int8_t dv = r.get_s8();
+  draw_line_to(st, pict_point(st.pen_location.x + dh, st.pen_location.y + dv));
+}
+
+static void draw_short_line(StringReader& r, pict_render_state& st, uint16_t opcode) {
+  st.pen_location = r.get<pict_point>();
+  st.pen_location.byteswap();
+  draw_short_line_from(r, st, opcode);
 }
 
 
@@ -638,64 +1113,141 @@ struct pict_copy_bits_monochrome_args {
  * };
  */
 
-static string unpack_bits(StringReader& r, size_t w, size_t h,
+// checks whether the packed data at r's current position unpacks to exactly
+// row_bytes bytes per row, without actually unpacking it (only the size fields
+// and segment headers are read). returns an empty string if it does, or a
+// description of the problem if it doesn't.
+static string check_packed_bits(const StringReader& r, size_t h,
     uint16_t row_bytes, bool sizes_are_words, bool chunks_are_words) {
-  string ret;
-  size_t expected_size = row_bytes * h;
-  ret.reserve(expected_size);
+  try {
+    size_t offset = r.where();
+    size_t unpacked_size = 0;
+    for (size_t y = 0; y < h; y++) {
+      uint16_t packed_row_bytes = sizes_are_words ? r.pget_u16r(offset) : r.pget_u8(offset);
+      offset += sizes_are_words ? 2 : 1;
+      for (size_t row_end_offset = offset + packed_row_bytes; offset < row_end_offset;) {
+        int8_t count = r.pget_u8(offset++);
+        if (count < 0) { // RLE segment
+          size_t chunk_size = chunks_are_words ? 2 : 1;
+          if (offset + chunk_size > r.size()) {
+            throw out_of_range("end of string");
+          }
+          offset += chunk_size;
+          unpacked_size += (1 - count) * chunk_size;
+        } else { // direct segment; may be truncated by the end of the data
+          size_t segment_size = (count + 1) * (chunks_are_words ? 2 : 1);
+          segment_size = min<size_t>(segment_size, r.size() - offset);
+          offset += segment_size;
+          unpacked_size += segment_size;
+        }
+      }
+      if (unpacked_size != row_bytes * (y + 1)) {
+        return string_printf("packed data size is incorrect on row %zu at offset %zX (expected %zX, have %zX)",
+            y, offset, row_bytes * (y + 1), unpacked_size);
+      }
+    }
+    return "";
+  } catch (const out_of_range& e) {
+    return e.what();
+  }
+}
 
+// unpacks only rows [first_row, first_row + num_rows). the other rows still
+// have to be walked (segments may run past the end of a row's packed size),
+// but only their segment headers are read.
+static string unpack_bits(StringReader& r, size_t w, size_t h,
+    uint16_t row_bytes, bool sizes_are_words, bool chunks_are_words,
+    size_t first_row, size_t num_rows) {
+  string ret(row_bytes * num_rows, '\0');
+  char* out = const_cast<char*>(ret.data());
+  size_t out_offset = 0;
+
+  size_t offset = r.where();
   for (size_t y = 0; y < h; y++) {
-    uint16_t packed_row_bytes = sizes_are_words ? r.get_u16r() : r.get_u8();
-    for (size_t row_end_offset = r.where() + packed_row_bytes; r.where() < row_end_offset;) {
-      int16_t count = r.get_s8();
+    uint16_t packed_row_bytes = sizes_are_words ? r.pget_u16r(offset) : r.pget_u8(offset);
+    offset += sizes_are_words ? 2 : 1;
+    bool skip_row = (y < first_row) || (y >= first_row + num_rows);
+    size_t row_end_out_offset = row_bytes * (y - first_row + 1);
+    for (size_t row_end_offset = offset + packed_row_bytes; offset < row_end_offset;) {
+      int8_t count = r.pget_u8(offset++);
+      size_t chunk_size = chunks_are_words ? 2 : 1;
+      size_t segment_size;
+      if (count < 0) {
+        segment_size = (1 - count) * chunk_size;
+      } else {
+        // direct segments may be truncated by the end of the data
+        segment_size = min<size_t>((count + 1) * chunk_size, r.size() - offset);
+      }
+      if (skip_row) {
+        offset += (count < 0) ? chunk_size : segment_size;
+        continue;
+      }
+      if (segment_size > row_end_out_offset - out_offset) {
+        throw runtime_error(string_printf("packed data size is incorrect on row %zu at offset %zX (expected %zX, have more)",
+            y, offset, row_end_out_offset));
+      }
+
       if (count < 0) { // RLE segment
         if (chunks_are_words) {
-          uint16_t value = r.get_u16r();
-          for (size_t x = 0; x < -(count - 1); x++) {
-            ret.push_back((value >> 8) & 0xFF);
-            ret.push_back(value & 0xFF);
+          uint16_t value = r.pget_u16r(offset);
+          offset += 2;
+          for (size_t z = 0; z < segment_size; z += 2) {
+            out[out_offset + z] = (value >> 8) & 0xFF;
+            out[out_offset + z + 1] = value & 0xFF;
           }
         } else {
-          ret.insert(ret.size(), -(count - 1), r.get_u8());
+          memset(out + out_offset, r.pget_u8(offset++), segment_size);
         }
+        out_offset += segment_size;
+
       } else { // direct segment
-        if (chunks_are_words) {
-          ret += r.read((count + 1) * 2);
-        } else {
-          ret += r.read(count + 1);
-        }
+        r.pread_into(offset, out + out_offset, segment_size);
+        offset += segment_size;
+        out_offset += segment_size;
       }
     }
-    if (ret.size() != row_bytes * (y + 1)) {
+    if (!skip_row && (out_offset != row_end_out_offset)) {
       throw runtime_error(string_printf("packed data size is incorrect on row %zu at offset %zX (expected %zX, have %zX)",
-          y, r.where(), row_bytes * (y + 1), ret.size()));
+          y, offset, row_end_out_offset, out_offset));
     }
   }
-  if (row_bytes * h != ret.size()) {
-    throw runtime_error(string_printf("unpacked data size is incorrect (expected %zX, have %zX)",
-        row_bytes * h, ret.size()));
-  }
+  r.go(offset);
   return ret;
 }
 
 static string unpack_bits(StringReader& r, size_t w, size_t h,
-    uint16_t row_bytes, bool chunks_are_words) {
-  size_t start_offset = r.where();
+    uint16_t row_bytes, bool chunks_are_words, size_t first_row,
+    size_t num_rows) {
+  // the row sizes may be bytes or words, and the header doesn't say which. if
+  // row_bytes > 250, word sizes are most likely to be correct, so check that
+  // first. checking is much cheaper than unpacking, so only the correct
+  // interpretation is actually unpacked.
   string failure_strs[2];
   for (size_t x = 0; x < 2; x++) {
-    try {
-      // if row_bytes > 250, word sizes are most likely to be correct, so try
-      // that first
-      return unpack_bits(r, w, h, row_bytes, x ^ (row_bytes > 250), chunks_are_words);
-    } catch (const exception& e) {
-      failure_strs[x ^ (row_bytes > 250)] = e.what();
-      r.go(start_offset);
+    bool sizes_are_words = x ^ (row_bytes > 250);
+    failure_strs[sizes_are_words] = check_packed_bits(r, h, row_bytes,
+        sizes_are_words, chunks_are_words);
+    if (failure_strs[sizes_are_words].empty()) {
+      return unpack_bits(r, w, h, row_bytes, sizes_are_words, chunks_are_words,
+          first_row, num_rows);
     }
   }
   throw runtime_error(string_printf("failed to unpack data with either byte sizes (%s) or word sizes (%s)",
       failure_strs[0].c_str(), failure_strs[1].c_str()));
 }
 
+// reads rows [first_row, first_row + num_rows) of an unpacked bitmap with h
+// rows, and skips the rest of it
+static string read_bitmap_rows(StringReader& r, size_t h, size_t row_bytes,
+    size_t first_row, size_t num_rows) {
+  if ((first_row == 0) && (num_rows == h)) {
+    return r.read(h * row_bytes);
+  }
+  string ret = r.pread(r.where() + first_row * row_bytes, num_rows * row_bytes);
+  r.go(r.where() + h * row_bytes);
+  return ret;
+}
+
 static shared_ptr<Image> read_mask_region(StringReader& r, const rect& dest_rect, rect& mask_rect) {
   pict_region rgn(r);
   shared_ptr<Image> mask_region(new Image(rgn.render()));
@@ -714,6 +1266,30 @@ static shared_ptr<Image> read_mask_region(StringReader& r, const rect& dest_rect
   return mask_region;
 }
 
+static void execute_copy_bits(pict_canvas& canvas,
+    const pict_display_command& cmd) {
+  // TODO: the clipping rect should apply here
+  if (cmd.image.get() && cmd.mask.get()) {
+    canvas.image.mask_blit(*cmd.image,
+        cmd.r.x1 - canvas.area.x1,
+        cmd.r.y1 - canvas.area.y1,
+        cmd.r.x2 - cmd.r.x1,
+        cmd.r.y2 - cmd.r.y1,
+        cmd.source_x,
+        cmd.source_y,
+        *cmd.mask);
+  } else if (cmd.image.get()) {
+    canvas.image.blit(*cmd.image,
+        cmd.r.x1 - canvas.area.x1,
+        cmd.r.y1 - canvas.area.y1,
+        cmd.r.x2 - cmd.r.x1,
+        cmd.r.y2 - cmd.r.y1,
+        cmd.source_x,
+        cmd.source_y);
+  }
+  canvas.modified = true;
+}
+
 static void copy_bits_indexed_color(StringReader& r, pict_render_state& st, uint16_t opcode) {
   bool is_packed = opcode & 0x08;
   bool has_mask_region = opcode & 0x01;
@@ -725,6 +1301,7 @@ static void copy_bits_indexed_color(StringReader& r, pict_render_state& st, uint
   uint16_t mode;
   shared_ptr<Image> mask_region;
   Image source_image(0, 0);
+  size_t first_row, num_rows, dest_skip_rows;
 
   // TODO: should we support pixmaps in v1? currently we do, but I don't know if
   // this is technically correct behavior
@@ -752,12 +1329,19 @@ static void copy_bits_indexed_color(StringReader& r, pict_render_state& st, uint
       mask_region = read_mask_region(r, dest_rect, mask_region_rect);
     }
 
+    st.get_visible_source_rows(dest_rect, source_rect.y1 - bounds.y1,
+        bounds.height(), &first_row, &num_rows, &dest_skip_rows);
+
     uint16_t row_bytes = header.flags_row_bytes & 0x7FFF;
     string data = is_packed ?
-        unpack_bits(r, header.bounds.width(), header.bounds.height(), row_bytes, header.pixel_size == 0x10) :
-        r.read(header.bounds.height() * row_bytes);
+        unpack_bits(r, header.bounds.width(), header.bounds.height(), row_bytes, header.pixel_size == 0x10, first_row, num_rows) :
+        read_bitmap_rows(r, header.bounds.height(), row_bytes, first_row, num_rows);
     const pixel_map_data* pixel_map = reinterpret_cast<const pixel_map_data*>(data.data());
 
+    // only the visible rows were unpacked, so decode them as if they were the
+    // entire pixel map
+    header.bounds.y1 += first_row;
+    header.bounds.y2 = header.bounds.y1 + num_rows;
     source_image = decode_color_image(header, *pixel_map, *ctable.table);
 
   } else {
@@ -782,37 +1366,49 @@ static void copy_bits_indexed_color(StringReader& r, pict_render_state& st, uint
       mask_region = read_mask_region(r, dest_rect, mask_region_rect);
     }
 
+    st.get_visible_source_rows(dest_rect, source_rect.y1 - bounds.y1,
+        bounds.height(), &first_row, &num_rows, &dest_skip_rows);
+
     string data = is_packed ?
-        unpack_bits(r, args.header.bounds.width(), args.header.bounds.height(), args.header.flags_row_bytes, false) :
-        r.read(args.header.bounds.height() * args.header.flags_row_bytes);
+        unpack_bits(r, args.header.bounds.width(), args.header.bounds.height(), args.header.flags_row_bytes, false, first_row, num_rows) :
+        read_bitmap_rows(r, args.header.bounds.height(), args.header.flags_row_bytes, first_row, num_rows);
     source_image = decode_monochrome_image(data.data(), data.size(),
-        args.header.bounds.width(), args.header.bounds.height(),
-        args.header.flags_row_bytes);
+        args.header.bounds.width(), num_rows, args.header.flags_row_bytes);
   }
 
-  // TODO: the clipping rect should apply here
-  if (mask_region.get()) {
-    if (mask_region_rect != source_rect) {
-      throw runtime_error("mask region rect is not same as source rect");
+  if (mask_region.get() && (mask_region_rect != source_rect)) {
+    throw runtime_error("mask region rect is not same as source rect");
+  }
+
+  // if none of the copied rows are in the current band, this command only
+  // marks the canvas as modified
+  pict_display_command cmd(execute_copy_bits);
+  if (num_rows != 0) {
+    // the source image only contains the decoded rows, and if rendering in
+    // bands, the mask region has to be cropped to match
+    ssize_t copy_h = source_rect.y2 - source_rect.y1 - dest_skip_rows;
+    if (mask_region.get() && st.is_banded()) {
+      shared_ptr<Image> cropped_mask(new Image(mask_region->get_width(),
+          min<size_t>(num_rows, mask_region->get_height() - dest_skip_rows)));
+      cropped_mask->blit(*mask_region, 0, 0, cropped_mask->get_width(),
+          cropped_mask->get_height(), 0, dest_skip_rows);
+      mask_region = cropped_mask;
+      copy_h = min<ssize_t>(copy_h, mask_region->get_height());
+    }
+
+    cmd.r = rect(dest_rect.y1 + dest_skip_rows, dest_rect.x1,
+        dest_rect.y1 + dest_skip_rows + copy_h,
+        dest_rect.x1 + (source_rect.x2 - source_rect.x1));
+    cmd.source_x = source_rect.x1 - bounds.x1;
+    cmd.source_y = source_rect.y1 - bounds.y1 + dest_skip_rows - first_row;
+    st.account_for(source_image);
+    cmd.image.reset(new Image(move(source_image)));
+    if (mask_region.get()) {
+      st.account_for(*mask_region);
+      cmd.mask = mask_region;
     }
-    st.canvas.mask_blit(source_image,
-        dest_rect.x1 - st.header.bounds.x1,
-        dest_rect.y1 - st.header.bounds.y1,
-        source_rect.x2 - source_rect.x1,
-        source_rect.y2 - source_rect.y1,
-        source_rect.x1 - bounds.x1,
-        source_rect.y1 - bounds.y1,
-        *mask_region);
-  } else {
-    st.canvas.blit(source_image,
-        dest_rect.x1 - st.header.bounds.x1,
-        dest_rect.y1 - st.header.bounds.y1,
-        source_rect.x2 - source_rect.x1,
-        source_rect.y2 - source_rect.y1,
-        source_rect.x1 - bounds.x1,
-        source_rect.y1 - bounds.y1);
   }
-  st.canvas_modified = true;
+  st.emit(move(cmd));
 }
 
 struct pict_packed_copy_bits_direct_color_args {
@@ -830,6 +1426,22 @@ struct pict_packed_copy_bits_direct_color_args {
   }
 };
 
+// unlike execute_copy_bits, this respects the clipping region (but is slower)
+static void execute_copy_pixels(pict_canvas& canvas,
+    const pict_display_command& cmd) {
+  const Image& img = *cmd.image;
+  const uint8_t* data = reinterpret_cast<const uint8_t*>(img.get_data());
+  for (size_t y = 0; y < img.get_height(); y++) {
+    const uint8_t* row = data + y * img.get_width() * 4;
+    for (size_t x = 0; x < img.get_width(); x++) {
+      if (row[x * 4 + 3]) {
+        canvas.write_pixel(*cmd.clip, cmd.r.x1 + x, cmd.r.y1 + y,
+            row[x * 4 + 0], row[x * 4 + 1], row[x * 4 + 2]);
+      }
+    }
+  }
+}
+
 static void packed_copy_bits_direct_color(StringReader& r, pict_render_state& st, uint16_t opcode) {
   bool has_mask_region = opcode & 0x01;
 
@@ -867,16 +1479,27 @@ static void packed_copy_bits_direct_color(StringReader& r, pict_render_state& st
   } else {
     throw runtime_error("only 8-bit and 5-bit channels are supported");
   }
+  size_t first_row, num_rows, dest_skip_rows;
+  st.get_visible_source_rows(args.dest_rect, 0, args.header.bounds.height(),
+      &first_row, &num_rows, &dest_skip_rows);
+
   size_t row_bytes = args.header.bounds.width() * bytes_per_pixel;
-  string data = unpack_bits(r, args.header.bounds.width(), args.header.bounds.height(), row_bytes, args.header.pixel_size == 0x10);
+  string data = unpack_bits(r, args.header.bounds.width(), args.header.bounds.height(), row_bytes, args.header.pixel_size == 0x10, first_row, num_rows);
 
   if (mask_region.get() && (mask_region_rect != args.source_rect)) {
     throw runtime_error("mask region rect is not same as source rect");
   }
 
-  for (ssize_t y = 0; y < args.source_rect.height(); y++) {
-    size_t row_offset = row_bytes * y;
-    for (ssize_t x = 0; x < args.source_rect.width(); x++) {
+  // decode the visible rows into an image; masked-out pixels are left
+  // transparent so they aren't drawn
+  ssize_t end_y = min<ssize_t>(args.source_rect.height(), first_row + num_rows);
+  ssize_t w = args.source_rect.width();
+  shared_ptr<Image> source_image(new Image(w, max<ssize_t>(end_y - static_cast<ssize_t>(first_row), 0), true));
+  uint8_t* source_data = reinterpret_cast<uint8_t*>(source_image->get_data());
+  for (ssize_t y = first_row; y < end_y; y++) {
+    size_t row_offset = row_bytes * (y - first_row);
+    uint8_t* out = source_data + (y - first_row) * w * 4;
+    for (ssize_t x = 0; x < w; x++) {
       if (mask_region.get()) {
         uint64_t r, g, b;
         mask_region->read_pixel(x + args.source_rect.x1 - mask_region_rect.x1,
@@ -910,10 +1533,21 @@ static void packed_copy_bits_direct_color(StringReader& r, pict_render_state& st
         throw logic_error("unimplemented channel width");
       }
 
-      st.write_canvas_pixel(x + args.dest_rect.x1, y + args.dest_rect.y1,
-          r_value, g_value, b_value);
+      out[x * 4 + 0] = r_value;
+      out[x * 4 + 1] = g_value;
+      out[x * 4 + 2] = b_value;
+      out[x * 4 + 3] = 0xFF;
     }
   }
+
+  pict_display_command cmd(execute_copy_pixels);
+  cmd.r = rect(args.dest_rect.y1 + first_row, args.dest_rect.x1,
+      args.dest_rect.y1 + first_row + source_image->get_height(),
+      args.dest_rect.x1 + w);
+  cmd.clip = st.clip;
+  st.account_for(*source_image);
+  cmd.image = source_image;
+  st.emit(move(cmd));
 }
 
 
@@ -1027,11 +1661,21 @@ static const unordered_map<uint32_t, string> codec_to_extension({
   {0x74696666, "tiff"},
 });
 
+static void execute_set_embedded_image(pict_canvas& canvas,
+    const pict_display_command& cmd) {
+  if (canvas.modified) {
+    throw runtime_error("PICT requires QuickTime data after drawing opcodes");
+  }
+  canvas.embedded_image_format = cmd.embedded_image_format;
+  canvas.embedded_image_data = cmd.embedded_image_data;
+}
+
 static void write_quicktime_data(StringReader& r, pict_render_state& st,
     uint16_t opcode) {
   bool is_compressed = !(opcode & 0x01);
 
-  if (st.canvas_modified) {
+  // when compiling a display list, this is checked when it's rendered instead
+  if (st.canvas && st.canvas->modified) {
     throw runtime_error("PICT requires QuickTime data after drawing opcodes");
   }
   if (!is_compressed) {
@@ -1062,12 +1706,17 @@ static void write_quicktime_data(StringReader& r, pict_render_state& st,
   }
 
   // read the image data
+  pict_display_command cmd(execute_set_embedded_image);
   try {
-    st.embedded_image_format = codec_to_extension.at(desc.codec);
+    cmd.embedded_image_format = codec_to_extension.at(desc.codec);
   } catch (const out_of_range&) {
     throw runtime_error(string_printf("compressed QuickTime data uses codec %08" PRIX32, desc.codec));
   }
-  st.embedded_image_data = r.read(desc.data_size);
+  cmd.embedded_image_data.reset(new string(r.read(desc.data_size)));
+  if (st.display_list) {
+    st.display_list->size += cmd.embedded_image_data->size();
+  }
+  st.emit(move(cmd));
 }
 
 
@@ -1096,7 +1745,7 @@ vector<void(*)(StringReader&, pict_render_state&, uint16_t)> render_functions({
   set_background_pixel_pattern,   // 0012: background pixel pattern (missing in v1) (args: ?)
   set_pen_pixel_pattern,          // 0013: pen pixel pattern (missing in v1) (args: ?)
   set_fill_pixel_pattern,         // 0014: fill pixel pattern (missing in v1) (args: ?)
-  unimplemented_opcode,           // 0015: fractional pen position (missing in v1) (args: u16 low word of fixed)
+  skip_2,                         // 0015: fractional pen position (missing in v1) (args: u16 low word of fixed)
   set_text_nonspace_extra_width,  // 0016: added width for nonspace characters (missing in v1) (args: u16)
   unimplemented_opcode,           // 0017: reserved (args: indeterminate)
   unimplemented_opcode,           // 0018: reserved (args: indeterminate)
@@ -1107,10 +1756,10 @@ vector<void(*)(StringReader&, pict_render_state&, uint16_t)> render_functions({
   set_highlight_color,            // 001D: highlight color (missing in v1) (args: rgb48)
   set_default_highlight_color,    // 001E: use default highlight color (missing in v1) (args: 0)
   set_op_color,                   // 001F: color (missing in v1) (args: rgb48)
-  unimplemented_opcode,           // 0020: line (args: point, point)
-  unimplemented_opcode,           // 0021: line from (args: point)
-  unimplemented_opcode,           // 0022: short line (args: point, s8 dh, s8 dv)
-  unimplemented_opcode,           // 0023: short line from (args: s8 dh, s8 dv)
+  draw_line,                      // 0020: line (args: point, point)
+  draw_line_from,                 // 0021: line from (args: point)
+  draw_short_line,                // 0022: short line (args: point, s8 dh, s8 dv)
+  draw_short_line_from,           // 0023: short line from (args: s8 dh, s8 dv)
   skip_var16,                     // 0024: reserved (args: u16 data length, u8[] data)
   skip_var16,                     // 0025: reserved (args: u16 data length, u8[] data)
   skip_var16,                     // 0026: reserved (args: u16 data length, u8[] data)
@@ -1120,102 +1769,102 @@ vector<void(*)(StringReader&, pict_render_state&, uint16_t)> render_functions({
   unimplemented_opcode,           // 002A: dv text (args: u8 dv, u8 count, char[] text)
   unimplemented_opcode,           // 002B: dh/dv text (args: u8 dh, u8 dv, u8 count, char[] text)
   set_font_number_and_name,       // 002C: font name (missing in v1) (args: u16 length, u16 old font id, u8 name length, char[] name)
-  unimplemented_opcode,           // 002D: line justify (missing in v1) (args: u16 data length, fixed interchar spacing, fixed total extra space)
-  unimplemented_opcode,           // 002E: glyph state (missing in v1) (u16 data length, u8 outline, u8 preserve glyph, u8 fractional widths, u8 scaling disabled)
-  unimplemented_opcode,           // 002F: reserved (args: u16 data length, u8[] data)
-  unimplemented_opcode,           // 0030: frame rect (args: rect)
-  unimplemented_opcode,           // 0031: paint rect (args: rect)
-  erase_rect,                     // 0032: erase rect (args: rect)
-  unimplemented_opcode,           // 0033: invert rect (args: rect)
-  fill_rect,                      // 0034: fill rect (args: rect)
+  skip_var16,                     // 002D: line justify (missing in v1) (args: u16 data length, fixed interchar spacing, fixed total extra space)
+  skip_var16,                     // 002E: glyph state (missing in v1) (u16 data length, u8 outline, u8 preserve glyph, u8 fractional widths, u8 scaling disabled)
+  skip_var16,                     // 002F: reserved (args: u16 data length, u8[] data)
+  draw_rect,                      // 0030: frame rect (args: rect)
+  draw_rect,                      // 0031: paint rect (args: rect)
+  draw_rect,                      // 0032: erase rect (args: rect)
+  draw_rect,                      // 0033: invert rect (args: rect)
+  draw_rect,                      // 0034: fill rect (args: rect)
   skip_8,                         // 0035: reserved (args: rect)
   skip_8,                         // 0036: reserved (args: rect)
   skip_8,                         // 0037: reserved (args: rect)
-  unimplemented_opcode,           // 0038: frame same rect (args: 0)
-  unimplemented_opcode,           // 0039: paint same rect (args: 0)
-  erase_last_rect,                // 003A: erase same rect (args: 0)
-  unimplemented_opcode,           // 003B: invert same rect (args: 0)
-  fill_last_rect,                 // 003C: fill same rect (args: 0)
+  draw_rect,                      // 0038: frame same rect (args: 0)
+  draw_rect,                      // 0039: paint same rect (args: 0)
+  draw_rect,                      // 003A: erase same rect (args: 0)
+  draw_rect,                      // 003B: invert same rect (args: 0)
+  draw_rect,                      // 003C: fill same rect (args: 0)
   skip_0,                         // 003D: reserved (args: 0)
   skip_0,                         // 003E: reserved (args: 0)
   skip_0,                         // 003F: reserved (args: 0)
-  unimplemented_opcode,           // 0040: frame rrect (args: rect)
-  unimplemented_opcode,           // 0041: paint rrect (args: rect)
-  unimplemented_opcode,           // 0042: erase rrect (args: rect)
-  unimplemented_opcode,           // 0043: invert rrect (args: rect)
-  unimplemented_opcode,           // 0044: fill rrect (args: rect)
+  draw_round_rect,                // 0040: frame rrect (args: rect)
+  draw_round_rect,                // 0041: paint rrect (args: rect)
+  draw_round_rect,                // 0042: erase rrect (args: rect)
+  draw_round_rect,                // 0043: invert rrect (args: rect)
+  draw_round_rect,                // 0044: fill rrect (args: rect)
   skip_8,                         // 0045: reserved (args: rect)
   skip_8,                         // 0046: reserved (args: rect)
   skip_8,                         // 0047: reserved (args: rect)
-  unimplemented_opcode,           // 0048: frame same rrect (args: 0)
-  unimplemented_opcode,           // 0049: paint same rrect (args: 0)
-  unimplemented_opcode,           // 004A: erase same rrect (args: 0)
-  unimplemented_opcode,           // 004B: invert same rrect (args: 0)
-  unimplemented_opcode,           // 004C: fill same rrect (args: 0)
+  draw_round_rect,                // 0048: frame same rrect (args: 0)
+  draw_round_rect,                // 0049: paint same rrect (args: 0)
+  draw_round_rect,                // 004A: erase same rrect (args: 0)
+  draw_round_rect,                // 004B: invert same rrect (args: 0)
+  draw_round_rect,                // 004C: fill same rrect (args: 0)
   skip_0,                         // 004D: reserved (args: 0)
   skip_0,                         // 004E: reserved (args: 0)
   skip_0,                         // 004F: reserved (args: 0)
-  unimplemented_opcode,           // 0050: frame oval (args: rect)
-  unimplemented_opcode,           // 0051: paint oval (args: rect)
-  unimplemented_opcode,           // 0052: erase oval (args: rect)
-  unimplemented_opcode,           // 0053: invert oval (args: rect)
-  fill_oval,                      // 0054: fill oval (args: rect)
+  draw_oval,                      // 0050: frame oval (args: rect)
+  draw_oval,                      // 0051: paint oval (args: rect)
+  draw_oval,                      // 0052: erase oval (args: rect)
+  draw_oval,                      // 0053: invert oval (args: rect)
+  draw_oval,                      // 0054: fill oval (args: rect)
   skip_8,                         // 0055: reserved (args: rect)
   skip_8,                         // 0056: reserved (args: rect)
   skip_8,                         // 0057: reserved (args: rect)
-  unimplemented_opcode,           // 0058: frame same oval (args: 0)
-  unimplemented_opcode,           // 0059: paint same oval (args: 0)
-  unimplemented_opcode,           // 005A: erase same oval (args: 0)
-  unimplemented_opcode,           // 005B: invert same oval (args: 0)
-  fill_last_oval,                 // 005C: fill same oval (args: 0)
+  draw_oval,                      // 0058: frame same oval (args: 0)
+  draw_oval,                      // 0059: paint same oval (args: 0)
+  draw_oval,                      // 005A: erase same oval (args: 0)
+  draw_oval,                      // 005B: invert same oval (args: 0)
+  draw_oval,                      // 005C: fill same oval (args: 0)
   skip_0,                         // 005D: reserved (args: 0)
   skip_0,                         // 005E: reserved (args: 0)
   skip_0,                         // 005F: reserved (args: 0)
-  unimplemented_opcode,           // 0060: frame arc (args: rect, u16 start angle, u16 arc angle)
-  unimplemented_opcode,           // 0061: paint arc (args: rect, u16 start angle, u16 arc angle)
-  unimplemented_opcode,           // 0062: erase arc (args: rect, u16 start angle, u16 arc angle)
-  unimplemented_opcode,           // 0063: invert arc (args: rect, u16 start angle, u16 arc angle)
-  unimplemented_opcode,           // 0064: fill arc (args: rect, u16 start angle, u16 arc angle)
+  draw_arc,                       // 0060: frame arc (args: rect, u16 start angle, u16 arc angle)
+  draw_arc,                       // 0061: paint arc (args: rect, u16 start angle, u16 arc angle)
+  draw_arc,                       // 0062: erase arc (args: rect, u16 start angle, u16 arc angle)
+  draw_arc,                       // 0063: invert arc (args: rect, u16 start angle, u16 arc angle)
+  draw_arc,                       // 0064: fill arc (args: rect, u16 start angle, u16 arc angle)
   skip_12,                        // 0065: reserved (args: rect, u16 start angle, u16 arc angle)
   skip_12,                        // 0066: reserved (args: rect, u16 start angle, u16 arc angle)
   skip_12,                        // 0067: reserved (args: rect, u16 start angle, u16 arc angle)
-  unimplemented_opcode,           // 0068: frame same arc (args: rect)
-  unimplemented_opcode,           // 0069: paint same arc (args: rect)
-  unimplemented_opcode,           // 006A: erase same arc (args: rect)
-  unimplemented_opcode,           // 006B: invert same arc (args: rect)
-  unimplemented_opcode,           // 006C: fill same arc (args: rect)
-  skip_8,                         // 006D: reserved (args: rect)
-  skip_8,                         // 006E: reserved (args: rect)
-  skip_8,                         // 006F: reserved (args: rect)
-  unimplemented_opcode,           // 0070: frame poly (args: polygon)
-  unimplemented_opcode,           // 0071: paint poly (args: polygon)
-  unimplemented_opcode,           // 0072: erase poly (args: polygon)
-  unimplemented_opcode,           // 0073: invert poly (args: polygon)
-  unimplemented_opcode,           // 0074: fill poly (args: polygon)
+  draw_arc,                       // 0068: frame same arc (args: u16 start angle, u16 arc angle)
+  draw_arc,                       // 0069: paint same arc (args: u16 start angle, u16 arc angle)
+  draw_arc,                       // 006A: erase same arc (args: u16 start angle, u16 arc angle)
+  draw_arc,                       // 006B: invert same arc (args: u16 start angle, u16 arc angle)
+  draw_arc,                       // 006C: fill same arc (args: u16 start angle, u16 arc angle)
+  skip_4,                         // 006D: reserved (args: u32)
+  skip_4,                         // 006E: reserved (args: u32)
+  skip_4,                         // 006F: reserved (args: u32)
+  draw_polygon,                   // 0070: frame poly (args: polygon)
+  draw_polygon,                   // 0071: paint poly (args: polygon)
+  draw_polygon,                   // 0072: erase poly (args: polygon)
+  draw_polygon,                   // 0073: invert poly (args: polygon)
+  draw_polygon,                   // 0074: fill poly (args: polygon)
   skip_var16,                     // 0075: reserved (args: polygon)
   skip_var16,                     // 0076: reserved (args: polygon)
   skip_var16,                     // 0077: reserved (args: polygon)
-  unimplemented_opcode,           // 0078: frame same poly (args: 0)
-  unimplemented_opcode,           // 0079: paint same poly (args: 0)
-  unimplemented_opcode,           // 007A: erase same poly (args: 0)
-  unimplemented_opcode,           // 007B: invert same poly (args: 0)
-  unimplemented_opcode,           // 007C: fill same poly (args: 0)
+  draw_polygon,                   // 0078: frame same poly (args: 0)
+  draw_polygon,                   // 0079: paint same poly (args: 0)
+  draw_polygon,                   // 007A: erase same poly (args: 0)
+  draw_polygon,                   // 007B: invert same poly (args: 0)
+  draw_polygon,                   // 007C: fill same poly (args: 0)
   skip_0,                         // 007D: reserved (args: 0)
   skip_0,                         // 007E: reserved (args: 0)
   skip_0,                         // 007F: reserved (args: 0)
-  unimplemented_opcode,           // 0080: frame region (args: region)
-  unimplemented_opcode,           // 0081: paint region (args: region)
-  unimplemented_opcode,           // 0082: erase region (args: region)
-  unimplemented_opcode,           // 0083: invert region (args: region)
-  unimplemented_opcode,           // 0084: fill region (args: region)
+  draw_region,                    // 0080: frame region (args: region)
+  draw_region,                    // 0081: paint region (args: region)
+  draw_region,                    // 0082: erase region (args: region)
+  draw_region,                    // 0083: invert region (args: region)
+  draw_region,                    // 0084: fill region (args: region)
   skip_var16,                     // 0085: reserved (args: region)
   skip_var16,                     // 0086: reserved (args: region)
   skip_var16,                     // 0087: reserved (args: region)
-  unimplemented_opcode,           // 0088: frame same region (args: 0)
-  unimplemented_opcode,           // 0089: paint same region (args: 0)
-  unimplemented_opcode,           // 008A: erase same region (args: 0)
-  unimplemented_opcode,           // 008B: invert same region (args: 0)
-  unimplemented_opcode,           // 008C: fill same region (args: 0)
+  draw_region,                    // 0088: frame same region (args: 0)
+  draw_region,                    // 0089: paint same region (args: 0)
+  draw_region,                    // 008A: erase same region (args: 0)
+  draw_region,                    // 008B: invert same region (args: 0)
+  draw_region,                    // 008C: fill same region (args: 0)
   skip_0,                         // 008D: reserved (args: 0)
   skip_0,                         // 008E: reserved (args: 0)
   skip_0,                         // 008F: reserved (args: 0)
@@ -1239,25 +1888,26 @@ vector<void(*)(StringReader&, pict_render_state&, uint16_t)> render_functions({
   skip_long_comment,              // 00A1: long comment (args: u16 kind, u16 length, char[] data)
 });
 
-pict_render_result render_quickdraw_picture(const void* vdata, size_t size) {
-  if (size < sizeof(pict_header)) {
+static pict_header read_pict_header(StringReader& r) {
+  if (r.size() < sizeof(pict_header)) {
     throw runtime_error("pict too small for header");
   }
 
-  StringReader r(vdata, size);
   pict_header header = r.get<pict_header>();
   header.byteswap();
 
   // if the pict header is all zeroes, assume this is a pict file with a
   // 512-byte header that needs to be skipped
   if (header.size == 0 && header.bounds.x1 == 0 && header.bounds.y1 == 0 &&
-      header.bounds.x2 == 0 && header.bounds.y2 == 0 && size > 0x200) {
+      header.bounds.x2 == 0 && header.bounds.y2 == 0 && r.size() > 0x200) {
     r.go(0x200);
     header = r.get<pict_header>();
     header.byteswap();
   }
+  return header;
+}
 
-  pict_render_state st(header);
+static void render_opcodes(StringReader& r, pict_render_state& st) {
   while (!r.eof()) {
     // in v2 pictures, opcodes are word-aligned
     if ((st.version == 2) && (r.where() & 1)) {
@@ -1326,10 +1976,91 @@ pict_render_result render_quickdraw_picture(const void* vdata, size_t size) {
       skip_var32(r, st, opcode);
     }
   }
+}
 
+static pict_render_result result_from_canvas(pict_canvas& canvas) {
   pict_render_result result;
-  result.image = move(st.canvas);
-  result.embedded_image_format = move(st.embedded_image_format);
-  result.embedded_image_data = move(st.embedded_image_data);
+  result.image = move(canvas.image);
+  result.embedded_image_format = move(canvas.embedded_image_format);
+  if (canvas.embedded_image_data.get()) {
+    result.embedded_image_data = *canvas.embedded_image_data;
+  }
   return result;
 }
+
+pict_render_result render_quickdraw_picture(const void* vdata, size_t size) {
+  StringReader r(vdata, size);
+  pict_header header = read_pict_header(r);
+
+  pict_canvas canvas(header.bounds, normalized_frame(header.bounds));
+  pict_render_state st(header, &canvas, NULL);
+  render_opcodes(r, st);
+  return result_from_canvas(canvas);
+}
+
+pict_render_result render_quickdraw_picture_banded(const void* vdata,
+    size_t size, size_t band_height, pict_band_fn band_fn) {
+  if (band_height == 0) {
+    throw invalid_argument("band height must be nonzero");
+  }
+
+  StringReader r(vdata, size);
+  pict_header header = read_pict_header(r);
+  size_t opcodes_offset = r.where();
+
+  // each band is rendered by running all the opcodes again with a canvas that
+  // only covers that band. this costs more CPU time than rendering the picture
+  // once, but only the rows of each bitmap that are in the band are decoded,
+  // so memory usage is proportional to the band height rather than to the
+  // picture's area.
+  rect frame = normalized_frame(header.bounds);
+  pict_render_result result;
+  for (ssize_t band_y1 = frame.y1; band_y1 < frame.y2; band_y1 += band_height) {
+    ssize_t band_y2 = min<ssize_t>(band_y1 + band_height, frame.y2);
+    pict_canvas canvas(header.bounds, rect(band_y1, frame.x1, band_y2, frame.x2));
+    pict_render_state st(header, &canvas, NULL);
+    r.go(opcodes_offset);
+    render_opcodes(r, st);
+
+    // embedded images don't use the canvas at all, and they'll be the same in
+    // every band, so there's no need to render more than one
+    if (!canvas.embedded_image_format.empty()) {
+      return result_from_canvas(canvas);
+    }
+    band_fn(canvas.image, band_y1 - frame.y1);
+  }
+  return result;
+}
+
+shared_ptr<const pict_display_list> compile_quickdraw_picture(
+    const void* vdata, size_t size) {
+  StringReader r(vdata, size);
+  shared_ptr<pict_display_list> dl(new pict_display_list(read_pict_header(r)));
+  pict_render_state st(dl->header, NULL, dl.get());
+  render_opcodes(r, st);
+  return dl;
+}
+
+size_t pict_display_list_size(const pict_display_list& dl) {
+  return dl.size;
+}
+
+pict_render_result render_quickdraw_picture(const pict_display_list& dl) {
+  return render_quickdraw_picture(dl, normalized_frame(dl.header.bounds));
+}
+
+pict_render_result render_quickdraw_picture(const pict_display_list& dl,
+    const rect& clip) {
+  rect frame = normalized_frame(dl.header.bounds);
+  rect area(max(frame.y1, clip.y1), max(frame.x1, clip.x1),
+      min(frame.y2, clip.y2), min(frame.x2, clip.x2));
+  if ((area.y2 < area.y1) || (area.x2 < area.x1)) {
+    area = rect(frame.y1, frame.x1, frame.y1, frame.x1);
+  }
+
+  pict_canvas canvas(dl.header.bounds, area);
+  for (const auto& cmd : dl.commands) {
+    cmd.execute(canvas, cmd);
+  }
+  return result_from_canvas(canvas);
+}
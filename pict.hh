@@ -2,10 +2,16 @@
 
 #include <stdint.h>
 
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string>
 #include <utility>
 
 #include <phosg/Image.hh>
 
+#include "quickdraw_formats.hh"
+
 struct pict_render_result {
   Image image;
   std::string embedded_image_format;
@@ -14,4 +20,37 @@ struct pict_render_result {
   pict_render_result();
 };
 
+// thrown when a picture uses an opcode that the renderer doesn't support
+class pict_unimplemented_opcode_error : public std::runtime_error {
+public:
+  pict_unimplemented_opcode_error(uint16_t opcode, size_t offset);
+
+  uint16_t opcode;
+};
+
 pict_render_result render_quickdraw_picture(const void* data, size_t size);
+
+// renders the picture in horizontal bands of at most band_height rows, calling
+// band_fn with each band (and the row of the picture it starts at) from top to
+// bottom. the entire canvas is never in memory at once, so this can render
+// pictures that are too large to render with render_quickdraw_picture. the
+// returned result's image is empty; if the picture contains embedded QuickTime
+// data, band_fn isn't called and the result contains the embedded data instead.
+typedef std::function<void(const Image& band, size_t y)> pict_band_fn;
+pict_render_result render_quickdraw_picture_banded(const void* data,
+    size_t size, size_t band_height, pict_band_fn band_fn);
+
+// a picture that has already been parsed, with all of its bitmaps decoded. it
+// can be rendered any number of times (from any number of threads at once)
+// without parsing the picture again; see ResourceFile::get_PICT_display_list.
+struct pict_display_list;
+std::shared_ptr<const pict_display_list> compile_quickdraw_picture(
+    const void* data, size_t size);
+// returns the approximate amount of memory used by the display list
+size_t pict_display_list_size(const pict_display_list& dl);
+pict_render_result render_quickdraw_picture(const pict_display_list& dl);
+// renders only the part of the picture within clip (in the picture's own
+// coordinates, not relative to its frame). the result's image has the size of
+// the intersection of clip and the picture frame.
+pict_render_result render_quickdraw_picture(const pict_display_list& dl,
+    const rect& clip);
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include <exception>
+#include <memory>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -21,6 +22,7 @@
 #include "audio_codecs.hh"
 #include "mc68k.hh"
 #include "pict.hh"
+#include "row_kernels.hh"
 
 using namespace std;
 
@@ -101,16 +103,9 @@ Image decode_monochrome_image(const void* vdata, size_t size, size_t w,
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
   Image result(w, h);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(result.get_data());
   for (size_t y = 0; y < h; y++) {
-    for (size_t x = 0; x < w; x += 8) {
-      uint8_t pixels = data[y * row_bytes + x / 8];
-      size_t z_limit = ((x + 8) <= w) ? 8 : w - x;
-      for (size_t z = 0; z < z_limit; z++) {
-        uint8_t value = (pixels & 0x80) ? 0x00 : 0xFF;
-        pixels <<= 1;
-        result.write_pixel(x + z, y, value, value, value);
-      }
-    }
+    decode_1bit_row_rgb(dest + y * w * 3, data + y * row_bytes, w);
   }
 
   return result;
@@ -130,18 +125,10 @@ Image decode_monochrome_image_masked(const void* vdata, size_t size,
   }
 
   Image result(w, h, true);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(result.get_data());
   for (size_t y = 0; y < h; y++) {
-    for (size_t x = 0; x < w; x += 8) {
-      uint8_t pixels = image_data[y * w / 8 + x / 8];
-      uint8_t mask_pixels = mask_data[y * w / 8 + x / 8];
-      for (size_t z = 0; z < 8; z++) {
-        uint8_t value = (pixels & 0x80) ? 0x00 : 0xFF;
-        uint8_t mask_value = (mask_pixels & 0x80) ? 0xFF : 0x00;
-        pixels <<= 1;
-        mask_pixels <<= 1;
-        result.write_pixel(x + z, y, value, value, value, mask_value);
-      }
-    }
+    decode_1bit_row_rgba_masked(dest + y * w * 4, image_data + y * w / 8,
+        mask_data + y * w / 8, w);
   }
 
   return result;
@@ -163,16 +150,10 @@ Image decode_4bit_image(const void* vdata, size_t size, size_t w, size_t h) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
   Image result(w, h);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(result.get_data());
   for (size_t y = 0; y < h; y++) {
-    for (size_t x = 0; x < w; x += 2) {
-      uint8_t indexes = data[y * w / 2 + x / 2];
-      uint32_t left_pixel = icon_color_table_16[(indexes >> 4) & 0x0F];
-      uint32_t right_pixel = icon_color_table_16[indexes & 0x0F];
-      result.write_pixel(x, y, (left_pixel >> 16) & 0xFF,
-          (left_pixel >> 8) & 0xFF, left_pixel & 0xFF);
-      result.write_pixel(x + 1, y, (right_pixel >> 16) & 0xFF,
-          (right_pixel >> 8) & 0xFF, right_pixel & 0xFF);
-    }
+    decode_4bit_row_rgb(dest + y * w * 3, data + y * w / 2, w,
+        icon_color_table_16);
   }
 
   return result;
@@ -235,12 +216,10 @@ Image decode_8bit_image(const void* vdata, size_t size, size_t w, size_t h) {
   const uint8_t* data = reinterpret_cast<const uint8_t*>(vdata);
 
   Image result(w, h);
+  uint8_t* dest = reinterpret_cast<uint8_t*>(result.get_data());
   for (size_t y = 0; y < h; y++) {
-    for (size_t x = 0; x < w; x++) {
-      uint32_t pixel = icon_color_table_256[data[y * w + x]];
-      result.write_pixel(x, y, (pixel >> 16) & 0xFF, (pixel >> 8) & 0xFF,
-          pixel & 0xFF);
-    }
+    decode_8bit_row_rgb(dest + y * w * 3, data + y * w, w,
+        icon_color_table_256);
   }
 
   return result;
@@ -336,6 +315,173 @@ const color_table_entry* color_table::get_entry(int16_t id) const {
   return NULL;
 }
 
+// returns pixel x from a row of pixels of the given size (in bits)
+template <uint16_t PixelSize>
+static inline uint32_t get_row_pixel(const uint8_t* row, size_t x);
+
+template <>
+inline uint32_t get_row_pixel<1>(const uint8_t* row, size_t x) {
+  return (row[x / 8] >> (7 - (x & 7))) & 1;
+}
+
+template <>
+inline uint32_t get_row_pixel<2>(const uint8_t* row, size_t x) {
+  return (row[x / 4] >> (6 - ((x & 3) * 2))) & 3;
+}
+
+template <>
+inline uint32_t get_row_pixel<4>(const uint8_t* row, size_t x) {
+  return (row[x / 2] >> (4 - ((x & 1) * 4))) & 15;
+}
+
+template <>
+inline uint32_t get_row_pixel<8>(const uint8_t* row, size_t x) {
+  return row[x];
+}
+
+template <>
+inline uint32_t get_row_pixel<16>(const uint8_t* row, size_t x) {
+  return (row[x * 2] << 8) | row[x * 2 + 1];
+}
+
+template <>
+inline uint32_t get_row_pixel<32>(const uint8_t* row, size_t x) {
+  return (row[x * 4] << 24) | (row[x * 4 + 1] << 16) | (row[x * 4 + 2] << 8) |
+      row[x * 4 + 3];
+}
+
+// the colors for every possible pixel value in an indexed pixel map, looked up
+// in the color table once per image instead of once per pixel
+struct indexed_palette {
+  uint32_t colors[0x100]; // 0xRRGGBB
+  uint8_t alpha_override[0x100]; // 0xFF if the mask doesn't apply
+  bool present[0x100];
+  bool complete; // true if all values for the pixel size are present
+
+  indexed_palette(const color_table& ctable, uint16_t pixel_size) :
+      complete(true) {
+    uint32_t num_colors = 1 << pixel_size;
+    for (uint32_t color_id = 0; color_id < 0x100; color_id++) {
+      this->colors[color_id] = 0;
+      this->alpha_override[color_id] = 0x00;
+      this->present[color_id] = false;
+      if (color_id >= num_colors) {
+        continue;
+      }
+
+      const auto* e = ctable.get_entry(color_id);
+      if (e) {
+        this->colors[color_id] = ((e->r & 0xFF00) << 8) | (e->g & 0xFF00) | (e->b >> 8);
+        this->present[color_id] = true;
+
+      // some rare pixmaps appear to use 0xFF as black, so we handle that
+      // manually here. TODO: figure out if this is the right behavior
+      } else if (color_id == num_colors - 1) {
+        this->alpha_override[color_id] = 0xFF;
+        this->present[color_id] = true;
+
+      } else {
+        this->complete = false;
+      }
+    }
+  }
+};
+
+// each of these decodes one row of a pixel map into an RGB row, or an RGBA row
+// if there's a mask. they're chosen once per image, so the pixel size and
+// format don't have to be checked for each pixel.
+typedef void (*pixel_map_row_decoder)(uint8_t* dest, const uint8_t* row,
+    const uint8_t* mask_row, size_t w, const indexed_palette* palette);
+
+template <uint16_t PixelSize, bool HasMask>
+static void decode_indexed_row(uint8_t* dest, const uint8_t* row,
+    const uint8_t* mask_row, size_t w, const indexed_palette* palette) {
+  for (size_t x = 0; x < w; x++) {
+    uint32_t color_id = get_row_pixel<PixelSize>(row, x);
+    if (!palette->complete && !palette->present[color_id]) {
+      throw runtime_error(string_printf("color %" PRIX32 " not found in color map", color_id));
+    }
+    uint32_t color = palette->colors[color_id];
+    if (HasMask) {
+      dest[x * 4 + 0] = color >> 16;
+      dest[x * 4 + 1] = color >> 8;
+      dest[x * 4 + 2] = color;
+      dest[x * 4 + 3] = palette->alpha_override[color_id] |
+          (get_row_pixel<1>(mask_row, x) ? 0xFF : 0x00);
+    } else {
+      dest[x * 3 + 0] = color >> 16;
+      dest[x * 3 + 1] = color >> 8;
+      dest[x * 3 + 2] = color;
+    }
+  }
+}
+
+// unmasked 4-bit and 8-bit images with no missing colors (almost all of them)
+// can use the vectorized palette lookups
+static void decode_indexed_row_4bit_complete(uint8_t* dest, const uint8_t* row,
+    const uint8_t*, size_t w, const indexed_palette* palette) {
+  decode_4bit_row_rgb(dest, row, w, palette->colors);
+}
+
+static void decode_indexed_row_8bit_complete(uint8_t* dest, const uint8_t* row,
+    const uint8_t*, size_t w, const indexed_palette* palette) {
+  decode_8bit_row_rgb(dest, row, w, palette->colors);
+}
+
+template <uint16_t PixelSize, bool HasMask>
+static void decode_direct_row(uint8_t* dest, const uint8_t* row,
+    const uint8_t*, size_t w, const indexed_palette*) {
+  size_t pixel_bytes = HasMask ? 4 : 3;
+  for (size_t x = 0; x < w; x++) {
+    uint32_t color_id = get_row_pixel<PixelSize>(row, x);
+    uint8_t* pixel = dest + x * pixel_bytes;
+    if (PixelSize == 16) {
+      // xrgb1555. we cheat by filling the lower 3 bits of each channel with
+      // the upper 3 bits; this makes white (1F) actually white and black
+      // actually black when expanded to 8-bit channels
+      pixel[0] = ((color_id >> 7) & 0xF8) | ((color_id >> 12) & 0x07);
+      pixel[1] = ((color_id >> 2) & 0xF8) | ((color_id >> 7) & 0x07);
+      pixel[2] = ((color_id << 3) & 0xF8) | ((color_id >> 2) & 0x07);
+    } else {
+      // xrgb8888
+      pixel[0] = color_id >> 16;
+      pixel[1] = color_id >> 8;
+      pixel[2] = color_id;
+    }
+    if (HasMask) {
+      pixel[3] = 0xFF;
+    }
+  }
+}
+
+template <bool HasMask>
+static pixel_map_row_decoder get_pixel_map_row_decoder(
+    const pixel_map_header& header, const indexed_palette* palette) {
+  if (header.pixel_type == 0) {
+    switch (header.pixel_size) {
+      case 1:
+        return decode_indexed_row<1, HasMask>;
+      case 2:
+        return decode_indexed_row<2, HasMask>;
+      case 4:
+        if (!HasMask && palette->complete) {
+          return decode_indexed_row_4bit_complete;
+        }
+        return decode_indexed_row<4, HasMask>;
+      case 8:
+        if (!HasMask && palette->complete) {
+          return decode_indexed_row_8bit_complete;
+        }
+        return decode_indexed_row<8, HasMask>;
+    }
+  } else if (header.pixel_size == 0x0010 && header.component_size == 5) {
+    return decode_direct_row<16, HasMask>;
+  } else if (header.pixel_size == 0x0020 && header.component_size == 8) {
+    return decode_direct_row<32, HasMask>;
+  }
+  return NULL;
+}
+
 Image decode_color_image(const pixel_map_header& header,
     const pixel_map_data& pixel_map, const color_table& ctable,
     const pixel_map_data* mask_map, size_t mask_row_bytes) {
@@ -360,6 +506,29 @@ Image decode_color_image(const pixel_map_header& header,
   size_t width = header.bounds.width();
   size_t height = header.bounds.height();
   Image img(width, height, (mask_map != NULL));
+
+  // decode a row at a time if the format is one of the common ones
+  unique_ptr<indexed_palette> palette;
+  if ((header.pixel_type == 0) && (header.pixel_size <= 8)) {
+    palette.reset(new indexed_palette(ctable, header.pixel_size));
+  }
+  pixel_map_row_decoder decode_row = mask_map ?
+      get_pixel_map_row_decoder<true>(header, palette.get()) :
+      get_pixel_map_row_decoder<false>(header, palette.get());
+  if (decode_row) {
+    size_t row_bytes = header.flags_row_bytes & 0x3FFF;
+    size_t dest_row_bytes = width * (mask_map ? 4 : 3);
+    uint8_t* dest = reinterpret_cast<uint8_t*>(img.get_data());
+    for (size_t y = 0; y < height; y++) {
+      decode_row(dest + y * dest_row_bytes, pixel_map.data + y * row_bytes,
+          mask_map ? (mask_map->data + y * mask_row_bytes) : NULL, width,
+          palette.get());
+    }
+    return img;
+  }
+
+  // anything else (e.g. indexed pixel maps with more than 8 bits per pixel)
+  // goes through lookup_entry and get_entry for each pixel
   for (size_t y = 0; y < height; y++) {
     for (size_t x = 0; x < width; x++) {
       uint32_t color_id = pixel_map.lookup_entry(header.pixel_size,
@@ -411,6 +580,22 @@ Image apply_alpha_from_mask(const Image& img, const Image& mask) {
   }
 
   Image ret(img.get_width(), img.get_height(), true);
+
+  // the icon decoders produce RGB images and RGBA masks, so this is the usual
+  // case; it can be done a row at a time without going through read_pixel
+  if (!img.get_has_alpha() && mask.get_has_alpha() &&
+      (img.get_channel_width() == 8) && (mask.get_channel_width() == 8)) {
+    size_t w = img.get_width();
+    const uint8_t* src = reinterpret_cast<const uint8_t*>(img.get_data());
+    const uint8_t* mask_src = reinterpret_cast<const uint8_t*>(mask.get_data());
+    uint8_t* dest = reinterpret_cast<uint8_t*>(ret.get_data());
+    for (size_t y = 0; y < img.get_height(); y++) {
+      merge_rgb_row_with_alpha(dest + y * w * 4, src + y * w * 3,
+          mask_src + y * w * 4, w);
+    }
+    return ret;
+  }
+
   for (size_t y = 0; y < img.get_height(); y++) {
     for (size_t x = 0; x < img.get_width(); x++) {
       uint64_t r, g, b, a;
@@ -274,6 +274,7 @@ unordered_map<int16_t, Image> get_picts(const string& rsf_name) {
   unordered_map<int16_t, Image> ret;
 
   ResourceFile rf(rsf_name.c_str());
+  rf.set_cache_PICT_display_lists(true);
   for (const auto& it : rf.all_resources()) {
     if (it.first != RESOURCE_TYPE_PICT) {
       continue;
@@ -2311,6 +2312,7 @@ void populate_custom_tileset_configuration(const string& land_type,
 
 void populate_image_caches(const string& the_family_jewels_name) {
   ResourceFile rf(the_family_jewels_name.c_str());
+  rf.set_cache_PICT_display_lists(true);
   vector<pair<uint32_t, int16_t>> all_resources = rf.all_resources();
 
   for (const auto& it : all_resources) {
@@ -2374,6 +2376,7 @@ static const Image& positive_pattern_for_land_type(const string& land_type,
     }
 
     ResourceFile rf(rsf_file.c_str());
+    rf.set_cache_PICT_display_lists(true);
     int16_t resource_id = land_type_to_resource_id.at(land_type);
     pict_render_result res = rf.decode_PICT(resource_id);
     if (!res.embedded_image_data.empty()) {
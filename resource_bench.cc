@@ -0,0 +1,482 @@
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <phosg/Encoding.hh>
+#include <phosg/Filesystem.hh>
+#include <phosg/JSON.hh>
+#include <phosg/Strings.hh>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "audio_codecs.hh"
+#include "pict.hh"
+#include "resource_fork.hh"
+
+using namespace std;
+
+
+
+// the decoders are called the same way resource_dasm calls them, but their
+// results are discarded
+typedef void (*decode_fn)(ResourceFile& rf, uint32_t type, int16_t id);
+
+#define DECODER(TYPE) {RESOURCE_TYPE_##TYPE, \
+    [](ResourceFile& rf, uint32_t type, int16_t id) { rf.decode_##TYPE(id, type); }}
+
+static const unordered_map<uint32_t, decode_fn> type_to_decode_fn({
+  DECODER(ADBS),
+  DECODER(CDEF),
+  DECODER(cicn),
+  DECODER(clok),
+  DECODER(clut),
+  DECODER(cmid),
+  DECODER(CODE),
+  DECODER(crsr),
+  DECODER(csnd),
+  DECODER(CURS),
+  DECODER(dcmp),
+  DECODER(ecmi),
+  DECODER(emid),
+  DECODER(esnd),
+  DECODER(ESnd),
+  DECODER(icl4),
+  DECODER(icl8),
+  DECODER(icm4),
+  DECODER(icm8),
+  DECODER(icmN),
+  DECODER(ICNN),
+  DECODER(ICON),
+  DECODER(ics4),
+  DECODER(ics8),
+  DECODER(icsN),
+  DECODER(INIT),
+  DECODER(INST),
+  DECODER(kcs4),
+  DECODER(kcs8),
+  DECODER(kcsN),
+  DECODER(LDEF),
+  DECODER(MDBF),
+  DECODER(MDEF),
+  DECODER(PACK),
+  DECODER(PAT),
+  DECODER(PATN),
+  DECODER(PICT),
+  DECODER(pltt),
+  DECODER(ppat),
+  DECODER(pptN),
+  DECODER(proc),
+  DECODER(PTCH),
+  DECODER(ptch),
+  DECODER(ROvr),
+  DECODER(SERD),
+  DECODER(SICN),
+  DECODER(SMOD),
+  DECODER(SMSD),
+  DECODER(snd),
+  DECODER(snth),
+  DECODER(SONG),
+  DECODER(STR),
+  DECODER(STRN),
+  DECODER(styl),
+  DECODER(TEXT),
+  DECODER(Tune),
+  DECODER(WDEF),
+});
+
+#undef DECODER
+
+
+
+struct bench_options {
+  size_t warmup_count;
+  size_t repeat_count;
+};
+
+// the results for one operation on one resource type. latencies has one entry
+// (in nanoseconds) for each timed call
+struct bench_result {
+  size_t resource_count;
+  size_t failure_count;
+  size_t bytes; // per repetition
+  vector<uint64_t> latencies;
+
+  bench_result() : resource_count(0), failure_count(0), bytes(0) { }
+};
+
+static uint64_t now_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// runs fn warmup_count times untimed, then repeat_count times timed, and adds
+// the timings to result. if fn throws, the resource is counted as a failure and
+// none of its timings are used.
+static void bench_one(bench_result& result, const bench_options& options,
+    size_t bytes, const function<void()>& fn) {
+  size_t prev_latencies_size = result.latencies.size();
+  try {
+    for (size_t x = 0; x < options.warmup_count; x++) {
+      fn();
+    }
+    for (size_t x = 0; x < options.repeat_count; x++) {
+      uint64_t start = now_ns();
+      fn();
+      result.latencies.emplace_back(now_ns() - start);
+    }
+  } catch (const exception&) {
+    result.latencies.resize(prev_latencies_size);
+    result.failure_count++;
+    return;
+  }
+  result.resource_count++;
+  result.bytes += bytes;
+}
+
+// results are indexed by (type, operation); codec results use type 0
+typedef map<pair<uint32_t, string>, bench_result> bench_results;
+
+static void bench_file(bench_results& results, const bench_options& options,
+    const string& filename, bool use_data_fork,
+    const unordered_set<uint32_t>& target_types) {
+  string resource_fork_filename;
+  if (use_data_fork) {
+    resource_fork_filename = filename;
+  } else if (isfile(filename + "/..namedfork/rsrc")) {
+    resource_fork_filename = filename + "/..namedfork/rsrc";
+  } else if (isfile(filename + "/rsrc")) {
+    resource_fork_filename = filename + "/rsrc";
+  } else {
+    fprintf(stderr, "skipping %s: no resource fork present\n", filename.c_str());
+    return;
+  }
+
+  ResourceFile rf(resource_fork_filename.c_str(), true);
+  // nothing should come from the cache, or every repetition after the first
+  // would only measure a lookup
+  rf.set_resource_data_cache_size(0);
+
+  for (const auto& it : rf.all_resources()) {
+    uint32_t type = it.first;
+    int16_t id = it.second;
+    if (!target_types.empty() && !target_types.count(type)) {
+      continue;
+    }
+
+    string raw_data;
+    string data;
+    try {
+      raw_data = rf.get_resource_data(type, id, false);
+      data = rf.get_resource_data(type, id, true);
+    } catch (const exception&) {
+      results[make_pair(type, "read")].failure_count++;
+      continue;
+    }
+
+    bench_one(results[make_pair(type, "read")], options, raw_data.size(), [&]() {
+      rf.get_resource_data(type, id, false);
+    });
+    if (rf.resource_is_compressed(type, id)) {
+      bench_one(results[make_pair(type, "decompress")], options, data.size(), [&]() {
+        rf.get_resource_data(type, id, true);
+      });
+    }
+
+    auto decode_fn_it = type_to_decode_fn.find(type);
+    if (decode_fn_it != type_to_decode_fn.end()) {
+      auto fn = decode_fn_it->second;
+      bench_one(results[make_pair(type, "decode")], options, data.size(), [&]() {
+        fn(rf, type, id);
+      });
+    }
+
+    // decode_PICT parses and renders; these time each step separately
+    if (type == RESOURCE_TYPE_PICT) {
+      shared_ptr<const pict_display_list> dl;
+      bench_one(results[make_pair(type, "parse")], options, data.size(), [&]() {
+        dl = rf.get_PICT_display_list(id, type);
+      });
+      if (dl.get()) {
+        bench_one(results[make_pair(type, "render")], options, data.size(), [&]() {
+          render_quickdraw_picture(*dl);
+        });
+      }
+    }
+  }
+}
+
+// the codecs are timed on generated data, so their results don't depend on
+// which sounds are in the corpus
+static void bench_codecs(bench_results& results, const bench_options& options) {
+  // divisible by the MACE and IMA4 block sizes
+  static const size_t data_size = 34 * 6 * 5000;
+  string data(data_size, '\0');
+  uint32_t state = 0x12345678;
+  for (size_t x = 0; x < data_size; x++) {
+    state = state * 1103515245 + 12345;
+    data[x] = state >> 24;
+  }
+  const uint8_t* src = reinterpret_cast<const uint8_t*>(data.data());
+
+  vector<int16_t> samples(max(max(mace_decoded_sample_count(data_size, true),
+      mace_decoded_sample_count(data_size, false)),
+      max(ima4_decoded_sample_count(data_size), data_size)));
+
+  bench_one(results[make_pair(0, "mace3")], options, data_size, [&]() {
+    decode_mace(samples.data(), src, data_size, false, true);
+  });
+  bench_one(results[make_pair(0, "mace6")], options, data_size, [&]() {
+    decode_mace(samples.data(), src, data_size, false, false);
+  });
+  bench_one(results[make_pair(0, "ima4")], options, data_size, [&]() {
+    decode_ima4(samples.data(), src, data_size, false);
+  });
+  bench_one(results[make_pair(0, "alaw")], options, data_size, [&]() {
+    decode_alaw(samples.data(), src, data_size);
+  });
+  bench_one(results[make_pair(0, "ulaw")], options, data_size, [&]() {
+    decode_ulaw(samples.data(), src, data_size);
+  });
+}
+
+
+
+struct result_summary {
+  string type;
+  string operation;
+  size_t resource_count;
+  size_t failure_count;
+  size_t bytes;
+  size_t call_count;
+  double total_seconds;
+  double mb_per_second;
+  double resources_per_second;
+  double p50_usecs;
+  double p99_usecs;
+};
+
+static vector<result_summary> summarize_results(bench_results& results,
+    const bench_options& options) {
+  vector<result_summary> ret;
+  for (auto& it : results) {
+    auto& result = it.second;
+    result_summary s;
+    s.type = it.first.first ? string_for_resource_type(it.first.first) : "codec";
+    s.operation = it.first.second;
+    s.resource_count = result.resource_count;
+    s.failure_count = result.failure_count;
+    s.bytes = result.bytes;
+    s.call_count = result.latencies.size();
+
+    uint64_t total_ns = 0;
+    for (uint64_t latency : result.latencies) {
+      total_ns += latency;
+    }
+    s.total_seconds = static_cast<double>(total_ns) / 1000000000.0;
+    if (total_ns) {
+      s.mb_per_second = (static_cast<double>(s.bytes * options.repeat_count) /
+          (1024.0 * 1024.0)) / s.total_seconds;
+      s.resources_per_second = static_cast<double>(s.call_count) / s.total_seconds;
+    } else {
+      s.mb_per_second = 0.0;
+      s.resources_per_second = 0.0;
+    }
+
+    // nearest-rank percentiles
+    auto& latencies = result.latencies;
+    sort(latencies.begin(), latencies.end());
+    auto percentile = [&](size_t p) -> double {
+      if (latencies.empty()) {
+        return 0.0;
+      }
+      size_t index = (latencies.size() * p + 99) / 100;
+      return static_cast<double>(latencies[index ? (index - 1) : 0]) / 1000.0;
+    };
+    s.p50_usecs = percentile(50);
+    s.p99_usecs = percentile(99);
+
+    ret.emplace_back(move(s));
+  }
+  return ret;
+}
+
+static string csv_quote(const string& s) {
+  string ret = "\"";
+  for (char ch : s) {
+    if (ch == '\"') {
+      ret += '\"';
+    }
+    ret += ch;
+  }
+  ret += '\"';
+  return ret;
+}
+
+static string format_csv(const vector<result_summary>& summaries) {
+  string ret = "type,operation,resources,failures,bytes,calls,total_secs,mb_per_sec,resources_per_sec,p50_usecs,p99_usecs\n";
+  for (const auto& s : summaries) {
+    ret += string_printf("%s,%s,%zu,%zu,%zu,%zu,%.6f,%.3f,%.3f,%.3f,%.3f\n",
+        csv_quote(s.type).c_str(), s.operation.c_str(), s.resource_count,
+        s.failure_count, s.bytes, s.call_count, s.total_seconds,
+        s.mb_per_second, s.resources_per_second, s.p50_usecs, s.p99_usecs);
+  }
+  return ret;
+}
+
+static string format_json(const vector<result_summary>& summaries,
+    const bench_options& options) {
+  vector<shared_ptr<JSONObject>> results_list;
+  for (const auto& s : summaries) {
+    unordered_map<string, shared_ptr<JSONObject>> result_dict;
+    result_dict.emplace("type", new JSONObject(s.type));
+    result_dict.emplace("operation", new JSONObject(s.operation));
+    result_dict.emplace("resources", new JSONObject(static_cast<int64_t>(s.resource_count)));
+    result_dict.emplace("failures", new JSONObject(static_cast<int64_t>(s.failure_count)));
+    result_dict.emplace("bytes", new JSONObject(static_cast<int64_t>(s.bytes)));
+    result_dict.emplace("calls", new JSONObject(static_cast<int64_t>(s.call_count)));
+    result_dict.emplace("total_secs", new JSONObject(s.total_seconds));
+    result_dict.emplace("mb_per_sec", new JSONObject(s.mb_per_second));
+    result_dict.emplace("resources_per_sec", new JSONObject(s.resources_per_second));
+    result_dict.emplace("p50_usecs", new JSONObject(s.p50_usecs));
+    result_dict.emplace("p99_usecs", new JSONObject(s.p99_usecs));
+    results_list.emplace_back(new JSONObject(result_dict));
+  }
+
+  unordered_map<string, shared_ptr<JSONObject>> base_dict;
+  base_dict.emplace("warmup", new JSONObject(static_cast<int64_t>(options.warmup_count)));
+  base_dict.emplace("repeat", new JSONObject(static_cast<int64_t>(options.repeat_count)));
+  base_dict.emplace("results", new JSONObject(results_list));
+
+  shared_ptr<JSONObject> json(new JSONObject(base_dict));
+  return json->format();
+}
+
+
+
+void print_usage(const char* argv0) {
+  fprintf(stderr, "\
+Usage: %s [options] filename [filename ...]\n\
+\n\
+Times reading, decompressing and decoding every resource in the given files,\n\
+and reports the results for each resource type. PICTs are also timed parsing\n\
+and rendering separately, and the audio codecs are timed on generated data.\n\
+\n\
+Each result has the number of resources timed and the number that failed, the\n\
+total size of the resources (compressed for read, decompressed otherwise), the\n\
+number of timed calls and their total time, the throughput in MB/s and\n\
+resources/s, and the median and 99th percentile latency of a single call.\n\
+\n\
+Options:\n\
+  --warmup=N\n\
+      Call each decoder N times on each resource before timing it (default 1).\n\
+  --repeat=N\n\
+      Time each decoder N times on each resource (default 5).\n\
+  --format=csv\n\
+      Write the results as CSV, with a header row (default).\n\
+  --format=json\n\
+      Write the results as JSON.\n\
+  --output=FILE\n\
+      Write the results to FILE instead of to stdout.\n\
+  --target-type=TYPE\n\
+      Only time resources of this type (can be given multiple times).\n\
+  --data-fork\n\
+      Read the resources from the files\' data forks instead of their resource\n\
+      forks.\n\
+  --skip-codecs\n\
+      Don\'t time the audio codecs.\n\
+\n", argv0);
+}
+
+int main(int argc, char* argv[]) {
+  vector<string> filenames;
+  bench_options options = {1, 5};
+  bool use_json = false;
+  string output_filename;
+  unordered_set<uint32_t> target_types;
+  bool use_data_fork = false;
+  bool skip_codecs = false;
+  // only time the native PICT renderer, not picttoppm
+  use_picttoppm_fallback = false;
+  for (int x = 1; x < argc; x++) {
+    if (argv[x][0] == '-') {
+      if (!strncmp(argv[x], "--warmup=", 9)) {
+        options.warmup_count = strtoull(&argv[x][9], NULL, 0);
+      } else if (!strncmp(argv[x], "--repeat=", 9)) {
+        options.repeat_count = strtoull(&argv[x][9], NULL, 0);
+        if (options.repeat_count == 0) {
+          fprintf(stderr, "--repeat must be at least 1\n");
+          return 1;
+        }
+      } else if (!strcmp(argv[x], "--format=csv")) {
+        use_json = false;
+      } else if (!strcmp(argv[x], "--format=json")) {
+        use_json = true;
+      } else if (!strncmp(argv[x], "--output=", 9)) {
+        output_filename = &argv[x][9];
+      } else if (!strncmp(argv[x], "--target-type=", 14)) {
+        if (strlen(argv[x]) != 18) {
+          fprintf(stderr, "incorrect format for --target-type: %s (type must be 4 bytes)\n", argv[x]);
+          return 1;
+        }
+        target_types.emplace(bswap32(*(uint32_t*)&argv[x][14]));
+      } else if (!strcmp(argv[x], "--data-fork")) {
+        use_data_fork = true;
+      } else if (!strcmp(argv[x], "--skip-codecs")) {
+        skip_codecs = true;
+      } else {
+        fprintf(stderr, "unknown option: %s\n", argv[x]);
+        print_usage(argv[0]);
+        return 1;
+      }
+    } else {
+      filenames.emplace_back(argv[x]);
+    }
+  }
+
+  if (filenames.empty() && skip_codecs) {
+    print_usage(argv[0]);
+    return 1;
+  }
+
+  // the decoders' warnings would be repeated for every call
+  FILE* null_stream = fopen("/dev/null", "w");
+  if (null_stream) {
+    resource_log_stream = null_stream;
+  }
+
+  bench_results results;
+  for (const auto& filename : filenames) {
+    fprintf(stderr, "... %s\n", filename.c_str());
+    try {
+      bench_file(results, options, filename, use_data_fork, target_types);
+    } catch (const exception& e) {
+      fprintf(stderr, "failed on %s: %s\n", filename.c_str(), e.what());
+    }
+  }
+  if (!skip_codecs) {
+    fprintf(stderr, "... audio codecs\n");
+    bench_codecs(results, options);
+  }
+
+  auto summaries = summarize_results(results, options);
+  string output = use_json ? format_json(summaries, options) : format_csv(summaries);
+  if (output_filename.empty()) {
+    fwritex(stdout, output);
+  } else {
+    save_file(output_filename, output);
+  }
+
+  if (null_stream) {
+    resource_log_stream = stderr;
+    fclose(null_stream);
+  }
+  return 0;
+}
@@ -1,11 +1,17 @@
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
+#include <condition_variable>
 #include <functional>
+#include <map>
+#include <mutex>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -16,6 +22,8 @@
 #include <algorithm>
 
 #include "resource_fork.hh"
+#include "resource_stats.hh"
+#include "thread_pool.hh"
 
 using namespace std;
 
@@ -53,16 +61,25 @@ static Image tile_image(const Image& i, size_t tile_x, size_t tile_y) {
 void write_decoded_file(const string& out_dir, const string& base_filename,
     uint32_t type, int16_t id, const string& after, const string& data) {
   string filename = output_prefix(out_dir, base_filename, type, id) + after;
-  save_file(filename.c_str(), data);
-  fprintf(stderr, "... %s\n", filename.c_str());
+  {
+    ResourcePhaseTimer timer(type, ResourcePhase::Write);
+    save_file(filename.c_str(), data);
+    timer.add_bytes(data.size());
+  }
+  fprintf(resource_log_stream, "... %s\n", filename.c_str());
 }
 
 void write_decoded_image(const string& out_dir, const string& base_filename,
     uint32_t type, int16_t id, const string& after, const Image& img) {
 
   string filename = output_prefix(out_dir, base_filename, type, id) + after;
-  img.save(filename.c_str(), Image::WindowsBitmap);
-  fprintf(stderr, "... %s\n", filename.c_str());
+  {
+    ResourcePhaseTimer timer(type, ResourcePhase::Write);
+    auto f = fopen_unique(filename, "wb");
+    img.save(f.get(), Image::WindowsBitmap);
+    timer.add_bytes(ftell(f.get()));
+  }
+  fprintf(resource_log_stream, "... %s\n", filename.c_str());
 }
 
 void write_decoded_CURS(const string& out_dir, const string& base_filename,
@@ -287,8 +304,146 @@ void write_decoded_ICON(const string& out_dir, const string& base_filename,
   write_decoded_image(out_dir, base_filename, type, id, ".bmp", decoded);
 }
 
+// if nonzero, PICTs are rendered this many rows at a time, and each band is
+// written to the output file as soon as it's done
+static size_t pict_band_height = 0;
+
+struct bmp_header {
+  char magic[2];
+  uint32_t file_size;
+  uint32_t reserved;
+  uint32_t data_offset;
+  uint32_t header_size; // 40 for 24-bit images, 108 (with the fields below) for 32-bit
+  int32_t width;
+  int32_t height; // negative means rows are stored top to bottom
+  uint16_t planes;
+  uint16_t bit_depth;
+  uint32_t compression;
+  uint32_t image_size;
+  int32_t x_pixels_per_meter;
+  int32_t y_pixels_per_meter;
+  uint32_t num_colors;
+  uint32_t num_important_colors;
+
+  // these are only present in 32-bit images, which use them to specify where
+  // the alpha channel is
+  uint32_t red_mask;
+  uint32_t green_mask;
+  uint32_t blue_mask;
+  uint32_t alpha_mask;
+  uint32_t color_space_type;
+  int32_t color_space_endpoints[9];
+  uint32_t gamma_red;
+  uint32_t gamma_green;
+  uint32_t gamma_blue;
+} __attribute__((packed));
+
+// writes a BMP a band at a time. the header is rewritten at the end, once the
+// image's height is known. like Image::save, this writes a 32-bit image with an
+// alpha channel if the rendered picture has one, so the output is the same
+// as when the picture is rendered all at once.
+static void write_banded_PICT(const string& out_dir,
+    const string& base_filename, ResourceFile& res, uint32_t type, int16_t id) {
+  auto data = res.get_resource_data_view(type, id);
+  string filename = output_prefix(out_dir, base_filename, type, id) + ".bmp";
+
+  unique_ptr<FILE, void(*)(FILE*)> f(NULL, [](FILE*) { });
+  bmp_header header;
+  memset(&header, 0, sizeof(header));
+  size_t header_bytes = 0;
+  size_t out_pixel_bytes = 0;
+  size_t row_padding_bytes = 0;
+  string row_data;
+  pict_render_result result;
+  try {
+    result = render_quickdraw_picture_banded(data.data, data.size,
+        pict_band_height, [&](const Image& band, size_t y) {
+      ResourcePhaseTimer timer(type, ResourcePhase::Write);
+      size_t pixel_bytes = band.get_has_alpha() ? 4 : 3;
+      if (!f.get()) {
+        f = fopen_unique(filename, "wb");
+        header.width = band.get_width();
+        out_pixel_bytes = pixel_bytes;
+        header.header_size = (out_pixel_bytes == 4) ? 108 : 40;
+        header_bytes = offsetof(bmp_header, header_size) + header.header_size;
+        row_padding_bytes = (4 - ((band.get_width() * out_pixel_bytes) % 4)) % 4;
+        fwritex(f.get(), &header, header_bytes);
+      } else if (pixel_bytes != out_pixel_bytes) {
+        throw runtime_error("picture bands have different formats");
+      }
+
+      row_data.resize(band.get_width() * out_pixel_bytes + row_padding_bytes, 0);
+      const uint8_t* band_data = reinterpret_cast<const uint8_t*>(band.get_data());
+      for (size_t yy = 0; yy < band.get_height(); yy++) {
+        const uint8_t* src = band_data + yy * band.get_width() * pixel_bytes;
+        for (size_t x = 0; x < band.get_width(); x++) {
+          row_data[x * out_pixel_bytes + 0] = src[x * pixel_bytes + 2];
+          row_data[x * out_pixel_bytes + 1] = src[x * pixel_bytes + 1];
+          row_data[x * out_pixel_bytes + 2] = src[x * pixel_bytes + 0];
+          if (out_pixel_bytes == 4) {
+            row_data[x * 4 + 3] = src[x * 4 + 3];
+          }
+        }
+        fwritex(f.get(), row_data);
+      }
+      timer.add_bytes(row_data.size() * band.get_height());
+      header.height -= band.get_height();
+    });
+  } catch (...) {
+    // don't leave a partial image behind
+    if (f.get()) {
+      f.reset();
+      unlink(filename.c_str());
+    }
+    throw;
+  }
+
+  if (!result.embedded_image_data.empty()) {
+    write_decoded_file(out_dir, base_filename, type, id,
+        "." + result.embedded_image_format, result.embedded_image_data);
+    return;
+  }
+  if (!f.get()) {
+    throw runtime_error("picture has no rows");
+  }
+
+  header.magic[0] = 'B';
+  header.magic[1] = 'M';
+  header.image_size = (header.width * out_pixel_bytes + row_padding_bytes) * -header.height;
+  header.file_size = header_bytes + header.image_size;
+  header.data_offset = header_bytes;
+  header.planes = 1;
+  header.bit_depth = out_pixel_bytes * 8;
+  header.x_pixels_per_meter = 0x0B13;
+  header.y_pixels_per_meter = 0x0B13;
+  if (out_pixel_bytes == 4) {
+    header.compression = 3; // BI_BITFIELDS
+    header.red_mask = 0x00FF0000;
+    header.green_mask = 0x0000FF00;
+    header.blue_mask = 0x000000FF;
+    header.alpha_mask = 0xFF000000;
+    header.color_space_type = 0x73524742; // 'sRGB'
+  }
+  {
+    ResourcePhaseTimer timer(type, ResourcePhase::Write);
+    fseek(f.get(), 0, SEEK_SET);
+    fwritex(f.get(), &header, header_bytes);
+    timer.add_bytes(header_bytes);
+  }
+  fprintf(resource_log_stream, "... %s\n", filename.c_str());
+}
+
 void write_decoded_PICT(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
+  if (pict_band_height) {
+    try {
+      write_banded_PICT(out_dir, base_filename, res, type, id);
+      return;
+    } catch (const exception& e) {
+      fprintf(resource_log_stream, "warning: banded PICT rendering failed (%s); rendering the entire picture instead\n", e.what());
+    }
+  }
+
   auto decoded = res.decode_PICT(id, type);
   if (!decoded.embedded_image_data.empty()) {
     write_decoded_file(out_dir, base_filename, type, id, "." + decoded.embedded_image_format, decoded.embedded_image_data);
@@ -297,34 +452,66 @@ void write_decoded_PICT(const string& out_dir, const string& base_filename,
   }
 }
 
+// streams a WAV file from one of the sound decoders to the output file. the
+// file isn't created until the decoder produces the header, and is deleted if
+// decoding fails partway through.
+static void write_decoded_sound(const string& out_dir,
+    const string& base_filename, uint32_t type, int16_t id,
+    function<void(const wav_sink_fn&)> decode) {
+  string filename = output_prefix(out_dir, base_filename, type, id) + ".wav";
+
+  unique_ptr<FILE, void(*)(FILE*)> f(NULL, [](FILE*) { });
+  try {
+    decode([&](const void* data, size_t size) {
+      ResourcePhaseTimer timer(type, ResourcePhase::Write);
+      if (!f.get()) {
+        f = fopen_unique(filename, "wb");
+      }
+      fwritex(f.get(), data, size);
+      timer.add_bytes(size);
+    });
+  } catch (...) {
+    if (f.get()) {
+      f.reset();
+      unlink(filename.c_str());
+    }
+    throw;
+  }
+
+  if (!f.get()) {
+    throw runtime_error("sound decoder produced no data");
+  }
+  fprintf(resource_log_stream, "... %s\n", filename.c_str());
+}
+
 void write_decoded_snd(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
-  string decoded = res.decode_snd(id, type);
-  write_decoded_file(out_dir, base_filename, type, id, ".wav", decoded);
+  write_decoded_sound(out_dir, base_filename, type, id,
+      [&](const wav_sink_fn& sink) { res.decode_snd(id, type, sink); });
 }
 
 void write_decoded_SMSD(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
-  string decoded = res.decode_SMSD(id, type);
-  write_decoded_file(out_dir, base_filename, type, id, ".wav", decoded);
+  write_decoded_sound(out_dir, base_filename, type, id,
+      [&](const wav_sink_fn& sink) { res.decode_SMSD(id, type, sink); });
 }
 
 void write_decoded_csnd(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
-  string decoded = res.decode_csnd(id, type);
-  write_decoded_file(out_dir, base_filename, type, id, ".wav", decoded);
+  write_decoded_sound(out_dir, base_filename, type, id,
+      [&](const wav_sink_fn& sink) { res.decode_csnd(id, type, sink); });
 }
 
 void write_decoded_esnd(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
-  string decoded = res.decode_esnd(id, type);
-  write_decoded_file(out_dir, base_filename, type, id, ".wav", decoded);
+  write_decoded_sound(out_dir, base_filename, type, id,
+      [&](const wav_sink_fn& sink) { res.decode_esnd(id, type, sink); });
 }
 
 void write_decoded_ESnd(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
-  string decoded = res.decode_ESnd(id, type);
-  write_decoded_file(out_dir, base_filename, type, id, ".wav", decoded);
+  write_decoded_sound(out_dir, base_filename, type, id,
+      [&](const wav_sink_fn& sink) { res.decode_ESnd(id, type, sink); });
 }
 
 void write_decoded_cmid(const string& out_dir, const string& base_filename,
@@ -345,10 +532,100 @@ void write_decoded_ecmi(const string& out_dir, const string& base_filename,
   write_decoded_file(out_dir, base_filename, type, id, ".midi", decoded);
 }
 
+// the control flow index for a CODE segment. blocks are [start, end, function,
+// flags], edges are [from_block, to_block, is_branch] and functions are
+// [entry_offset, entry_block]; all offsets are from the end of the segment
+// header (see ResourceFile::analyzed_CODE and mc68k_control_flow_graph)
+string generate_json_for_CODE_analysis(int16_t id,
+    const ResourceFile::analyzed_CODE& analysis) {
+  typedef mc68k_control_flow_graph CFG;
+  const auto& cfg = analysis.cfg;
+
+  vector<shared_ptr<JSONObject>> blocks;
+  for (const auto& b : cfg.blocks) {
+    int64_t function_index = (b.function_index == CFG::NO_FUNCTION) ?
+        -1 : static_cast<int64_t>(b.function_index);
+    blocks.emplace_back(new JSONObject(vector<shared_ptr<JSONObject>>({
+        make_shared<JSONObject>(static_cast<int64_t>(b.start_offset)),
+        make_shared<JSONObject>(static_cast<int64_t>(b.end_offset)),
+        make_shared<JSONObject>(function_index),
+        make_shared<JSONObject>(static_cast<int64_t>(b.flags))})));
+  }
+
+  vector<shared_ptr<JSONObject>> edges;
+  for (const auto& e : cfg.edges) {
+    edges.emplace_back(new JSONObject(vector<shared_ptr<JSONObject>>({
+        make_shared<JSONObject>(static_cast<int64_t>(e.from_block)),
+        make_shared<JSONObject>(static_cast<int64_t>(e.to_block)),
+        make_shared<JSONObject>(e.type == CFG::edge_type::BRANCH)})));
+  }
+
+  vector<shared_ptr<JSONObject>> functions;
+  for (const auto& f : cfg.functions) {
+    functions.emplace_back(new JSONObject(vector<shared_ptr<JSONObject>>({
+        make_shared<JSONObject>(static_cast<int64_t>(f.entry_offset)),
+        make_shared<JSONObject>(static_cast<int64_t>(f.entry_block))})));
+  }
+
+  vector<shared_ptr<JSONObject>> calls;
+  auto jump_table_call_it = analysis.jump_table_calls.begin();
+  for (size_t x = 0; x < cfg.calls.size(); x++) {
+    const auto& c = cfg.calls[x];
+    unordered_map<string, shared_ptr<JSONObject>> call_dict;
+    call_dict.emplace("offset", new JSONObject(static_cast<int64_t>(c.opcode_offset)));
+    call_dict.emplace("block", new JSONObject(static_cast<int64_t>(c.from_block)));
+    if (c.is_tail_call) {
+      call_dict.emplace("tail_call", new JSONObject(true));
+    }
+    switch (c.type) {
+      case CFG::call_type::LOCAL:
+        call_dict.emplace("type", new JSONObject("local"));
+        call_dict.emplace("target_offset", new JSONObject(static_cast<int64_t>(c.target)));
+        break;
+      case CFG::call_type::A5_RELATIVE:
+        call_dict.emplace("a5_offset", new JSONObject(static_cast<int64_t>(c.target)));
+        if ((jump_table_call_it != analysis.jump_table_calls.end()) &&
+            (jump_table_call_it->call_index == x)) {
+          call_dict.emplace("type", new JSONObject("jump_table"));
+          call_dict.emplace("jump_table_index", new JSONObject(static_cast<int64_t>(jump_table_call_it->jump_table_index)));
+          call_dict.emplace("target_segment", new JSONObject(static_cast<int64_t>(jump_table_call_it->target_segment)));
+          call_dict.emplace("target_offset", new JSONObject(static_cast<int64_t>(jump_table_call_it->target_offset)));
+          jump_table_call_it++;
+        } else {
+          call_dict.emplace("type", new JSONObject("a5"));
+        }
+        break;
+      case CFG::call_type::INDIRECT:
+        call_dict.emplace("type", new JSONObject("indirect"));
+        break;
+    }
+    calls.emplace_back(new JSONObject(call_dict));
+  }
+
+  unordered_map<string, shared_ptr<JSONObject>> base_dict;
+  base_dict.emplace("segment", new JSONObject(static_cast<int64_t>(id)));
+  base_dict.emplace("header_size", new JSONObject(static_cast<int64_t>(analysis.header_size)));
+  base_dict.emplace("blocks", new JSONObject(blocks));
+  base_dict.emplace("edges", new JSONObject(edges));
+  base_dict.emplace("functions", new JSONObject(functions));
+  base_dict.emplace("calls", new JSONObject(calls));
+
+  shared_ptr<JSONObject> json(new JSONObject(base_dict));
+  return json->serialize();
+}
+
 void write_decoded_CODE(const string& out_dir, const string& base_filename,
     ResourceFile& res, uint32_t type, int16_t id) {
-  string decoded = res.decode_CODE(id, type);
+  // the control flow graph comes from the same disassembly as the listing. CODE
+  // 0 is the jump table, so there's no control flow to analyze
+  ResourceFile::analyzed_CODE analysis;
+  string decoded = res.decode_CODE(id, type, (id != 0) ? &analysis : NULL);
   write_decoded_file(out_dir, base_filename, type, id, ".txt", decoded);
+
+  if (id != 0) {
+    string json_data = generate_json_for_CODE_analysis(id, analysis);
+    write_decoded_file(out_dir, base_filename, type, id, "_cfg.json", json_data);
+  }
 }
 
 void write_decoded_dcmp(const string& out_dir, const string& base_filename,
@@ -538,7 +815,7 @@ string generate_json_for_SONG(const string& base_filename, ResourceFile& res,
         }
 
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to get sound metadata for instrument %hu region %hhX-%hhX from snd/csnd/esnd %hu: %s\n",
+        fprintf(resource_log_stream, "warning: failed to get sound metadata for instrument %hu region %hhX-%hhX from snd/csnd/esnd %hu: %s\n",
             id, rgn.key_low, rgn.key_high, rgn.snd_id, e.what());
       }
 
@@ -581,7 +858,7 @@ string generate_json_for_SONG(const string& base_filename, ResourceFile& res,
       try {
         add_instrument(it.first, res.decode_INST(it.second));
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to add instrument %hu from INST %hu: %s\n",
+        fprintf(resource_log_stream, "warning: failed to add instrument %hu from INST %hu: %s\n",
             it.first, it.second, e.what());
       }
     }
@@ -593,7 +870,7 @@ string generate_json_for_SONG(const string& base_filename, ResourceFile& res,
     try {
       add_instrument(id, res.decode_INST(id));
     } catch (const exception& e) {
-      fprintf(stderr, "warning: failed to add instrument %hu: %s\n", id, e.what());
+      fprintf(resource_log_stream, "warning: failed to add instrument %hu: %s\n", id, e.what());
     }
   }
 
@@ -731,25 +1008,25 @@ bool export_resource(const string& base_filename, ResourceFile& rf,
   string out_filename = string_printf("%s/%s_%.4s_%d.%s", out_dir.c_str(),
       base_filename.c_str(), type_str, id, out_ext);
 
-  string data;
+  resource_data_view data;
   bool decompression_failed = false;
   try {
-    data = rf.get_resource_data(type, id, true, decompress_debug);
+    data = rf.get_resource_data_view(type, id, true, decompress_debug);
   } catch (const exception& e) {
     auto type_str = string_for_resource_type(type);
     if (rf.resource_is_compressed(type, id)) {
-      fprintf(stderr, "warning: failed to load resource %s:%d: %s (retrying without decompression)\n",
+      fprintf(resource_log_stream, "warning: failed to load resource %s:%d: %s (retrying without decompression)\n",
           type_str.c_str(), id, e.what());
       try {
-        data = rf.get_resource_data(type, id, false);
+        data = rf.get_resource_data_view(type, id, false);
         decompression_failed = true;
       } catch (const exception& e) {
-        fprintf(stderr, "warning: failed to load resource %s:%d: %s\n",
+        fprintf(resource_log_stream, "warning: failed to load resource %s:%d: %s\n",
             type_str.c_str(), id, e.what());
         return false;
       }
     } else {
-      fprintf(stderr, "warning: failed to load resource %s:%d: %s\n",
+      fprintf(resource_log_stream, "warning: failed to load resource %s:%d: %s\n",
           type_str.c_str(), id, e.what());
       return false;
     }
@@ -757,13 +1034,18 @@ bool export_resource(const string& base_filename, ResourceFile& rf,
 
   bool write_raw = (save_raw == SaveRawBehavior::Always);
 
-  // decode if possible
-  resource_decode_fn decode_fn = type_to_decode_fn[type];
+  // decode if possible. note that this can't use operator[] since this may be
+  // called from multiple threads at once
+  auto decode_fn_it = type_to_decode_fn.find(type);
+  resource_decode_fn decode_fn = (decode_fn_it == type_to_decode_fn.end()) ?
+      NULL : decode_fn_it->second;
   if (!decompression_failed && decode_fn) {
     try {
+      ResourcePhaseTimer timer(type, ResourcePhase::Decode);
+      timer.add_bytes(data.size);
       decode_fn(out_dir, base_filename, rf, type, id);
     } catch (const runtime_error& e) {
-      fprintf(stderr, "warning: failed to decode %.4s %d: %s\n",
+      fprintf(resource_log_stream, "warning: failed to decode %.4s %d: %s\n",
           (const char*)&rtype, id, e.what());
 
       // write the raw version if decoding failed and we didn't write it already
@@ -777,19 +1059,22 @@ bool export_resource(const string& base_filename, ResourceFile& rf,
 
   if (write_raw) {
     try {
+      ResourcePhaseTimer timer(type, ResourcePhase::Write);
       // hack: PICT resources, when saved to disk, should be prepended with a
       // 512-byte unused header
       if (type == RESOURCE_TYPE_PICT) {
         static const string pict_header(512, 0);
         auto f = fopen_unique(out_filename, "wb");
         fwritex(f.get(), pict_header);
-        fwritex(f.get(), data);
+        fwritex(f.get(), data.data, data.size);
+        timer.add_bytes(pict_header.size());
       } else {
-        save_file(out_filename, data);
+        save_file(out_filename, data.data, data.size);
       }
-      fprintf(stderr, "... %s\n", out_filename.c_str());
+      timer.add_bytes(data.size);
+      fprintf(resource_log_stream, "... %s\n", out_filename.c_str());
     } catch (const exception& e) {
-      fprintf(stderr, "warning: failed to save raw data for %.4s %d: %s\n",
+      fprintf(resource_log_stream, "warning: failed to save raw data for %.4s %d: %s\n",
           (const char*)&rtype, id, e.what());
     }
   }
@@ -798,9 +1083,96 @@ bool export_resource(const string& base_filename, ResourceFile& rf,
 
 
 
+// runs fn with resource_log_stream pointed at a memory buffer, and returns
+// everything that was written to it. exceptions from fn are not caught
+static string capture_log(function<void()> fn) {
+  char* log_data = NULL;
+  size_t log_size = 0;
+  FILE* log = open_memstream(&log_data, &log_size);
+  if (!log) {
+    fn();
+    return "";
+  }
+
+  FILE* prev_log_stream = resource_log_stream;
+  resource_log_stream = log;
+  try {
+    fn();
+  } catch (...) {
+    resource_log_stream = prev_log_stream;
+    fclose(log);
+    free(log_data);
+    throw;
+  }
+  resource_log_stream = prev_log_stream;
+  fclose(log);
+
+  string ret(log_data, log_size);
+  free(log_data);
+  return ret;
+}
+
+// exports resources on a thread pool. each resource's log output is buffered
+// and written to the caller's log stream in the same order as it would be in a
+// serial export
+static bool export_resources_parallel(ThreadPool& pool,
+    const string& filename, const string& base_filename, ResourceFile& rf,
+    const string& out_dir, const vector<pair<uint32_t, int16_t>>& resources,
+    SaveRawBehavior save_raw) {
+  FILE* out_stream = resource_log_stream;
+
+  mutex lock;
+  condition_variable resource_done;
+  vector<string> logs(resources.size());
+  vector<bool> done(resources.size(), false);
+  size_t next_log_index = 0;
+  size_t num_done = 0;
+  bool ret = false;
+
+  for (size_t x = 0; x < resources.size(); x++) {
+    pool.add([&, x]() {
+      bool exported = false;
+      string log = capture_log([&]() {
+        try {
+          exported = export_resource(base_filename, rf, out_dir,
+              resources[x].first, resources[x].second, save_raw);
+        } catch (const exception& e) {
+          fprintf(resource_log_stream, "failed on %s: %s\n", filename.c_str(), e.what());
+        }
+      });
+
+      lock_guard<mutex> g(lock);
+      logs[x] = move(log);
+      done[x] = true;
+      ret |= exported;
+      for (; (next_log_index < resources.size()) && done[next_log_index]; next_log_index++) {
+        fwritex(out_stream, logs[next_log_index]);
+        logs[next_log_index].clear();
+      }
+      num_done++;
+      resource_done.notify_one();
+    });
+  }
+
+  // if this is running on one of the pool's threads (because we're exporting
+  // multiple files in parallel), help with the queued tasks instead of just
+  // blocking the thread
+  unique_lock<mutex> g(lock);
+  while (num_done < resources.size()) {
+    g.unlock();
+    bool ran_task = pool.run_one_task();
+    g.lock();
+    if (!ran_task && (num_done < resources.size())) {
+      resource_done.wait(g);
+    }
+  }
+  return ret;
+}
+
 bool disassemble_file(const string& filename, const string& out_dir,
     bool use_data_fork, const unordered_set<uint32_t>& target_types,
     const unordered_set<int16_t>& target_ids, SaveRawBehavior save_raw,
+    bool use_mmap, ThreadPool* pool,
     DebuggingMode decompress_debug = DebuggingMode::Disabled) {
 
   // open resource fork if present
@@ -812,7 +1184,7 @@ bool disassemble_file(const string& filename, const string& out_dir,
   } else if (isfile(filename + "/rsrc")) {
     resource_fork_filename = filename + "/rsrc";
   } else {
-    fprintf(stderr, "failed on %s: no resource fork present\n", filename.c_str());
+    fprintf(resource_log_stream, "failed on %s: no resource fork present\n", filename.c_str());
     return false;
   }
 
@@ -824,12 +1196,17 @@ bool disassemble_file(const string& filename, const string& out_dir,
   // get the resources from the file
   unique_ptr<ResourceFile> rf;
   try {
-    rf.reset(new ResourceFile(resource_fork_filename.c_str()));
+    rf.reset(new ResourceFile(resource_fork_filename.c_str(), use_mmap));
   } catch (const cannot_open_file&) {
-    fprintf(stderr, "failed on %s: no resource fork present\n", filename.c_str());
+    fprintf(resource_log_stream, "failed on %s: no resource fork present\n", filename.c_str());
     return false;
   } catch (const io_error& e) {
-    fprintf(stderr, "failed on %s: incorrect resource index format\n",
+    fprintf(resource_log_stream, "failed on %s: incorrect resource index format\n",
+        filename.c_str());
+    return false;
+  } catch (const out_of_range& e) {
+    // mapped files report out-of-bounds index offsets this way instead
+    fprintf(resource_log_stream, "failed on %s: incorrect resource index format\n",
         filename.c_str());
     return false;
   }
@@ -839,6 +1216,7 @@ bool disassemble_file(const string& filename, const string& out_dir,
     auto resources = rf->all_resources();
 
     bool has_INST = false;
+    vector<pair<uint32_t, int16_t>> resources_to_export;
     for (const auto& it : resources) {
       if (!target_types.empty() && !target_types.count(it.first)) {
         continue;
@@ -849,8 +1227,23 @@ bool disassemble_file(const string& filename, const string& out_dir,
       if (it.first == RESOURCE_TYPE_INST) {
         has_INST = true;
       }
-      ret |= export_resource(base_filename.c_str(), *rf, out_dir.c_str(),
-          it.first, it.second, save_raw, decompress_debug);
+      // if exporting one resource fails, go on to the next one. the parallel
+      // path can't stop the resources after it from being exported, so this
+      // keeps the output the same regardless of how many threads there are
+      if (!pool) {
+        try {
+          ret |= export_resource(base_filename.c_str(), *rf, out_dir.c_str(),
+              it.first, it.second, save_raw, decompress_debug);
+        } catch (const exception& e) {
+          fprintf(resource_log_stream, "failed on %s: %s\n", filename.c_str(), e.what());
+        }
+      } else {
+        resources_to_export.emplace_back(it);
+      }
+    }
+    if (pool) {
+      ret |= export_resources_parallel(*pool, filename, base_filename, *rf,
+          out_dir, resources_to_export, save_raw);
     }
 
     // special case: if we disassembled any INSTs and the save-raw behavior is
@@ -866,41 +1259,60 @@ bool disassemble_file(const string& filename, const string& out_dir,
 
       try {
         string json_data = generate_json_for_SONG(base_filename, *rf, NULL);
-        save_file(json_filename.c_str(), json_data);
-        fprintf(stderr, "... %s\n", json_filename.c_str());
+        {
+          ResourcePhaseTimer timer(RESOURCE_TYPE_INST, ResourcePhase::Write);
+          save_file(json_filename.c_str(), json_data);
+          timer.add_bytes(json_data.size());
+        }
+        fprintf(resource_log_stream, "... %s\n", json_filename.c_str());
 
       } catch (const exception& e) {
-        fprintf(stderr, "failed to write smssynth env template %s: %s\n",
+        fprintf(resource_log_stream, "failed to write smssynth env template %s: %s\n",
             json_filename.c_str(), e.what());
       }
     }
 
   } catch (const exception& e) {
-    fprintf(stderr, "failed on %s: %s\n", filename.c_str(), e.what());
+    fprintf(resource_log_stream, "failed on %s: %s\n", filename.c_str(), e.what());
   }
   return ret;
 }
 
+static vector<string> list_directory_sorted(const string& dirname) {
+  unique_ptr<DIR, int(*)(DIR*)> dir(opendir(dirname.c_str()), closedir);
+  if (!dir.get()) {
+    throw cannot_open_file(dirname);
+  }
+
+  vector<string> ret;
+  struct dirent* entry;
+  while ((entry = readdir(dir.get()))) {
+    if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, "..")) {
+      continue;
+    }
+    ret.emplace_back(entry->d_name);
+  }
+  sort(ret.begin(), ret.end());
+  return ret;
+}
+
 bool disassemble_path(const string& filename, const string& out_dir,
     bool use_data_fork, const unordered_set<uint32_t>& target_types,
     const unordered_set<int16_t>& target_ids, SaveRawBehavior save_raw,
+    bool use_mmap, ThreadPool* pool,
     DebuggingMode decompress_debug = DebuggingMode::Disabled) {
 
   if (isdir(filename)) {
-    fprintf(stderr, ">>> %s (directory)\n", filename.c_str());
+    fprintf(resource_log_stream, ">>> %s (directory)\n", filename.c_str());
 
-    unordered_set<string> items;
+    vector<string> sorted_items;
     try {
-      items = list_directory(filename);
+      sorted_items = list_directory_sorted(filename);
     } catch (const runtime_error& e) {
-      fprintf(stderr, "warning: can\'t list directory: %s\n", e.what());
+      fprintf(resource_log_stream, "warning: can\'t list directory: %s\n", e.what());
       return false;
     }
 
-    vector<string> sorted_items;
-    sorted_items.insert(sorted_items.end(), items.begin(), items.end());
-    sort(sorted_items.begin(), sorted_items.end());
-
     size_t last_slash_pos = filename.rfind('/');
     string base_filename = (last_slash_pos == string::npos) ? filename :
         filename.substr(last_slash_pos + 1);
@@ -911,7 +1323,7 @@ bool disassemble_path(const string& filename, const string& out_dir,
     bool ret = false;
     for (const string& item : sorted_items) {
       ret |= disassemble_path(filename + "/" + item, sub_out_dir, use_data_fork,
-          target_types, target_ids, save_raw, decompress_debug);
+          target_types, target_ids, save_raw, use_mmap, pool, decompress_debug);
     }
     if (!ret) {
       rmdir(sub_out_dir.c_str());
@@ -919,10 +1331,217 @@ bool disassemble_path(const string& filename, const string& out_dir,
     return ret;
 
   } else {
-    fprintf(stderr, ">>> %s\n", filename.c_str());
+    fprintf(resource_log_stream, ">>> %s\n", filename.c_str());
     return disassemble_file(filename, out_dir, use_data_fork, target_types,
-        target_ids, save_raw, decompress_debug);
+        target_ids, save_raw, use_mmap, pool, decompress_debug);
+  }
+}
+
+
+
+// parallel directory traversal. the tree is walked on the calling thread in
+// the same order as disassemble_path does, so output directories are created
+// in the same order; each file is then disassembled by a task on the pool.
+// each file's (or directory's) log output is buffered and written in traversal
+// order, and the walker blocks if too many entries are waiting to be written,
+// so memory usage doesn't grow with the size of the tree. directories are
+// removed if nothing was written to them, once all their children are done.
+
+struct parallel_walk_state {
+  struct directory {
+    shared_ptr<directory> parent;
+    string out_dir; // empty for the root (which is never removed)
+    size_t outstanding; // unfinished children, plus 1 until the walk leaves it
+    bool any_written;
+
+    directory(shared_ptr<directory> parent, const string& out_dir);
+  };
+
+  ThreadPool& pool;
+  size_t max_outstanding_entries;
+
+  mutex lock;
+  condition_variable entry_written;
+  map<size_t, string> finished_logs;
+  size_t next_entry_index;
+  size_t next_log_index;
+
+  parallel_walk_state(ThreadPool& pool, size_t max_outstanding_entries);
+
+  size_t begin_entry();
+  void finish_entry(size_t entry_index, string&& log);
+  void finish_child(shared_ptr<directory> dir, bool written);
+};
+
+parallel_walk_state::directory::directory(shared_ptr<directory> parent,
+    const string& out_dir) : parent(parent), out_dir(out_dir), outstanding(1),
+    any_written(false) { }
+
+parallel_walk_state::parallel_walk_state(ThreadPool& pool,
+    size_t max_outstanding_entries) : pool(pool),
+    max_outstanding_entries(max_outstanding_entries), next_entry_index(0),
+    next_log_index(0) { }
+
+size_t parallel_walk_state::begin_entry() {
+  unique_lock<mutex> g(this->lock);
+  this->entry_written.wait(g, [this]() {
+    return this->next_entry_index - this->next_log_index < this->max_outstanding_entries;
+  });
+  return this->next_entry_index++;
+}
+
+void parallel_walk_state::finish_entry(size_t entry_index, string&& log) {
+  lock_guard<mutex> g(this->lock);
+  this->finished_logs.emplace(entry_index, move(log));
+  for (auto it = this->finished_logs.begin();
+       (it != this->finished_logs.end()) && (it->first == this->next_log_index);
+       it = this->finished_logs.erase(it), this->next_log_index++) {
+    fwritex(stderr, it->second);
   }
+  this->entry_written.notify_one();
+}
+
+void parallel_walk_state::finish_child(shared_ptr<directory> dir, bool written) {
+  lock_guard<mutex> g(this->lock);
+  for (; dir; dir = dir->parent) {
+    dir->any_written |= written;
+    if (--dir->outstanding) {
+      break;
+    }
+    if (!dir->any_written && !dir->out_dir.empty()) {
+      rmdir(dir->out_dir.c_str());
+    }
+    written = dir->any_written;
+  }
+}
+
+static void walk_path_parallel(parallel_walk_state& st,
+    shared_ptr<parallel_walk_state::directory> parent, const string& filename,
+    const string& out_dir, bool use_data_fork,
+    const unordered_set<uint32_t>& target_types,
+    const unordered_set<int16_t>& target_ids, SaveRawBehavior save_raw,
+    bool use_mmap) {
+
+  size_t entry_index = st.begin_entry();
+  {
+    lock_guard<mutex> g(st.lock);
+    parent->outstanding++;
+  }
+
+  if (isdir(filename)) {
+    vector<string> sorted_items;
+    bool list_failed = false;
+    string log = capture_log([&]() {
+      fprintf(resource_log_stream, ">>> %s (directory)\n", filename.c_str());
+      try {
+        sorted_items = list_directory_sorted(filename);
+      } catch (const runtime_error& e) {
+        fprintf(resource_log_stream, "warning: can\'t list directory: %s\n", e.what());
+        list_failed = true;
+      }
+    });
+    st.finish_entry(entry_index, move(log));
+    if (list_failed) {
+      st.finish_child(parent, false);
+      return;
+    }
+
+    size_t last_slash_pos = filename.rfind('/');
+    string base_filename = (last_slash_pos == string::npos) ? filename :
+        filename.substr(last_slash_pos + 1);
+
+    string sub_out_dir = out_dir + "/" + base_filename;
+    mkdir(sub_out_dir.c_str(), 0777);
+
+    shared_ptr<parallel_walk_state::directory> dir(
+        new parallel_walk_state::directory(parent, sub_out_dir));
+    for (const string& item : sorted_items) {
+      walk_path_parallel(st, dir, filename + "/" + item, sub_out_dir,
+          use_data_fork, target_types, target_ids, save_raw, use_mmap);
+    }
+
+    // the walk is done with this directory; if all its children are also done,
+    // this removes it if it's empty and then finishes it in the parent
+    st.finish_child(dir, false);
+
+  } else {
+    st.pool.add([&st, parent, filename, out_dir, use_data_fork, &target_types,
+        &target_ids, save_raw, use_mmap, entry_index]() {
+      bool written = false;
+      string log = capture_log([&]() {
+        fprintf(resource_log_stream, ">>> %s\n", filename.c_str());
+        try {
+          written = disassemble_file(filename, out_dir, use_data_fork,
+              target_types, target_ids, save_raw, use_mmap, &st.pool);
+        } catch (const exception& e) {
+          fprintf(resource_log_stream, "failed on %s: %s\n", filename.c_str(), e.what());
+        }
+      });
+      st.finish_entry(entry_index, move(log));
+      st.finish_child(parent, written);
+    });
+  }
+}
+
+bool disassemble_path_parallel(ThreadPool& pool, const string& filename,
+    const string& out_dir, bool use_data_fork,
+    const unordered_set<uint32_t>& target_types,
+    const unordered_set<int16_t>& target_ids, SaveRawBehavior save_raw,
+    bool use_mmap) {
+  parallel_walk_state st(pool, pool.size() * 4);
+  shared_ptr<parallel_walk_state::directory> root(
+      new parallel_walk_state::directory(NULL, ""));
+  walk_path_parallel(st, root, filename, out_dir, use_data_fork, target_types,
+      target_ids, save_raw, use_mmap);
+  st.finish_child(root, false);
+  pool.wait();
+  return root->any_written;
+}
+
+
+
+static shared_ptr<JSONObject> json_for_resource_type_stats(
+    const resource_type_stats& stats) {
+  unordered_map<string, shared_ptr<JSONObject>> dict;
+  for (size_t x = 0; x < NUM_RESOURCE_PHASES; x++) {
+    const auto& phase_stats = stats[x];
+    if (phase_stats.count == 0) {
+      continue;
+    }
+    unordered_map<string, shared_ptr<JSONObject>> phase_dict;
+    phase_dict.emplace("count", new JSONObject(static_cast<int64_t>(phase_stats.count)));
+    phase_dict.emplace("nsecs", new JSONObject(static_cast<int64_t>(phase_stats.nsecs)));
+    phase_dict.emplace("bytes", new JSONObject(static_cast<int64_t>(phase_stats.bytes)));
+    dict.emplace(name_for_resource_phase(static_cast<ResourcePhase>(x)),
+        new JSONObject(phase_dict));
+  }
+  return shared_ptr<JSONObject>(new JSONObject(dict));
+}
+
+static string generate_json_for_resource_stats() {
+  auto stats = collect_resource_stats();
+
+  // map parsing is recorded under type 0, since it isn't specific to any type
+  resource_type_stats totals = {};
+  unordered_map<string, shared_ptr<JSONObject>> types_dict;
+  for (const auto& it : stats) {
+    for (size_t x = 0; x < NUM_RESOURCE_PHASES; x++) {
+      totals[x].count += it.second[x].count;
+      totals[x].nsecs += it.second[x].nsecs;
+      totals[x].bytes += it.second[x].bytes;
+    }
+    if (it.first != 0) {
+      types_dict.emplace(string_for_resource_type(it.first),
+          json_for_resource_type_stats(it.second));
+    }
+  }
+
+  unordered_map<string, shared_ptr<JSONObject>> base_dict;
+  base_dict.emplace("types", new JSONObject(types_dict));
+  base_dict.emplace("totals", json_for_resource_type_stats(totals));
+
+  shared_ptr<JSONObject> json(new JSONObject(base_dict));
+  return json->format();
 }
 
 
@@ -955,6 +1574,19 @@ Options:\n\
       Decode TYP2 resources as if they were TYP1.\n\
   --data-fork\n\
       Disassemble the file\'s data fork as if it were the resource fork.\n\
+  --jobs=N\n\
+      Use N threads. If N is 0, use one thread per CPU core. When disassembling\n\
+      a directory, multiple files and their resources are processed at once;\n\
+      otherwise, multiple resources from the file are. Output files and log\n\
+      messages are the same as when N is 1 (the default). Decompression\n\
+      debugging options force N to 1.\n\
+  --no-mmap\n\
+      Read resources with individual reads instead of mapping the entire file\n\
+      into memory.\n\
+  --resource-cache-size=N\n\
+      Keep up to N megabytes of resource data in memory per file after it\'s\n\
+      read or decompressed, so it doesn\'t have to be done again if another\n\
+      resource refers to it (default 64). If N is 0, nothing is cached.\n\
   --show-decompression\n\
       Show a message when a resource decompressor is run.\n\
   --debug-decompression\n\
@@ -962,6 +1594,38 @@ Options:\n\
   --debug-decompression-interactive\n\
       Run resource decompressors in an interactive debugging shell.\n\
       Be warned: this shell has no documentation.\n\
+  --emulate-decompressors\n\
+      Always run the system decompressors in the 68K emulator, even if there\n\
+      are native implementations of them. Decompression debugging options\n\
+      also do this.\n\
+  --verify-decompressors\n\
+      Run both the native and emulated system decompressors, and show a\n\
+      warning if their results differ. The emulated result is used. Results\n\
+      in the decompression cache are not used with this option, so every\n\
+      resource is checked.\n\
+  --decompression-cache=DIR\n\
+      Save decompressed resources in DIR, and use them instead of running the\n\
+      decompressor again if the same compressed data is seen in a later run.\n\
+  --decompression-cache-size=N\n\
+      Limit the decompression cache to N megabytes (default 1024). The least\n\
+      recently used entries are deleted when this is exceeded. If N is 0, the\n\
+      cache size is unlimited.\n\
+  --pict-band-height=N\n\
+      Render PICTs N rows at a time, writing each band to the output file as\n\
+      it\'s finished. This uses much less memory for very large pictures, but\n\
+      takes more time. If banded rendering fails, the entire picture is\n\
+      rendered at once instead.\n\
+  --use-picttoppm\n\
+      If a PICT can\'t be rendered natively, render it with picttoppm (from\n\
+      netpbm) instead. Without this option, these PICTs are not decoded. At\n\
+      the end, resource_dasm lists the opcodes that prevented PICTs from\n\
+      being rendered natively.\n\
+  --stats=FILE\n\
+      Count and time each phase of extraction (map parsing, reading,\n\
+      decompression, decoding, and writing) by resource type, and write the\n\
+      results to FILE as JSON. Times are in nanoseconds and don\'t include\n\
+      time spent in other phases; for example, if a decoder reads another\n\
+      resource, that time counts as reading, not decoding.\n\
 \n", argv0);
 }
 
@@ -971,12 +1635,20 @@ int main(int argc, char* argv[]) {
 
   string filename;
   string out_dir;
+  string stats_filename;
   bool use_data_fork = false;
+  bool use_mmap = true;
+  size_t num_threads = 1;
   SaveRawBehavior save_raw = SaveRawBehavior::IfDecodeFails;
   unordered_set<uint32_t> target_types;
   unordered_set<int16_t> target_ids;
   uint32_t decode_type = 0;
   DebuggingMode decompress_debug = DebuggingMode::Disabled;
+  string decompression_cache_dir;
+  size_t decompression_cache_size = 1024;
+  // picttoppm spawns a process per PICT, so it's opt-in here (unlike in the
+  // other tools that render PICTs)
+  use_picttoppm_fallback = false;
   for (int x = 1; x < argc; x++) {
     if (argv[x][0] == '-') {
       if (!strncmp(argv[x], "--decode-type=", 14)) {
@@ -1054,6 +1726,20 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "note: reading data forks as resource forks\n");
         use_data_fork = true;
 
+      } else if (!strncmp(argv[x], "--jobs=", 7)) {
+        num_threads = strtoull(&argv[x][7], NULL, 0);
+        if (num_threads == 0) {
+          num_threads = ThreadPool::default_thread_count();
+        }
+        fprintf(stderr, "note: using %zu threads\n", num_threads);
+
+      } else if (!strcmp(argv[x], "--no-mmap")) {
+        fprintf(stderr, "note: not memory-mapping resource files\n");
+        use_mmap = false;
+
+      } else if (!strncmp(argv[x], "--resource-cache-size=", 22)) {
+        default_resource_data_cache_size = strtoull(&argv[x][22], NULL, 0) * 1024 * 1024;
+
       } else if (!strcmp(argv[x], "--show-decompression")) {
         decompress_debug = DebuggingMode::Passive;
 
@@ -1065,6 +1751,34 @@ int main(int argc, char* argv[]) {
         fprintf(stderr, "note: interactive decompression debugging enabled\n");
         decompress_debug = DebuggingMode::Interactive;
 
+      } else if (!strcmp(argv[x], "--emulate-decompressors")) {
+        fprintf(stderr, "note: emulating all system decompressors\n");
+        system_decompressor_mode = SystemDecompressorMode::Emulated;
+
+      } else if (!strcmp(argv[x], "--verify-decompressors")) {
+        fprintf(stderr, "note: verifying native system decompressors against emulation\n");
+        system_decompressor_mode = SystemDecompressorMode::Verify;
+
+      } else if (!strncmp(argv[x], "--decompression-cache=", 22)) {
+        decompression_cache_dir = &argv[x][22];
+        fprintf(stderr, "note: using decompression cache in %s\n",
+            decompression_cache_dir.c_str());
+
+      } else if (!strncmp(argv[x], "--decompression-cache-size=", 27)) {
+        decompression_cache_size = strtoull(&argv[x][27], NULL, 0);
+
+      } else if (!strncmp(argv[x], "--pict-band-height=", 19)) {
+        pict_band_height = strtoull(&argv[x][19], NULL, 0);
+
+      } else if (!strcmp(argv[x], "--use-picttoppm")) {
+        use_picttoppm_fallback = true;
+
+      } else if (!strncmp(argv[x], "--stats=", 8)) {
+        stats_filename = &argv[x][8];
+        resource_stats_enabled = true;
+        fprintf(stderr, "note: writing resource stats to %s\n",
+            stats_filename.c_str());
+
       } else {
         fprintf(stderr, "unknown option: %s\n", argv[x]);
         return 1;
@@ -1102,6 +1816,8 @@ int main(int argc, char* argv[]) {
     SingleResourceFile rf(decode_type, 1, data.data(), data.size());
 
     try {
+      ResourcePhaseTimer timer(decode_type, ResourcePhase::Decode);
+      timer.add_bytes(data.size());
       decode_fn(out_dir, filename, rf, decode_type, 1);
     } catch (const runtime_error& e) {
       fprintf(stderr, "error: failed to decode %s: %s\n",
@@ -1109,6 +1825,9 @@ int main(int argc, char* argv[]) {
       return 3;
     }
 
+    if (!stats_filename.empty()) {
+      save_file(stats_filename, generate_json_for_resource_stats());
+    }
     return 0;
   }
 
@@ -1117,8 +1836,44 @@ int main(int argc, char* argv[]) {
   }
   mkdir(out_dir.c_str(), 0777);
 
-  disassemble_path(filename, out_dir, use_data_fork, target_types, target_ids,
-      save_raw, decompress_debug);
+  // the decompression debugger writes directly to stderr (and may read from
+  // stdin), so it can't be used on multiple threads at once
+  if ((num_threads > 1) && (decompress_debug != DebuggingMode::Disabled)) {
+    fprintf(stderr, "note: decompression debugging is enabled; using only one thread\n");
+    num_threads = 1;
+  }
+  if (!decompression_cache_dir.empty()) {
+    decompression_cache.reset(new DecompressionCache(decompression_cache_dir,
+        decompression_cache_size * 1024 * 1024));
+  }
+
+  unique_ptr<ThreadPool> pool;
+  if (num_threads > 1) {
+    pool.reset(new ThreadPool(num_threads));
+  }
+
+  if (pool.get() && isdir(filename)) {
+    disassemble_path_parallel(*pool, filename, out_dir, use_data_fork,
+        target_types, target_ids, save_raw, use_mmap);
+  } else {
+    disassemble_path(filename, out_dir, use_data_fork, target_types, target_ids,
+        save_raw, use_mmap, pool.get(), decompress_debug);
+  }
+
+  // each worker's stats are merged into the totals when it exits, so the
+  // workers have to be stopped before the stats are collected
+  pool.reset();
+  if (!stats_filename.empty()) {
+    save_file(stats_filename, generate_json_for_resource_stats());
+  }
+
+  auto pict_fallback_counts = get_PICT_fallback_opcode_counts();
+  if (!pict_fallback_counts.empty()) {
+    fprintf(stderr, "note: PICTs not rendered natively, by unimplemented opcode:\n");
+    for (const auto& it : pict_fallback_counts) {
+      fprintf(stderr, "  %04hX: %zu\n", it.first, it.second);
+    }
+  }
 
   return 0;
 }
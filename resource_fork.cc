@@ -5,10 +5,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include <exception>
+#include <functional>
 #include <phosg/Encoding.hh>
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
@@ -18,16 +20,45 @@
 #include <vector>
 #include <string>
 #include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
 
 #include "audio_codecs.hh"
 #include "quickdraw_formats.hh"
 #include "mc68k.hh"
 #include "pict.hh"
+#include "resource_stats.hh"
+#include "system_decompressors.hh"
 
 using namespace std;
 
 
 
+thread_local FILE* resource_log_stream = stderr;
+SystemDecompressorMode system_decompressor_mode = SystemDecompressorMode::Native;
+shared_ptr<DecompressionCache> decompression_cache;
+size_t default_resource_data_cache_size = 64 * 1024 * 1024;
+bool use_picttoppm_fallback = true;
+
+static mutex PICT_fallback_opcode_counts_lock;
+static map<uint16_t, size_t> PICT_fallback_opcode_counts;
+
+map<uint16_t, size_t> get_PICT_fallback_opcode_counts() {
+  lock_guard<mutex> g(PICT_fallback_opcode_counts_lock);
+  return PICT_fallback_opcode_counts;
+}
+
+static void count_PICT_failure(const exception& e) {
+  auto* opcode_e = dynamic_cast<const pict_unimplemented_opcode_error*>(&e);
+  if (opcode_e) {
+    lock_guard<mutex> g(PICT_fallback_opcode_counts_lock);
+    PICT_fallback_opcode_counts[opcode_e->opcode]++;
+  }
+}
+
+
+
 // note: all structs in this file are packed
 #pragma pack(push)
 #pragma pack(1)
@@ -54,43 +85,26 @@ string string_for_resource_type(uint32_t type) {
 ////////////////////////////////////////////////////////////////////////////////
 // resource fork parsing
 
-void resource_fork_header::read(int fd, size_t offset) {
-  preadx(fd, this, sizeof(*this), offset);
+void resource_fork_header::byteswap() {
   this->resource_data_offset = bswap32(this->resource_data_offset);
   this->resource_map_offset = bswap32(this->resource_map_offset);
   this->resource_data_size = bswap32(this->resource_data_size);
   this->resource_map_size = bswap32(this->resource_map_size);
 }
 
-void resource_map_header::read(int fd, size_t offset) {
-  preadx(fd, this, sizeof(*this), offset);
+void resource_map_header::byteswap() {
   this->attributes = bswap16(this->attributes);
   this->resource_type_list_offset = bswap16(this->resource_type_list_offset);
   this->resource_name_list_offset = bswap16(this->resource_name_list_offset);
 }
 
-void resource_type_list_entry::read(int fd, size_t offset) {
-  preadx(fd, this, sizeof(*this), offset);
+void resource_type_list_entry::byteswap() {
   this->resource_type = bswap32(this->resource_type);
   this->num_items = bswap16(this->num_items);
   this->reference_list_offset = bswap16(this->reference_list_offset);
 }
 
-void resource_type_list::read(int fd, size_t offset) {
-  preadx(fd, &this->num_types, sizeof(this->num_types), offset);
-  this->num_types = bswap16(this->num_types);
-
-  // 0xFFFF means an empty resource fork
-  if (this->num_types != 0xFFFF) {
-    for (uint32_t i = 0; i <= this->num_types; i++) {
-      this->entries.emplace_back();
-      this->entries.back().read(fd, offset + 2 + i * sizeof(resource_type_list_entry));
-    }
-  }
-}
-
-void resource_reference_list_entry::read(int fd, size_t offset) {
-  preadx(fd, this, sizeof(*this), offset);
+void resource_reference_list_entry::byteswap() {
   this->resource_id = (int16_t)bswap16((uint16_t)this->resource_id);
   this->name_offset = bswap16(this->name_offset);
   this->attributes_and_offset = bswap32(this->attributes_and_offset);
@@ -98,58 +112,183 @@ void resource_reference_list_entry::read(int fd, size_t offset) {
 
 
 
-ResourceFile::ResourceFile(const string& filename) : ResourceFile(filename.c_str()) { }
+resource_data_view::resource_data_view() : data(NULL), size(0) { }
+
+resource_data_view::resource_data_view(const char* data, size_t size) :
+    data(data), size(size) { }
+
+resource_data_view::resource_data_view(const string& data) :
+    data(data.data()), size(data.size()) { }
+
+resource_data_view::resource_data_view(shared_ptr<const string> owner) :
+    data(owner->data()), size(owner->size()), owner(move(owner)) { }
+
+string resource_data_view::str() const {
+  return string(this->data, this->size);
+}
 
-ResourceFile::ResourceFile(const char* filename) : empty(false) {
+
+
+ResourceFile::ResourceFile(const string& filename, bool use_mmap) :
+    ResourceFile(filename.c_str(), use_mmap) { }
+
+ResourceFile::ResourceFile(const char* filename, bool use_mmap) :
+    mapped_data(NULL), mapped_size(0), empty(false),
+    resource_data_cache_size(0),
+    resource_data_cache_max_size(default_resource_data_cache_size),
+    cache_PICT_display_lists(false) {
   if (filename == NULL) {
     this->empty = true;
     return;
   }
   this->fd = scoped_fd(filename, O_RDONLY);
   // if the resource fork is empty, treat it as a valid index with no contents
-  if (fstat(this->fd).st_size == 0) {
+  size_t file_size = fstat(this->fd).st_size;
+  if (file_size == 0) {
     this->empty = true;
     return;
   }
-  this->header.read(this->fd, 0);
-  this->map_header.read(this->fd, this->header.resource_map_offset);
-  this->map_type_list.read(this->fd,
-      this->header.resource_map_offset + this->map_header.resource_type_list_offset);
-}
 
-vector<resource_reference_list_entry>* ResourceFile::get_reference_list(uint32_t type) {
-  vector<resource_reference_list_entry>* reference_list = NULL;
-  try {
-    reference_list = &this->reference_list_cache.at(type);
+  ResourcePhaseTimer timer(0, ResourcePhase::MapParse);
+  timer.add_bytes(file_size);
 
-  } catch (const out_of_range&) {
-    const resource_type_list_entry* type_list = NULL;
-    for (const auto& entry : this->map_type_list.entries) {
-      if (entry.resource_type == type) {
-        type_list = &entry;
-      }
+  // if mmap fails (e.g. for named forks on some filesystems), just use pread
+  // for everything instead
+  if (use_mmap) {
+    void* mapped = mmap(NULL, file_size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+    if (mapped != MAP_FAILED) {
+      this->mapped_data = reinterpret_cast<const char*>(mapped);
+      this->mapped_size = file_size;
     }
+  }
+
+  this->read_file_data(&this->header, sizeof(this->header), 0);
+  this->header.byteswap();
+  this->read_file_data(&this->map_header, sizeof(this->map_header),
+      this->header.resource_map_offset);
+  this->map_header.byteswap();
+
+  size_t type_list_offset = this->header.resource_map_offset +
+      this->map_header.resource_type_list_offset;
+  this->read_file_data(&this->map_type_list.num_types,
+      sizeof(this->map_type_list.num_types), type_list_offset);
+  this->map_type_list.num_types = bswap16(this->map_type_list.num_types);
 
-    if (!type_list) {
-      throw out_of_range("file doesn\'t contain resources of the given type");
+  // 0xFFFF means an empty resource fork
+  if (this->map_type_list.num_types != 0xFFFF) {
+    this->map_type_list.entries.resize(this->map_type_list.num_types + 1);
+    this->read_file_data(this->map_type_list.entries.data(),
+        this->map_type_list.entries.size() * sizeof(resource_type_list_entry),
+        type_list_offset + 2);
+    for (auto& entry : this->map_type_list.entries) {
+      entry.byteswap();
     }
+  }
+
+  this->build_index();
+}
+
+ResourceFile::~ResourceFile() {
+  if (this->mapped_data) {
+    munmap(const_cast<char*>(this->mapped_data), this->mapped_size);
+  }
+}
+
+void ResourceFile::set_resource_data_cache_size(size_t max_size) {
+  lock_guard<mutex> g(this->resource_data_cache_lock);
+  this->resource_data_cache_max_size = max_size;
+  this->evict_from_cache_locked();
+}
+
+void ResourceFile::set_cache_PICT_display_lists(bool enabled) {
+  lock_guard<mutex> g(this->resource_data_cache_lock);
+  this->cache_PICT_display_lists = enabled;
+}
+
+resource_data_view ResourceFile::mapped_range(size_t offset, size_t size) const {
+  if ((offset > this->mapped_size) || (size > this->mapped_size - offset)) {
+    throw out_of_range(string_printf(
+        "range %zX:%zX is beyond end of mapped file (%zX bytes)",
+        offset, size, this->mapped_size));
+  }
+  return resource_data_view(this->mapped_data + offset, size);
+}
+
+void ResourceFile::read_file_data(void* dest, size_t size, size_t offset) const {
+  if (this->mapped_data) {
+    memcpy(dest, this->mapped_range(offset, size).data, size);
+  } else {
+    preadx(this->fd, dest, size, offset);
+  }
+}
+
+static inline uint64_t resource_key(uint32_t type, int16_t id) {
+  return (static_cast<uint64_t>(type) << 16) | static_cast<uint16_t>(id);
+}
+
+void ResourceFile::build_index() {
+  // read all the reference lists into one flat array, in map order. each type
+  // occupies a contiguous range in it
+  size_t total_entries = 0;
+  for (const auto& type_entry : this->map_type_list.entries) {
+    total_entries += type_entry.num_items + 1;
+  }
+  this->entries.resize(total_entries);
+  this->key_to_entry_index.reserve(total_entries);
 
-    // look in resource list for something with the given ID
-    reference_list = &this->reference_list_cache[type];
-    reference_list->reserve(type_list->num_items + 1);
-    size_t base_offset = this->map_header.resource_type_list_offset +
-        this->header.resource_map_offset + type_list->reference_list_offset;
-    for (size_t x = 0; x <= type_list->num_items; x++) {
-      reference_list->emplace_back();
-      reference_list->back().read(fd, base_offset + x * sizeof(resource_reference_list_entry));
+  size_t base_offset = this->map_header.resource_type_list_offset +
+      this->header.resource_map_offset;
+  size_t start_index = 0;
+  for (const auto& type_entry : this->map_type_list.entries) {
+    size_t count = type_entry.num_items + 1;
+    resource_reference_list_entry* type_entries = &this->entries[start_index];
+    this->read_file_data(type_entries,
+        count * sizeof(resource_reference_list_entry),
+        base_offset + type_entry.reference_list_offset);
+    for (size_t x = 0; x < count; x++) {
+      type_entries[x].byteswap();
+    }
+    start_index += count;
+  }
+
+  // if a type appears more than once in the map, only its last reference list
+  // is used; the earlier ones are ignored entirely. within a list, the first
+  // entry with a given id wins. this matches what the old linear search did, so
+  // we go through the types backward here
+  size_t end_index = this->entries.size();
+  for (auto it = this->map_type_list.entries.rbegin();
+       it != this->map_type_list.entries.rend(); it++) {
+    size_t range_start = end_index - (it->num_items + 1);
+    bool is_last_list = this->type_to_entry_range.emplace(it->resource_type,
+        make_pair(range_start, end_index)).second;
+    if (!is_last_list) {
+      end_index = range_start;
+      continue;
     }
+    for (size_t x = range_start; x < end_index; x++) {
+      this->key_to_entry_index.emplace(
+          resource_key(it->resource_type, this->entries[x].resource_id), x);
+    }
+    end_index = range_start;
   }
+}
 
-  return reference_list;
+const resource_reference_list_entry* ResourceFile::find_entry(uint32_t type,
+    int16_t id) const {
+  auto it = this->key_to_entry_index.find(resource_key(type, id));
+  if (it == this->key_to_entry_index.end()) {
+    return NULL;
+  }
+  return &this->entries[it->second];
 }
 
 const string& ResourceFile::get_system_decompressor(int16_t resource_id) {
+  static mutex id_to_data_lock;
   static unordered_map<int16_t, string> id_to_data;
+
+  // references to existing entries stay valid when others are added, so it's
+  // safe to return them after releasing the lock
+  lock_guard<mutex> g(id_to_data_lock);
   try {
     return id_to_data.at(resource_id);
   } catch (const out_of_range&) {
@@ -178,8 +317,8 @@ struct compressed_resource_header {
     struct {
       uint16_t dcmp_resource_id;
       uint16_t unused1;
-      uint8_t unused2;
-      uint8_t unused3;
+      uint8_t table_size; // dcmp 2 only: custom table entry count - 1
+      uint8_t flags; // dcmp 2 only: 1 = custom table present, 2 = tagged
     } header9;
   };
 
@@ -222,71 +361,61 @@ struct dcmp_input_header {
   uint16_t unused;
 };
 
-string ResourceFile::decompress_resource(const string& data,
-    DebuggingMode debug) {
-  if (data.size() < sizeof(compressed_resource_header)) {
-    fprintf(stderr, "warning: resource marked as compressed but is too small\n");
-    return data;
-  }
-
-  compressed_resource_header header;
-  memcpy(&header, data.data(), sizeof(compressed_resource_header));
-  header.byteswap();
-  if (header.magic != 0xA89F6572) {
-    fprintf(stderr, "warning: resource marked as compressed but does not appear to be compressed\n");
-    return data;
-  }
-
-  int16_t dcmp_resource_id;
-  if (header.header_version == 9) {
-    dcmp_resource_id = header.header9.dcmp_resource_id;
-  } else if (header.header_version == 8) {
-    dcmp_resource_id = header.header8.dcmp_resource_id;
-  } else {
-    throw runtime_error("compressed resource header version is not 8 or 9");
-  }
-  if ((debug != DebuggingMode::Disabled) && (debug != DebuggingMode::Passive)) {
-    fprintf(stderr, "using dcmp %hd\n", dcmp_resource_id);
-    fprintf(stderr, "resource header looks like:\n");
-    print_data(stderr, data.data(), data.size() > 0x40 ? 0x40 : data.size());
-    fprintf(stderr, "note: data size is %zu (0x%zX); decompressed data size is %" PRIu32 " (0x%" PRIX32 ") bytes\n",
-        data.size(), data.size(), header.decompressed_size, header.decompressed_size);
+// returns true and sets ret if there's a native implementation of the given
+// system dcmp that accepts this header. throws if the data is malformed.
+static bool decompress_resource_native(const compressed_resource_header& header,
+    int16_t dcmp_resource_id, const string& data, string& ret) {
+  if (!has_native_system_decompressor(dcmp_resource_id)) {
+    return false;
   }
 
-  // get the decompressor code. if it's not in the file, look in system as well
-  string dcmp_contents;
-  try {
-    dcmp_contents = this->get_resource_data(RESOURCE_TYPE_dcmp, dcmp_resource_id);
-  } catch (const out_of_range&) {
-    dcmp_contents = this->get_system_decompressor(dcmp_resource_id);
+  // the system dcmps only work with the header version they were written for;
+  // anything else is emulated so it behaves the same as before
+  const char* compressed_data = data.data() + sizeof(compressed_resource_header);
+  size_t compressed_size = data.size() - sizeof(compressed_resource_header);
+  if ((dcmp_resource_id == 0) && (header.header_version == 8)) {
+    ret = decompress_system0(compressed_data, compressed_size,
+        header.decompressed_size);
+    return true;
+  } else if ((dcmp_resource_id == 1) && (header.header_version == 8)) {
+    ret = decompress_system1(compressed_data, compressed_size,
+        header.decompressed_size);
+    return true;
+  } else if ((dcmp_resource_id == 2) && (header.header_version == 9)) {
+    ret = decompress_system2(compressed_data, compressed_size,
+        header.decompressed_size, header.header9.table_size,
+        header.header9.flags);
+    return true;
+  } else if ((dcmp_resource_id == 3) && (header.header_version == 9)) {
+    ret = decompress_system3(compressed_data, compressed_size,
+        header.decompressed_size);
+    return true;
   }
+  return false;
+}
 
-  // figure out where in the dcmp to start execution. there appear to be two
-  // formats: one that has 'dcmp' in bytes 4-8 where execution appears to just
-  // start at byte 0 (usually it's a branch opcode), and one where the first
-  // three words appear to be offsets to various functions, followed by code.
-  // the second word appears to be the main entry point in this format, so we'll
-  // use that to determine where to start execution.
-  uint32_t dcmp_entry_offset;
-  if (dcmp_contents.size() < 10) {
-    throw runtime_error("decompressor resource is too short");
-  }
-  if (dcmp_contents.substr(4, 4) == "dcmp") {
-    dcmp_entry_offset = 0;
+// decompressors are run in a per-thread emulator that's reused across calls, so
+// its memory regions' allocations don't have to be made again for every
+// resource. a call takes the emulator out of this slot while it runs and puts it
+// back when it's done, so a call that fails (or a nested call) just uses a new
+// emulator instead.
+static thread_local unique_ptr<MC68KEmulator> dcmp_emulator;
+
+static string execute_decompressor(const string& data,
+    const compressed_resource_header& header, int16_t dcmp_resource_id,
+    const string& dcmp_contents, uint32_t dcmp_entry_offset,
+    size_t working_buffer_size, DebuggingMode debug,
+    const string* native_result) {
+  unique_ptr<MC68KEmulator> emu_holder = move(dcmp_emulator);
+  if (emu_holder) {
+    emu_holder->reset();
   } else {
-    dcmp_entry_offset = bswap16(*reinterpret_cast<const uint16_t*>(
-        dcmp_contents.data() + 2));
-  }
-  if ((debug != DebuggingMode::Disabled) && (debug != DebuggingMode::Passive)) {
-    fprintf(stderr, "dcmp entry offset is %08" PRIX32 "\n", dcmp_entry_offset);
+    emu_holder.reset(new MC68KEmulator());
   }
+  MC68KEmulator& emu = *emu_holder;
 
-  MC68KEmulator emu;
-
-  // set up memory regions
-  // slightly awkward assumption: decompressed data is never more than 256 times
-  // the size of the input data. TODO: it looks like we probably should be using
-  // ((data.size() * 256) / working_buffer_fractional_size) instead here?
+  // set up memory regions. if the emulator was used before, these reuse the
+  // previous regions' allocations
   static const uint32_t stack_base = 0x10000000;
   static const uint32_t output_base = 0x20000000;
   static const uint32_t working_buffer_base = 0x80000000;
@@ -304,11 +433,11 @@ string ResourceFile::decompress_resource(const string& data,
   string& input_region = emu.memory_regions[input_base];
   string& working_buffer_region = emu.memory_regions[working_buffer_base];
   string& code_region = emu.memory_regions[code_base];
-  stack_region.resize(1024 * 16);
-  output_region.resize(header.decompressed_size + 0x100);
-  input_region = data;
-  working_buffer_region.resize(data.size() * 256);
-  code_region = move(dcmp_contents);
+  stack_region.assign(1024 * 16, '\0');
+  output_region.assign(header.decompressed_size + 0x100, '\0');
+  input_region.assign(data);
+  working_buffer_region.assign(working_buffer_size, '\0');
+  code_region.assign(dcmp_contents);
 
   // TODO: looks like some decompressors expect zero bytes after the compressed
   // data? find out if this is actually true and fix it if not
@@ -383,85 +512,348 @@ string ResourceFile::decompress_resource(const string& data,
         dcmp_resource_id, duration);
   }
 
-  output_region.resize(header.decompressed_size);
-  return output_region;
+  string ret = output_region.substr(0, header.decompressed_size);
+
+  if (native_result && (*native_result != ret)) {
+    size_t offset = 0;
+    while ((*native_result)[offset] == ret[offset]) {
+      offset++;
+    }
+    fprintf(resource_log_stream, "warning: native dcmp %hd result differs from emulated result at offset %zX; using emulated result\n",
+        dcmp_resource_id, offset);
+  }
+
+  // don't keep huge allocations around between calls; only the working buffer
+  // (if a decompressor needed a retry) or the output of a very large resource
+  // could get this big
+  static const size_t max_retained_region_size = 0x1000000;
+  for (auto& region_it : emu.memory_regions) {
+    if (region_it.second.capacity() > max_retained_region_size) {
+      string().swap(region_it.second);
+    }
+  }
+  dcmp_emulator = move(emu_holder);
+
+  return ret;
 }
 
-bool ResourceFile::resource_exists(uint32_t resource_type, int16_t resource_id) {
-  if (this->empty) {
-    return false;
+string ResourceFile::decompress_resource(const string& data,
+    DebuggingMode debug) {
+  if (data.size() < sizeof(compressed_resource_header)) {
+    fprintf(resource_log_stream, "warning: resource marked as compressed but is too small\n");
+    return data;
+  }
+
+  compressed_resource_header header;
+  memcpy(&header, data.data(), sizeof(compressed_resource_header));
+  header.byteswap();
+  if (header.magic != 0xA89F6572) {
+    fprintf(resource_log_stream, "warning: resource marked as compressed but does not appear to be compressed\n");
+    return data;
+  }
+
+  int16_t dcmp_resource_id;
+  if (header.header_version == 9) {
+    dcmp_resource_id = header.header9.dcmp_resource_id;
+  } else if (header.header_version == 8) {
+    dcmp_resource_id = header.header8.dcmp_resource_id;
+  } else {
+    throw runtime_error("compressed resource header version is not 8 or 9");
+  }
+  if ((debug != DebuggingMode::Disabled) && (debug != DebuggingMode::Passive)) {
+    fprintf(stderr, "using dcmp %hd\n", dcmp_resource_id);
+    fprintf(stderr, "resource header looks like:\n");
+    print_data(stderr, data.data(), data.size() > 0x40 ? 0x40 : data.size());
+    fprintf(stderr, "note: data size is %zu (0x%zX); decompressed data size is %" PRIu32 " (0x%" PRIX32 ") bytes\n",
+        data.size(), data.size(), header.decompressed_size, header.decompressed_size);
   }
+
+  // get the decompressor code. if it's not in the file, look in system as well
+  string dcmp_contents;
+  bool use_system_dcmp = false;
   try {
-    for (const auto& e : *this->get_reference_list(resource_type)) {
-      if (e.resource_id == resource_id) {
-        return true;
+    dcmp_contents = this->get_resource_data(RESOURCE_TYPE_dcmp, dcmp_resource_id);
+  } catch (const out_of_range&) {
+    use_system_dcmp = true;
+  }
+
+  // check the cache before running anything (unless we're debugging the
+  // decompressor). the key includes the decompressor code, so a file with its
+  // own version of a dcmp doesn't get results from another file's. the system
+  // dcmps never change, so they're identified by number instead. when verifying
+  // the native decompressors, the cache is only written, since a cached result
+  // would skip the comparison
+  bool use_cache = decompression_cache &&
+      ((debug == DebuggingMode::Disabled) || (debug == DebuggingMode::Passive));
+  string cache_dcmp_key;
+  if (use_cache) {
+    cache_dcmp_key = use_system_dcmp ?
+        string_printf("system dcmp %hd", dcmp_resource_id) : dcmp_contents;
+    string ret;
+    if ((system_decompressor_mode != SystemDecompressorMode::Verify) &&
+        decompression_cache->get(data, cache_dcmp_key, ret) &&
+        (ret.size() == header.decompressed_size)) {
+      if (debug != DebuggingMode::Disabled) {
+        fprintf(stderr, "note: found resource decompressed with dcmp %hd in cache\n",
+            dcmp_resource_id);
       }
+      return ret;
     }
-  } catch (const out_of_range&) { }
+  }
 
-  return false;
+  string ret = this->run_decompressor(data, header, dcmp_resource_id,
+      use_system_dcmp, move(dcmp_contents), debug);
+
+  if (use_cache) {
+    try {
+      decompression_cache->put(data, cache_dcmp_key, ret);
+    } catch (const exception& e) {
+      fprintf(resource_log_stream, "warning: can\'t write decompressed resource to cache: %s\n",
+          e.what());
+    }
+  }
+  return ret;
 }
 
-string ResourceFile::get_resource_data(uint32_t resource_type,
-    int16_t resource_id, bool decompress, DebuggingMode decompress_debug) {
+string ResourceFile::run_decompressor(const string& data,
+    const compressed_resource_header& header, int16_t dcmp_resource_id,
+    bool use_system_dcmp, string&& dcmp_contents, DebuggingMode debug) {
 
-  uint64_t cache_key = (static_cast<uint64_t>(resource_type) << 16) |
-      (static_cast<uint64_t>(resource_id) & 0xFFFF);
-  try {
-    return this->resource_data_cache.at(cache_key);
-  } catch (const out_of_range&) { }
+  // if it's a system dcmp, try the native implementation first (unless we're
+  // debugging the emulated one). if it fails, fall back to emulation
+  string native_result;
+  bool native_succeeded = false;
+  if (use_system_dcmp &&
+      (system_decompressor_mode != SystemDecompressorMode::Emulated) &&
+      ((debug == DebuggingMode::Disabled) || (debug == DebuggingMode::Passive))) {
+    uint64_t native_start_time = now();
+    try {
+      native_succeeded = decompress_resource_native(header, dcmp_resource_id,
+          data, native_result);
+    } catch (const exception& e) {
+      fprintf(resource_log_stream, "warning: native dcmp %hd failed (%s); emulating it instead\n",
+          dcmp_resource_id, e.what());
+    }
+    if (native_succeeded && (debug != DebuggingMode::Disabled)) {
+      uint64_t diff = now() - native_start_time;
+      float duration = static_cast<float>(diff) / 1000000.0f;
+      fprintf(stderr, "note: decompressed resource using native dcmp %hd in %g seconds\n",
+          dcmp_resource_id, duration);
+    }
+    if (native_succeeded &&
+        (system_decompressor_mode != SystemDecompressorMode::Verify)) {
+      return native_result;
+    }
+  }
+  if (use_system_dcmp) {
+    dcmp_contents = this->get_system_decompressor(dcmp_resource_id);
+  }
 
-  if (!this->empty) {
-    auto* reference_list = this->get_reference_list(resource_type);
-    for (const auto& e : *reference_list) {
-      if (e.resource_id != resource_id) {
-        continue;
+  // figure out where in the dcmp to start execution. there appear to be two
+  // formats: one that has 'dcmp' in bytes 4-8 where execution appears to just
+  // start at byte 0 (usually it's a branch opcode), and one where the first
+  // three words appear to be offsets to various functions, followed by code.
+  // the second word appears to be the main entry point in this format, so we'll
+  // use that to determine where to start execution.
+  uint32_t dcmp_entry_offset;
+  if (dcmp_contents.size() < 10) {
+    throw runtime_error("decompressor resource is too short");
+  }
+  if (dcmp_contents.substr(4, 4) == "dcmp") {
+    dcmp_entry_offset = 0;
+  } else {
+    dcmp_entry_offset = bswap16(*reinterpret_cast<const uint16_t*>(
+        dcmp_contents.data() + 2));
+  }
+  if ((debug != DebuggingMode::Disabled) && (debug != DebuggingMode::Passive)) {
+    fprintf(stderr, "dcmp entry offset is %08" PRIX32 "\n", dcmp_entry_offset);
+  }
+
+  // version 8 decompressors get a working buffer. the header says roughly how
+  // big the decompressed data is relative to the compressed data, so start with
+  // that (the system dcmps use much less than this). if the decompressor fails
+  // with a smaller buffer than the old worst-case assumption (that decompressed
+  // data is never more than 256 times the size of the input data), it's run
+  // again with a bigger one in case that was the problem.
+  size_t compressed_size = data.size() - sizeof(compressed_resource_header);
+  size_t max_working_buffer_size = 0;
+  size_t working_buffer_size = 0;
+  if (header.header_version == 8) {
+    max_working_buffer_size = data.size() * 256;
+    working_buffer_size = header.decompressed_size;
+    if (header.header8.working_buffer_fractional_size) {
+      working_buffer_size = max<size_t>(working_buffer_size,
+          (compressed_size * 256) / header.header8.working_buffer_fractional_size);
+    }
+    working_buffer_size = min<size_t>(working_buffer_size + 0x100,
+        max_working_buffer_size);
+  }
+
+  for (;;) {
+    try {
+      return execute_decompressor(data, header, dcmp_resource_id,
+          dcmp_contents, dcmp_entry_offset, working_buffer_size, debug,
+          native_succeeded ? &native_result : NULL);
+    } catch (const exception& e) {
+      if (working_buffer_size >= max_working_buffer_size) {
+        // in verify mode, the native result is still usable
+        if (native_succeeded) {
+          fprintf(resource_log_stream, "warning: emulated dcmp %hd failed (%s); using native result\n",
+              dcmp_resource_id, e.what());
+          return native_result;
+        }
+        throw;
       }
+      working_buffer_size = min<size_t>(working_buffer_size * 16,
+          max_working_buffer_size);
+      if (debug != DebuggingMode::Disabled) {
+        fprintf(stderr, "note: retrying decompression with a %zu-byte working buffer\n",
+            working_buffer_size);
+      }
+    }
+  }
+}
 
-      // yay we found it! now read the thing
-      size_t offset = header.resource_data_offset + (e.attributes_and_offset & 0x00FFFFFF);
-      uint32_t size;
-      preadx(fd, &size, sizeof(size), offset);
-      size = bswap32(size);
+bool ResourceFile::resource_exists(uint32_t resource_type, int16_t resource_id) {
+  return this->find_entry(resource_type, resource_id) != NULL;
+}
 
-      string result = preadx(fd, size, offset + sizeof(size));
+string ResourceFile::get_resource_data(uint32_t resource_type,
+    int16_t resource_id, bool decompress, DebuggingMode decompress_debug) {
+  // if nothing is cached, the loaded data can be returned without copying it
+  bool use_cache;
+  {
+    lock_guard<mutex> g(this->resource_data_cache_lock);
+    use_cache = (this->resource_data_cache_max_size != 0);
+  }
+  if (!use_cache) {
+    const auto* e = this->find_entry(resource_type, resource_id);
+    if (!e) {
+      throw out_of_range("file doesn\'t contain resource with the given id");
+    }
+    return this->load_resource_data(resource_type, e, decompress,
+        decompress_debug);
+  }
 
-      if ((e.attributes_and_offset & 0x01000000) && decompress) {
-        string ret = this->decompress_resource(result, decompress_debug);
-        this->resource_data_cache.emplace(cache_key, ret);
-        return ret;
+  return this->get_resource_data_view(resource_type, resource_id, decompress,
+      decompress_debug).str();
+}
 
-      } else {
-        this->resource_data_cache.emplace(cache_key, result);
-        return result;
-      }
+resource_data_view ResourceFile::get_resource_data_view(uint32_t resource_type,
+    int16_t resource_id, bool decompress, DebuggingMode decompress_debug) {
+
+  uint64_t cache_key = resource_key(resource_type, resource_id);
+  {
+    lock_guard<mutex> g(this->resource_data_cache_lock);
+    auto cache_it = this->resource_data_cache.find(cache_key);
+    if (cache_it != this->resource_data_cache.end()) {
+      this->resource_data_cache_lru.splice(this->resource_data_cache_lru.end(),
+          this->resource_data_cache_lru, cache_it->second);
+      return resource_data_view(cache_it->second->data);
     }
   }
 
-  throw out_of_range("file doesn\'t contain resource with the given id");
+  const auto* e = this->find_entry(resource_type, resource_id);
+  if (!e) {
+    throw out_of_range("file doesn\'t contain resource with the given id");
+  }
+
+  // if the file is mapped, uncompressed resources don't need to be copied or
+  // cached at all; the mapping already serves as the cache
+  bool should_decompress = (e->attributes_and_offset & 0x01000000) && decompress;
+  if (this->mapped_data && !should_decompress) {
+    ResourcePhaseTimer timer(resource_type, ResourcePhase::Read);
+    size_t offset = header.resource_data_offset + (e->attributes_and_offset & 0x00FFFFFF);
+    uint32_t size;
+    this->read_file_data(&size, sizeof(size), offset);
+    size = bswap32(size);
+    timer.add_bytes(size);
+    return this->mapped_range(offset + sizeof(size), size);
+  }
+
+  return this->add_to_cache(cache_key, this->load_resource_data(resource_type,
+      e, decompress, decompress_debug));
 }
 
-bool ResourceFile::resource_is_compressed(uint32_t resource_type,
-    int16_t resource_id) {
-  if (this->empty) {
-    return false;
+string ResourceFile::load_resource_data(uint32_t resource_type,
+    const resource_reference_list_entry* e, bool decompress,
+    DebuggingMode decompress_debug) {
+  string result;
+  {
+    ResourcePhaseTimer timer(resource_type, ResourcePhase::Read);
+    size_t offset = header.resource_data_offset + (e->attributes_and_offset & 0x00FFFFFF);
+    uint32_t size;
+    this->read_file_data(&size, sizeof(size), offset);
+    size = bswap32(size);
+
+    if (this->mapped_data) {
+      result = this->mapped_range(offset + sizeof(size), size).str();
+    } else {
+      result = preadx(this->fd, size, offset + sizeof(size));
+    }
+    timer.add_bytes(size);
   }
+  if ((e->attributes_and_offset & 0x01000000) && decompress) {
+    ResourcePhaseTimer timer(resource_type, ResourcePhase::Decompress);
+    result = this->decompress_resource(result, decompress_debug);
+    timer.add_bytes(result.size());
+  }
+  return result;
+}
 
-  auto* reference_list = this->get_reference_list(resource_type);
-  for (const auto& e : *reference_list) {
-    if (e.resource_id != resource_id) {
-      continue;
+resource_data_view ResourceFile::add_to_cache(uint64_t cache_key, string&& data) {
+  shared_ptr<const string> shared_data(new string(move(data)));
+
+  lock_guard<mutex> g(this->resource_data_cache_lock);
+
+  // if another thread loaded the same resource while we were working on it,
+  // use the existing entry so there's only one copy in memory
+  auto cache_it = this->resource_data_cache.find(cache_key);
+  if (cache_it != this->resource_data_cache.end()) {
+    return resource_data_view(cache_it->second->data);
+  }
+
+  // if the resource is bigger than the entire cache (or the cache is disabled),
+  // don't bother adding it
+  if (shared_data->size() >= this->resource_data_cache_max_size) {
+    return resource_data_view(move(shared_data));
+  }
+
+  this->resource_data_cache.emplace(cache_key, this->resource_data_cache_lru.emplace(
+      this->resource_data_cache_lru.end(),
+      cached_resource_data({cache_key, shared_data, NULL, shared_data->size()})));
+  this->resource_data_cache_size += shared_data->size();
+  this->evict_from_cache_locked();
+  return resource_data_view(move(shared_data));
+}
+
+void ResourceFile::evict_from_cache_locked() {
+  // views of evicted resources share ownership of the data, so they stay valid
+  while ((this->resource_data_cache_size > this->resource_data_cache_max_size) &&
+      !this->resource_data_cache_lru.empty()) {
+    const auto& entry = this->resource_data_cache_lru.front();
+    this->resource_data_cache_size -= entry.size;
+    if (entry.display_list.get()) {
+      this->pict_display_list_cache.erase(entry.key);
+    } else {
+      this->resource_data_cache.erase(entry.key);
     }
-    return (e.attributes_and_offset & 0x01000000);
+    this->resource_data_cache_lru.pop_front();
   }
-  return false;
+}
+
+bool ResourceFile::resource_is_compressed(uint32_t resource_type,
+    int16_t resource_id) {
+  const auto* e = this->find_entry(resource_type, resource_id);
+  return e && (e->attributes_and_offset & 0x01000000);
 }
 
 vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) {
   vector<int16_t> all_resources;
-  if (!this->empty) {
-    for (const auto& x : *this->get_reference_list(type)) {
-      all_resources.emplace_back(x.resource_id);
+  auto range_it = this->type_to_entry_range.find(type);
+  if (range_it != this->type_to_entry_range.end()) {
+    for (size_t x = range_it->second.first; x < range_it->second.second; x++) {
+      all_resources.emplace_back(this->entries[x].resource_id);
     }
   }
   return all_resources;
@@ -469,11 +861,10 @@ vector<int16_t> ResourceFile::all_resources_of_type(uint32_t type) {
 
 vector<pair<uint32_t, int16_t>> ResourceFile::all_resources() {
   vector<pair<uint32_t, int16_t>> all_resources;
-  if (!this->empty) {
-    for (const auto& entry : this->map_type_list.entries) {
-      for (const auto& x : *this->get_reference_list(entry.resource_type)) {
-        all_resources.emplace_back(entry.resource_type, x.resource_id);
-      }
+  all_resources.reserve(this->entries.size());
+  for (const auto& type_entry : this->map_type_list.entries) {
+    for (int16_t id : this->all_resources_of_type(type_entry.resource_type)) {
+      all_resources.emplace_back(type_entry.resource_type, id);
     }
   }
   return all_resources;
@@ -536,7 +927,8 @@ struct CODE_header {
   uint16_t unknown;
 
   void byteswap() {
-    this->entry_offset = bswap32(this->entry_offset);
+    this->entry_offset = bswap16(this->entry_offset);
+    this->unknown = bswap16(this->unknown);
   }
 };
 
@@ -565,7 +957,8 @@ struct CODE_far_header {
   }
 };
 
-string ResourceFile::decode_CODE(int16_t id, uint32_t type) {
+string ResourceFile::decode_CODE(int16_t id, uint32_t type,
+    analyzed_CODE* analysis) {
   string data = this->get_resource_data(type, id);
   if (id == 0) {
     if (data.size() < sizeof(CODE_0_header)) {
@@ -634,37 +1027,140 @@ string ResourceFile::decode_CODE(int16_t id, uint32_t type) {
       header_bytes = sizeof(CODE_header);
     }
 
-    // attempt to decode CODE 0 to get the exported label offsets
+    // get the exported label offsets from CODE 0
     unordered_multimap<uint32_t, string> labels;
-    try {
-      string code0_data = this->get_resource_data(type, 0);
-      if (code0_data.size() < sizeof(CODE_0_header)) {
-        throw runtime_error("CODE 0 too small for header");
-      }
-      auto* header = reinterpret_cast<CODE_0_header*>(const_cast<char*>(code0_data.data()));
-      header->byteswap(code0_data.size());
-
-      size_t count = (code0_data.size() - sizeof(CODE_0_header)) / sizeof(header->entries[0]);
-      for (size_t x = 0; x < count; x++) {
-        auto& e = header->entries[x];
-        if (e.push_opcode != 0x3F3C || e.trap_opcode != 0xA9F0) {
-          continue;
-        }
-        if (e.resource_id == id) {
-          labels.emplace(e.offset + header_bytes, string_printf("export_%zu", x));
-        }
+    const auto& jump_table = this->get_CODE_jump_table(type);
+    auto exports_it = jump_table.exports.find(id);
+    if (exports_it != jump_table.exports.end()) {
+      for (const auto& it : exports_it->second) {
+        labels.emplace(it.first + header_bytes, string_printf("export_%zu", it.second));
       }
+    }
 
-    } catch (const exception& e) {
-      // TODO: we probably should report this somehow
+    if (!analysis) {
+      ret += MC68KEmulator::disassemble(data.data() + header_bytes,
+          data.size() - header_bytes, header_bytes, &labels);
+      return ret;
     }
 
+    vector<mc68k_opcode_span> opcodes;
     ret += MC68KEmulator::disassemble(data.data() + header_bytes,
-        data.size() - header_bytes, header_bytes, &labels);
+        data.size() - header_bytes, header_bytes, &labels, &opcodes);
+    analysis->header_size = header_bytes;
+    this->analyze_CODE_code(*analysis, id, type, data.data() + header_bytes,
+        data.size() - header_bytes, &opcodes);
     return ret;
   }
 }
 
+ResourceFile::analyzed_CODE ResourceFile::analyze_CODE(int16_t id,
+    uint32_t type) {
+  if (id == 0) {
+    throw runtime_error("CODE 0 contains the jump table, not code");
+  }
+
+  auto data = this->get_resource_data_view(type, id);
+  if (data.size < sizeof(CODE_header)) {
+    throw runtime_error("CODE too small for header");
+  }
+  CODE_header header = *reinterpret_cast<const CODE_header*>(data.data);
+  header.byteswap();
+
+  analyzed_CODE ret;
+  if (header.entry_offset == 0xFFFF && header.unknown == 0x0000) {
+    if (data.size < sizeof(CODE_far_header)) {
+      throw runtime_error("CODE too small for far model header");
+    }
+    ret.header_size = sizeof(CODE_far_header);
+  } else {
+    ret.header_size = sizeof(CODE_header);
+  }
+
+  this->analyze_CODE_code(ret, id, type, data.data + ret.header_size,
+      data.size - ret.header_size, NULL);
+  return ret;
+}
+
+void ResourceFile::analyze_CODE_code(analyzed_CODE& ret, int16_t id,
+    uint32_t type, const void* code, size_t size,
+    const vector<mc68k_opcode_span>* opcodes) {
+  ret.jump_table_calls.clear();
+  const auto& jump_table = this->get_CODE_jump_table(type);
+  vector<uint32_t> entry_offsets(1, 0);
+  auto exports_it = jump_table.exports.find(id);
+  if (exports_it != jump_table.exports.end()) {
+    for (const auto& it : exports_it->second) {
+      entry_offsets.emplace_back(it.first);
+    }
+  }
+  ret.cfg = MC68KEmulator::analyze_control_flow(code, size, entry_offsets,
+      opcodes);
+
+  // calls through the jump table go to A5 + offset, which is the second word
+  // (the move.w #id, -[A7] opcode) of an entry that isn't loaded yet
+  for (size_t x = 0; x < ret.cfg.calls.size(); x++) {
+    const auto& c = ret.cfg.calls[x];
+    if (c.type != mc68k_control_flow_graph::call_type::A5_RELATIVE) {
+      continue;
+    }
+    int64_t entry_offset = static_cast<int64_t>(c.target) - jump_table.offset - 2;
+    if ((entry_offset < 0) || (entry_offset % sizeof(CODE_0_header::method_entry))) {
+      continue;
+    }
+    size_t entry_index = entry_offset / sizeof(CODE_0_header::method_entry);
+    if (entry_index >= jump_table.entries.size()) {
+      continue;
+    }
+    const auto& e = jump_table.entries[entry_index];
+    if (e.first == 0) {
+      continue;
+    }
+    ret.jump_table_calls.emplace_back(analyzed_CODE::jump_table_call({
+        static_cast<uint32_t>(x), static_cast<uint32_t>(entry_index), e.first,
+        e.second}));
+  }
+}
+
+const ResourceFile::CODE_jump_table& ResourceFile::get_CODE_jump_table(
+    uint32_t type) {
+  lock_guard<mutex> g(this->CODE_jump_tables_lock);
+
+  // unordered_map never moves its values, so the returned reference stays
+  // valid after the lock is released
+  auto it = this->CODE_jump_tables.find(type);
+  if (it != this->CODE_jump_tables.end()) {
+    return it->second;
+  }
+
+  auto& jump_table = this->CODE_jump_tables[type];
+  jump_table.offset = 0;
+  try {
+    string code0_data = this->get_resource_data(type, 0);
+    if (code0_data.size() < sizeof(CODE_0_header)) {
+      throw runtime_error("CODE 0 too small for header");
+    }
+    auto* header = reinterpret_cast<CODE_0_header*>(const_cast<char*>(code0_data.data()));
+    header->byteswap(code0_data.size());
+
+    jump_table.offset = header->jump_table_offset;
+    size_t count = (code0_data.size() - sizeof(CODE_0_header)) / sizeof(header->entries[0]);
+    for (size_t x = 0; x < count; x++) {
+      auto& e = header->entries[x];
+      if (e.push_opcode != 0x3F3C || e.trap_opcode != 0xA9F0) {
+        jump_table.entries.emplace_back(0, 0);
+        continue;
+      }
+      jump_table.entries.emplace_back(e.resource_id, e.offset);
+      jump_table.exports[e.resource_id].emplace_back(e.offset, x);
+    }
+
+  } catch (const exception& e) {
+    // TODO: we probably should report this somehow
+  }
+
+  return jump_table;
+}
+
 string ResourceFile::decode_dcmp(int16_t id, uint32_t type) {
   string data = this->get_resource_data(type, id);
   if (data.size() < 10) {
@@ -1278,19 +1774,94 @@ Image ResourceFile::decode_icmN(int16_t id, uint32_t type) {
   return decode_monochrome_image_masked(data.data(), data.size(), 16, 12);
 }
 
+shared_ptr<const pict_display_list> ResourceFile::get_PICT_display_list(
+    int16_t id, uint32_t type) {
+  uint64_t cache_key = resource_key(type, id);
+  auto dl = this->get_cached_PICT_display_list(cache_key);
+  if (dl.get()) {
+    return dl;
+  }
+  auto data = this->get_resource_data_view(type, id);
+  return this->add_PICT_display_list_to_cache(cache_key,
+      compile_quickdraw_picture(data.data, data.size));
+}
+
+shared_ptr<const pict_display_list> ResourceFile::get_cached_PICT_display_list(
+    uint64_t cache_key) {
+  lock_guard<mutex> g(this->resource_data_cache_lock);
+  auto cache_it = this->pict_display_list_cache.find(cache_key);
+  if (cache_it == this->pict_display_list_cache.end()) {
+    return NULL;
+  }
+  this->resource_data_cache_lru.splice(this->resource_data_cache_lru.end(),
+      this->resource_data_cache_lru, cache_it->second);
+  return cache_it->second->display_list;
+}
+
+shared_ptr<const pict_display_list> ResourceFile::add_PICT_display_list_to_cache(
+    uint64_t cache_key, shared_ptr<const pict_display_list> dl) {
+  size_t dl_size = pict_display_list_size(*dl);
+
+  lock_guard<mutex> g(this->resource_data_cache_lock);
+  auto cache_it = this->pict_display_list_cache.find(cache_key);
+  if (cache_it != this->pict_display_list_cache.end()) {
+    return cache_it->second->display_list;
+  }
+  if (dl_size >= this->resource_data_cache_max_size) {
+    return dl;
+  }
+  this->pict_display_list_cache.emplace(cache_key, this->resource_data_cache_lru.emplace(
+      this->resource_data_cache_lru.end(),
+      cached_resource_data({cache_key, NULL, dl, dl_size})));
+  this->resource_data_cache_size += dl_size;
+  this->evict_from_cache_locked();
+  return dl;
+}
+
 pict_render_result ResourceFile::decode_PICT(int16_t id, uint32_t type) {
-  string data = this->get_resource_data(type, id);
-  try {
-    return render_quickdraw_picture(data.data(), data.size());
-  } catch (const exception& e) {
-    fprintf(stderr, "warning: PICT rendering failed (%s); attempting rendering using picttoppm\n", e.what());
+  // if this PICT was rendered before, it doesn't have to be parsed again
+  uint64_t cache_key = resource_key(type, id);
+  auto dl = this->get_cached_PICT_display_list(cache_key);
+  string failure;
+  if (dl.get()) {
+    try {
+      return render_quickdraw_picture(*dl);
+    } catch (const exception& e) {
+      failure = e.what();
+    }
+  }
+
+  auto data = this->get_resource_data_view(type, id);
+  if (!dl.get()) {
+    bool use_cache;
+    {
+      lock_guard<mutex> g(this->resource_data_cache_lock);
+      use_cache = this->cache_PICT_display_lists &&
+          (this->resource_data_cache_max_size != 0);
+    }
+    try {
+      // if the display list won't be cached, it would just be thrown away after
+      // rendering it, so it's faster to render the PICT directly
+      if (use_cache) {
+        return render_quickdraw_picture(*this->add_PICT_display_list_to_cache(
+            cache_key, compile_quickdraw_picture(data.data, data.size)));
+      }
+      return render_quickdraw_picture(data.data, data.size);
+    } catch (const exception& e) {
+      count_PICT_failure(e);
+      failure = e.what();
+    }
   }
+  if (!use_picttoppm_fallback) {
+    throw runtime_error(failure);
+  }
+  fprintf(resource_log_stream, "warning: PICT rendering failed (%s); attempting rendering using picttoppm\n", failure.c_str());
 
   char temp_filename[36] = "/tmp/resource_dasm.XXXXXXXXXXXX";
   {
     int fd = mkstemp(temp_filename);
     auto f = fdopen_unique(fd, "wb");
-    fwrite(data.data(), data.size(), 1, f.get());
+    fwrite(data.data, data.size, 1, f.get());
   }
 
   char command[0x100];
@@ -1596,7 +2167,38 @@ struct snd_compressed_buffer {
   }
 };
 
-string decode_snd_data(string data) {
+// sample data is passed to the sink in blocks of at most this many bytes
+static const size_t WAV_BLOCK_SIZE = 0x10000;
+
+// writes a 16-bit WAV file with num_samples samples (across all channels) to
+// sink. decode_samples is called to decode each block of samples; blocks start
+// at multiples of block_samples, which should be a multiple of the number of
+// samples the decoder produces at once.
+static void write_wav16(const wav_sink_fn& sink, size_t num_samples,
+    uint16_t num_channels, uint16_t sample_rate,
+    const snd_sample_buffer* sample_buffer, uint32_t loop_factor,
+    size_t block_samples,
+    function<void(int16_t* dest, size_t start_sample, size_t count)> decode_samples) {
+  wav_header wav(num_samples / num_channels, num_channels, sample_rate, 16,
+      sample_buffer->loop_start * loop_factor,
+      sample_buffer->loop_end * loop_factor, sample_buffer->base_note);
+  if (wav.get_data_size() != 2 * num_samples) {
+    throw runtime_error(string_printf(
+      "computed data size (%" PRIu32 ") does not match decoded data size (%zu)",
+      wav.get_data_size(), 2 * num_samples));
+  }
+
+  sink(&wav, wav.size());
+  vector<int16_t> block(min(block_samples, num_samples));
+  for (size_t start = 0; start < num_samples; start += block_samples) {
+    size_t count = min(block_samples, num_samples - start);
+    decode_samples(block.data(), start, count);
+    sink(block.data(), count * sizeof(int16_t));
+  }
+}
+
+// data is modified (the headers are byteswapped in place)
+static void decode_snd_data(string& data, const wav_sink_fn& sink) {
   if (data.size() < 2) {
     throw runtime_error("snd doesn\'t even contain a format code");
   }
@@ -1697,10 +2299,9 @@ string decode_snd_data(string data) {
         sample_buffer->loop_start, sample_buffer->loop_end,
         sample_buffer->base_note);
 
-    string ret;
-    ret.append(reinterpret_cast<const char*>(&wav), wav.size());
-    ret.append(reinterpret_cast<const char*>(sample_buffer->data), sample_buffer->data_bytes);
-    return ret;
+    sink(&wav, wav.size());
+    sink(sample_buffer->data, sample_buffer->data_bytes);
+    return;
 
   // compressed data will need to be processed somehow... sigh
   } else if ((sample_buffer->encoding == 0xFE) || (sample_buffer->encoding == 0xFF)) {
@@ -1717,22 +2318,18 @@ string decode_snd_data(string data) {
       case 3:
       case 4: {
         bool is_mace3 = compressed_buffer->compression_id == 3;
-        auto decoded_samples = decode_mace(compressed_buffer->data,
-            compressed_buffer->num_frames * (is_mace3 ? 2 : 1) * num_channels,
-            num_channels == 2, is_mace3);
-        uint32_t loop_factor = is_mace3 ? 3 : 6;
-
-        wav_header wav(decoded_samples.size() / num_channels, num_channels,
-            sample_rate, 16, sample_buffer->loop_start * loop_factor,
-            sample_buffer->loop_end * loop_factor, sample_buffer->base_note);
-        if (wav.get_data_size() != 2 * decoded_samples.size()) {
-          throw runtime_error("computed data size does not match decoded data size");
-        }
-
-        string ret;
-        ret.append(reinterpret_cast<const char*>(&wav), wav.size());
-        ret.append(reinterpret_cast<const char*>(decoded_samples.data()), wav.get_data_size());
-        return ret;
+        const uint8_t* compressed_data = compressed_buffer->data;
+        size_t compressed_size = compressed_buffer->num_frames * (is_mace3 ? 2 : 1) * num_channels;
+        bool stereo = (num_channels == 2);
+        // the decoder state carries over between frames, so this can't be
+        // decoded in blocks
+        size_t num_samples = mace_decoded_sample_count(compressed_size, is_mace3);
+        write_wav16(sink, num_samples, num_channels, sample_rate,
+            sample_buffer, is_mace3 ? 3 : 6, num_samples,
+            [=](int16_t* dest, size_t start_sample, size_t count) {
+          decode_mace(dest, compressed_data, compressed_size, stereo, is_mace3);
+        });
+        return;
       }
 
       case 0xFFFF:
@@ -1741,30 +2338,47 @@ string decode_snd_data(string data) {
         // to the uncompressed case below. for all others, we'll have to
         // decompress somehow
         if ((compressed_buffer->format != 0x74776F73) && (compressed_buffer->format != 0x736F7774)) {
-          vector<int16_t> decoded_samples;
+          const uint8_t* compressed_data = compressed_buffer->data;
+          size_t num_frames = compressed_buffer->num_frames;
+          bool stereo = (num_channels == 2);
 
+          size_t num_samples;
+          size_t block_samples = WAV_BLOCK_SIZE / sizeof(int16_t);
           uint32_t loop_factor;
+          function<void(int16_t*, size_t, size_t)> decode_samples;
           if (compressed_buffer->format == 0x696D6134) { // ima4
-            decoded_samples = decode_ima4(compressed_buffer->data,
-                compressed_buffer->num_frames * 34 * num_channels,
-                num_channels == 2);
+            // packets decode independently, so blocks can start at any packet
+            // (or pair of packets, for stereo)
+            size_t compressed_size = num_frames * 34 * num_channels;
+            num_samples = ima4_decoded_sample_count(compressed_size);
+            decode_samples = [=](int16_t* dest, size_t start_sample, size_t count) {
+              decode_ima4(dest, compressed_data + (start_sample / 64) * 34,
+                  (count / 64) * 34, stereo);
+            };
             loop_factor = 4; // TODO: verify this. I don't actually have any examples right now
 
           } else if ((compressed_buffer->format == 0x4D414333) || (compressed_buffer->format == 0x4D414336)) { // MAC3, MAC6
             bool is_mace3 = compressed_buffer->format == 0x4D414333;
-            decoded_samples = decode_mace(compressed_buffer->data,
-                compressed_buffer->num_frames * (is_mace3 ? 2 : 1) * num_channels,
-                num_channels == 2, is_mace3);
+            size_t compressed_size = num_frames * (is_mace3 ? 2 : 1) * num_channels;
+            num_samples = mace_decoded_sample_count(compressed_size, is_mace3);
+            block_samples = num_samples;
+            decode_samples = [=](int16_t* dest, size_t start_sample, size_t count) {
+              decode_mace(dest, compressed_data, compressed_size, stereo, is_mace3);
+            };
             loop_factor = is_mace3 ? 3 : 6;
 
           } else if (compressed_buffer->format == 0x756C6177) { // ulaw
-            decoded_samples = decode_ulaw(compressed_buffer->data,
-                compressed_buffer->num_frames);
+            num_samples = num_frames;
+            decode_samples = [=](int16_t* dest, size_t start_sample, size_t count) {
+              decode_ulaw(dest, compressed_data + start_sample, count);
+            };
             loop_factor = 2;
 
           } else if (compressed_buffer->format == 0x616C6177) { // alaw (guess)
-            decoded_samples = decode_alaw(compressed_buffer->data,
-                compressed_buffer->num_frames);
+            num_samples = num_frames;
+            decode_samples = [=](int16_t* dest, size_t start_sample, size_t count) {
+              decode_alaw(dest, compressed_data + start_sample, count);
+            };
             loop_factor = 2;
 
           } else {
@@ -1772,19 +2386,9 @@ string decode_snd_data(string data) {
                 compressed_buffer->format));
           }
 
-          wav_header wav(decoded_samples.size() / num_channels, num_channels,
-              sample_rate, 16, sample_buffer->loop_start * loop_factor,
-              sample_buffer->loop_end * loop_factor, sample_buffer->base_note);
-          if (wav.get_data_size() != 2 * decoded_samples.size()) {
-            throw runtime_error(string_printf(
-              "computed data size (%" PRIu32 ") does not match decoded data size (%zu)",
-              wav.get_data_size(), 2 * decoded_samples.size()));
-          }
-
-          string ret;
-          ret.append(reinterpret_cast<const char*>(&wav), wav.size());
-          ret.append(reinterpret_cast<const char*>(decoded_samples.data()), wav.get_data_size());
-          return ret;
+          write_wav16(sink, num_samples, num_channels, sample_rate,
+              sample_buffer, loop_factor, block_samples, decode_samples);
+          return;
         }
 
         // intentional fallthrough to uncompressed case
@@ -1818,19 +2422,24 @@ string decode_snd_data(string data) {
               wav.get_data_size(), available_data));
         }
 
-        string ret;
-        ret.append(reinterpret_cast<const char*>(&wav), wav.size());
-        ret.append(reinterpret_cast<const char*>(compressed_buffer->data), wav.get_data_size());
+        sink(&wav, wav.size());
 
         // byteswap the samples if it's 16-bit and not 'swot'
         if ((wav.bits_per_sample == 0x10) && (compressed_buffer->format != 0x736F7774)) {
-          uint16_t* samples = const_cast<uint16_t*>(reinterpret_cast<const uint16_t*>(
-              ret.data() + wav.size()));
-          for (uint32_t x = 0; x < wav.get_data_size() / 2; x++) {
-            samples[x] = bswap16(samples[x]);
+          const uint16_t* samples = reinterpret_cast<const uint16_t*>(compressed_buffer->data);
+          size_t num_samples = wav.get_data_size() / 2;
+          vector<uint16_t> block(min<size_t>(WAV_BLOCK_SIZE / 2, num_samples));
+          for (size_t start = 0; start < num_samples; start += block.size()) {
+            size_t count = min<size_t>(block.size(), num_samples - start);
+            for (size_t x = 0; x < count; x++) {
+              block[x] = bswap16(samples[start + x]);
+            }
+            sink(block.data(), count * 2);
           }
+        } else {
+          sink(compressed_buffer->data, wav.get_data_size());
         }
-        return ret;
+        return;
       }
 
       default:
@@ -1844,61 +2453,153 @@ string decode_snd_data(string data) {
 
 
 
+// collects a sink's output in a string, for the decoders that return the
+// entire WAV file
+static wav_sink_fn string_sink(string& ret) {
+  return [&ret](const void* data, size_t size) {
+    ret.append(reinterpret_cast<const char*>(data), size);
+  };
+}
+
+string decode_snd_data(string data) {
+  string ret;
+  decode_snd_data(data, string_sink(ret));
+  return ret;
+}
+
 string ResourceFile::decode_snd(int16_t id, uint32_t type) {
-  return decode_snd_data(this->get_resource_data(type, id));
+  string ret;
+  this->decode_snd(id, type, string_sink(ret));
+  return ret;
 }
 
+void ResourceFile::decode_snd(int16_t id, uint32_t type,
+    const wav_sink_fn& sink) {
+  string data = this->get_resource_data(type, id);
+  decode_snd_data(data, sink);
+}
 
 
-static string lzss_decompress(const string& src) {
-  string ret;
-  size_t offset = 0;
 
-  for (;;) {
-    if (offset >= src.size()) {
-      return ret;
+// decompresses LZSS data into dest, stopping when the input runs out. returns
+// the number of bytes written. if the input would produce more than dest_size
+// bytes, the output is truncated if truncate is true; otherwise this throws.
+static size_t lzss_decompress(void* dest, size_t dest_size, const void* src,
+    size_t src_size, bool truncate) {
+  uint8_t* out = reinterpret_cast<uint8_t*>(dest);
+  uint8_t* out_end = out + dest_size;
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* in_end = in + src_size;
+
+  while (in != in_end) {
+    uint8_t control_bits = *(in++);
+
+    // a group of 8 tokens reads at most 16 bytes after the control byte, and
+    // writes at most 8 * 18 bytes (plus up to 7 more past the end of the last
+    // match; see below). if there's room for all of that, nothing in the group
+    // needs to be bounds-checked except the match distances.
+    if ((in_end - in >= 16) && (out_end - out >= 8 * 24)) {
+      for (uint8_t control_mask = 0x01; control_mask; control_mask <<= 1) {
+        if (control_bits & control_mask) {
+          *(out++) = *(in++);
+          continue;
+        }
+
+        uint16_t params = (in[0] << 8) | in[1];
+        in += 2;
+        size_t distance = (1 << 12) - (params & 0x0FFF);
+        size_t count = (params >> 12) + 3;
+        if (distance > static_cast<size_t>(out - reinterpret_cast<uint8_t*>(dest))) {
+          throw runtime_error("backreference before beginning of output");
+        }
+
+        // if the match is at least 8 bytes back, each 8-byte word only reads
+        // bytes that have already been written, so copy whole words. this can
+        // write up to 7 bytes past the end of the match, but later tokens
+        // overwrite them.
+        const uint8_t* copy_src = out - distance;
+        if (distance >= 8) {
+          for (size_t x = 0; x < count; x += 8) {
+            memcpy(out + x, copy_src + x, 8);
+          }
+        } else {
+          for (size_t x = 0; x < count; x++) {
+            out[x] = copy_src[x];
+          }
+        }
+        out += count;
+      }
+      continue;
     }
-    uint8_t control_bits = src.at(offset++);
 
+    // near the end of the input or output, check everything
     for (uint8_t control_mask = 0x01; control_mask; control_mask <<= 1) {
       if (control_bits & control_mask) {
-        if (offset >= src.size()) {
-          return ret;
+        if (in == in_end) {
+          break;
         }
-        ret += src.at(offset++);
+        if (out == out_end) {
+          if (truncate) {
+            return dest_size;
+          }
+          throw runtime_error("decompression produced too much data");
+        }
+        *(out++) = *(in++);
 
       } else {
-        if (offset >= src.size() - 1) {
-          return ret;
+        if (in_end - in < 2) {
+          in = in_end;
+          break;
+        }
+        uint16_t params = (in[0] << 8) | in[1];
+        in += 2;
+        size_t distance = (1 << 12) - (params & 0x0FFF);
+        size_t count = (params >> 12) + 3;
+        bool output_full = false;
+        if (count > static_cast<size_t>(out_end - out)) {
+          if (!truncate) {
+            throw runtime_error("decompression produced too much data");
+          }
+          count = out_end - out;
+          output_full = true;
+        }
+        if (distance > static_cast<size_t>(out - reinterpret_cast<uint8_t*>(dest))) {
+          throw runtime_error("backreference before beginning of output");
         }
-        uint16_t params = (static_cast<uint16_t>(src.at(offset)) << 8) | static_cast<uint8_t>(src.at(offset + 1));
-        offset += 2;
-
-        size_t copy_offset = ret.size() - ((1 << 12) - (params & 0x0FFF));
-        uint8_t count = ((params >> 12) & 0x0F) + 3;
-        size_t copy_end_offset = copy_offset + count;
 
-        for (; copy_offset != copy_end_offset; copy_offset++) {
-          ret += ret.at(copy_offset);
+        const uint8_t* copy_src = out - distance;
+        for (size_t x = 0; x < count; x++) {
+          out[x] = copy_src[x];
+        }
+        out += count;
+        if (output_full) {
+          return dest_size;
         }
       }
     }
   }
-  return ret;
+
+  return out - reinterpret_cast<uint8_t*>(dest);
 }
 
-static string decompress_soundmusicsys_data(const string& data) {
-  if (data.size() < 4) {
+static string decompress_soundmusicsys_data(const void* data, size_t size) {
+  if (size < 4) {
     throw runtime_error("resource too small for compression header");
   }
 
-  uint32_t decompressed_size = bswap32(*reinterpret_cast<const uint32_t*>(data.data()));
-  string decompressed = lzss_decompress(data.substr(4));
-  if (decompressed.size() < decompressed_size) {
+  // each control byte and its 8 tokens (at most 17 bytes) can produce at most
+  // 8 * 18 bytes, so don't bother allocating the output if the input is too
+  // small to fill it
+  uint32_t decompressed_size = bswap32(*reinterpret_cast<const uint32_t*>(data));
+  if (decompressed_size > ((size - 4) / 17 + 1) * (8 * 18)) {
     throw runtime_error("decompression did not produce enough data");
   }
-  if (decompressed.size() > decompressed_size) {
-    throw runtime_error("decompression produced too much data");
+
+  string decompressed(decompressed_size, '\0');
+  size_t bytes_written = lzss_decompress(&decompressed[0], decompressed.size(),
+      reinterpret_cast<const uint8_t*>(data) + 4, size - 4, false);
+  if (bytes_written < decompressed_size) {
+    throw runtime_error("decompression did not produce enough data");
   }
   return decompressed;
 }
@@ -1914,20 +2615,32 @@ static string decrypt_soundmusicsys_data(const string& src) {
 }
 
 string ResourceFile::decode_SMSD(int16_t id, uint32_t type) {
-  string data = this->get_resource_data(type, id);
-  if (data.size() < 8) {
+  string ret;
+  this->decode_SMSD(id, type, string_sink(ret));
+  return ret;
+}
+
+void ResourceFile::decode_SMSD(int16_t id, uint32_t type,
+    const wav_sink_fn& sink) {
+  auto data = this->get_resource_data_view(type, id);
+  if (data.size < 8) {
     throw runtime_error("resource too small for header");
   }
 
   // there's just an 8-byte header, then the rest of it is 22050khz 8-bit mono
-  wav_header wav(data.size() - 8, 1, 22050, 8);
+  wav_header wav(data.size - 8, 1, 22050, 8);
+  sink(&wav, wav.size());
+  sink(reinterpret_cast<const uint8_t*>(data.data) + 8, data.size - 8);
+}
+
+string ResourceFile::decode_csnd(int16_t id, uint32_t type) {
   string ret;
-  ret.append(reinterpret_cast<const char*>(&wav), wav.size());
-  ret.append(data.substr(8));
+  this->decode_csnd(id, type, string_sink(ret));
   return ret;
 }
 
-string ResourceFile::decode_csnd(int16_t id, uint32_t type) {
+void ResourceFile::decode_csnd(int16_t id, uint32_t type,
+    const wav_sink_fn& sink) {
   string data = this->get_resource_data(type, id);
   if (data.size() < 4) {
     throw runtime_error("csnd too small for header");
@@ -1949,11 +2662,13 @@ string ResourceFile::decode_csnd(int16_t id, uint32_t type) {
     }
   }
 
-  string decompressed = lzss_decompress(data.substr(4));
-  if (decompressed.size() < decompressed_size) {
+  // any data past decompressed_size is ignored
+  string decompressed(decompressed_size, '\0');
+  size_t bytes_written = lzss_decompress(&decompressed[0], decompressed.size(),
+      data.data() + 4, data.size() - 4, true);
+  if (bytes_written < decompressed_size) {
     throw runtime_error("decompression did not produce enough data");
   }
-  decompressed.resize(decompressed_size);
 
   // if sample_type isn't 0xFF, then the buffer is delta-encoded
   if (sample_type == 0) { // mono8
@@ -1990,16 +2705,30 @@ string ResourceFile::decode_csnd(int16_t id, uint32_t type) {
   }
 
   // the result is a normal snd resource
-  return decode_snd_data(decompressed);
+  decode_snd_data(decompressed, sink);
 }
 
 string ResourceFile::decode_esnd(int16_t id, uint32_t type) {
+  string ret;
+  this->decode_esnd(id, type, string_sink(ret));
+  return ret;
+}
+
+void ResourceFile::decode_esnd(int16_t id, uint32_t type,
+    const wav_sink_fn& sink) {
   string data = this->get_resource_data(type, id);
   string decrypted = decrypt_soundmusicsys_data(data);
-  return decode_snd_data(decrypted);
+  decode_snd_data(decrypted, sink);
 }
 
 string ResourceFile::decode_ESnd(int16_t id, uint32_t type) {
+  string ret;
+  this->decode_ESnd(id, type, string_sink(ret));
+  return ret;
+}
+
+void ResourceFile::decode_ESnd(int16_t id, uint32_t type,
+    const wav_sink_fn& sink) {
   string data = this->get_resource_data(type, id);
 
   uint8_t* ptr = reinterpret_cast<uint8_t*>(const_cast<char*>(data.data()));
@@ -2008,12 +2737,12 @@ string ResourceFile::decode_ESnd(int16_t id, uint32_t type) {
     *ptr = (sample += (*ptr ^ 0xFF));
   }
 
-  return decode_snd_data(data);
+  decode_snd_data(data, sink);
 }
 
 string ResourceFile::decode_cmid(int16_t id, uint32_t type) {
-  string data = this->get_resource_data(type, id);
-  return decompress_soundmusicsys_data(data);
+  auto data = this->get_resource_data_view(type, id);
+  return decompress_soundmusicsys_data(data.data, data.size);
 }
 
 string ResourceFile::decode_emid(int16_t id, uint32_t type) {
@@ -2024,7 +2753,7 @@ string ResourceFile::decode_emid(int16_t id, uint32_t type) {
 string ResourceFile::decode_ecmi(int16_t id, uint32_t type) {
   string data = this->get_resource_data(type, id);
   string decrypted = decrypt_soundmusicsys_data(data);
-  return decompress_soundmusicsys_data(decrypted);
+  return decompress_soundmusicsys_data(decrypted.data(), decrypted.size());
 }
 
 
@@ -2961,6 +3690,14 @@ string SingleResourceFile::get_resource_data(uint32_t type, int16_t id,
   return this->data;
 }
 
+resource_data_view SingleResourceFile::get_resource_data_view(uint32_t type,
+    int16_t id, bool decompress, DebuggingMode decompress_debug) {
+  if ((type != this->type) || (id != this->id)) {
+    throw out_of_range("file doesn\'t contain resource with the given id");
+  }
+  return resource_data_view(this->data);
+}
+
 bool SingleResourceFile::resource_is_compressed(uint32_t type, int16_t id) {
   return false;
 }
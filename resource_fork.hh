@@ -8,8 +8,15 @@
 #include <phosg/Filesystem.hh>
 #include <phosg/Image.hh>
 
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
 #include <vector>
 
+#include "decompression_cache.hh"
 #include "mc68k.hh"
 #include "quickdraw_formats.hh"
 #include "pict.hh"
@@ -84,6 +91,45 @@
 
 std::string string_for_resource_type(uint32_t type);
 
+// ResourceFile writes warnings here. this is stderr by default, but programs
+// that decode resources on multiple threads can point it at a per-thread buffer
+// to keep their output in a deterministic order.
+extern thread_local FILE* resource_log_stream;
+
+// controls how the system dcmps (0-3) are run when a file doesn't have its own.
+// Native uses the built-in implementations where they exist and falls back to
+// emulating the 68K code if they fail; Emulated always emulates; Verify runs
+// both, warns if they differ, and uses the emulated result. this should be set
+// before any resources are decompressed.
+enum class SystemDecompressorMode {
+  Native = 0,
+  Emulated,
+  Verify,
+};
+extern SystemDecompressorMode system_decompressor_mode;
+
+// if this is set, decompressed resources are looked up in (and added to) this
+// cache, so they don't have to be decompressed again in later runs. like the
+// above, this should be set before any resources are decompressed.
+extern std::shared_ptr<DecompressionCache> decompression_cache;
+
+// the maximum total size of resources each ResourceFile keeps in memory after
+// they're read (see ResourceFile::set_resource_data_cache_size). this only
+// affects ResourceFiles created after it's changed.
+extern size_t default_resource_data_cache_size;
+
+// PICTs are rendered natively; if that fails and this is set, decode_PICT runs
+// picttoppm (from netpbm) as a last resort instead of failing. this is on by
+// default, so tools that render PICTs keep working when the native renderer
+// can't handle one; resource_dasm turns it off unless --use-picttoppm is given,
+// since it's slow and picttoppm occasionally hangs.
+extern bool use_picttoppm_fallback;
+
+// returns the number of PICTs that couldn't be rendered natively because of
+// each (unimplemented) opcode, so it's easy to tell which ones are worth
+// implementing. this covers all ResourceFiles, on all threads.
+std::map<uint16_t, size_t> get_PICT_fallback_opcode_counts();
+
 
 struct resource_fork_header {
   uint32_t resource_data_offset;
@@ -91,7 +137,7 @@ struct resource_fork_header {
   uint32_t resource_data_size;
   uint32_t resource_map_size;
 
-  void read(int fd, size_t offset);
+  void byteswap();
 };
 
 struct resource_map_header {
@@ -102,7 +148,7 @@ struct resource_map_header {
   uint16_t resource_type_list_offset; // relative to start of this struct
   uint16_t resource_name_list_offset; // relative to start of this struct
 
-  void read(int fd, size_t offset);
+  void byteswap();
 };
 
 struct resource_type_list_entry {
@@ -110,14 +156,12 @@ struct resource_type_list_entry {
   uint16_t num_items; // actually num_items - 1
   uint16_t reference_list_offset; // relative to start of type list
 
-  void read(int fd, size_t offset);
+  void byteswap();
 };
 
 struct resource_type_list {
   uint16_t num_types; // actually num_types - 1
   std::vector<resource_type_list_entry> entries;
-
-  void read(int fd, size_t offset);
 };
 
 struct resource_reference_list_entry {
@@ -126,25 +170,76 @@ struct resource_reference_list_entry {
   uint32_t attributes_and_offset; // attr = high 8 bits; offset relative to resource data segment start
   uint32_t reserved;
 
-  void read(int fd, size_t offset);
+  void byteswap();
+};
+
+// receives a WAV file in pieces, in order: the header, then the sample data
+// (possibly in several blocks). the pointer is only valid during the call.
+typedef std::function<void(const void* data, size_t size)> wav_sink_fn;
+
+// reference to a resource's contents. for mmapped files this points directly
+// into the mapping, and is valid for as long as the ResourceFile exists.
+// otherwise it shares ownership of the buffer with the ResourceFile's cache (if
+// the resource is cached at all), so it stays valid even after the resource is
+// evicted or the ResourceFile is destroyed.
+struct resource_data_view {
+  const char* data;
+  size_t size;
+  std::shared_ptr<const std::string> owner; // NULL if not owned
+
+  resource_data_view();
+  resource_data_view(const char* data, size_t size);
+  resource_data_view(const std::string& data);
+  resource_data_view(std::shared_ptr<const std::string> owner);
+
+  std::string str() const;
 };
 
 
+// defined in resource_fork.cc
+struct compressed_resource_header;
 
+
+// all public methods of ResourceFile are safe to call from multiple threads at
+// once, as long as resource_log_stream is set appropriately on each thread.
 class ResourceFile {
 public:
-  ResourceFile(const std::string& filename);
-  ResourceFile(const char* filename);
-  virtual ~ResourceFile() = default;
+  // if use_mmap is true, the entire file is mapped into memory and resources
+  // are read directly from the mapping instead of with a pread per access. if
+  // the file can't be mapped, this silently falls back to pread.
+  ResourceFile(const std::string& filename, bool use_mmap = false);
+  ResourceFile(const char* filename, bool use_mmap = false);
+  virtual ~ResourceFile();
+
+  // resources are kept in memory after they're read (unless they can be read
+  // directly from the mapped file), so reading them again doesn't require
+  // another read or decompression. when the total size of the cached resources
+  // exceeds max_size bytes, the least recently used ones are discarded. if
+  // max_size is 0, nothing is cached, which saves memory and copies when each
+  // resource is only read once.
+  void set_resource_data_cache_size(size_t max_size);
+  // if enabled, decode_PICT keeps the display list of each PICT it renders in
+  // the resource data cache, so rendering the same PICT again doesn't have to
+  // parse it again. this is off by default, since most callers render each
+  // PICT once and the display lists would just push resources out of the cache.
+  void set_cache_PICT_display_lists(bool enabled);
 
   virtual bool resource_exists(uint32_t type, int16_t id);
   virtual std::string get_resource_data(uint32_t type, int16_t id,
       bool decompress = true,
       DebuggingMode decompress_debug = DebuggingMode::Disabled);
+  // like get_resource_data, but doesn't copy the data if it can be avoided
+  virtual resource_data_view get_resource_data_view(uint32_t type, int16_t id,
+      bool decompress = true,
+      DebuggingMode decompress_debug = DebuggingMode::Disabled);
   virtual bool resource_is_compressed(uint32_t type, int16_t id);
   virtual std::vector<int16_t> all_resources_of_type(uint32_t type);
   virtual std::vector<std::pair<uint32_t, int16_t>> all_resources();
 
+  // returns NULL if the resource doesn't exist. the returned entry is already
+  // byteswapped, and remains valid for the lifetime of the ResourceFile
+  const resource_reference_list_entry* find_entry(uint32_t type, int16_t id) const;
+
   uint32_t find_resource_by_id(int16_t id, const std::vector<uint32_t>& types);
 
   struct decoded_cicn {
@@ -190,6 +285,25 @@ public:
     bool constant_pitch;
   };
 
+  // control flow graph for a CODE segment. offsets in the graph are relative to
+  // the end of the segment's header, like the offsets in the CODE 0 jump table
+  // (add header_size to get the addresses used in decode_CODE's output). calls
+  // through the jump table are resolved to the segment and offset they reach.
+  // this only depends on the segment and CODE 0, so each segment can be
+  // analyzed (or reanalyzed) independently of the others.
+  struct analyzed_CODE {
+    struct jump_table_call {
+      uint32_t call_index; // in cfg.calls
+      uint32_t jump_table_index;
+      int16_t target_segment;
+      uint16_t target_offset;
+    };
+
+    size_t header_size;
+    mc68k_control_flow_graph cfg;
+    std::vector<jump_table_call> jump_table_calls; // in order of call_index
+  };
+
   struct decoded_SONG {
     int16_t midi_id;
     uint16_t tempo_bias;
@@ -222,23 +336,40 @@ public:
   Image decode_kcsN(int16_t id, uint32_t type = RESOURCE_TYPE_kcsN);
   decoded_INST decode_INST(int16_t id, uint32_t type = RESOURCE_TYPE_INST);
   pict_render_result decode_PICT(int16_t id, uint32_t type = RESOURCE_TYPE_PICT);
+  // parses the PICT into a display list that can be rendered repeatedly with
+  // render_quickdraw_picture. display lists share the resource data cache's
+  // size limit, so if it's 0, this parses the PICT every time it's called.
+  std::shared_ptr<const pict_display_list> get_PICT_display_list(int16_t id,
+      uint32_t type = RESOURCE_TYPE_PICT);
   std::vector<color> decode_pltt(int16_t id, uint32_t type = RESOURCE_TYPE_pltt);
   std::vector<color> decode_clut(int16_t id, uint32_t type = RESOURCE_TYPE_clut);
+  // the sound decoders return WAV files. the versions that take a sink write
+  // the file through it in pieces instead, so it's never all in memory at once.
   std::string decode_snd(int16_t id, uint32_t type = RESOURCE_TYPE_snd);
+  void decode_snd(int16_t id, uint32_t type, const wav_sink_fn& sink);
   std::string decode_csnd(int16_t id, uint32_t type = RESOURCE_TYPE_csnd);
+  void decode_csnd(int16_t id, uint32_t type, const wav_sink_fn& sink);
   std::string decode_esnd(int16_t id, uint32_t type = RESOURCE_TYPE_esnd);
+  void decode_esnd(int16_t id, uint32_t type, const wav_sink_fn& sink);
   std::string decode_ESnd(int16_t id, uint32_t type = RESOURCE_TYPE_ESnd);
+  void decode_ESnd(int16_t id, uint32_t type, const wav_sink_fn& sink);
   std::string decode_cmid(int16_t id, uint32_t type = RESOURCE_TYPE_cmid);
   std::string decode_emid(int16_t id, uint32_t type = RESOURCE_TYPE_emid);
   std::string decode_ecmi(int16_t id, uint32_t type = RESOURCE_TYPE_ecmi);
   std::string decode_SMSD(int16_t id, uint32_t type = RESOURCE_TYPE_SMSD);
+  void decode_SMSD(int16_t id, uint32_t type, const wav_sink_fn& sink);
   decoded_SONG decode_SONG(int16_t id, uint32_t type = RESOURCE_TYPE_SONG);
   std::string decode_Tune(int16_t id, uint32_t type = RESOURCE_TYPE_Tune);
   std::pair<std::string, std::string> decode_STR(int16_t id, uint32_t type = RESOURCE_TYPE_STR);
   std::pair<std::vector<std::string>, std::string> decode_STRN(int16_t id, uint32_t type = RESOURCE_TYPE_STRN);
   std::string decode_TEXT(int16_t id, uint32_t type = RESOURCE_TYPE_TEXT);
   std::string decode_styl(int16_t id, uint32_t type = RESOURCE_TYPE_styl);
-  std::string decode_CODE(int16_t id, uint32_t type = RESOURCE_TYPE_CODE);
+  // if analysis is given (and id isn't 0), the segment's control flow is also
+  // analyzed and stored there. this uses the opcodes found while disassembling
+  // it, so it's faster than calling analyze_CODE afterward.
+  std::string decode_CODE(int16_t id, uint32_t type = RESOURCE_TYPE_CODE,
+      analyzed_CODE* analysis = NULL);
+  analyzed_CODE analyze_CODE(int16_t id, uint32_t type = RESOURCE_TYPE_CODE);
   std::string decode_dcmp(int16_t id, uint32_t type = RESOURCE_TYPE_dcmp);
   std::string decode_CDEF(int16_t id, uint32_t type = RESOURCE_TYPE_CDEF);
   std::string decode_INIT(int16_t id, uint32_t type = RESOURCE_TYPE_INIT);
@@ -259,18 +390,70 @@ public:
 
 private:
   scoped_fd fd;
+  const char* mapped_data;
+  size_t mapped_size;
 
   bool empty;
   resource_fork_header header;
   resource_map_header map_header;
   resource_type_list map_type_list;
-  std::unordered_map<uint32_t, std::vector<resource_reference_list_entry>> reference_list_cache;
 
-  std::unordered_map<uint64_t, std::string> resource_data_cache;
-
-  std::vector<resource_reference_list_entry>* get_reference_list(uint32_t type);
+  // all reference list entries for all types, indexed by (type, id) and by type
+  std::vector<resource_reference_list_entry> entries;
+  std::unordered_map<uint64_t, size_t> key_to_entry_index;
+  std::unordered_map<uint32_t, std::pair<size_t, size_t>> type_to_entry_range;
+
+  // resources and PICT display lists in least- to most-recently-used order,
+  // indexed by (type, id). each entry has either data or display_list set.
+  struct cached_resource_data {
+    uint64_t key;
+    std::shared_ptr<const std::string> data;
+    std::shared_ptr<const pict_display_list> display_list;
+    size_t size;
+  };
+  std::mutex resource_data_cache_lock;
+  std::list<cached_resource_data> resource_data_cache_lru;
+  std::unordered_map<uint64_t, std::list<cached_resource_data>::iterator> resource_data_cache;
+  std::unordered_map<uint64_t, std::list<cached_resource_data>::iterator> pict_display_list_cache;
+  size_t resource_data_cache_size;
+  size_t resource_data_cache_max_size;
+  bool cache_PICT_display_lists;
+
+  // CODE 0 jump tables, parsed on first use by decode_CODE and analyze_CODE so
+  // each segment doesn't have to parse CODE 0 again. indexed by type
+  struct CODE_jump_table {
+    uint32_t offset; // from A5 to the first entry
+    // (segment id, offset in segment after header) for each entry. the segment
+    // id is 0 for entries that aren't in the usual _LoadSeg format
+    std::vector<std::pair<int16_t, uint16_t>> entries;
+    // (offset in segment after header, entry index) for each valid entry,
+    // indexed by segment id
+    std::unordered_map<int16_t, std::vector<std::pair<uint16_t, size_t>>> exports;
+  };
+  std::mutex CODE_jump_tables_lock;
+  std::unordered_map<uint32_t, CODE_jump_table> CODE_jump_tables;
+
+  void read_file_data(void* dest, size_t size, size_t offset) const;
+  resource_data_view mapped_range(size_t offset, size_t size) const;
+  void build_index();
+  std::string load_resource_data(uint32_t resource_type,
+      const resource_reference_list_entry* e, bool decompress,
+      DebuggingMode decompress_debug);
+  resource_data_view add_to_cache(uint64_t cache_key, std::string&& data);
+  std::shared_ptr<const pict_display_list> get_cached_PICT_display_list(
+      uint64_t cache_key);
+  std::shared_ptr<const pict_display_list> add_PICT_display_list_to_cache(
+      uint64_t cache_key, std::shared_ptr<const pict_display_list> dl);
+  void evict_from_cache_locked();
+  const CODE_jump_table& get_CODE_jump_table(uint32_t type);
+  void analyze_CODE_code(analyzed_CODE& ret, int16_t id, uint32_t type,
+      const void* code, size_t size,
+      const std::vector<mc68k_opcode_span>* opcodes);
   std::string decompress_resource(const std::string& data,
       DebuggingMode debug = DebuggingMode::Disabled);
+  std::string run_decompressor(const std::string& data,
+      const compressed_resource_header& header, int16_t dcmp_resource_id,
+      bool use_system_dcmp, std::string&& dcmp_contents, DebuggingMode debug);
   static const std::string& get_system_decompressor(int16_t resource_id);
 };
 
@@ -285,6 +468,9 @@ public:
   virtual std::string get_resource_data(uint32_t type, int16_t id,
       bool decompress = true,
       DebuggingMode decompress_debug = DebuggingMode::Disabled);
+  virtual resource_data_view get_resource_data_view(uint32_t type, int16_t id,
+      bool decompress = true,
+      DebuggingMode decompress_debug = DebuggingMode::Disabled);
   virtual bool resource_is_compressed(uint32_t type, int16_t id);
   virtual std::vector<int16_t> all_resources_of_type(uint32_t type);
   virtual std::vector<std::pair<uint32_t, int16_t>> all_resources();
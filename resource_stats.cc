@@ -0,0 +1,93 @@
+#include "resource_stats.hh"
+
+#include <stdint.h>
+
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+using namespace std;
+
+
+
+bool resource_stats_enabled = false;
+
+static mutex global_stats_lock;
+static map<uint32_t, resource_type_stats> global_stats;
+
+static void merge_stats(map<uint32_t, resource_type_stats>& dest,
+    const unordered_map<uint32_t, resource_type_stats>& src) {
+  for (const auto& it : src) {
+    auto& dest_type_stats = dest[it.first];
+    for (size_t x = 0; x < NUM_RESOURCE_PHASES; x++) {
+      dest_type_stats[x].count += it.second[x].count;
+      dest_type_stats[x].nsecs += it.second[x].nsecs;
+      dest_type_stats[x].bytes += it.second[x].bytes;
+    }
+  }
+}
+
+// each thread's counters are added to the global totals when it exits
+struct thread_stats {
+  unordered_map<uint32_t, resource_type_stats> stats;
+
+  ~thread_stats() {
+    lock_guard<mutex> g(global_stats_lock);
+    merge_stats(global_stats, this->stats);
+  }
+};
+
+static thread_local thread_stats current_thread_stats;
+static thread_local ResourcePhaseTimer* current_timer = NULL;
+
+static uint64_t now_nsecs() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+      chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+
+
+const char* name_for_resource_phase(ResourcePhase phase) {
+  switch (phase) {
+    case ResourcePhase::MapParse:
+      return "map_parse";
+    case ResourcePhase::Read:
+      return "read";
+    case ResourcePhase::Decompress:
+      return "decompress";
+    case ResourcePhase::Decode:
+      return "decode";
+    case ResourcePhase::Write:
+      return "write";
+  }
+  return "unknown";
+}
+
+void ResourcePhaseTimer::start(uint32_t type, ResourcePhase phase) {
+  this->type = type;
+  this->phase = phase;
+  this->parent = current_timer;
+  current_timer = this;
+  this->start_nsecs = now_nsecs();
+}
+
+void ResourcePhaseTimer::finish() {
+  uint64_t elapsed_nsecs = now_nsecs() - this->start_nsecs;
+  current_timer = this->parent;
+  if (this->parent) {
+    this->parent->nested_nsecs += elapsed_nsecs;
+  }
+
+  auto& s = current_thread_stats.stats[this->type][static_cast<size_t>(this->phase)];
+  s.count++;
+  s.nsecs += elapsed_nsecs - this->nested_nsecs;
+  s.bytes += this->bytes;
+}
+
+map<uint32_t, resource_type_stats> collect_resource_stats() {
+  lock_guard<mutex> g(global_stats_lock);
+  merge_stats(global_stats, current_thread_stats.stats);
+  current_thread_stats.stats.clear();
+  return global_stats;
+}
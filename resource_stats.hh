@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <map>
+
+
+// counts and times the phases of extracting resources, by resource type. each
+// thread accumulates its own counters, so recording never takes a lock; they're
+// merged into the global totals when the thread exits. when stats are disabled,
+// the timers don't read the clock or touch the counters at all.
+
+enum class ResourcePhase {
+  MapParse = 0, // recorded with type 0, since it covers the entire file
+  Read,
+  Decompress,
+  Decode,
+  Write,
+};
+static const size_t NUM_RESOURCE_PHASES = 5;
+
+const char* name_for_resource_phase(ResourcePhase phase);
+
+struct resource_phase_stats {
+  uint64_t count;
+  uint64_t nsecs; // not including time spent in nested phases
+  uint64_t bytes;
+};
+typedef std::array<resource_phase_stats, NUM_RESOURCE_PHASES> resource_type_stats;
+
+// this should be set before any timers are created, and not changed afterward
+extern bool resource_stats_enabled;
+
+// times one phase for one resource type, from construction to destruction.
+// timers on the same thread nest: while one is active, the time spent in timers
+// created after it (e.g. reading another resource while decoding this one)
+// counts only toward those timers' phases.
+class ResourcePhaseTimer {
+public:
+  inline ResourcePhaseTimer(uint32_t type, ResourcePhase phase)
+      : enabled(resource_stats_enabled), nested_nsecs(0), bytes(0) {
+    if (this->enabled) {
+      this->start(type, phase);
+    }
+  }
+  inline ~ResourcePhaseTimer() {
+    if (this->enabled) {
+      this->finish();
+    }
+  }
+  ResourcePhaseTimer(const ResourcePhaseTimer&) = delete;
+  ResourcePhaseTimer(ResourcePhaseTimer&&) = delete;
+  ResourcePhaseTimer& operator=(const ResourcePhaseTimer&) = delete;
+  ResourcePhaseTimer& operator=(ResourcePhaseTimer&&) = delete;
+
+  inline void add_bytes(size_t bytes) {
+    this->bytes += bytes;
+  }
+
+private:
+  bool enabled;
+  uint32_t type;
+  ResourcePhase phase;
+  uint64_t start_nsecs;
+  uint64_t nested_nsecs;
+  uint64_t bytes;
+  ResourcePhaseTimer* parent;
+
+  void start(uint32_t type, ResourcePhase phase);
+  void finish();
+};
+
+// merges the calling thread's counters into the global totals and returns
+// them. counters from threads that are still running aren't included, so this
+// should be called after all the other threads that recorded stats have exited.
+std::map<uint32_t, resource_type_stats> collect_resource_stats();
@@ -0,0 +1,182 @@
+#include "row_kernels.hh"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROW_KERNELS_X86
+#endif
+
+using namespace std;
+
+
+
+// 1-bit pixels are expanded with tables indexed by source byte, which gives 8
+// pixels per lookup. this is about as fast as a vectorized version would be
+// (it's mostly memcpy), and doesn't depend on the CPU.
+
+struct monochrome_tables {
+  uint8_t rgb[0x100][24];
+  uint8_t rgba_color[0x100][32]; // alpha bytes are zero
+  uint8_t rgba_alpha[0x100][32]; // color bytes are zero
+
+  monochrome_tables() {
+    for (size_t v = 0; v < 0x100; v++) {
+      for (size_t z = 0; z < 8; z++) {
+        uint8_t value = (v & (0x80 >> z)) ? 0x00 : 0xFF;
+        uint8_t alpha = (v & (0x80 >> z)) ? 0xFF : 0x00;
+        memset(&this->rgb[v][z * 3], value, 3);
+        memset(&this->rgba_color[v][z * 4], value, 3);
+        this->rgba_color[v][z * 4 + 3] = 0x00;
+        memset(&this->rgba_alpha[v][z * 4], 0x00, 3);
+        this->rgba_alpha[v][z * 4 + 3] = alpha;
+      }
+    }
+  }
+};
+
+static const monochrome_tables& get_monochrome_tables() {
+  static const monochrome_tables tables;
+  return tables;
+}
+
+void decode_1bit_row_rgb(uint8_t* dest, const uint8_t* src, size_t w) {
+  const auto& tables = get_monochrome_tables();
+  size_t x;
+  for (x = 0; x + 8 <= w; x += 8) {
+    memcpy(dest + x * 3, tables.rgb[src[x / 8]], 24);
+  }
+  if (x < w) {
+    memcpy(dest + x * 3, tables.rgb[src[x / 8]], (w - x) * 3);
+  }
+}
+
+void decode_1bit_row_rgba_masked(uint8_t* dest, const uint8_t* src,
+    const uint8_t* mask, size_t w) {
+  const auto& tables = get_monochrome_tables();
+  for (size_t x = 0; x < w; x += 8) {
+    const uint8_t* color = tables.rgba_color[src[x / 8]];
+    const uint8_t* alpha = tables.rgba_alpha[mask[x / 8]];
+    size_t count = ((x + 8) <= w) ? 32 : (w - x) * 4;
+    for (size_t z = 0; z < count; z++) {
+      dest[x * 4 + z] = color[z] | alpha[z];
+    }
+  }
+}
+
+
+
+// scalar versions of the palette lookups, used if the CPU doesn't support
+// AVX2 (and for the last few pixels of each row if it does)
+
+static inline void write_rgb(uint8_t* dest, uint32_t color) {
+  dest[0] = color >> 16;
+  dest[1] = color >> 8;
+  dest[2] = color;
+}
+
+static void decode_4bit_row_rgb_scalar(uint8_t* dest, const uint8_t* src,
+    size_t w, const uint32_t* palette, size_t start_x) {
+  for (size_t x = start_x; x < w; x++) {
+    uint8_t indexes = src[x / 2];
+    write_rgb(dest + x * 3, palette[(x & 1) ? (indexes & 0x0F) : (indexes >> 4)]);
+  }
+}
+
+static void decode_8bit_row_rgb_scalar(uint8_t* dest, const uint8_t* src,
+    size_t w, const uint32_t* palette, size_t start_x) {
+  for (size_t x = start_x; x < w; x++) {
+    write_rgb(dest + x * 3, palette[src[x]]);
+  }
+}
+
+#ifdef ROW_KERNELS_X86
+
+// these look up 8 pixels at a time with a gather, then shuffle the low 3 bytes
+// of each palette entry into RGB order. each iteration writes 32 bytes but only
+// advances 24, so the loops stop while there are still at least 2 pixels left;
+// the scalar version finishes the row.
+
+__attribute__((target("avx2")))
+static inline void write_8_rgb_avx2(uint8_t* dest, __m256i indexes,
+    const uint32_t* palette) {
+  const __m256i rgb_shuffle = _mm256_setr_epi8(
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+      2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  __m256i colors = _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(palette), indexes, 4);
+  __m256i rgb = _mm256_shuffle_epi8(colors, rgb_shuffle);
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dest),
+      _mm256_castsi256_si128(rgb));
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(dest + 12),
+      _mm256_extracti128_si256(rgb, 1));
+}
+
+__attribute__((target("avx2")))
+static void decode_4bit_row_rgb_avx2(uint8_t* dest, const uint8_t* src,
+    size_t w, const uint32_t* palette) {
+  const __m128i low_nibbles = _mm_set1_epi8(0x0F);
+  size_t x;
+  for (x = 0; x + 10 <= w; x += 8) {
+    uint32_t packed;
+    memcpy(&packed, src + x / 2, sizeof(packed));
+    __m128i bytes = _mm_cvtsi32_si128(packed);
+    __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), low_nibbles);
+    __m128i low = _mm_and_si128(bytes, low_nibbles);
+    __m256i indexes = _mm256_cvtepu8_epi32(_mm_unpacklo_epi8(high, low));
+    write_8_rgb_avx2(dest + x * 3, indexes, palette);
+  }
+  decode_4bit_row_rgb_scalar(dest, src, w, palette, x);
+}
+
+__attribute__((target("avx2")))
+static void decode_8bit_row_rgb_avx2(uint8_t* dest, const uint8_t* src,
+    size_t w, const uint32_t* palette) {
+  size_t x;
+  for (x = 0; x + 10 <= w; x += 8) {
+    __m256i indexes = _mm256_cvtepu8_epi32(
+        _mm_loadl_epi64(reinterpret_cast<const __m128i*>(src + x)));
+    write_8_rgb_avx2(dest + x * 3, indexes, palette);
+  }
+  decode_8bit_row_rgb_scalar(dest, src, w, palette, x);
+}
+
+static bool cpu_has_avx2() {
+  static const bool ret = __builtin_cpu_supports("avx2");
+  return ret;
+}
+
+#endif
+
+void decode_4bit_row_rgb(uint8_t* dest, const uint8_t* src, size_t w,
+    const uint32_t* palette) {
+#ifdef ROW_KERNELS_X86
+  if (cpu_has_avx2()) {
+    decode_4bit_row_rgb_avx2(dest, src, w, palette);
+    return;
+  }
+#endif
+  decode_4bit_row_rgb_scalar(dest, src, w, palette, 0);
+}
+
+void decode_8bit_row_rgb(uint8_t* dest, const uint8_t* src, size_t w,
+    const uint32_t* palette) {
+#ifdef ROW_KERNELS_X86
+  if (cpu_has_avx2()) {
+    decode_8bit_row_rgb_avx2(dest, src, w, palette);
+    return;
+  }
+#endif
+  decode_8bit_row_rgb_scalar(dest, src, w, palette, 0);
+}
+
+void merge_rgb_row_with_alpha(uint8_t* dest, const uint8_t* rgb_src,
+    const uint8_t* alpha_src, size_t w) {
+  for (size_t x = 0; x < w; x++) {
+    dest[x * 4 + 0] = rgb_src[x * 3 + 0];
+    dest[x * 4 + 1] = rgb_src[x * 3 + 1];
+    dest[x * 4 + 2] = rgb_src[x * 3 + 2];
+    dest[x * 4 + 3] = alpha_src[x * 4 + 3];
+  }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+// functions that decode one row of pixels directly into an Image's data buffer
+// (8-bit RGB or RGBA, packed). they're used by the QuickDraw decoders, which
+// would otherwise spend most of their time in Image::write_pixel. some of these
+// have vectorized versions which are used if the CPU supports them; the results
+// are the same either way.
+
+// 1-bit pixels, most significant bit first. set bits are black and clear bits
+// are white. the masked version writes RGBA, with alpha 0xFF where mask bits are
+// set and 0x00 where they're clear.
+void decode_1bit_row_rgb(uint8_t* dest, const uint8_t* src, size_t w);
+void decode_1bit_row_rgba_masked(uint8_t* dest, const uint8_t* src,
+    const uint8_t* mask, size_t w);
+
+// indexed pixels, looked up in a palette of 0xRRGGBB values. 4-bit pixels are
+// two per byte (high nibble first); the palette must have at least 16 entries
+// for 4-bit pixels and 256 for 8-bit pixels.
+void decode_4bit_row_rgb(uint8_t* dest, const uint8_t* src, size_t w,
+    const uint32_t* palette);
+void decode_8bit_row_rgb(uint8_t* dest, const uint8_t* src, size_t w,
+    const uint32_t* palette);
+
+// copies RGB pixels into RGBA pixels, taking the alpha channel from another row
+// of RGBA pixels
+void merge_rgb_row_with_alpha(uint8_t* dest, const uint8_t* rgb_src,
+    const uint8_t* alpha_src, size_t w);
@@ -0,0 +1,619 @@
+#include "system_decompressors.hh"
+
+#include <stdint.h>
+#include <string.h>
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace std;
+
+
+
+// these tables were extracted from the code in system_dcmps/
+
+// words written by dcmp 0 opcodes 4B-FD
+static const uint16_t dcmp0_constant_words[0xB3] = {
+  0x0000, 0x4EBA, 0x0008, 0x4E75, 0x000C, 0x4EAD, 0x2053, 0x2F0B,
+  0x6100, 0x0010, 0x7000, 0x2F00, 0x486E, 0x2050, 0x206E, 0x2F2E,
+  0xFFFC, 0x48E7, 0x3F3C, 0x0004, 0xFFF8, 0x2F0C, 0x2006, 0x4EED,
+  0x4E56, 0x2068, 0x4E5E, 0x0001, 0x588F, 0x4FEF, 0x0002, 0x0018,
+  0x6000, 0xFFFF, 0x508F, 0x4E90, 0x0006, 0x266E, 0x0014, 0xFFF4,
+  0x4CEE, 0x000A, 0x000E, 0x41EE, 0x4CDF, 0x48C0, 0xFFF0, 0x2D40,
+  0x0012, 0x302E, 0x7001, 0x2F28, 0x2054, 0x6700, 0x0020, 0x001C,
+  0x205F, 0x1800, 0x266F, 0x4878, 0x0016, 0x41FA, 0x303C, 0x2840,
+  0x7200, 0x286E, 0x200C, 0x6600, 0x206B, 0x2F07, 0x558F, 0x0028,
+  0xFFFE, 0xFFEC, 0x22D8, 0x200B, 0x000F, 0x598F, 0x2F3C, 0xFF00,
+  0x0118, 0x81E1, 0x4A00, 0x4EB0, 0xFFE8, 0x48C7, 0x0003, 0x0022,
+  0x0007, 0x001A, 0x6706, 0x6708, 0x4EF9, 0x0024, 0x2078, 0x0800,
+  0x6604, 0x002A, 0x4ED0, 0x3028, 0x265F, 0x6704, 0x0030, 0x43EE,
+  0x3F00, 0x201F, 0x001E, 0xFFF6, 0x202E, 0x42A7, 0x2007, 0xFFFA,
+  0x6002, 0x3D40, 0x0C40, 0x6606, 0x0026, 0x2D48, 0x2F01, 0x70FF,
+  0x6004, 0x1880, 0x4A40, 0x0040, 0x002C, 0x2F08, 0x0011, 0xFFE4,
+  0x2140, 0x2640, 0xFFF2, 0x426E, 0x4EB9, 0x3D7C, 0x0038, 0x000D,
+  0x6006, 0x422E, 0x203C, 0x670C, 0x2D68, 0x6608, 0x4A2E, 0x4AAE,
+  0x002E, 0x4840, 0x225F, 0x2200, 0x670A, 0x3007, 0x4267, 0x0032,
+  0x2028, 0x0009, 0x487A, 0x0200, 0x2F2B, 0x0005, 0x226E, 0x6602,
+  0xE580, 0x670E, 0x660A, 0x0050, 0x3E00, 0x660C, 0x2E00, 0xFFEE,
+  0x206D, 0x2040, 0xFFE0, 0x5340, 0x6008, 0x0480, 0x0068, 0x0B7C,
+  0x4400, 0x41E8, 0x4841,
+};
+
+// words written by dcmp 1 opcodes D5-FD
+static const uint16_t dcmp1_constant_words[0x29] = {
+  0x0000, 0x0001, 0x0002, 0x0003, 0x2E01, 0x3E01, 0x0101, 0x1E01,
+  0xFFFF, 0x0E01, 0x3100, 0x1112, 0x0107, 0x3332, 0x1239, 0xED10,
+  0x0127, 0x2322, 0x0137, 0x0706, 0x0117, 0x0123, 0x00FF, 0x002F,
+  0x070E, 0xFD3C, 0x0135, 0x0115, 0x0102, 0x0007, 0x003E, 0x05D5,
+  0x0201, 0x0607, 0x0708, 0x3001, 0x0133, 0x0010, 0x1716, 0x373E,
+  0x3637,
+};
+
+// dcmp 2's table, used if the resource doesn't supply its own
+static const uint16_t dcmp2_default_table[0x100] = {
+  0x0000, 0x0008, 0x4EBA, 0x206E, 0x4E75, 0x000C, 0x0004, 0x7000,
+  0x0010, 0x0002, 0x486E, 0xFFFC, 0x6000, 0x0001, 0x48E7, 0x2F2E,
+  0x4E56, 0x0006, 0x4E5E, 0x2F00, 0x6100, 0xFFF8, 0x2F0B, 0xFFFF,
+  0x0014, 0x000A, 0x0018, 0x205F, 0x000E, 0x2050, 0x3F3C, 0xFFF4,
+  0x4CEE, 0x302E, 0x6700, 0x4CDF, 0x266E, 0x0012, 0x001C, 0x4267,
+  0xFFF0, 0x303C, 0x2F0C, 0x0003, 0x4ED0, 0x0020, 0x7001, 0x0016,
+  0x2D40, 0x48C0, 0x2078, 0x7200, 0x588F, 0x6600, 0x4FEF, 0x42A7,
+  0x6706, 0xFFFA, 0x558F, 0x286E, 0x3F00, 0xFFFE, 0x2F3C, 0x6704,
+  0x598F, 0x206B, 0x0024, 0x201F, 0x41FA, 0x81E1, 0x6604, 0x6708,
+  0x001A, 0x4EB9, 0x508F, 0x202E, 0x0007, 0x4EB0, 0xFFF2, 0x3D40,
+  0x001E, 0x2068, 0x6606, 0xFFF6, 0x4EF9, 0x0800, 0x0C40, 0x3D7C,
+  0xFFEC, 0x0005, 0x203C, 0xFFE8, 0xDEFC, 0x4A2E, 0x0030, 0x0028,
+  0x2F08, 0x200B, 0x6002, 0x426E, 0x2D48, 0x2053, 0x2040, 0x1800,
+  0x6004, 0x41EE, 0x2F28, 0x2F01, 0x670A, 0x4840, 0x2007, 0x6608,
+  0x0118, 0x2F07, 0x3028, 0x3F2E, 0x302B, 0x226E, 0x2F2B, 0x002C,
+  0x670C, 0x225F, 0x6006, 0x00FF, 0x3007, 0xFFEE, 0x5340, 0x0040,
+  0xFFE4, 0x4A40, 0x660A, 0x000F, 0x4EAD, 0x70FF, 0x22D8, 0x486B,
+  0x0022, 0x204B, 0x670E, 0x4AAE, 0x4E90, 0xFFE0, 0xFFC0, 0x002A,
+  0x2740, 0x6702, 0x51C8, 0x02B6, 0x487A, 0x2278, 0xB06E, 0xFFE6,
+  0x0009, 0x322E, 0x3E00, 0x4841, 0xFFEA, 0x43EE, 0x4E71, 0x7400,
+  0x2F2C, 0x206C, 0x003C, 0x0026, 0x0050, 0x1880, 0x301F, 0x2200,
+  0x660C, 0xFFDA, 0x0038, 0x6602, 0x302C, 0x200C, 0x2D6E, 0x4240,
+  0xFFE2, 0xA9F0, 0xFF00, 0x377C, 0xE580, 0xFFDC, 0x4868, 0x594F,
+  0x0034, 0x3E1F, 0x6008, 0x2F06, 0xFFDE, 0x600A, 0x7002, 0x0032,
+  0xFFCC, 0x0080, 0x2251, 0x101F, 0x317C, 0xA029, 0xFFD8, 0x5240,
+  0x0100, 0x6710, 0xA023, 0xFFCE, 0xFFD4, 0x2006, 0x4878, 0x002E,
+  0x504F, 0x43FA, 0x6712, 0x7600, 0x41E8, 0x4A6E, 0x20D9, 0x005A,
+  0x7FFF, 0x51CA, 0x005C, 0x2E00, 0x0240, 0x48C7, 0x6714, 0x0C80,
+  0x2E9F, 0xFFD6, 0x8000, 0x1000, 0x4842, 0x4A6B, 0xFFD2, 0x0048,
+  0x4A47, 0x4ED1, 0x206F, 0x0041, 0x600C, 0x2A78, 0x422E, 0x3200,
+  0x6574, 0x6716, 0x0044, 0x486D, 0x2008, 0x486C, 0x0B7C, 0x2640,
+  0x0400, 0x0068, 0x206D, 0x000D, 0x2A40, 0x000B, 0x003E, 0x0220,
+};
+
+
+
+bool has_native_system_decompressor(int16_t dcmp_resource_id) {
+  return (dcmp_resource_id >= 0) && (dcmp_resource_id <= 3);
+}
+
+
+
+// all reads are bounds-checked. the emulated decompressors would read whatever
+// is after the input buffer instead of failing, but if that happens the data is
+// malformed anyway, so we just throw and let the caller use the emulator.
+struct dcmp_reader {
+  const uint8_t* data;
+  size_t size;
+  size_t offset;
+
+  dcmp_reader(const void* data, size_t size) :
+      data(reinterpret_cast<const uint8_t*>(data)), size(size), offset(0) { }
+
+  const uint8_t* get_bytes(size_t count) {
+    if (count > this->size - this->offset) {
+      throw out_of_range("compressed data ends unexpectedly");
+    }
+    const uint8_t* ret = this->data + this->offset;
+    this->offset += count;
+    return ret;
+  }
+
+  uint8_t get_u8() {
+    return *this->get_bytes(1);
+  }
+
+  uint16_t get_u16() {
+    const uint8_t* p = this->get_bytes(2);
+    return (p[0] << 8) | p[1];
+  }
+
+  // dcmp 0 and 1 use this for counts and values. 00-7F are literal values,
+  // 80-FE are the high byte of a signed 15-bit value (biased by C0), and FF is
+  // followed by a 32-bit value
+  int32_t get_varint() {
+    uint8_t v = this->get_u8();
+    if (v < 0x80) {
+      return v;
+    }
+    if (v == 0xFF) {
+      const uint8_t* p = this->get_bytes(4);
+      return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+    }
+    return static_cast<int16_t>((((v - 0xC0) & 0xFF) << 8) | this->get_u8());
+  }
+};
+
+// the emulated decompressors write into a zero-filled buffer of the expected
+// size, so this does the same
+struct dcmp_writer {
+  string data;
+  size_t offset;
+
+  dcmp_writer(size_t size) : data(size, '\0'), offset(0) { }
+
+  uint8_t* get_bytes(size_t count) {
+    if (count > this->data.size() - this->offset) {
+      throw runtime_error("decompressed data is larger than expected");
+    }
+    uint8_t* ret = reinterpret_cast<uint8_t*>(&this->data[this->offset]);
+    this->offset += count;
+    return ret;
+  }
+
+  void write(const void* src, size_t size) {
+    if (size) {
+      memcpy(this->get_bytes(size), src, size);
+    }
+  }
+
+  void put_u8(uint8_t v) {
+    *this->get_bytes(1) = v;
+  }
+
+  void put_u16(uint16_t v) {
+    uint8_t* p = this->get_bytes(2);
+    p[0] = v >> 8;
+    p[1] = v;
+  }
+
+  void put_u32(uint32_t v) {
+    uint8_t* p = this->get_bytes(4);
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+  }
+};
+
+// the 68K code uses dbf for its loops, so counts are effectively 16 bits. we
+// don't try to reproduce what happens with larger (or negative) counts.
+static uint16_t check_count(int32_t count) {
+  if ((count < 0) || (count > 0xFFFF)) {
+    throw runtime_error("count is out of range");
+  }
+  return count;
+}
+
+
+
+// dcmp 0 and 1 save some literal runs so they can be referred to by later
+// opcodes. the entries point into the compressed data.
+typedef vector<pair<const uint8_t*, size_t>> dcmp_literal_table;
+
+static void write_saved_literal(dcmp_writer& w,
+    const dcmp_literal_table& literals, size_t index) {
+  if (index >= literals.size()) {
+    throw out_of_range("reference to nonexistent saved literal");
+  }
+  const auto& literal = literals[index];
+  w.write(literal.first, literal.second);
+}
+
+// dcmp 0 and 1 have the same set of extended opcodes (prefixed with FE)
+static void decompress_system01_extended(dcmp_reader& r, dcmp_writer& w) {
+  uint8_t subopcode = r.get_u8();
+  switch (subopcode) {
+    case 0x00: { // segment loader jump table entries for unloaded segments
+      uint16_t segment_number = r.get_varint();
+      uint16_t count = check_count(r.get_varint());
+      uint16_t offset = 6;
+      for (; count > 0; count--) {
+        offset += r.get_varint() - 6;
+        w.put_u16(0x3F3C); // move.w -[A7], segment_number
+        w.put_u16(segment_number);
+        w.put_u16(0xA9F0); // trap _LoadSeg
+        w.put_u16(offset); // offset of the next entry's function
+      }
+      w.put_u16(0x3F3C);
+      w.put_u16(segment_number);
+      w.put_u16(0xA9F0);
+      break;
+    }
+
+    case 0x01: { // jump table entries for loaded segments
+      uint16_t bsr_offset = r.get_varint();
+      uint16_t a5_offset_delta = r.get_varint();
+      uint16_t count = check_count(r.get_varint());
+      uint16_t a5_offset = r.get_varint();
+      for (;;) {
+        w.put_u16(0x6100); // bsr bsr_offset
+        w.put_u16(bsr_offset);
+        w.put_u16(0x4EED); // jmp [A5 + a5_offset]
+        w.put_u16(a5_offset);
+        if (count == 0) {
+          break;
+        }
+        count--;
+        bsr_offset -= 8;
+        if (a5_offset_delta) {
+          a5_offset += a5_offset_delta;
+        } else {
+          a5_offset = r.get_varint();
+        }
+      }
+      break;
+    }
+
+    case 0x02: { // repeated byte
+      uint8_t value = r.get_varint();
+      size_t count = check_count(r.get_varint()) + 1;
+      memset(w.get_bytes(count), value, count);
+      break;
+    }
+
+    case 0x03: { // repeated word
+      uint16_t value = r.get_varint();
+      size_t count = check_count(r.get_varint()) + 1;
+      for (; count > 0; count--) {
+        w.put_u16(value);
+      }
+      break;
+    }
+
+    case 0x04: { // words with 8-bit deltas
+      uint16_t value = r.get_varint();
+      uint16_t count = check_count(r.get_varint());
+      w.put_u16(value);
+      for (; count > 0; count--) {
+        value += static_cast<int8_t>(r.get_u8());
+        w.put_u16(value);
+      }
+      break;
+    }
+
+    case 0x05: { // words with variable-length deltas
+      uint16_t value = r.get_varint();
+      uint16_t count = check_count(r.get_varint());
+      w.put_u16(value);
+      for (; count > 0; count--) {
+        value += r.get_varint();
+        w.put_u16(value);
+      }
+      break;
+    }
+
+    case 0x06: { // longs with variable-length deltas
+      uint32_t value = r.get_varint();
+      uint16_t count = check_count(r.get_varint());
+      w.put_u32(value);
+      for (; count > 0; count--) {
+        value += r.get_varint();
+        w.put_u32(value);
+      }
+      break;
+    }
+
+    default:
+      // the 68K code ignores other subopcodes, so we do too
+      break;
+  }
+}
+
+string decompress_system0(const void* data, size_t size,
+    size_t decompressed_size) {
+  dcmp_reader r(data, size);
+  dcmp_writer w(decompressed_size);
+  dcmp_literal_table literals;
+
+  for (;;) {
+    uint8_t opcode = r.get_u8();
+
+    if (opcode < 0x20) { // literal run (of words); 1X also saves it
+      size_t count = opcode & 0x0F;
+      if (count == 0) {
+        count = check_count(r.get_varint());
+        if (count > 0x7FFF) {
+          throw runtime_error("literal is too long");
+        }
+      }
+      count *= 2;
+      const uint8_t* literal = r.get_bytes(count);
+      if (opcode & 0x10) {
+        literals.emplace_back(literal, count);
+      }
+      w.write(literal, count);
+
+    } else if (opcode < 0x4B) { // saved literal reference
+      size_t index;
+      if (opcode == 0x20) {
+        index = r.get_u8() + 0x28;
+      } else if (opcode == 0x21) {
+        index = r.get_u8() + 0x128;
+      } else if (opcode == 0x22) {
+        index = r.get_u16() + 0x28;
+      } else {
+        index = opcode - 0x23;
+      }
+      write_saved_literal(w, literals, index);
+
+    } else if (opcode < 0xFE) {
+      w.put_u16(dcmp0_constant_words[opcode - 0x4B]);
+
+    } else if (opcode == 0xFE) {
+      decompress_system01_extended(r, w);
+
+    } else {
+      break;
+    }
+  }
+
+  return move(w.data);
+}
+
+string decompress_system1(const void* data, size_t size,
+    size_t decompressed_size) {
+  dcmp_reader r(data, size);
+  dcmp_writer w(decompressed_size);
+  dcmp_literal_table literals;
+
+  for (;;) {
+    uint8_t opcode = r.get_u8();
+
+    if ((opcode < 0x20) || (opcode == 0xD0) || (opcode == 0xD1)) {
+      // literal run; 1X and D1 also save it
+      size_t count;
+      bool save;
+      if (opcode < 0x20) {
+        count = (opcode & 0x0F) + 1;
+        save = opcode & 0x10;
+      } else {
+        count = check_count(r.get_varint());
+        save = (opcode == 0xD1);
+      }
+      const uint8_t* literal = r.get_bytes(count);
+      if (save) {
+        literals.emplace_back(literal, count);
+      }
+      w.write(literal, count);
+
+    } else if (opcode < 0xD0) { // saved literal reference
+      write_saved_literal(w, literals, opcode - 0x20);
+
+    } else if (opcode < 0xD5) { // saved literal reference, long form
+      size_t index;
+      if (opcode == 0xD2) {
+        index = r.get_u8() + 0xB0;
+      } else if (opcode == 0xD3) {
+        index = r.get_u8() + 0x1B0;
+      } else {
+        index = r.get_u16() + 0xB0;
+      }
+      write_saved_literal(w, literals, index);
+
+    } else if (opcode < 0xFE) {
+      w.put_u16(dcmp1_constant_words[opcode - 0xD5]);
+
+    } else if (opcode == 0xFE) {
+      decompress_system01_extended(r, w);
+
+    } else {
+      break;
+    }
+  }
+
+  return move(w.data);
+}
+
+string decompress_system2(const void* data, size_t size,
+    size_t decompressed_size, uint8_t custom_table_size, uint8_t flags) {
+  dcmp_reader r(data, size);
+  dcmp_writer w(decompressed_size);
+
+  // if flags bit 0 is set, the table is at the beginning of the data instead
+  // of using the default table. entries past the end of a custom table are zero
+  uint16_t custom_table[0x100];
+  const uint16_t* table = dcmp2_default_table;
+  if (flags & 0x01) {
+    size_t count = custom_table_size + 1;
+    const uint8_t* table_data = r.get_bytes(count * 2);
+    for (size_t x = 0; x < 0x100; x++) {
+      custom_table[x] = (x < count) ?
+          ((table_data[x * 2] << 8) | table_data[x * 2 + 1]) : 0;
+    }
+    table = custom_table;
+  }
+
+  size_t word_count = decompressed_size / 2;
+  if (flags & 0x02) {
+    // each tag byte describes the next 8 words; 1 bits are table references and
+    // 0 bits are literal words
+    for (size_t x = 0; x < word_count; x += 8) {
+      uint8_t tag = r.get_u8();
+      size_t group_count = ((word_count - x) < 8) ? (word_count - x) : 8;
+      for (size_t y = 0; y < group_count; y++, tag <<= 1) {
+        if (tag & 0x80) {
+          w.put_u16(table[r.get_u8()]);
+        } else {
+          w.write(r.get_bytes(2), 2);
+        }
+      }
+    }
+
+  } else {
+    // the 68K code always writes at least one word here, even if it shouldn't
+    if (word_count == 0) {
+      throw runtime_error("decompressed size is too small");
+    }
+    const uint8_t* indexes = r.get_bytes(word_count);
+    for (size_t x = 0; x < word_count; x++) {
+      w.put_u16(table[indexes[x]]);
+    }
+  }
+
+  // if the size is odd, the last byte is copied directly
+  if (decompressed_size & 1) {
+    w.put_u8(r.get_u8());
+  }
+
+  return move(w.data);
+}
+
+
+
+// dcmp 3 reads its input as a stream of bits, most-significant bit first. like
+// dcmp_reader, this throws if the data runs out (the 68K code reads a few bytes
+// past the end, but only uses them if the data is malformed).
+struct dcmp_bit_reader {
+  dcmp_reader r;
+  uint32_t buffer;
+  uint8_t buffered_bits;
+
+  dcmp_bit_reader(const void* data, size_t size) :
+      r(data, size), buffer(0), buffered_bits(0) { }
+
+  uint32_t get_bits(uint8_t count) {
+    while (this->buffered_bits < count) {
+      this->buffer = (this->buffer << 8) | this->r.get_u8();
+      this->buffered_bits += 8;
+    }
+    this->buffered_bits -= count;
+    return (this->buffer >> this->buffered_bits) & ((1 << count) - 1);
+  }
+
+  bool get_bit() {
+    return this->get_bits(1);
+  }
+};
+
+// dcmp 3 is an LZ77 variant. each step begins with a length code; if it's zero
+// (and the previous step wasn't a short literal run), a literal run follows.
+// otherwise it's a backreference, whose distance is encoded with fewer bits
+// when the output position is small.
+static uint16_t decompress_system3_length_code(dcmp_bit_reader& r) {
+  uint8_t prefix = 0;
+  while ((prefix < 10) && r.get_bit()) {
+    prefix++;
+  }
+  switch (prefix) {
+    case 0:
+      return r.get_bit();
+    case 1:
+      return r.get_bit() ? (r.get_bit() + 3) : 2;
+    case 2:
+      return r.get_bit() ? (r.get_bits(2) + 7) : (r.get_bit() + 5);
+    case 3:
+      return r.get_bits(3) + 11;
+    case 4:
+      return r.get_bits(3) + 19;
+    default: // 5-10
+      return r.get_bits(prefix) + (1 << prefix) - 5;
+  }
+}
+
+static size_t decompress_system3_literal_count(dcmp_bit_reader& r) {
+  if (!r.get_bit()) {
+    return 1;
+  }
+  switch (r.get_bits(2)) {
+    case 0:
+      return 2;
+    case 1:
+      return 3;
+    case 2:
+      return r.get_bits(2) + 4;
+    default: {
+      uint8_t v = r.get_bits(4);
+      if (v <= 7) {
+        return v + 8;
+      } else if (v <= 11) {
+        return ((v - 8) << 2) + 16 + r.get_bits(2);
+      } else {
+        return ((v - 12) << 3) + 32 + r.get_bits(3);
+      }
+    }
+  }
+}
+
+// the distance encoding to use is chosen by comparing the output position to
+// these limits; positions past the last limit use encoding 14
+static const size_t dcmp3_distance_position_limits[14] = {
+  10, 20, 40, 80, 160, 672, 1000, 2688, 5376, 10752, 21504, 43008, 70000,
+  172032,
+};
+
+static size_t decompress_system3_distance(dcmp_bit_reader& r, size_t pos) {
+  uint8_t encoding = 0;
+  while ((encoding < 14) &&
+         (pos > dcmp3_distance_position_limits[encoding])) {
+    encoding++;
+  }
+
+  // short distances use (encoding) or (encoding + 2) bits
+  if (!r.get_bit()) {
+    return r.get_bits(encoding) + 1;
+  }
+  if (!r.get_bit()) {
+    return r.get_bits(encoding + 2) + 1 + (1 << encoding);
+  }
+
+  // long distances use just enough bits to reach back to the beginning of the
+  // output, up to (encoding + 4) bits. encoding 7 has a different limit for 10
+  // bits in the 68K code (0x66C instead of 0x680), so we do the same.
+  size_t base = 1 + 5 * (1 << encoding);
+  uint8_t bits = 1;
+  for (; bits < encoding + 4; bits++) {
+    size_t limit = (encoding == 7 && bits == 10) ?
+        0x66C : (base - 1 + (1 << bits));
+    if (pos <= limit) {
+      break;
+    }
+  }
+  return r.get_bits(bits) + base;
+}
+
+string decompress_system3(const void* data, size_t size,
+    size_t decompressed_size) {
+  dcmp_bit_reader r(data, size);
+  dcmp_writer w(decompressed_size);
+
+  // after a literal run shorter than 63 bytes, the next step is always a
+  // backreference, so a length code of 0 means 3 bytes instead of a literal run
+  bool after_short_literal = false;
+  while (w.offset < decompressed_size) {
+    size_t length_code = decompress_system3_length_code(r);
+
+    if ((length_code == 0) && !after_short_literal) {
+      size_t count = decompress_system3_literal_count(r);
+      uint8_t* dest = w.get_bytes(count);
+      for (size_t x = 0; x < count; x++) {
+        dest[x] = r.get_bits(8);
+      }
+      after_short_literal = (count < 63);
+
+    } else {
+      size_t count = length_code + (after_short_literal ? 3 : 2);
+      after_short_literal = false;
+      size_t pos = w.offset;
+      size_t distance = decompress_system3_distance(r, pos);
+      if (distance > pos) {
+        throw runtime_error("backreference is before the beginning of the data");
+      }
+      // the source and destination can overlap, so this copies one byte at a
+      // time like the 68K code does
+      uint8_t* dest = w.get_bytes(count);
+      const uint8_t* src = dest - distance;
+      for (size_t x = 0; x < count; x++) {
+        dest[x] = src[x];
+      }
+    }
+  }
+
+  return move(w.data);
+}
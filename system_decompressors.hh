@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <string>
+
+
+// native implementations of the decompressors in system_dcmps/. these produce
+// the same output as running the 68K code in the emulator, but are much faster.
+// data points to the compressed data (after the compressed resource header) and
+// decompressed_size comes from the header. if the compressed data is malformed
+// or does something these don't handle, they throw; callers should fall back to
+// emulating the decompressor in that case.
+
+// returns true if there's a native implementation of this system dcmp
+bool has_native_system_decompressor(int16_t dcmp_resource_id);
+
+std::string decompress_system0(const void* data, size_t size,
+    size_t decompressed_size);
+std::string decompress_system1(const void* data, size_t size,
+    size_t decompressed_size);
+// dcmp 2 gets its parameters from the last two bytes of the version 9 header
+std::string decompress_system2(const void* data, size_t size,
+    size_t decompressed_size, uint8_t custom_table_size, uint8_t flags);
+std::string decompress_system3(const void* data, size_t size,
+    size_t decompressed_size);
@@ -0,0 +1,163 @@
+#include "thread_pool.hh"
+
+#include <stdint.h>
+
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+using namespace std;
+
+
+
+// used to figure out which queue add() should use when called from a task
+static thread_local ThreadPool* current_pool = NULL;
+static thread_local size_t current_worker_index = 0;
+
+
+
+ThreadPool::ThreadPool(size_t num_threads) : queued_count(0),
+    pending_count(0), should_exit(false), next_queue(0) {
+  if (num_threads == 0) {
+    num_threads = this->default_thread_count();
+  }
+  for (size_t x = 0; x < num_threads; x++) {
+    this->queues.emplace_back(new worker_queue());
+  }
+  for (size_t x = 0; x < num_threads; x++) {
+    this->threads.emplace_back(&ThreadPool::worker_thread_fn, this, x);
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<mutex> g(this->lock);
+    this->should_exit = true;
+  }
+  this->work_available.notify_all();
+  for (auto& t : this->threads) {
+    t.join();
+  }
+}
+
+void ThreadPool::add(function<void()> task) {
+  // the counts have to be updated before the task is visible in any queue, so
+  // a worker can't finish it before it's counted
+  {
+    lock_guard<mutex> g(this->lock);
+    this->queued_count++;
+    this->pending_count++;
+  }
+
+  size_t queue_index = (current_pool == this) ? current_worker_index :
+      (this->next_queue++ % this->queues.size());
+  auto& q = *this->queues[queue_index];
+  {
+    lock_guard<mutex> g(q.lock);
+    q.tasks.emplace_back(move(task));
+  }
+  this->work_available.notify_one();
+}
+
+void ThreadPool::wait() {
+  unique_lock<mutex> g(this->lock);
+  this->all_done.wait(g, [this]() { return this->pending_count == 0; });
+
+  if (this->first_exception) {
+    exception_ptr e = this->first_exception;
+    this->first_exception = nullptr;
+    rethrow_exception(e);
+  }
+}
+
+size_t ThreadPool::size() const {
+  return this->threads.size();
+}
+
+size_t ThreadPool::default_thread_count() {
+  size_t ret = thread::hardware_concurrency();
+  return ret ? ret : 1;
+}
+
+bool ThreadPool::pop_task(size_t worker_index, function<void()>& task) {
+  bool found = false;
+
+  // take the most recently added task from our own queue first; it's the most
+  // likely to have its data in cache
+  {
+    auto& q = *this->queues[worker_index];
+    lock_guard<mutex> g(q.lock);
+    if (!q.tasks.empty()) {
+      task = move(q.tasks.back());
+      q.tasks.pop_back();
+      found = true;
+    }
+  }
+
+  // if there's nothing there, steal the oldest task from another worker
+  for (size_t x = 1; !found && (x < this->queues.size()); x++) {
+    auto& q = *this->queues[(worker_index + x) % this->queues.size()];
+    lock_guard<mutex> g(q.lock);
+    if (!q.tasks.empty()) {
+      task = move(q.tasks.front());
+      q.tasks.pop_front();
+      found = true;
+    }
+  }
+
+  if (found) {
+    lock_guard<mutex> g(this->lock);
+    this->queued_count--;
+  }
+  return found;
+}
+
+void ThreadPool::run_task(function<void()>& task) {
+  try {
+    task();
+  } catch (...) {
+    lock_guard<mutex> g(this->lock);
+    if (!this->first_exception) {
+      this->first_exception = current_exception();
+    }
+  }
+
+  lock_guard<mutex> g(this->lock);
+  if (--this->pending_count == 0) {
+    this->all_done.notify_all();
+  }
+}
+
+bool ThreadPool::run_one_task() {
+  // if this is called from outside the pool, just start stealing at the first
+  // worker's queue
+  size_t worker_index = (current_pool == this) ? current_worker_index : 0;
+  function<void()> task;
+  if (!this->pop_task(worker_index, task)) {
+    return false;
+  }
+  this->run_task(task);
+  return true;
+}
+
+void ThreadPool::worker_thread_fn(size_t worker_index) {
+  current_pool = this;
+  current_worker_index = worker_index;
+
+  for (;;) {
+    function<void()> task;
+    if (this->pop_task(worker_index, task)) {
+      this->run_task(task);
+      continue;
+    }
+
+    unique_lock<mutex> g(this->lock);
+    this->work_available.wait(g, [this]() {
+      return this->should_exit || (this->queued_count > 0);
+    });
+    if (this->should_exit && (this->queued_count == 0)) {
+      return;
+    }
+  }
+}
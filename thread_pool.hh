@@ -0,0 +1,68 @@
+#pragma once
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+
+// a simple work-stealing thread pool. each worker has its own task queue;
+// tasks added from a worker thread go to that worker's queue (so subtasks tend
+// to stay on the thread that created them), and idle workers steal from the
+// front of other workers' queues.
+class ThreadPool {
+public:
+  // if num_threads is 0, uses one thread per hardware thread
+  explicit ThreadPool(size_t num_threads = 0);
+  ThreadPool(const ThreadPool&) = delete;
+  ThreadPool(ThreadPool&&) = delete;
+  ThreadPool& operator=(const ThreadPool&) = delete;
+  ThreadPool& operator=(ThreadPool&&) = delete;
+  ~ThreadPool();
+
+  // tasks may call add() to enqueue more tasks, but must not call wait().
+  // tasks should not throw; if one does, the exception is rethrown from wait()
+  // after all other tasks are done.
+  void add(std::function<void()> task);
+  void wait();
+
+  // runs one queued task on the calling thread, if there are any. returns true
+  // if a task was run. a task that needs to wait for subtasks it added can call
+  // this in a loop instead of blocking, so the worker it's running on can help
+  // finish them (and the pool can't deadlock with every worker waiting).
+  bool run_one_task();
+
+  size_t size() const;
+
+  // returns the number of hardware threads, or 1 if it can't be determined
+  static size_t default_thread_count();
+
+private:
+  struct worker_queue {
+    std::mutex lock;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  std::vector<std::unique_ptr<worker_queue>> queues;
+  std::vector<std::thread> threads;
+
+  std::mutex lock;
+  std::condition_variable work_available;
+  std::condition_variable all_done;
+  size_t queued_count; // tasks in queues, not yet started
+  size_t pending_count; // tasks added but not yet finished
+  bool should_exit;
+  std::exception_ptr first_exception;
+
+  std::atomic<size_t> next_queue;
+
+  bool pop_task(size_t worker_index, std::function<void()>& task);
+  void run_task(std::function<void()>& task);
+  void worker_thread_fn(size_t worker_index);
+};